@@ -49,6 +49,8 @@ STRUCT_TRANSACTION_CONTENT
 	char *preferences;
 	int download_only;
 	struct string_list dpkg_options;
+	/* stage directory in shared download cache */
+	char *archives;
 };
 
 /* creation */
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * built-in tar/lz4 archiver declarations
+ */
+
+#include <sys/types.h>
+#include "vztt_options.h"
+
+#ifndef _VZTT_ARCHIVE_H_
+#define _VZTT_ARCHIVE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* lz4 frame block size, the same as lz4 utility uses by default (-B7) */
+#define ARCHIVE_LZ4_BLOCK_SIZE	(4*1024*1024)
+/* upper limit of compression/decompression threads */
+#define ARCHIVE_MAX_THREADS	16
+
+/*
+pack NULL-terminated list of 'what' entries (relative to 'dir') to 'file'.
+Archiver is detected from 'file' extension: .tar.lz4 archives are written
+in-process by multi-threaded lz4 frame encoder, other ones are created
+via external tar/compressor pipeline.
+*/
+int archive_pack(
+		const char *file,
+		const char *dir,
+		const char *const what[],
+		struct options_vztt *opts_vztt);
+
+/*
+unpack 'file' to 'where'. Independent-blocks lz4 frames are decompressed by
+pool of threads and files are written by other pool, other archives are
+unpacked by external tar/compressor pipeline.
+*/
+int archive_unpack(
+		const char *file,
+		const char *where,
+		struct options_vztt *opts_vztt);
+
+/*
+read content of archive 'member' to malloc'ed NULL-terminated buffer
+'data' of 'size' bytes. Returns VZT_FILE_NFOUND if member is not found.
+*/
+int archive_read_member(
+		const char *file,
+		const char *member,
+		char **data,
+		size_t *size);
+
+/*
+remove chunks of chunk store near cache 'file' (<dir>/chunks) which are
+not referenced by any manifest in <dir> and were not used for a day.
+*/
+int archive_chunks_gc(const char *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * bump allocator declarations
+ */
+
+#ifndef _VZTT_ARENA_H_
+#define _VZTT_ARENA_H_
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* default size of arena block */
+#define ARENA_BLOCK_SIZE	(64*1024)
+
+struct arena_block;
+
+/*
+Per-operation bump allocator: memory is taken from chained blocks and
+is released all at once by arena_reset(). There is no per-object free.
+Arena is not thread-safe.
+*/
+struct arena {
+	struct arena_block *head;
+	char *ptr;
+	char *end;
+};
+
+/* arena initialization, does not alloc memory */
+static inline void arena_init(struct arena *a)
+{
+	a->head = NULL;
+	a->ptr = a->end = NULL;
+}
+
+/* alloc <size> bytes aligned to pointer size, NULL on error */
+void *arena_alloc(struct arena *a, size_t size);
+
+/* copy string <s> in arena, NULL on error */
+char *arena_strdup(struct arena *a, const char *s);
+
+/* release all memory of arena, arena can be used again */
+void arena_reset(struct arena *a);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ *
+ * base OS templates catalog declarations
+ */
+
+#include "queue.h"
+
+#ifndef _VZTT_CATALOG_H_
+#define _VZTT_CATALOG_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* catalog directory in template area */
+#define CATALOG_SUBDIR		".catalog"
+/* base OS templates catalog file in it */
+#define CATALOG_BASE_FILE	"base"
+/* upper limit of scanner threads, used on shared template area */
+#define CATALOG_MAX_THREADS	16
+/* scanner threads on local template area */
+#define CATALOG_LOCAL_THREADS	4
+
+/*
+Catalog of base OS templates: names of found templates and mtimes of all
+directories which were looked up to find them (template area, OS name and
+version directories, deepest existing directory of every
+<osver>/<osarch>/config/os/default probe). Adding or removing any template
+changes mtime of one of them, so catalog is valid while all mtimes are
+the same. Catalog also records set of available architectures and ends
+with trailer line, so catalog of other architectures or truncated one is
+stale too.
+*/
+
+/*
+seek all base OS templates <osname>-<osver>-<osarch> in <tmpldir> and add
+them into <ls>. Names are taken from <tmpldir>/.catalog/base if it is valid,
+otherwise template area is scanned by pool of threads (directory per
+thread, fstatat() relative to directory descriptors) and catalog is
+rewritten. Entries started with '.' (catalog, metadata store) are skipped.
+*/
+int catalog_get_all_base(const char *tmpldir, struct string_list *ls);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
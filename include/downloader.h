@@ -29,6 +29,25 @@
 
 #include "vzcommon.h"
 
+/* upper limit of parallel transfers of fetch_files() */
+#define FETCH_MAX_PARALLEL	16
+
+/* download request of fetch_files() */
+struct fetch_item {
+	char *url;
+	char *dst;
+	/* result */
+	int rc;
+};
+
+/*
+  Downloads are done in-process by libcurl: connections of all downloads
+  of the process are kept alive and reused, file is loaded to <dst>.part
+  and renamed to <dst> on success, http part left by broken download is
+  resumed if server file was not changed since. Proxy is taken from <u>.
+*/
+
+/* download <file> to <dst>, <tmpdir> is not used */
 int fetch_file(
 		const char *tmpdir,
 		const char *file,
@@ -36,6 +55,25 @@ int fetch_file(
 		const char *dst,
 		int debug);
 
+/* download <file> to <dst> only if it was modified after existing <dst>
+   (If-Modified-Since), <dst> gets server modification time */
+int fetch_file_cond(
+		const char *file,
+		struct _url *u,
+		const char *dst,
+		int debug);
+
+/* download <n> <items> by up to <nparallel> transfers at once, report
+   loaded bytes to <progress_fd>. Result of every item is in item->rc,
+   returns first error */
+int fetch_files(
+		struct fetch_item *items,
+		size_t n,
+		struct _url *u,
+		int nparallel,
+		int progress_fd,
+		int debug);
+
 #ifdef __cplusplus
 }
 #endif
@@ -62,6 +62,15 @@ int fetch_mirrorlist(
 		char *buf,
 		int size);
 
+/* try to download first location of every mirrorlist at once by parallel
+   transfers: bufs[i] gets path of local copy of mirrorlists[i] or empty
+   string if it can not be loaded. NULL mirrorlists are skipped */
+int fetch_mirrorlists(
+		struct Transaction *pm,
+		char **mirrorlists,
+		char (*bufs)[PATH_MAX+1],
+		size_t n);
+
 int env_compat_get_install_pkg(
 		struct Transaction *pm,
 		struct package_list *packages);
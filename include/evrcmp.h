@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * rpm and dpkg version comparison declarations
+ */
+
+#ifndef _VZTT_EVRCMP_H_
+#define _VZTT_EVRCMP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+All functions return 1 if <a> is newer than <b>, 0 if they are the same
+version and -1 if <b> is newer than <a>.
+*/
+
+/* compare version or release strings as rpmvercmp() does,
+   with '~' (sorts before anything) and '^' (sorts after base version) */
+int rpm_vercmp(const char *a, const char *b);
+
+/* compare rpm [epoch:]version[-release], absent epoch is 0,
+   release is compared only if both strings have it */
+int rpm_evrcmp(const char *a, const char *b);
+
+/* compare debian [epoch:]upstream_version[-debian_revision]
+   as dpkg --compare-versions does */
+int deb_evrcmp(const char *a, const char *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -37,13 +37,20 @@ extern "C" {
 #define LOCK_READ  0
 #define LOCK_WRITE 1
 
+/*
+Lock functions wait for the lock up to timeout (0 - infinitely) and
+report lock holder and waiting time to progress_fd (0 - do not report).
+Lock handle belongs to calling thread.
+*/
+
 /* lock base os template */
 int tmpl_lock(
 		struct global_config *gc,
 		struct base_os_tmpl *tmpl,
 		int mode,
 		int skiplock,
-		void **lockdata);
+		void **lockdata,
+		int progress_fd);
 
 /* unlock base os template */
 int tmpl_unlock(void *lockdata, int skiplock);
@@ -55,11 +62,32 @@ int cache_lock(
 		int mode,
 		int vztt,
 		void **lockdata,
-		unsigned int timeout);
+		unsigned int timeout,
+		int progress_fd);
 
 /* unlock template cache */
 int cache_unlock(void *lockdata, int vztt);
 
+/* lock metadata of base os template, only updaters take it,
+   see lock hierarchy in lock.c */
+int metadata_lock(
+		struct global_config *gc,
+		struct base_os_tmpl *tmpl,
+		int mode,
+		int vztt,
+		void **lockdata,
+		int progress_fd);
+
+/* unlock metadata of base os template */
+int metadata_unlock(void *lockdata, int vztt);
+
+/* lock package download area <path> exclusively, it is the innermost
+   level of lock hierarchy */
+int download_lock(const char *path, void **lockdata, int progress_fd);
+
+/* unlock package download area */
+void download_unlock(void *lockdata);
+
 int lock_ve(const char *ctid, int vztt, void **lockdata);
 void unlock_ve(const char *ctid, void *lockdata, int skiplock);
 
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * shared repository metadata store declarations
+ */
+
+#ifndef _VZTT_MDSTORE_H_
+#define _VZTT_MDSTORE_H_
+
+#include <time.h>
+#include "queue.h"
+#include "vzcommon.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* store directory in template area */
+#define MDSTORE_SUBDIR	".mdstore"
+/* fingerprint is md5 in hex */
+#define MDSTORE_FP_LEN	32
+
+/*
+Content-addressed store of repository metadata:
+<tmpldir>/.mdstore/<fingerprint>/ is package manager cache directory of
+repository, <tmpldir>/.mdstore/<fingerprint>.stamp is lock file of entry,
+its mtime is time of last successful metadata update or revalidation,
+content is checksum of upstream index file and time of last update. Template cache
+directories of the same repository in any OS template area are symlinks
+to one entry, <tmpldir>/.mdstore/<fingerprint>.refs/ lists them.
+*/
+
+/* variable to expand in urls before fingerprinting */
+struct mdstore_var {
+	const char *name;
+	const char *value;
+};
+
+/*
+calculate fingerprint of repository <kind> (baseurl, mirrorlist) with
+alternative <urls>: urls are expanded by NULL-terminated <vars>,
+normalized (lowercase scheme and host, no duplicated and trailing
+slashes) and sorted, so order of alternatives does not matter.
+*/
+int mdstore_fingerprint(
+		const char *kind,
+		struct string_list *urls,
+		const struct mdstore_var *vars,
+		char *fp,
+		size_t size);
+
+/*
+replace directory <path> by symlink to store entry <fp> and register it as
+reference of entry. If <path> is existing directory and entry does not
+exist yet - it is moved to the store. Entry should be locked by
+mdstore_lock().
+*/
+int mdstore_link(const char *tmpldir, const char *fp, const char *path);
+
+/* open stamp file of entry <fp> and lock it exclusively */
+int mdstore_lock(const char *tmpldir, const char *fp, int *fd);
+
+/* downgrade lock of entry to shared one: entry is used, but not updated */
+int mdstore_share(int fd);
+
+/* is entry locked by <fd> updated less than <expire> seconds ago? */
+int mdstore_is_fresh(int fd, int expire);
+
+/* expand NULL-terminated <vars> in <url> to <buf> */
+void mdstore_expand_url(
+		const char *url,
+		const struct mdstore_var *vars,
+		char *buf,
+		size_t size);
+
+/* mark entry locked by <fd> as checked now */
+int mdstore_touch(int fd);
+
+/*
+revalidate entry <fp> locked by <fd> against upstream index file <url>
+(repomd.xml, Release): local copy of index near the stamp is loaded
+again only if upstream one is newer (If-Modified-Since) and its checksum
+is compared with one saved by mdstore_updated().
+Returns 0 if upstream was not changed, 1 if it was changed or on error.
+*/
+int mdstore_revalidate(
+		const char *tmpldir,
+		const char *fp,
+		int fd,
+		const char *url,
+		struct _url *proxy,
+		int debug);
+
+/* mark entry locked by <fd> as updated at <changed> and save checksum of
+   upstream index if it was <validated> by mdstore_revalidate() */
+int mdstore_updated(
+		const char *tmpldir,
+		const char *fp,
+		int fd,
+		int validated,
+		time_t changed);
+
+/* time of last update of entry locked by <fd>, 0 if unknown */
+time_t mdstore_changed(int fd);
+
+/* unlock and close entry */
+void mdstore_unlock(int fd);
+
+/*
+Metadata of entry are replaced by generations, so readers never see
+partially updated ones: <tmpldir>/.mdstore/<fingerprint> is symlink to
+current generation directory near it. mdstore_begin() creates new
+generation <gen> of <size> as hard linked copy of current one, updater
+loads metadata into it and mdstore_commit() switches symlink to it
+atomically, or mdstore_abort() drops it. Entry should be locked by
+mdstore_lock().
+Readers lock generations they use by mdstore_read_lock() (shared flock of
+<generation>.lock), previous generations are removed by mdstore_begin()
+and mdstore_commit() only if nobody holds such lock.
+*/
+int mdstore_begin(
+		const char *tmpldir,
+		const char *fp,
+		char *gen,
+		size_t size);
+
+int mdstore_commit(const char *tmpldir, const char *fp, const char *gen);
+
+void mdstore_abort(const char *gen);
+
+/* lock current generations of entries linked from package manager cache
+   directory <cachedir> for reading. <fds> is malloc'ed array of lock
+   descriptors terminated by -1, release it by mdstore_read_unlock() */
+int mdstore_read_lock(const char *cachedir, int **fds);
+
+void mdstore_read_unlock(int *fds);
+
+/* lock package download areas of entries linked from package manager
+   cache directory <cachedir> exclusively: package managers do not
+   download the same packages into one directory concurrently. Waiting
+   is limited and reported to <progress_fd> as for other locks, see
+   lock.h. <lockdata> is malloc'ed array of lock handles terminated by
+   NULL, or NULL, release it by mdstore_download_unlock() */
+int mdstore_download_lock(
+		const char *cachedir,
+		int progress_fd,
+		void ***lockdata);
+
+void mdstore_download_unlock(void **lockdata);
+
+/* remove entries which are not referred by any template cache directory
+   and are not used now */
+void mdstore_gc(const char *tmpldir);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
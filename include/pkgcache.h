@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * shared package download cache declarations
+ */
+
+#ifndef _VZTT_PKGCACHE_H_
+#define _VZTT_PKGCACHE_H_
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Package download cache of OS template is shared by all apt runs of the
+node. Every run downloads into own stage directory inside the cache,
+which is seeded by hard links to all cached packages, and new packages
+of successful run are published into the cache by rename(), so
+concurrent runs never see partially written files and do not lock each
+other.
+yum loads packages into directories of shared repositories instead,
+see mdstore_download_lock().
+*/
+
+/* stage directory name prefix in cache directory */
+#define PKGCACHE_STAGE_PREFIX	".stage."
+/* stage not changed for this time is left by killed run, seconds */
+#define PKGCACHE_STAGE_TTL	(24*60*60)
+
+/*
+create empty stage directory <stage> of <size> in <cachedir>. Stale
+stages are removed before it under exclusive lock of <cachedir>.
+*/
+int pkgcache_stage(
+		const char *cachedir,
+		char *stage,
+		size_t size);
+
+/* link cached files with <suffix> from <cachedir> into <stage> */
+int pkgcache_seed(
+		const char *cachedir,
+		const char *stage,
+		const char *suffix);
+
+/*
+move new files with <suffix> from <stage> into <cachedir> and remove
+stage directory
+*/
+int pkgcache_publish(
+		const char *cachedir,
+		const char *stage,
+		const char *suffix);
+
+/* remove stage directory of failed run without publishing */
+void pkgcache_abort(const char *stage);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
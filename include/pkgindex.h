@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * binary package list index declarations
+ */
+
+#ifndef _VZTT_PKGINDEX_H_
+#define _VZTT_PKGINDEX_H_
+
+#include <sys/types.h>
+#include "queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* suffix of index file near text package list */
+#define PKGINDEX_SUFFIX	".idx"
+
+/*
+Binary index of text package list (name arch evr records, see read_nevra()):
+header, fixed-size records in list order, record numbers sorted by
+name and arch, and string table. Record keeps version comparison key:
+numeric epoch and version-release without epoch. Index keeps size and mtime of the
+text file and is considered stale if the text file was changed.
+*/
+struct pkgindex;
+
+/*
+write index of <packages> to <path> (via temporary file and rename).
+<src> is the text file with the same list, it should be already written.
+*/
+int pkgindex_save(
+		const char *path,
+		const char *src,
+		struct package_list *packages);
+
+/*
+map index <path> for text file <src> (staleness is not checked if <src>
+is NULL). Returns VZT_FILE_NFOUND if index is absent, invalid or stale,
+in this case caller should use text file.
+*/
+int pkgindex_open(const char *path, const char *src, struct pkgindex **idx);
+
+/* unmap index */
+void pkgindex_close(struct pkgindex *idx);
+
+/* number of records */
+size_t pkgindex_count(struct pkgindex *idx);
+
+/* find first record with <name> in name order, -1 if not found */
+long pkgindex_find(struct pkgindex *idx, const char *name);
+
+/*
+fill <pkg> by pointers to strings of record <n> in name order. Strings
+are in read-only mapping and are valid until pkgindex_close().
+Returns -1 if <n> is out of range.
+*/
+int pkgindex_get(struct pkgindex *idx, long n, struct package *pkg);
+
+/* record with version comparison key */
+struct pkgindex_entry {
+	const char *name;
+	const char *arch;
+	const char *evr;
+	/* evr without epoch */
+	const char *ver;
+	unsigned long epoch;
+	/* record number in list order */
+	size_t pos;
+};
+
+/* fill <e> for record <n> in name order, -1 if <n> is out of range */
+int pkgindex_entry(struct pkgindex *idx, long n, struct pkgindex_entry *e);
+
+/* version comparison key of <evr>: returns version-release without
+   epoch and puts numeric epoch (0 if absent) in <epoch> */
+const char *pkgindex_evr_key(const char *evr, unsigned long *epoch);
+
+/* add all records in list order into <packages>, like read_nevra() */
+int pkgindex_read(struct pkgindex *idx, struct package_list *packages);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
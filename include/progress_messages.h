@@ -54,6 +54,9 @@
 #define PROGRESS_REMOVE_APPTEMPLATE "Removing the application template %s"
 #define PROGRESS_UPGRADE_AREA "Upgrading OS template area"
 
+/* downloader.c */
+#define PROGRESS_DOWNLOAD "Downloading files (%lld of %lld bytes)"
+
 /* info.c */
 #define PROGRESS_GET_PACKAGE_INFO "Getting package information"
 #define PROGRESS_GET_APPTEMPLATE_INFO "Getting application template information"
@@ -112,6 +115,13 @@
 #define PROGRESS_CREATE_PLOOP "Creating virtual disk"
 #define PROGRESS_RESIZE_PLOOP "Resizing virtual disk"
 
+/* archive.c */
+#define PROGRESS_UNPACK_CACHE "Unpacking cache"
+
+/* lock.c */
+#define PROGRESS_LOCK_WAIT "Waiting for %s lock (%lds)"
+#define PROGRESS_LOCK_WAIT_PID "Waiting for %s lock held by process %d (%lds)"
+
 /* env_compat.c */
 #define PROGRESS_PROCESS_METADATA "Processing metadata for %s"
 
@@ -34,6 +34,7 @@
 #include <ctype.h>
 #include <sys/queue.h>
 #include "vztt_types.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -59,9 +60,19 @@ extern "C" {
 	}
 	clean_string_list(&urls);
 
-  List functions alloc and free <char *>
+  List functions alloc and free <char *>, the list should be changed
+  by these functions only.
+  List, initialized by string_list_init_arena(), allocs elements and
+  strings from arena: string_list_remove() only unlinks element and
+  string_list_clean() releases whole arena at once. One arena serves
+  one list only.
 */
-TAILQ_HEAD(string_list, string_list_el);
+struct string_list {
+	/* the same layout as TAILQ_HEAD() */
+	struct string_list_el *tqh_first;
+	struct string_list_el **tqh_last;
+	struct arena *arena;
+};
 struct string_list_el {
 	char *s;
 	TAILQ_ENTRY(string_list_el) e;
@@ -71,6 +82,16 @@ struct string_list_el {
 static inline void string_list_init(struct string_list *ls)
 {
 	TAILQ_INIT(ls);
+	ls->arena = NULL;
+}
+
+/* list initialization, elements will be allocated from arena <a> */
+static inline void string_list_init_arena(
+		struct string_list *ls,
+		struct arena *a)
+{
+	TAILQ_INIT(ls);
+	ls->arena = a;
 }
 
 /* remove all elements and its content */
@@ -85,11 +106,16 @@ int string_list_add_head(struct string_list *ls, char *str);
 /* find string <str> in list <ls> */
 struct string_list_el *string_list_find(struct string_list *ls, char *str);
 
-/* remove element and its content and return pointer to previous elem */
+/* remove element and its content and return pointer to previous elem,
+   NULL for the first one */
 struct string_list_el *string_list_remove(
 		struct string_list *ls,
 		struct string_list_el *el);
 
+/* move all elements of <src> in tail of <dst>, <src> becomes empty.
+   Both lists should be without arena */
+void string_list_move(struct string_list *dst, struct string_list *src);
+
 /*
  read strings from file and add into list
  leading and tailing spaces omitted
@@ -234,8 +260,24 @@ int pkg_info_list_to_array(struct pkg_info_list *ls, struct pkg_info ***a);
 /*
  struct package * list function set.
  This functions not alloc and not free content: struct package *.
+ List keeps insertion order and has open addressing hash index by package
+ name for package_list_find(). Index is built on first lookup and is kept
+ up to date by package_list_* functions, so the list should be changed
+ by these functions only.
+ List, initialized by package_list_init_arena(), owns its content in arena:
+ packages for package_list_insert() should be allocated from ls->arena
+ (see create_structp_arena()), package_list_remove() only unlinks element
+ and package_list_clean() releases whole arena at once. One arena serves
+ one list only.
 */
-TAILQ_HEAD(package_list, package_list_el);
+struct package_index;
+struct package_list {
+	/* the same layout as TAILQ_HEAD() */
+	struct package_list_el *tqh_first;
+	struct package_list_el **tqh_last;
+	struct package_index *index;
+	struct arena *arena;
+};
 struct package_list_el {
 	struct package *p;
 	TAILQ_ENTRY(package_list_el) e;
@@ -245,6 +287,18 @@ struct package_list_el {
 static inline void package_list_init(struct package_list *ls)
 {
 	TAILQ_INIT(ls);
+	ls->index = NULL;
+	ls->arena = NULL;
+}
+
+/* list initialization, elements and content will be allocated from <a> */
+static inline void package_list_init_arena(
+		struct package_list *ls,
+		struct arena *a)
+{
+	TAILQ_INIT(ls);
+	ls->index = NULL;
+	ls->arena = a;
 }
 
 /* remove all elements and its content */
@@ -259,7 +313,8 @@ int package_list_insert(struct package_list *ls, struct package *p);
 /* copy struct package <s> content and add it in tail of queue */
 int package_list_add(struct package_list *ls, struct package *s);
 
-/* remove element and its content and return pointer to previous elem */
+/* remove element and its content and return pointer to previous elem,
+   NULL for the first one */
 struct package_list_el *package_list_remove(
 		struct package_list *ls,
 		struct package_list_el *el);
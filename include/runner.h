@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ *
+ * process runner declarations
+ */
+
+#include <sys/types.h>
+
+#ifndef _VZTT_RUNNER_H_
+#define _VZTT_RUNNER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* redirect child descriptor to /dev/null */
+#define RUNNER_DEVNULL	(-2)
+
+/* child descriptor <to> is duplicated from parent descriptor <from> */
+struct runner_fd {
+	int from;
+	int to;
+};
+
+struct runner_opts {
+	/* environment, NULL - environment of caller */
+	char *const *envp;
+	/* descriptor redirection table of <nfds> entries */
+	const struct runner_fd *fds;
+	size_t nfds;
+	/* chroot() to this directory before exec, if set */
+	const char *root;
+	/* run child in new UTS namespace */
+	int newuts;
+	/* ignore SIGINT/SIGQUIT in parent while child is running, as
+	   system() does: disposition is process-wide, it is changed by
+	   first such child and restored after last one */
+	int ignore_int;
+};
+
+struct runner_child {
+	pid_t pid;
+	/* -1 if kernel does not support pidfd */
+	int pidfd;
+	/* SIGINT/SIGQUIT are ignored for this child */
+	int ignore_int;
+};
+
+/*
+start <path> with arguments <argv>. Child is created by
+clone(CLONE_VM|CLONE_VFORK): caller address space is not copied, caller
+signal dispositions are not changed (child gets default SIGINT/SIGQUIT
+handlers and signal mask of caller thread). Exec errors are reported
+by this call.
+*/
+int runner_spawn(
+		const char *path,
+		char *const argv[],
+		const struct runner_opts *opts,
+		struct runner_child *child);
+
+/*
+wait for child started by runner_spawn(), by its pidfd if available,
+so children of other threads are not affected. <status> is in waitpid()
+format.
+*/
+int runner_wait(struct runner_child *child, int *status);
+
+/* runner_spawn() and runner_wait() */
+int runner_run(
+		const char *path,
+		char *const argv[],
+		const struct runner_opts *opts,
+		int *status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
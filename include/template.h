@@ -47,7 +47,10 @@ extern "C" {
 	struct repo_list mirrorlist; \
 	struct tmpl	*base; \
 	unsigned int golden_image; \
-	unsigned int no_pkgs_actions;
+	unsigned int no_pkgs_actions; \
+	/* VZTT_INFO_* fields read from files and to read on first access */ \
+	unsigned long loaded; \
+	unsigned long lazy;
 
 /* virtual template data structure */
 struct tmpl {
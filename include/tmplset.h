@@ -41,6 +41,11 @@ enum {
 	TMPLSET_LOAD_APP_LIST = (1<<1),
 };
 
+/* fields of os and app templates lists, which are read on first access:
+   info request or marking, other fields are needed for packages operations */
+#define TMPLSET_LAZY_FIELDS (VZTT_INFO_DESCRIPTION | VZTT_INFO_SUMMARY | \
+	VZTT_INFO_GOLDEN_IMAGE | VZTT_INFO_NO_PKG_ACTIONS)
+
 enum {
 	TMPLSET_MARK_OS = (1<<0),
 	TMPLSET_MARK_OS_LIST = (1<<1),
@@ -60,6 +65,9 @@ struct tmpl_set {
 	struct app_tmpl_list avail_apps;
 	struct app_tmpl_list used_apps;
 	int mode;
+	/* references to shared set (see tmplset_load_shared()),
+	   0 for private one */
+	int refs;
 };
 
 /*
@@ -104,6 +112,19 @@ int tmplset_selective_load(
 		struct tmpl_set **tmpl,
 		struct options_vztt *opts_vztt);
 
+/*
+ get shared template set from process-wide cache, load it if absent or
+ stale. Shared set is read-only: it should not be marked or changed,
+ tmplset_clean() releases the reference. Without watching (see watch.h)
+ private set is loaded, according fields mask of <opts_vztt>.
+*/
+int tmplset_load_shared(
+		char *tmpldir,
+		char *ostemplate,
+		int mask,
+		struct tmpl_set **tmpl,
+		struct options_vztt *opts_vztt);
+
 /* mark templates in <t> according names from <ls>
    use os, oses, avail_apps and used_apps fields according <mask>
    not found names will add into <nf>, if it is not NULL
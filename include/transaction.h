@@ -239,6 +239,9 @@ typedef enum {
 		struct Transaction *pm,\
 		char *sname,\
 		char *dname);\
+	/* metadata update is loaded aside and published atomically, \
+	 so readers of template area are not affected by it */\
+	int (*pm_is_metadata_staged)(struct Transaction *pm);\
 	/* parse template area directory name and create struct package */\
 	int (*pm_parse_vzdir_name)(char *dirname, struct package **pkg);\
 	/* To get group list from yum, parse and place in structures */\
@@ -296,20 +299,6 @@ int add_tmpl_envs(
 #define CLONE_NEWUTS 0x04000000
 #endif
 
-struct clone_params {
-	const char *cmd;
-	const char *envdir;
-	char **argv;
-	char **envp;
-	char *osrelease;
-	int *fds;
-	int ign_cmd_err;
-	int debug;
-	void *reader;
-};
-
-
-
 /* run <cmd> from chroot environment <envdir> with arguments <args> 
    and environments <envs>, 
    redirect <cmd> output to pipe and read by <reader> */
@@ -344,6 +333,8 @@ package architecture field at all, sometime for separate packages only
 Used by yum & apt classes for rpm & dpkg output parsing
 */
 int parse_p(char *str, struct package **pkg);
+/* parse_p() with structure allocation in arena <a> */
+int parse_p_arena(char *str, struct arena *a, struct package **pkg);
 
 /* check undefined '$*' variable in url.
 vars - list of internal variables for package manager */
@@ -400,6 +391,8 @@ int pm_get_available(
 		struct package_list *available);
 /* save metadata file for template <name> */
 int pm_save_metadata(struct Transaction *pm, const char *name);
+/* mark metadata file of template <name> as up2date */
+int pm_touch_metadata(struct Transaction *pm, const char *name);
 /* create temporary root dir for package manager */
 int pm_create_tmp_root(struct Transaction *pm);
 /* set package manager root dir */
@@ -58,6 +58,8 @@ void vztt_logger(int log_level, int err_num, const char * format, ...);
 int vztt_error(int err_code, int err_num, const char * format, ...);
 
 extern int parse_nav(char *str, struct package **pkg);
+/* parse_nav() with structure allocation in arena <a> */
+extern int parse_nav_arena(char *str, struct arena *a, struct package **pkg);
 extern int arch_is_none(const char *arch);
 extern int call_VE_script(
 	const char *ctid,
@@ -77,6 +79,13 @@ extern struct package *create_structp(
 	char const *arch, 
 	char const *evr, 
 	char const *descr);
+/* the same as create_structp(), but alloc in arena <a> (in heap if NULL) */
+extern struct package *create_structp_arena(
+	struct arena *a,
+	char const *name,
+	char const *arch,
+	char const *evr,
+	char const *descr);
 /* compare package <p1> and <p2> with name and arch */
 extern int cmp_pkg(struct package *p1, struct package *p2);
 /* check VE state */
@@ -99,8 +108,10 @@ int read_nevra(const char *path, struct package_list *packages);
 read_nevra fast: do not check records with the same name-arch
 */
 int read_nevra_f(const char *path, struct package_list *packages);
-/* save vzpackages file */
+/* save vzpackages file and its binary index */
 int save_vzpackages(const char *ve_private, struct package_list *packages);
+/* read vzpackages file of VE, from binary index if it is up to date */
+int read_vzpackages(const char *ve_private, struct package_list *packages);
 /* read vzpackages file from os template cache tarball */
 int read_tarball(
 		const char *tarball,
@@ -161,15 +172,19 @@ void clean_url(struct _url *u);
 char * get_url_vztt_proxy(const char *vztt_proxy, const char *url) ;
 /* remove directory with content */
 int remove_directory(const char *dirname);
+/* rename directory and remove it with content by background process */
+int remove_directory_bg(const char *dirname);
 /* copy from file src to descriptor d */
 int copy_file_fd(int d, const char *dst, const char *src);
 /* copy from file src to file dst */
 int copy_file(const char *dst, const char *src);
 /* move from file src to file dst */
 int move_file(const char *dst, const char *src);
-/*  execute command and check exit code */
+/*  execute command by shell and check exit code,
+    SIGINT/SIGQUIT are ignored while it is running */
 int exec_cmd(char *cmd, int quiet);
-/*  execute command by execv and check exit code */
+/*  execute command by execv and check exit code,
+    SIGINT/SIGQUIT are ignored while it is running */
 int execv_cmd(char **argv, int quiet, int mod);
 /* Log execv call */
 void execv_cmd_logger(int log_level, int err_num, char **argv);
@@ -275,6 +290,11 @@ int tmpl_callback_cache_tar(
 	void *data);
 
 
+/*
+detect archive type (VZT_ARCHIVE_*) from 'file' extension, -1 if unknown
+*/
+int get_archive_type(const char *file);
+
 /*
 generate cmd command for pack 'what' to 'file'. archiver is detected
 automatically from 'file' extension
@@ -59,6 +59,9 @@
 #define TARLZ4_SUFFIX		".tar.lz4"
 #define TARLZ4_SUFFIX_LEN	strlen(TARLZ4_SUFFIX)
 
+#define TARCHUNKS_SUFFIX	".tar.chunks"
+#define TARCHUNKS_SUFFIX_LEN	strlen(TARCHUNKS_SUFFIX)
+
 #define PLOOP_FORMAT		"ploop"
 #define PLOOP_V2_FORMAT		"ploopv2"
 #define SIMFS_FORMAT		"plain"
@@ -123,6 +126,7 @@
 #define VZT_ARCHIVE_GZ		1
 #define VZT_ARCHIVE_LZRW	2
 #define VZT_ARCHIVE_LZ4		3
+#define VZT_ARCHIVE_CHUNKS	4
 
 #define VZT_CACHE_TYPE_VZFS	(1 << 0)
 #define VZT_CACHE_TYPE_SIMFS	(1 << 1)
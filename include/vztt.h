@@ -419,6 +419,31 @@ extern int vztt2_update(
 	struct package ***pkg_added,
 	struct package ***pkg_removed);
 
+/*
+ install packages into several VEs <ctids> by pool of <nthreads> workers
+ (0 - default). Result of every VE is stored in corresponding element of
+ <results>, returns error of the first failed VE. SIGINT cancels
+ transactions which are not started yet.
+*/
+extern int vztt2_install_many(
+	const char *ctids[],
+	size_t nct,
+	char *packages[],
+	size_t size,
+	struct options_vztt *opts_vztt,
+	int nthreads,
+	struct vztt_ct_result *results);
+
+/* update packages in several VEs, the same as vztt2_install_many() */
+extern int vztt2_update_many(
+	const char *ctids[],
+	size_t nct,
+	char *packages[],
+	size_t size,
+	struct options_vztt *opts_vztt,
+	int nthreads,
+	struct vztt_ct_result *results);
+
 /* remove packages from VE */
 extern int vztt2_remove(
 	const char *ctid,
@@ -691,6 +716,32 @@ int vztt2_get_all_pkgs_vzdir(
 		struct options_vztt *opts_vztt,
 		char ***vzdir);
 
+/*
+enable process-wide caches of parsed configs and template sets,
+invalidated by inotify watches on config directories. Useful for
+long-running library users, should be called before any other call.
+*/
+int vztt_cache_enable(void);
+
+/* socket of vzttd, resident vzpkg daemon */
+#define VZTTD_SOCKET "/var/run/vzttd.sock"
+
+/*
+run vzpkg command <argv> by vzttd listening on <path>: stdin, stdout and
+stderr are passed to daemon, exit code of command is returned in <rc>.
+Returns non-zero if command can not be served by daemon and should be
+run locally (daemon is not running, command is not read-only, progress
+descriptor is used or VZTTD_DISABLE is set in environment).
+*/
+int vztt_daemon_call(const char *path, int argc, char **argv, int *rc);
+
+/*
+serve vzttd clients on <path> until SIGTERM/SIGINT/SIGHUP: every command
+is run by <handler> in process forked from daemon, so parsed configs
+cached by daemon are reused.
+*/
+int vztt_daemon_serve(const char *path, int (*handler)(int argc, char **argv));
+
 #ifdef __cplusplus
 }
 #endif
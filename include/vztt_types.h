@@ -50,6 +50,13 @@ struct package
 	int marker;
 };
 
+/* result of batch package operation for one VE */
+struct vztt_ct_result {
+	int rc;
+	struct package **pkg_added;
+	struct package **pkg_removed;
+};
+
 /* package info */
 struct pkg_info {
 	char *name;
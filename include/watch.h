@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ *
+ * inotify-based invalidation of in-memory caches
+ */
+
+#ifndef _VZTT_WATCH_H_
+#define _VZTT_WATCH_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Cache entry, built from files of watched directory, keeps stamp of the
+directory and is valid while the stamp is not changed: every change in the
+directory (entries and content of files) increases directory generation.
+Only process which enabled watching reads events (see watch_sync()),
+in its forked children caches are frozen snapshots.
+*/
+struct watch_stamp {
+	int wd;
+	unsigned long gen;
+};
+
+/* enable watching in this process, returns inotify descriptor */
+int watch_enable(void);
+
+/* is watching enabled */
+int watch_enabled(void);
+
+/*
+get stamp of directory <dir>, start to watch it if needed.
+Returns VZT_FILE_NFOUND if directory can not be watched, in this case
+caller should not cache data from it.
+*/
+int watch_get(const char *dir, struct watch_stamp *stamp);
+
+/* is data with stamp <stamp> still valid */
+int watch_check(const struct watch_stamp *stamp);
+
+/* read pending events and increase generations of changed directories,
+   returns number of changed directories */
+int watch_sync(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
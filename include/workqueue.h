@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * simple thread pool declarations
+ */
+
+#ifndef _VZTT_WORKQUEUE_H_
+#define _VZTT_WORKQUEUE_H_
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct workqueue;
+
+/* job function, should free its argument */
+typedef int (*workqueue_fn)(void *arg);
+
+/*
+create pool of 'nthreads' workers. workqueue_add() blocks while summary
+weight of queued jobs exceeds 'max_weight' (0 - unlimited)
+*/
+int workqueue_create(struct workqueue **wq, int nthreads, size_t max_weight);
+
+/* queue job, returns error of already failed job, if any */
+int workqueue_add(
+		struct workqueue *wq,
+		workqueue_fn fn,
+		void *arg,
+		size_t weight);
+
+/* wait for all queued jobs, returns first job error */
+int workqueue_wait(struct workqueue *wq);
+
+/* wait for all queued jobs and stop workers, returns first job error */
+int workqueue_destroy(struct workqueue *wq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -42,6 +42,10 @@ STRUCT_TRANSACTION_CONTENT
 	char *yum_conf;
 	char *pythonpath;
 //	char *rpm;
+	/* repositories to clean on metadata update, NULL - all */
+	struct string_list *clean_repos;
+	/* cache directory of metadata update, NULL - template one */
+	char *cachedir;
 };
 
 /* create structure */
@@ -52,6 +52,7 @@
 #include "tmplset.h"
 #include "lock.h"
 #include "ploop.h"
+#include "archive.h"
 #include "appcache.h"
 #include "cache.h"
 #include "md5.h"
@@ -200,6 +201,10 @@ static int check_appcache_options(
 		{
 			if (strncmp(p->s, a->tmpl->name, PATH_MAX) == 0)
 			{
+				/* golden_image is read on first access */
+				if (a->tmpl->lazy && (rc = load_app_tmpl(
+						a->tmpl->lazy, a->tmpl)))
+					goto cleanup;
 				if (gc->golden_image == 0 ||
 					(*tmpl)->os->golden_image == 0)
 				{
@@ -433,14 +438,10 @@ int vztt2_create_appcache(struct options_vztt *opts_vztt, int recreate)
 	char *ve_root = NULL;
 	char *ve_private = NULL;
 	char *ve_private_template = NULL;
-	char *pwd = NULL;
 	FILE *fp;
 
 	progress(PROGRESS_CREATE_APPCACHE, 0, opts_vztt->progress_fd);
 
-	if (getcwd(path, sizeof(path)))
-		pwd = strdup(path);
-
 	/* struct initialization: should be first block */
 	global_config_init(&gc);
 	vztt_config_init(&tc);
@@ -640,8 +641,7 @@ int vztt2_create_appcache(struct options_vztt *opts_vztt, int recreate)
 		fclose(fp);
 
 		vztt_logger(1, 0, "Unpacking ploop %s", base_cachename);
-		get_unpack_cmd(cmd, sizeof(cmd), base_cachename, ploop_dir, "");
-		if ((rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET))))
+		if ((rc = archive_unpack(base_cachename, ploop_dir, opts_vztt)))
 			goto cleanup_4;
 
 		/* Get the required the ploop size */
@@ -687,8 +687,7 @@ int vztt2_create_appcache(struct options_vztt *opts_vztt, int recreate)
 			goto cleanup_5;
 	} else {
 		vztt_logger(1, 0, "Unpacking %s", base_cachename);
-		get_unpack_cmd(cmd, sizeof(cmd), base_cachename, ve_private, "");
-		if ((rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET))))
+		if ((rc = archive_unpack(base_cachename, ve_private, opts_vztt)))
 			goto cleanup_4;
 	}
 
@@ -727,7 +726,8 @@ int vztt2_create_appcache(struct options_vztt *opts_vztt, int recreate)
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_6;
 
 	/* Set environment */
@@ -776,17 +776,9 @@ int vztt2_create_appcache(struct options_vztt *opts_vztt, int recreate)
 		/*pack ploop device to archive*/
 		rc = pack_ploop(ploop_dir, cachename, opts_vztt);
 	} else {
-		if (chdir(ve_private) == -1) {
-			vztt_logger(0, errno, "chdir(%s) failed", ve_private);
-			if (backup)
-				move_file(cachename, path);
-			goto cleanup_4;
-		}
-		get_pack_cmd(cmd, sizeof(cmd), cachename, ".", " --numeric-owner");
-		rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET));
-		if (pwd)
-			if (chdir(pwd) == -1)
-				vztt_logger(0, errno, "chdir(%s) failed", pwd);
+		const char *what[] = {".", NULL};
+
+		rc = archive_pack(cachename, ve_private, what, opts_vztt);
 	}
 
 	if (rc) {
@@ -854,7 +846,6 @@ cleanup_2:
 	unlink(temp_list);
 	VZTT_FREE_STR(temp_list)
 	VZTT_FREE_STR(config_path)
-	VZTT_FREE_STR(pwd)
 
 cleanup_1:
 	VZTT_FREE_STR(cachename)
@@ -900,7 +891,6 @@ int vztt2_update_appcache(struct options_vztt *opts_vztt)
 	char *ve_root = NULL;
 	char *ve_private = NULL;
 	char *ve_private_template = NULL;
-	char *pwd = NULL;
 	char *ploop_dir = NULL;
 	FILE *fp;
 
@@ -981,9 +971,6 @@ int vztt2_update_appcache(struct options_vztt *opts_vztt)
 	string_list_for_each(&apptemplates, p)
 		vztt_logger(1, 0, "     %s", p->s);
 
-	if (getcwd(path, PATH_MAX))
-		pwd = strdup(path);
-
 	/* check & update metadata */
 	if ((rc = update_metadata(tmpl->os->name , &gc, &tc, opts_vztt)))
 		goto cleanup_2;
@@ -1095,8 +1082,7 @@ int vztt2_update_appcache(struct options_vztt *opts_vztt)
 		fclose(fp);
 
 		vztt_logger(1, 0, "Unpacking ploop %s", cachename);
-		get_unpack_cmd(cmd, sizeof(cmd), cachename, ploop_dir, "");
-		if ((rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET))))
+		if ((rc = archive_unpack(cachename, ploop_dir, opts_vztt)))
 			goto cleanup_4;
 
 		/* Get the required the ploop size */
@@ -1146,8 +1132,7 @@ int vztt2_update_appcache(struct options_vztt *opts_vztt)
 			goto cleanup_5;
 	} else {
 		vztt_logger(1, 0, "Unpacking %s", cachename);
-		get_unpack_cmd(cmd, sizeof(cmd), cachename, ve_private, "");
-		if ((rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET))))
+		if ((rc = archive_unpack(cachename, ve_private, opts_vztt)))
 			goto cleanup_4;
 	}
 
@@ -1186,7 +1171,8 @@ int vztt2_update_appcache(struct options_vztt *opts_vztt)
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_6;
 
 	/* Setup the environmant */
@@ -1266,17 +1252,9 @@ int vztt2_update_appcache(struct options_vztt *opts_vztt)
 		/*pack ploop device to archive*/
 		rc = pack_ploop(ploop_dir, cachename, opts_vztt);
 	} else {
-		if (chdir(ve_private) == -1) {
-			vztt_logger(0, errno, "chdir(%s) failed", ve_private);
-			if (backup)
-				move_file(cachename, path);
-			goto cleanup_4;
-		}
-		get_pack_cmd(cmd, sizeof(cmd), cachename, ".", " --numeric-owner");
-		rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET));
-		if (pwd)
-			if (chdir(pwd) == -1)
-				vztt_logger(0, errno, "chdir(%s) failed", pwd);
+		const char *what[] = {".", NULL};
+
+		rc = archive_pack(cachename, ve_private, what, opts_vztt);
 	}
 
 	if (rc) {
@@ -1339,7 +1317,6 @@ cleanup_2:
 	string_list_clean(&args);
 	string_list_clean(&packages);
 
-	VZTT_FREE_STR(pwd)
 	VZTT_FREE_STR(cachename);
 	unlink(temp_list);
 	VZTT_FREE_STR(temp_list)
@@ -52,11 +52,14 @@
 #include "vztt.h"
 #include "env_compat.h"
 #include "progress_messages.h"
+#include "evrcmp.h"
+#include "pkgcache.h"
 
 #define DEB_EXT ".deb"
 
 int apt_init(struct Transaction *pm);
 int apt_clean(struct Transaction *pm);
+static int apt_publish_archives(struct AptTransaction *apt, int failed);
 int apt_get_install_pkg(struct Transaction *apt, struct package_list *packages);
 int apt_update_metadata(struct Transaction *pm, const char *name);
 int apt_action(
@@ -208,6 +211,7 @@ int apt_init(struct Transaction *pm)
 	apt->apt_conf = NULL;
 	apt->sources = NULL;
 	apt->preferences = NULL;
+	apt->archives = NULL;
 	string_list_init(&apt->dpkg_options);
 
 	/* create mandatory local cache tree */
@@ -236,6 +240,8 @@ int apt_clean(struct Transaction *pm)
 {
 	struct AptTransaction *apt = (struct AptTransaction *)pm;
 
+	/* stage of interrupted run */
+	apt_publish_archives(apt, 1);
 	string_list_clean(&apt->dpkg_options);
 	VZTT_FREE_STR(apt->apt_conf);
 	VZTT_FREE_STR(apt->sources);
@@ -262,7 +268,7 @@ static int read_deb(FILE *fp, void *data)
 		for (ptr=buf; *ptr && *ptr!='='; ptr++) ;
 		if (!*ptr) continue;
 		ptr++;
-		if ((rc = parse_p(ptr, &pkg)))
+		if ((rc = parse_p_arena(ptr, packages->arena, &pkg)))
 			return rc;
 		/* parse_p create <pkg>, add this pointer to list */
 		package_list_insert(packages, pkg);
@@ -599,7 +605,11 @@ static int apt_create_config(struct AptTransaction *apt)
 	/* Location of the cache dir */
 	fprintf(fd, "  Cache \"%s/" PM_DATA_SUBDIR "/\" // swsoft\n", path);
 	fprintf(fd, "  {\n");
-	fprintf(fd, "     Archives \"archives/\";\n");
+	/* own stage of shared download cache, see pkgcache.h */
+	if (apt->archives)
+		fprintf(fd, "     Archives \"%s/\";\n", apt->archives);
+	else
+		fprintf(fd, "     Archives \"archives/\";\n");
 	fprintf(fd, "     srcpkgcache \"srcpkgcache.bin\";\n");
 	fprintf(fd, "     pkgcache \"pkgcache.bin\";     \n");
 	fprintf(fd, "  };\n\n");
@@ -689,6 +699,56 @@ static int apt_remove_config(struct AptTransaction *apt)
 	return 0;
 }
 
+/* shared download cache of os template */
+static void apt_archives_dir(
+		struct AptTransaction *apt,
+		char *path,
+		size_t size)
+{
+	snprintf(path, size, "%s/%s/archives", apt->basedir, apt->datadir);
+}
+
+static int apt_stage_archives(struct AptTransaction *apt)
+{
+	int rc;
+	char cachedir[PATH_MAX+1];
+	char stage[PATH_MAX+1];
+	char path[PATH_MAX+1];
+
+	apt_archives_dir(apt, cachedir, sizeof(cachedir));
+	if ((rc = pkgcache_stage(cachedir, stage, sizeof(stage))))
+		return rc;
+	if ((apt->archives = strdup(stage)) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup()");
+	if (snprintf(path, sizeof(path), "%s/partial", stage) >=
+			(int)sizeof(path))
+		return vztt_error(VZT_INTERNAL, 0, "Too long path %s", stage);
+	if (mkdir(path, 0755))
+		return vztt_error(VZT_CANT_CREATE, errno, "mkdir(%s)", path);
+	/* apt takes needed packages from stage and ignores other ones */
+	return pkgcache_seed(cachedir, stage, DEB_EXT);
+}
+
+/* publish packages of successful run, partially loaded packages of
+   failed one are dropped with stage */
+static int apt_publish_archives(struct AptTransaction *apt, int failed)
+{
+	int rc = 0;
+	char cachedir[PATH_MAX+1];
+
+	if (apt->archives == NULL)
+		return 0;
+	if (failed) {
+		pkgcache_abort(apt->archives);
+	} else {
+		apt_archives_dir(apt, cachedir, sizeof(cachedir));
+		rc = pkgcache_publish(cachedir, apt->archives, DEB_EXT);
+	}
+	free(apt->archives);
+	apt->archives = NULL;
+	return rc;
+}
+
 /* run apt-* command */
 static int apt_run(
 		struct AptTransaction *apt,
@@ -696,7 +756,7 @@ static int apt_run(
 		const char *action, \
 		struct string_list *packages)
 {
-	int rc;
+	int rc, rc2;
 	struct string_list args;
 	struct string_list envs;
 	struct string_list_el *o;
@@ -707,6 +767,13 @@ static int apt_run(
 	string_list_init(&args);
 	string_list_init(&envs);
 
+	/* download packages into own stage of shared cache */
+	if (strcmp(cmd, APT_GET_BIN) == 0 && (strcmp(action, "install") == 0 ||
+			strcmp(action, "upgrade") == 0 ||
+			strcmp(action, "dist-upgrade") == 0))
+		if ((rc = apt_stage_archives(apt)))
+			return rc;
+
 	if ((rc = apt_create_config(apt)))
 		return rc;
 
@@ -744,8 +811,11 @@ static int apt_run(
 		return rc;
 
 	/* run cmd from chroot environment */
-	if ((rc = run_from_chroot((char *)cmd, apt->envdir, apt->debug, \
-			apt->ign_pm_err, &args, &envs, apt->osrelease)))
+	rc = run_from_chroot((char *)cmd, apt->envdir, apt->debug, \
+			apt->ign_pm_err, &args, &envs, apt->osrelease);
+	if ((rc2 = apt_publish_archives(apt, rc != 0)) && rc == 0)
+		rc = rc2;
+	if (rc)
 		return rc;
 
 	apt_remove_config(apt);
@@ -1258,37 +1328,8 @@ int apt_is_std_pkg_area(const char *pkgdir, struct package *pkg)
         -1: b is newer than a */
 int apt_ver_cmp(struct Transaction *pm, const char * a, const char * b, int *eval)
 {
-	char cmd[PATH_MAX+1];
-	int rc, status;
-
-	*eval = 0;
-	if (strcmp(a,b) == 0)
-		return 0;
-
-	/* run dpkg from chroot */
-	snprintf(cmd, sizeof(cmd), \
-		"chroot %s %s --compare-versions \"%s\" gt \"%s\"", \
-		pm->envdir, DPKG_BIN, a, b);
-
-	vztt_logger(2, 0, cmd);
-	if ((status = system(cmd)) == -1) {
-		vztt_logger(0, errno, "system(%s) error", cmd);
-		return VZT_CANT_EXEC;
-	}
-	if (!WIFEXITED(status)) {
-		vztt_logger(0, 0, "\"%s\" failed", cmd);
-		return VZT_CMD_FAILED;
-	}
-
-	rc = WEXITSTATUS(status);
-	if (rc == 0)
-		*eval = 1;
-	else if (rc == 1)
-		*eval = -1;
-	else {
-		vztt_logger(0, 0, "\"%s\" return %d", cmd, rc);
-		return VZT_CMD_FAILED;
-	}
+	/* in-process, the same as dpkg --compare-versions */
+	*eval = deb_evrcmp(a, b);
 	return 0;
 }
 
@@ -0,0 +1,3123 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * built-in tar/lz4 archiver: GNU tar stream writer and multi-threaded
+ * lz4 frame encoder, compatible with `tar -c | lz4 -z` output
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <ctype.h>
+#include <time.h>
+#include <search.h>
+#include <lz4.h>
+/* for XXH32_state_t on stack */
+#define XXH_STATIC_LINKING_ONLY
+#include <xxhash.h>
+
+#include "vztt_error.h"
+#include "util.h"
+#include "progress_messages.h"
+#include "md5.h"
+#include "workqueue.h"
+#include "archive.h"
+
+/* lz4 frame format constants */
+#define LZ4F_MAGIC		0x184D2204U
+/* version 01, independent blocks, content checksum */
+#define LZ4F_FLG		0x64
+/* 4Mb max block size */
+#define LZ4F_BD			0x70
+#define LZ4F_UNCOMPRESSED	0x80000000U
+
+#define TAR_BLOCK		512
+#define TAR_RECORD		(20 * TAR_BLOCK)
+
+static inline uint32_t get_le32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* number of worker threads for compression/decompression */
+static int archive_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		n = 1;
+	if (n > ARCHIVE_MAX_THREADS)
+		n = ARCHIVE_MAX_THREADS;
+	return (int)n;
+}
+
+/*
+ * multi-threaded lz4 frame encoder.
+ * Producer fills blocks in the ring, workers compress them independently,
+ * writer thread puts compressed blocks to file in original order.
+ */
+enum {
+	SLOT_FREE = 0,
+	SLOT_FILLED,
+	SLOT_BUSY,
+	SLOT_DONE,
+};
+
+struct lz4w_slot {
+	int state;
+	char *in;
+	size_t inlen;
+	char *out;
+	size_t outlen;
+	int raw;
+};
+
+struct lz4w {
+	int fd;
+	int nthreads;
+	int nslots;
+	struct lz4w_slot *slots;
+	pthread_t *workers;
+	pthread_t writer;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* next block to fill by producer */
+	unsigned long fill_seq;
+	/* next block to compress */
+	unsigned long zip_seq;
+	/* next block to write */
+	unsigned long write_seq;
+	int finish;
+	int err;
+	XXH32_state_t xxh;
+};
+
+static void *lz4w_worker(void *arg)
+{
+	struct lz4w *w = (struct lz4w *)arg;
+	struct lz4w_slot *s;
+	int n;
+
+	pthread_mutex_lock(&w->mutex);
+	while (1) {
+		if (w->zip_seq < w->fill_seq) {
+			s = &w->slots[w->zip_seq % w->nslots];
+			w->zip_seq++;
+			s->state = SLOT_BUSY;
+			pthread_mutex_unlock(&w->mutex);
+
+			/* store block as is if it can not be compressed */
+			n = LZ4_compress_default(s->in, s->out,
+					(int)s->inlen, (int)s->inlen - 1);
+			if (n <= 0) {
+				s->outlen = s->inlen;
+				s->raw = 1;
+			} else {
+				s->outlen = n;
+				s->raw = 0;
+			}
+
+			pthread_mutex_lock(&w->mutex);
+			s->state = SLOT_DONE;
+			pthread_cond_broadcast(&w->cond);
+			continue;
+		}
+		if (w->finish)
+			break;
+		pthread_cond_wait(&w->cond, &w->mutex);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+
+static void *lz4w_writer(void *arg)
+{
+	struct lz4w *w = (struct lz4w *)arg;
+	struct lz4w_slot *s;
+	unsigned char hdr[4];
+	int err;
+
+	pthread_mutex_lock(&w->mutex);
+	while (1) {
+		s = &w->slots[w->write_seq % w->nslots];
+		if (w->write_seq < w->fill_seq && s->state == SLOT_DONE) {
+			err = w->err;
+			pthread_mutex_unlock(&w->mutex);
+
+			if (!err) {
+				put_le32(hdr, (uint32_t)s->outlen |
+					(s->raw ? LZ4F_UNCOMPRESSED : 0));
+				if (write_all(w->fd, hdr, sizeof(hdr)) ||
+					write_all(w->fd, s->raw ? s->in : s->out,
+						s->outlen))
+					err = errno ? errno : EIO;
+			}
+
+			pthread_mutex_lock(&w->mutex);
+			if (err && !w->err)
+				w->err = err;
+			s->inlen = 0;
+			s->state = SLOT_FREE;
+			w->write_seq++;
+			pthread_cond_broadcast(&w->cond);
+			continue;
+		}
+		if (w->finish && w->write_seq == w->fill_seq)
+			break;
+		pthread_cond_wait(&w->cond, &w->mutex);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+
+static void lz4w_free(struct lz4w *w)
+{
+	int i;
+
+	if (w->slots) {
+		for (i = 0; i < w->nslots; i++) {
+			VZTT_FREE_STR(w->slots[i].in);
+			VZTT_FREE_STR(w->slots[i].out);
+		}
+		free(w->slots);
+		w->slots = NULL;
+	}
+	VZTT_FREE_STR(w->workers);
+	pthread_mutex_destroy(&w->mutex);
+	pthread_cond_destroy(&w->cond);
+}
+
+/* write frame header and start compression threads */
+static int lz4w_open(struct lz4w *w, int fd)
+{
+	unsigned char hdr[7];
+	int i;
+
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	w->nthreads = archive_threads();
+	w->nslots = 2 * w->nthreads + 1;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	XXH32_reset(&w->xxh, 0);
+
+	if ((w->slots = calloc(w->nslots, sizeof(*w->slots))) == NULL ||
+		(w->workers = calloc(w->nthreads, sizeof(pthread_t))) == NULL) {
+		lz4w_free(w);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	}
+	for (i = 0; i < w->nslots; i++) {
+		w->slots[i].in = malloc(ARCHIVE_LZ4_BLOCK_SIZE);
+		w->slots[i].out = malloc(ARCHIVE_LZ4_BLOCK_SIZE);
+		if (w->slots[i].in == NULL || w->slots[i].out == NULL) {
+			lz4w_free(w);
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+		}
+	}
+
+	put_le32(hdr, LZ4F_MAGIC);
+	hdr[4] = LZ4F_FLG;
+	hdr[5] = LZ4F_BD;
+	hdr[6] = (XXH32(hdr + 4, 2, 0) >> 8) & 0xFF;
+	if (write_all(fd, hdr, sizeof(hdr))) {
+		lz4w_free(w);
+		return vztt_error(VZT_CANT_WRITE, errno, "write()");
+	}
+
+	for (i = 0; i < w->nthreads; i++) {
+		if (pthread_create(&w->workers[i], NULL, lz4w_worker, w))
+			break;
+	}
+	w->nthreads = i;
+	if (w->nthreads == 0 ||
+		pthread_create(&w->writer, NULL, lz4w_writer, w)) {
+		pthread_mutex_lock(&w->mutex);
+		w->finish = 1;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->mutex);
+		for (i = 0; i < w->nthreads; i++)
+			pthread_join(w->workers[i], NULL);
+		lz4w_free(w);
+		return vztt_error(VZT_SYSTEM, 0, "Can not create thread");
+	}
+
+	return 0;
+}
+
+/* pass current block to workers */
+static void lz4w_submit(struct lz4w *w)
+{
+	pthread_mutex_lock(&w->mutex);
+	w->slots[w->fill_seq % w->nslots].state = SLOT_FILLED;
+	w->fill_seq++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/* get current block for filling, wait for it if needed */
+static struct lz4w_slot *lz4w_slot(struct lz4w *w)
+{
+	struct lz4w_slot *s;
+
+	pthread_mutex_lock(&w->mutex);
+	s = &w->slots[w->fill_seq % w->nslots];
+	while (s->state != SLOT_FREE && !w->err)
+		pthread_cond_wait(&w->cond, &w->mutex);
+	pthread_mutex_unlock(&w->mutex);
+	return w->err ? NULL : s;
+}
+
+static int lz4w_write(void *data, const void *buf, size_t len)
+{
+	struct lz4w *w = (struct lz4w *)data;
+	struct lz4w_slot *s;
+	const char *p = (const char *)buf;
+	size_t n;
+
+	XXH32_update(&w->xxh, buf, len);
+	while (len) {
+		if ((s = lz4w_slot(w)) == NULL) {
+			errno = w->err;
+			return -1;
+		}
+		n = ARCHIVE_LZ4_BLOCK_SIZE - s->inlen;
+		if (n > len)
+			n = len;
+		memcpy(s->in + s->inlen, p, n);
+		s->inlen += n;
+		p += n;
+		len -= n;
+		if (s->inlen == ARCHIVE_LZ4_BLOCK_SIZE)
+			lz4w_submit(w);
+	}
+	return 0;
+}
+
+/* flush last block, stop threads and write end mark and content checksum */
+static int lz4w_close(struct lz4w *w)
+{
+	struct lz4w_slot *s;
+	unsigned char tail[8];
+	int i, rc = 0;
+
+	pthread_mutex_lock(&w->mutex);
+	s = &w->slots[w->fill_seq % w->nslots];
+	if (!w->err && s->state == SLOT_FREE && s->inlen) {
+		s->state = SLOT_FILLED;
+		w->fill_seq++;
+	}
+	w->finish = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+	for (i = 0; i < w->nthreads; i++)
+		pthread_join(w->workers[i], NULL);
+	pthread_join(w->writer, NULL);
+
+	if (w->err) {
+		rc = vztt_error(VZT_CANT_WRITE, w->err, "write()");
+	} else {
+		put_le32(tail, 0);
+		put_le32(tail + 4, XXH32_digest(&w->xxh));
+		if (write_all(w->fd, tail, sizeof(tail)))
+			rc = vztt_error(VZT_CANT_WRITE, errno, "write()");
+	}
+	lz4w_free(w);
+	return rc;
+}
+
+/*
+ * GNU tar stream writer
+ */
+struct tar_hlink {
+	dev_t dev;
+	ino_t ino;
+	char *name;
+	struct tar_hlink *next;
+};
+
+#define TAR_HLINK_HASH	4096
+
+struct tar_writer {
+	int (*write)(void *data, const void *buf, size_t len);
+	void *data;
+	struct tar_hlink *hlinks[TAR_HLINK_HASH];
+	unsigned long long written;
+	/* progress */
+	unsigned long long total;
+	int percent;
+	int progress_fd;
+	char *buf;
+};
+
+#define TAR_BUF_SIZE	(256*1024)
+
+static int tar_out(struct tar_writer *t, const void *buf, size_t len)
+{
+	if (t->write(t->data, buf, len))
+		return -1;
+	t->written += len;
+	if (t->total) {
+		int percent = (int)(t->written * 100 / t->total);
+		if (percent > 99)
+			percent = 99;
+		if (percent > t->percent) {
+			t->percent = percent;
+			progress(PROGRESS_PACK_CACHE, percent, t->progress_fd);
+		}
+	}
+	return 0;
+}
+
+/* put numeric value to header field in octal or in base-256 if too large */
+static void tar_num(char *field, size_t len, unsigned long long val)
+{
+	size_t i;
+
+	if (val < (1ULL << (3 * (len - 1)))) {
+		field[len - 1] = '\0';
+		for (i = len - 1; i > 0; i--) {
+			field[i - 1] = '0' + (val & 7);
+			val >>= 3;
+		}
+		return;
+	}
+	for (i = len - 1; i > 0; i--) {
+		field[i] = (char)(val & 0xFF);
+		val >>= 8;
+	}
+	field[0] = (char)0x80;
+}
+
+static int tar_header(
+		struct tar_writer *t,
+		const char *name,
+		const struct stat *st,
+		char type,
+		const char *linkname,
+		unsigned long long size);
+
+/* write ././@LongLink pseudo entry for too long name or link target */
+static int tar_longlink(struct tar_writer *t, const char *name, char type)
+{
+	size_t len = strlen(name) + 1;
+	size_t pad = (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK;
+	struct stat st;
+	char zero[TAR_BLOCK];
+
+	/* as GNU tar with --numeric-owner: 0644, root:root, no owner names */
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFREG | 0644;
+	if (tar_header(t, "././@LongLink", &st, type, NULL, len))
+		return -1;
+	if (tar_out(t, name, len))
+		return -1;
+	memset(zero, 0, sizeof(zero));
+	if (pad && tar_out(t, zero, pad))
+		return -1;
+	return 0;
+}
+
+static int tar_header(
+		struct tar_writer *t,
+		const char *name,
+		const struct stat *st,
+		char type,
+		const char *linkname,
+		unsigned long long size)
+{
+	unsigned char h[TAR_BLOCK];
+	unsigned int sum = 0;
+	int i;
+
+	/* as GNU tar does, name of exactly 100 bytes is not terminated */
+	if (strlen(name) > 100 && tar_longlink(t, name, 'L'))
+		return -1;
+	if (linkname && strlen(linkname) > 100 &&
+		tar_longlink(t, linkname, 'K'))
+		return -1;
+
+	memset(h, 0, sizeof(h));
+	strncpy((char *)h, name, 100);
+	tar_num((char *)h + 100, 8, st->st_mode & 07777);
+	tar_num((char *)h + 108, 8, st->st_uid);
+	tar_num((char *)h + 116, 8, st->st_gid);
+	tar_num((char *)h + 124, 12, size);
+	tar_num((char *)h + 136, 12, st->st_mtime < 0 ? 0 : st->st_mtime);
+	memset(h + 148, ' ', 8);
+	h[156] = type;
+	if (linkname)
+		strncpy((char *)h + 157, linkname, 100);
+	memcpy(h + 257, "ustar  ", 8);
+	if (type == '3' || type == '4') {
+		tar_num((char *)h + 329, 8, major(st->st_rdev));
+		tar_num((char *)h + 337, 8, minor(st->st_rdev));
+	}
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += h[i];
+	snprintf((char *)h + 148, 8, "%06o", sum);
+	h[155] = ' ';
+
+	return tar_out(t, h, sizeof(h));
+}
+
+/* get in <*link> name of previously archived hardlink
+   or register new one and set <*link> to NULL */
+static int tar_hlink(
+		struct tar_writer *t,
+		const struct stat *st,
+		const char *name,
+		const char **link)
+{
+	unsigned int i = (unsigned int)((st->st_ino ^ st->st_dev) % TAR_HLINK_HASH);
+	struct tar_hlink *l;
+
+	*link = NULL;
+	for (l = t->hlinks[i]; l; l = l->next) {
+		if (l->ino == st->st_ino && l->dev == st->st_dev) {
+			*link = l->name;
+			return 0;
+		}
+	}
+
+	if ((l = malloc(sizeof(*l))) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+	if ((l->name = strdup(name)) == NULL) {
+		free(l);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup()");
+	}
+	l->dev = st->st_dev;
+	l->ino = st->st_ino;
+	l->next = t->hlinks[i];
+	t->hlinks[i] = l;
+	return 0;
+}
+
+static int tar_file_data(
+		struct tar_writer *t,
+		const char *path,
+		unsigned long long size)
+{
+	int fd;
+	ssize_t n;
+	size_t len;
+	int rc = 0;
+
+	if ((fd = open(path, O_RDONLY|O_NOFOLLOW)) == -1)
+		return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", path);
+
+	while (size) {
+		len = size < TAR_BUF_SIZE ? size : TAR_BUF_SIZE;
+		n = read(fd, t->buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			rc = vztt_error(VZT_CANT_READ, errno, "read(%s)", path);
+			break;
+		}
+		if (n == 0) {
+			/* file was truncated, pad it with zeroes as tar does */
+			vztt_logger(1, 0, "%s: file shrank", path);
+			memset(t->buf, 0, len);
+			n = len;
+		}
+		if (tar_out(t, t->buf, n)) {
+			rc = vztt_error(VZT_CANT_WRITE, errno, "write()");
+			break;
+		}
+		size -= n;
+	}
+	close(fd);
+	return rc;
+}
+
+static int tar_pad(struct tar_writer *t, unsigned long long size)
+{
+	size_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+	if (pad == 0)
+		return 0;
+	memset(t->buf, 0, pad);
+	if (tar_out(t, t->buf, pad))
+		return vztt_error(VZT_CANT_WRITE, errno, "write()");
+	return 0;
+}
+
+/* put entry 'path' to archive as 'name', recursively for directories */
+static int tar_entry(struct tar_writer *t, const char *path, const char *name)
+{
+	struct stat st;
+	char target[PATH_MAX+1];
+	char *subpath, *subname, *dirname;
+	const char *link;
+	DIR *dir;
+	struct dirent *de;
+	ssize_t n;
+	size_t len;
+	int rc = 0;
+
+	if (lstat(path, &st))
+		return vztt_error(VZT_CANT_LSTAT, errno, "lstat(%s)", path);
+
+	if (S_ISDIR(st.st_mode)) {
+		/* directory names are stored with trailing slash */
+		len = strlen(name);
+		if ((dirname = malloc(len + 2)) == NULL)
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+		memcpy(dirname, name, len);
+		if (len == 0 || name[len - 1] != '/')
+			dirname[len++] = '/';
+		dirname[len] = '\0';
+		if (tar_header(t, dirname, &st, '5', NULL, 0)) {
+			free(dirname);
+			return vztt_error(VZT_CANT_WRITE, errno, "write()");
+		}
+
+		if ((dir = opendir(path)) == NULL) {
+			free(dirname);
+			return vztt_error(VZT_CANT_OPEN, errno, "opendir(%s)", path);
+		}
+		while (1) {
+			errno = 0;
+			if ((de = readdir(dir)) == NULL) {
+				if (errno)
+					rc = vztt_error(VZT_CANT_READ, errno,
+						"readdir(%s)", path);
+				break;
+			}
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			if (asprintf(&subpath, "%s/%s", path, de->d_name) == -1) {
+				rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "asprintf()");
+				break;
+			}
+			if (asprintf(&subname, "%s%s", dirname, de->d_name) == -1) {
+				free(subpath);
+				rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "asprintf()");
+				break;
+			}
+			rc = tar_entry(t, subpath, subname);
+			free(subpath);
+			free(subname);
+			if (rc)
+				break;
+		}
+		closedir(dir);
+		free(dirname);
+		return rc;
+	}
+
+	if (st.st_nlink > 1) {
+		if ((rc = tar_hlink(t, &st, name, &link)))
+			return rc;
+		if (link) {
+			if (tar_header(t, name, &st, '1', link, 0))
+				return vztt_error(VZT_CANT_WRITE, errno, "write()");
+			return 0;
+		}
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		if (tar_header(t, name, &st, '0', NULL, st.st_size))
+			return vztt_error(VZT_CANT_WRITE, errno, "write()");
+		if ((rc = tar_file_data(t, path, st.st_size)))
+			return rc;
+		return tar_pad(t, st.st_size);
+	} else if (S_ISLNK(st.st_mode)) {
+		if ((n = readlink(path, target, sizeof(target) - 1)) == -1)
+			return vztt_error(VZT_CANT_READ, errno, "readlink(%s)", path);
+		target[n] = '\0';
+		if (tar_header(t, name, &st, '2', target, 0))
+			return vztt_error(VZT_CANT_WRITE, errno, "write()");
+	} else if (S_ISCHR(st.st_mode)) {
+		if (tar_header(t, name, &st, '3', NULL, 0))
+			return vztt_error(VZT_CANT_WRITE, errno, "write()");
+	} else if (S_ISBLK(st.st_mode)) {
+		if (tar_header(t, name, &st, '4', NULL, 0))
+			return vztt_error(VZT_CANT_WRITE, errno, "write()");
+	} else if (S_ISFIFO(st.st_mode)) {
+		if (tar_header(t, name, &st, '6', NULL, 0))
+			return vztt_error(VZT_CANT_WRITE, errno, "write()");
+	} else if (S_ISSOCK(st.st_mode)) {
+		vztt_logger(2, 0, "%s: socket ignored", path);
+	}
+
+	return 0;
+}
+
+/* add archived data size of <path> to <*size> for progress */
+static int tar_size(const char *path, unsigned long long *size)
+{
+	struct stat st;
+	DIR *dir;
+	struct dirent *de;
+	char *subpath;
+	int rc = 0;
+
+	if (lstat(path, &st))
+		return vztt_error(VZT_CANT_LSTAT, errno, "lstat(%s)", path);
+	*size += TAR_BLOCK;
+	if (S_ISREG(st.st_mode))
+		*size += (st.st_size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+	if (!S_ISDIR(st.st_mode))
+		return 0;
+
+	if ((dir = opendir(path)) == NULL)
+		return vztt_error(VZT_CANT_OPEN, errno, "opendir(%s)", path);
+	while (1) {
+		errno = 0;
+		if ((de = readdir(dir)) == NULL) {
+			if (errno)
+				rc = vztt_error(VZT_CANT_READ, errno,
+					"readdir(%s)", path);
+			break;
+		}
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (asprintf(&subpath, "%s/%s", path, de->d_name) == -1) {
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "asprintf()");
+			break;
+		}
+		rc = tar_size(subpath, size);
+		free(subpath);
+		if (rc)
+			break;
+	}
+	closedir(dir);
+	return rc;
+}
+
+static void tar_writer_free(struct tar_writer *t)
+{
+	struct tar_hlink *l;
+	int i;
+
+	for (i = 0; i < TAR_HLINK_HASH; i++) {
+		while ((l = t->hlinks[i])) {
+			t->hlinks[i] = l->next;
+			free(l->name);
+			free(l);
+		}
+	}
+	VZTT_FREE_STR(t->buf);
+}
+
+/* write archive entries and end-of-archive marker */
+static int tar_write(
+		struct tar_writer *t,
+		const char *dir,
+		const char *const what[])
+{
+	char *path;
+	unsigned long long size;
+	int i, rc;
+
+	if (t->progress_fd) {
+		for (i = 0; what[i]; i++) {
+			if (asprintf(&path, "%s/%s", dir, what[i]) == -1)
+				return vztt_error(VZT_CANT_ALLOC_MEM, errno, "asprintf()");
+			rc = tar_size(path, &t->total);
+			free(path);
+			if (rc)
+				return rc;
+		}
+	}
+
+	for (i = 0; what[i]; i++) {
+		if (asprintf(&path, "%s/%s", dir, what[i]) == -1)
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno, "asprintf()");
+		rc = tar_entry(t, path, what[i]);
+		free(path);
+		if (rc)
+			return rc;
+	}
+
+	/* two zero blocks, padded up to record size as GNU tar does */
+	size = t->written + 2 * TAR_BLOCK;
+	size = (size + TAR_RECORD - 1) / TAR_RECORD * TAR_RECORD - t->written;
+	memset(t->buf, 0, size);
+	if (tar_out(t, t->buf, size))
+		return vztt_error(VZT_CANT_WRITE, errno, "write()");
+	return 0;
+}
+
+static int archive_pack_lz4(
+		const char *file,
+		const char *dir,
+		const char *const what[],
+		struct options_vztt *opts_vztt)
+{
+	struct lz4w w;
+	struct tar_writer t;
+	int fd;
+	int rc, rc2;
+
+	memset(&t, 0, sizeof(t));
+	if ((t.buf = malloc(TAR_BUF_SIZE)) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+	t.progress_fd = opts_vztt->progress_fd;
+
+	if ((fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1) {
+		tar_writer_free(&t);
+		return vztt_error(VZT_CANT_CREATE, errno, "open(%s)", file);
+	}
+
+	if ((rc = lz4w_open(&w, fd)))
+		goto cleanup;
+
+	t.write = lz4w_write;
+	t.data = &w;
+	rc = tar_write(&t, dir, what);
+	rc2 = lz4w_close(&w);
+	if (rc == 0)
+		rc = rc2;
+
+cleanup:
+	if (close(fd) && rc == 0)
+		rc = vztt_error(VZT_CANT_WRITE, errno, "close(%s)", file);
+	tar_writer_free(&t);
+	if (rc)
+		unlink(file);
+	return rc;
+}
+
+
+/*
+ * multi-threaded lz4 frame decoder.
+ * Reader thread puts compressed blocks to the ring, workers decompress
+ * them independently, consumer takes decompressed blocks in original order.
+ */
+struct lz4r_slot {
+	int state;
+	char *in;
+	size_t inlen;
+	size_t insize;
+	char *out;
+	size_t outlen;
+	size_t outsize;
+	int raw;
+	/* block checksum */
+	int has_bsum;
+	uint32_t bsum;
+	/* end of frame mark with optional content checksum */
+	int frame_end;
+	int has_csum;
+	uint32_t csum;
+	/* chunk store: md5 of decompressed data */
+	int has_md5;
+	unsigned char md5[16];
+};
+
+struct lz4r {
+	int fd;
+	int nthreads;
+	int nslots;
+	struct lz4r_slot *slots;
+	pthread_t *workers;
+	pthread_t reader;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* next block to fill by reader */
+	unsigned long fill_seq;
+	/* next block to decompress */
+	unsigned long zip_seq;
+	/* next block to consume */
+	unsigned long read_seq;
+	int eof;
+	int stop;
+	int err;
+	/* current frame descriptor, reader thread only */
+	int flg;
+	size_t block_max;
+	int in_frame;
+	/* chunk store manifest instead of lz4 stream */
+	struct chunk_ref *chunks;
+	size_t nchunks;
+	size_t next_chunk;
+	char *chunkdir;
+	/* consumer side */
+	struct lz4r_slot *cur;
+	size_t pos;
+	XXH32_state_t xxh;
+	/* compressed bytes read, reader thread only */
+	unsigned long long in_bytes;
+	/* the same, published for consumer, for progress */
+	unsigned long long consumed;
+	unsigned long long total;
+	int percent;
+	int progress_fd;
+};
+
+static ssize_t read_full(int fd, void *buf, size_t len)
+{
+	char *p = (char *)buf;
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, p + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+/* read exactly <len> bytes of compressed stream, end of file is an error */
+static int lz4r_read_in(struct lz4r *r, void *buf, size_t len)
+{
+	ssize_t n;
+
+	if ((n = read_full(r->fd, buf, len)) == -1)
+		return vztt_error(-1, errno, "read()");
+	if ((size_t)n != len)
+		return vztt_error(-1, 0, "Unexpected end of lz4 stream");
+	return 0;
+}
+
+/*
+read next frame descriptor, skipping skippable frames.
+Returns 0 on success, 1 at end of stream, 2 for frame which can not be
+decoded in parallel (legacy format or linked blocks), -1 on error.
+*/
+static int lz4r_frame_header(struct lz4r *r)
+{
+	unsigned char buf[15];
+	uint32_t magic, skip;
+	ssize_t n;
+	size_t len;
+
+	while (1) {
+		if ((n = read_full(r->fd, buf, 4)) == -1)
+			return vztt_error(-1, errno, "read()");
+		if (n == 0)
+			return 1;
+		if (n != 4)
+			return vztt_error(-1, 0, "Unexpected end of lz4 stream");
+		r->in_bytes += 4;
+		magic = get_le32(buf);
+		if ((magic & 0xFFFFFFF0U) != 0x184D2A50U)
+			break;
+		/* skippable frame */
+		if (lz4r_read_in(r, buf, 4))
+			return -1;
+		skip = get_le32(buf);
+		if (lseek(r->fd, skip, SEEK_CUR) == (off_t)-1)
+			return vztt_error(-1, errno, "lseek()");
+		r->in_bytes += 4 + skip;
+	}
+	if (magic != LZ4F_MAGIC)
+		return 2;
+
+	if (lz4r_read_in(r, buf, 2))
+		return -1;
+	r->flg = buf[0];
+	if ((r->flg >> 6) != 1 || !(r->flg & 0x20))
+		return 2;
+	len = 2;
+	/* content size and dictionary id */
+	if (r->flg & 0x08)
+		len += 8;
+	if (r->flg & 0x01)
+		len += 4;
+	if (lz4r_read_in(r, buf + 2, len - 2 + 1))
+		return -1;
+	if (((XXH32(buf, len, 0) >> 8) & 0xFF) != buf[len])
+		return vztt_error(-1, 0, "Invalid lz4 frame header checksum");
+	r->in_bytes += len + 1;
+
+	switch ((buf[1] >> 4) & 0x07) {
+	case 4:
+		r->block_max = 64 * 1024;
+		break;
+	case 5:
+		r->block_max = 256 * 1024;
+		break;
+	case 6:
+		r->block_max = 1024 * 1024;
+		break;
+	case 7:
+		r->block_max = 4 * 1024 * 1024;
+		break;
+	default:
+		return vztt_error(-1, 0, "Invalid lz4 block size");
+	}
+	r->in_frame = 1;
+	return 0;
+}
+
+static int chunk_read_block(struct lz4r *r, struct lz4r_slot *s);
+
+/* read next block of current frame to slot */
+static int lz4r_read_block(struct lz4r *r, struct lz4r_slot *s)
+{
+	unsigned char buf[4];
+	uint32_t size;
+	int rc;
+
+	s->frame_end = 0;
+	s->has_bsum = 0;
+	s->has_csum = 0;
+	s->has_md5 = 0;
+	s->inlen = 0;
+
+	if (r->chunks)
+		return chunk_read_block(r, s);
+
+	if (!r->in_frame) {
+		if ((rc = lz4r_frame_header(r)) == 1)
+			return 1;
+		else if (rc == 2)
+			return vztt_error(-1, 0, "Unsupported lz4 frame format");
+		else if (rc)
+			return -1;
+	}
+
+	if (lz4r_read_in(r, buf, 4))
+		return -1;
+	r->in_bytes += 4;
+	size = get_le32(buf);
+	if (size == 0) {
+		s->frame_end = 1;
+		r->in_frame = 0;
+		if (r->flg & 0x04) {
+			if (lz4r_read_in(r, buf, 4))
+				return -1;
+			r->in_bytes += 4;
+			s->has_csum = 1;
+			s->csum = get_le32(buf);
+		}
+		return 0;
+	}
+
+	s->raw = (size & LZ4F_UNCOMPRESSED) ? 1 : 0;
+	size &= ~LZ4F_UNCOMPRESSED;
+	if (size > r->block_max)
+		return vztt_error(-1, 0, "Invalid lz4 block size");
+	if (s->insize < r->block_max) {
+		free(s->in);
+		if ((s->in = malloc(r->block_max)) == NULL) {
+			s->insize = 0;
+			return vztt_error(-1, errno, "malloc()");
+		}
+		s->insize = r->block_max;
+	}
+	if (lz4r_read_in(r, s->in, size))
+		return -1;
+	s->inlen = size;
+	r->in_bytes += size;
+	if (r->flg & 0x10) {
+		if (lz4r_read_in(r, buf, 4))
+			return -1;
+		r->in_bytes += 4;
+		s->has_bsum = 1;
+		s->bsum = get_le32(buf);
+	}
+	/* decompressed block can not be larger than frame block size */
+	s->outlen = r->block_max;
+	return 0;
+}
+
+static void *lz4r_reader(void *arg)
+{
+	struct lz4r *r = (struct lz4r *)arg;
+	struct lz4r_slot *s;
+	int rc;
+
+	pthread_mutex_lock(&r->mutex);
+	while (1) {
+		s = &r->slots[r->fill_seq % r->nslots];
+		while (s->state != SLOT_FREE && !r->stop && !r->err)
+			pthread_cond_wait(&r->cond, &r->mutex);
+		if (r->stop || r->err)
+			break;
+		pthread_mutex_unlock(&r->mutex);
+
+		rc = lz4r_read_block(r, s);
+
+		pthread_mutex_lock(&r->mutex);
+		if (rc == 1) {
+			r->eof = 1;
+			break;
+		} else if (rc) {
+			r->err = EIO;
+			break;
+		}
+		s->state = SLOT_FILLED;
+		r->fill_seq++;
+		r->consumed = r->in_bytes;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+	return NULL;
+}
+
+static void *lz4r_worker(void *arg)
+{
+	struct lz4r *r = (struct lz4r *)arg;
+	struct lz4r_slot *s;
+	size_t size;
+	int n, err;
+
+	pthread_mutex_lock(&r->mutex);
+	while (1) {
+		if (r->stop || r->err)
+			break;
+		if (r->zip_seq < r->fill_seq) {
+			s = &r->slots[r->zip_seq % r->nslots];
+			r->zip_seq++;
+			s->state = SLOT_BUSY;
+			pthread_mutex_unlock(&r->mutex);
+
+			err = 0;
+			size = s->outlen;
+			s->outlen = 0;
+			if (s->frame_end) {
+				;
+			} else if (s->has_bsum &&
+					XXH32(s->in, s->inlen, 0) != s->bsum) {
+				err = vztt_error(EIO, 0,
+					"lz4 block checksum mismatch");
+			} else if (s->raw) {
+				s->outlen = s->inlen;
+			} else {
+				if (s->outsize < size) {
+					free(s->out);
+					s->outsize = 0;
+					if ((s->out = malloc(size)) == NULL)
+						err = vztt_error(ENOMEM, errno,
+							"malloc()");
+					else
+						s->outsize = size;
+				}
+				if (err == 0) {
+					n = LZ4_decompress_safe(s->in, s->out,
+						(int)s->inlen, (int)size);
+					if (n < 0)
+						err = vztt_error(EIO, 0,
+							"Corrupted lz4 block");
+					else
+						s->outlen = n;
+				}
+			}
+			if (err == 0 && s->has_md5) {
+				struct MD5Context ctx;
+				unsigned char md5[16];
+
+				MD5Init(&ctx);
+				MD5Update(&ctx, (md5byte *)(s->raw ? s->in : s->out),
+					s->outlen);
+				MD5Final(md5, &ctx);
+				if (memcmp(md5, s->md5, sizeof(md5)))
+					err = vztt_error(EIO, 0,
+						"Chunk checksum mismatch");
+			}
+
+			pthread_mutex_lock(&r->mutex);
+			if (err && !r->err)
+				r->err = err;
+			s->state = SLOT_DONE;
+			pthread_cond_broadcast(&r->cond);
+			continue;
+		}
+		if (r->eof)
+			break;
+		pthread_cond_wait(&r->cond, &r->mutex);
+	}
+	pthread_mutex_unlock(&r->mutex);
+	return NULL;
+}
+
+static void lz4r_free(struct lz4r *r)
+{
+	int i;
+
+	if (r->slots) {
+		for (i = 0; i < r->nslots; i++) {
+			VZTT_FREE_STR(r->slots[i].in);
+			VZTT_FREE_STR(r->slots[i].out);
+		}
+		free(r->slots);
+		r->slots = NULL;
+	}
+	VZTT_FREE_STR(r->workers);
+	VZTT_FREE_STR(r->chunks);
+	VZTT_FREE_STR(r->chunkdir);
+	pthread_mutex_destroy(&r->mutex);
+	pthread_cond_destroy(&r->cond);
+}
+
+/* stop threads and free decoder */
+static void lz4r_close(struct lz4r *r)
+{
+	int i;
+
+	pthread_mutex_lock(&r->mutex);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+	for (i = 0; i < r->nthreads; i++)
+		pthread_join(r->workers[i], NULL);
+	pthread_join(r->reader, NULL);
+	lz4r_free(r);
+}
+
+/* start decoding threads */
+static int lz4r_start(struct lz4r *r)
+{
+	int i;
+
+	r->nthreads = archive_threads();
+	r->nslots = r->nthreads + 3;
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if ((r->slots = calloc(r->nslots, sizeof(*r->slots))) == NULL ||
+		(r->workers = calloc(r->nthreads, sizeof(pthread_t))) == NULL) {
+		lz4r_free(r);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	}
+
+	for (i = 0; i < r->nthreads; i++)
+		if (pthread_create(&r->workers[i], NULL, lz4r_worker, r))
+			break;
+	r->nthreads = i;
+	if (r->nthreads == 0 ||
+		pthread_create(&r->reader, NULL, lz4r_reader, r)) {
+		pthread_mutex_lock(&r->mutex);
+		r->stop = 1;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->mutex);
+		for (i = 0; i < r->nthreads; i++)
+			pthread_join(r->workers[i], NULL);
+		lz4r_free(r);
+		return vztt_error(VZT_SYSTEM, 0, "Can not create thread");
+	}
+
+	return 0;
+}
+
+/*
+read first frame descriptor and start decoding threads.
+Returns 0 on success, 1 if stream can not be decoded in parallel,
+VZT_* error code otherwise.
+*/
+static int lz4r_open(struct lz4r *r, int fd, int progress_fd)
+{
+	struct stat st;
+	int rc;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+	r->progress_fd = progress_fd;
+	if (progress_fd && fstat(fd, &st) == 0)
+		r->total = st.st_size;
+	XXH32_reset(&r->xxh, 0);
+
+	if ((rc = lz4r_frame_header(r)) == 2)
+		return 1;
+	else if (rc)
+		return vztt_error(VZT_CANT_READ, 0, "Invalid lz4 archive");
+
+	return lz4r_start(r);
+}
+
+/*
+get pointer to next piece of decompressed data, up to 'len' bytes.
+Pointer is valid up to next call. Returns size of data, 0 at the end of
+stream or -1 on error.
+*/
+static ssize_t lz4r_get(struct lz4r *r, const char **ptr, size_t len)
+{
+	struct lz4r_slot *s;
+	unsigned long long consumed;
+	int percent;
+	size_t n;
+
+	while (r->cur == NULL || r->pos == r->cur->outlen) {
+		pthread_mutex_lock(&r->mutex);
+		if (r->cur) {
+			r->cur->state = SLOT_FREE;
+			r->read_seq++;
+			r->cur = NULL;
+			pthread_cond_broadcast(&r->cond);
+		}
+		s = &r->slots[r->read_seq % r->nslots];
+		while (!r->err && !(r->read_seq < r->fill_seq &&
+				s->state == SLOT_DONE) &&
+				!(r->eof && r->read_seq == r->fill_seq))
+			pthread_cond_wait(&r->cond, &r->mutex);
+		if (r->err) {
+			pthread_mutex_unlock(&r->mutex);
+			return -1;
+		}
+		if (r->read_seq == r->fill_seq) {
+			pthread_mutex_unlock(&r->mutex);
+			return 0;
+		}
+		consumed = r->consumed;
+		pthread_mutex_unlock(&r->mutex);
+
+		r->cur = s;
+		r->pos = 0;
+		if (r->chunks) {
+			;
+		} else if (s->frame_end) {
+			if (s->has_csum && XXH32_digest(&r->xxh) != s->csum) {
+				vztt_logger(0, 0, "lz4 content checksum mismatch");
+				return -1;
+			}
+			XXH32_reset(&r->xxh, 0);
+		} else {
+			XXH32_update(&r->xxh, s->raw ? s->in : s->out,
+				s->outlen);
+		}
+		if (r->total) {
+			percent = (int)(consumed * 100 / r->total);
+			if (percent > 99)
+				percent = 99;
+			if (percent > r->percent) {
+				r->percent = percent;
+				progress(PROGRESS_UNPACK_CACHE, percent,
+					r->progress_fd);
+			}
+		}
+	}
+
+	s = r->cur;
+	n = s->outlen - r->pos;
+	if (n > len)
+		n = len;
+	*ptr = (s->raw ? s->in : s->out) + r->pos;
+	r->pos += n;
+	return n;
+}
+
+/* read exactly 'len' bytes of decompressed data to 'buf' */
+static int lz4r_read(struct lz4r *r, void *buf, size_t len)
+{
+	const char *ptr;
+	ssize_t n;
+
+	while (len) {
+		if ((n = lz4r_get(r, &ptr, len)) <= 0)
+			return -1;
+		if (buf) {
+			memcpy(buf, ptr, n);
+			buf = (char *)buf + n;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * tar stream reader
+ */
+struct tar_xattr {
+	char *name;
+	char *value;
+	size_t len;
+	struct tar_xattr *next;
+};
+
+struct tar_member {
+	char type;
+	char *name;
+	char *linkname;
+	unsigned long long size;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timespec mtime;
+	unsigned int devmajor;
+	unsigned int devminor;
+	struct tar_xattr *xattrs;
+};
+
+/* max size of LongLink and pax header data */
+#define TAR_MAX_META_SIZE	(16*1024*1024)
+
+/* fields overridden by pax header */
+#define PAX_SIZE	0x01
+#define PAX_UID		0x02
+#define PAX_GID		0x04
+#define PAX_MTIME	0x08
+
+static void tar_member_clean(struct tar_member *m)
+{
+	struct tar_xattr *x;
+
+	VZTT_FREE_STR(m->name);
+	VZTT_FREE_STR(m->linkname);
+	while ((x = m->xattrs)) {
+		m->xattrs = x->next;
+		free(x->name);
+		free(x->value);
+		free(x);
+	}
+}
+
+static unsigned long long tar_parse_num(const char *field, size_t len)
+{
+	unsigned long long val = 0;
+	size_t i = 0;
+
+	/* base-256 */
+	if ((unsigned char)field[0] & 0x80) {
+		for (i = 1; i < len; i++)
+			val = (val << 8) | (unsigned char)field[i];
+		return val;
+	}
+	while (i < len && (field[i] == ' ' || field[i] == '\0'))
+		i++;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		val = (val << 3) | (field[i] - '0');
+	return val;
+}
+
+static int tar_read_data(struct lz4r *r, unsigned long long size, char **data)
+{
+	size_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+	if (size > TAR_MAX_META_SIZE)
+		return vztt_error(VZT_CANT_PARSE, 0, "Too large tar header");
+	if ((*data = malloc(size + 1)) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+	if (lz4r_read(r, *data, size) || lz4r_read(r, NULL, pad)) {
+		VZTT_FREE_STR(*data);
+		return vztt_error(VZT_CANT_READ, 0, "Unexpected end of archive");
+	}
+	(*data)[size] = '\0';
+	return 0;
+}
+
+/* parse pax extended header records "len key=value\n" */
+static int tar_parse_pax(char *data, size_t size, struct tar_member *m,
+		int *pax)
+{
+	char *p = data, *end = data + size, *key, *value, *rec_end;
+	unsigned long len;
+	struct tar_xattr *x;
+
+	while (p < end) {
+		len = strtoul(p, &key, 10);
+		if (len == 0 || p + len > end || *key != ' ')
+			return vztt_error(VZT_CANT_PARSE, 0,
+				"Invalid pax header");
+		rec_end = p + len - 1;
+		key++;
+		if ((value = memchr(key, '=', rec_end - key)) == NULL)
+			return vztt_error(VZT_CANT_PARSE, 0,
+				"Invalid pax header");
+		*value++ = '\0';
+		*rec_end = '\0';
+
+		if (strcmp(key, "path") == 0) {
+			VZTT_FREE_STR(m->name);
+			m->name = strdup(value);
+		} else if (strcmp(key, "linkpath") == 0) {
+			VZTT_FREE_STR(m->linkname);
+			m->linkname = strdup(value);
+		} else if (strcmp(key, "size") == 0) {
+			m->size = strtoull(value, NULL, 10);
+			*pax |= PAX_SIZE;
+		} else if (strcmp(key, "uid") == 0) {
+			m->uid = strtoul(value, NULL, 10);
+			*pax |= PAX_UID;
+		} else if (strcmp(key, "gid") == 0) {
+			m->gid = strtoul(value, NULL, 10);
+			*pax |= PAX_GID;
+		} else if (strcmp(key, "mtime") == 0) {
+			char *frac;
+			int i, digits = 1;
+
+			m->mtime.tv_sec = strtoll(value, &frac, 10);
+			m->mtime.tv_nsec = 0;
+			/* fractional part, in nanoseconds */
+			for (i = 1; *frac == '.' && i <= 9; i++) {
+				m->mtime.tv_nsec *= 10;
+				if (digits && isdigit(frac[i]))
+					m->mtime.tv_nsec += frac[i] - '0';
+				else
+					digits = 0;
+			}
+			*pax |= PAX_MTIME;
+		} else if (strncmp(key, "SCHILY.xattr.", 13) == 0) {
+			if ((x = calloc(1, sizeof(*x))) == NULL)
+				return vztt_error(VZT_CANT_ALLOC_MEM, errno,
+					"calloc()");
+			x->len = rec_end - value;
+			x->name = strdup(key + 13);
+			x->value = malloc(x->len + 1);
+			if (x->name == NULL || x->value == NULL) {
+				free(x->name);
+				free(x->value);
+				free(x);
+				return vztt_error(VZT_CANT_ALLOC_MEM, errno,
+					"malloc()");
+			}
+			memcpy(x->value, value, x->len);
+			x->next = m->xattrs;
+			m->xattrs = x;
+		}
+		p += len;
+	}
+	return 0;
+}
+
+/* tar_next() result at the end of archive, VZT_CANT_READ is 1 */
+#define TAR_END		(-1)
+
+/*
+read next archive member header, including GNU LongLink and pax
+extensions. Returns 0 on success, TAR_END at the end of archive, VZT_*
+error code otherwise.
+*/
+static int tar_next(struct lz4r *r, struct tar_member *m)
+{
+	unsigned char h[TAR_BLOCK];
+	char *data;
+	char *name = NULL, *linkname = NULL;
+	unsigned long long size;
+	unsigned int sum, chksum;
+	int pax = 0;
+	int i, rc;
+
+	memset(m, 0, sizeof(*m));
+	while (1) {
+		if (lz4r_read(r, h, sizeof(h))) {
+			rc = vztt_error(VZT_CANT_READ, 0,
+				"Unexpected end of archive");
+			goto err;
+		}
+		for (i = 0; i < TAR_BLOCK && h[i] == 0; i++)
+			;
+		if (i == TAR_BLOCK) {
+			/* end of archive */
+			tar_member_clean(m);
+			VZTT_FREE_STR(name);
+			VZTT_FREE_STR(linkname);
+			return TAR_END;
+		}
+
+		chksum = tar_parse_num((char *)h + 148, 8);
+		for (sum = 0, i = 0; i < TAR_BLOCK; i++)
+			sum += (i >= 148 && i < 156) ? ' ' : h[i];
+		if (sum != chksum) {
+			rc = vztt_error(VZT_CANT_PARSE, 0,
+				"Invalid tar header checksum");
+			goto err;
+		}
+
+		size = tar_parse_num((char *)h + 124, 12);
+		switch (h[156]) {
+		case 'L':
+		case 'K':
+			if ((rc = tar_read_data(r, size, &data)))
+				goto err;
+			if (h[156] == 'L') {
+				VZTT_FREE_STR(name);
+				name = data;
+			} else {
+				VZTT_FREE_STR(linkname);
+				linkname = data;
+			}
+			continue;
+		case 'x':
+			if ((rc = tar_read_data(r, size, &data)))
+				goto err;
+			rc = tar_parse_pax(data, size, m, &pax);
+			free(data);
+			if (rc)
+				goto err;
+			continue;
+		case 'g':
+			/* global pax header is ignored */
+			if ((rc = tar_read_data(r, size, &data)))
+				goto err;
+			free(data);
+			continue;
+		}
+		break;
+	}
+
+	m->type = h[156] ? h[156] : '0';
+	m->mode = tar_parse_num((char *)h + 100, 8) & 07777;
+	if (!(pax & PAX_SIZE))
+		m->size = size;
+	if (!(pax & PAX_UID))
+		m->uid = tar_parse_num((char *)h + 108, 8);
+	if (!(pax & PAX_GID))
+		m->gid = tar_parse_num((char *)h + 116, 8);
+	if (!(pax & PAX_MTIME))
+		m->mtime.tv_sec = tar_parse_num((char *)h + 136, 12);
+	m->devmajor = tar_parse_num((char *)h + 329, 8);
+	m->devminor = tar_parse_num((char *)h + 337, 8);
+
+	/* pax header has priority over GNU LongLink */
+	if (m->name == NULL) {
+		if (name) {
+			m->name = name;
+			name = NULL;
+		} else if (memcmp(h + 257, "ustar", 6) == 0 && h[345]) {
+			/* POSIX ustar prefix */
+			if (asprintf(&m->name, "%.155s/%.100s",
+				(char *)h + 345, (char *)h) == -1)
+				m->name = NULL;
+		} else {
+			m->name = strndup((char *)h, 100);
+		}
+	}
+	if (m->linkname == NULL) {
+		if (linkname) {
+			m->linkname = linkname;
+			linkname = NULL;
+		} else {
+			m->linkname = strndup((char *)h + 157, 100);
+		}
+	}
+	VZTT_FREE_STR(name);
+	VZTT_FREE_STR(linkname);
+	if (m->name == NULL || m->linkname == NULL) {
+		tar_member_clean(m);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup()");
+	}
+	return 0;
+
+err:
+	tar_member_clean(m);
+	VZTT_FREE_STR(name);
+	VZTT_FREE_STR(linkname);
+	return rc;
+}
+
+/* skip member data and padding */
+static int tar_skip(struct lz4r *r, unsigned long long size)
+{
+	size += (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+	if (lz4r_read(r, NULL, size))
+		return vztt_error(VZT_CANT_READ, 0, "Unexpected end of archive");
+	return 0;
+}
+
+/* skip padding after member data of 'size' bytes */
+static int tar_skip_pad(struct lz4r *r, unsigned long long size)
+{
+	if (lz4r_read(r, NULL, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK))
+		return vztt_error(VZT_CANT_READ, 0, "Unexpected end of archive");
+	return 0;
+}
+
+/*
+ * tar extractor: small files are written by pool of threads,
+ * directory attributes are set at the end. Symlinks (and hard links to
+ * them) are created at the end too, so no member is written through
+ * extracted symlink, and members under them are refused.
+ */
+/* files up to this size are passed to writer threads */
+#define TAR_SMALL_FILE		(1024*1024)
+/* memory limit for files queued to writer threads */
+#define TAR_QUEUE_WEIGHT	(64*1024*1024)
+
+struct tar_file {
+	char *path;
+	char *data;
+	int same_owner;
+	struct tar_member m;
+};
+
+/* deferred symlink or hard link to it */
+struct tar_link {
+	char *path;
+	/* name relative to extraction root, points into path */
+	const char *name;
+	/* hard link target */
+	char *target;
+	struct tar_member m;
+	/* replaced by later member */
+	int skip;
+	struct tar_link *next;
+};
+
+struct tar_extractor {
+	struct lz4r *r;
+	const char *where;
+	struct workqueue *wq;
+	int same_owner;
+	/* deferred directory attributes */
+	struct tar_file *dirs;
+	size_t ndirs;
+	size_t dirs_size;
+	/* deferred links in archive order and tree of them by name */
+	struct tar_link *links;
+	struct tar_link **links_tail;
+	void *links_tree;
+};
+
+/* create missing parent directories for path */
+static int tar_make_parents(const char *path)
+{
+	char buf[PATH_MAX+1];
+	char *p;
+
+	if (strlen(path) >= sizeof(buf))
+		return ENAMETOOLONG;
+	strcpy(buf, path);
+	for (p = buf + 1; (p = strchr(p, '/')); p++) {
+		*p = '\0';
+		if (mkdir(buf, 0755) && errno != EEXIST)
+			return errno;
+		*p = '/';
+	}
+	return 0;
+}
+
+/*
+resolve object creation error the same way as tar does: create missing
+parent directories or remove existing object. Returns 1 to retry.
+*/
+static int tar_retry(const char *path, int *retries)
+{
+	int err = errno;
+
+	if ((*retries)++ > 1)
+		return 0;
+	if (err == ENOENT) {
+		if ((err = tar_make_parents(path)) == 0)
+			return 1;
+	} else if (err == EEXIST) {
+		if (unlink(path) == 0 || errno == ENOENT)
+			return 1;
+		err = errno;
+	}
+	errno = err;
+	return 0;
+}
+
+static int tar_set_xattrs(int fd, const char *path, struct tar_member *m)
+{
+	struct tar_xattr *x;
+	int rc;
+
+	for (x = m->xattrs; x; x = x->next) {
+		if (fd != -1)
+			rc = fsetxattr(fd, x->name, x->value, x->len, 0);
+		else
+			rc = lsetxattr(path, x->name, x->value, x->len, 0);
+		if (rc)
+			return vztt_error(VZT_EATTR_ERR, errno,
+				"setxattr(%s, %s)", path, x->name);
+	}
+	return 0;
+}
+
+/* set owner, mode, xattrs and mtime for created object */
+static int tar_set_attrs(
+		int fd,
+		const char *path,
+		struct tar_member *m,
+		int same_owner)
+{
+	struct timespec ts[2];
+
+	ts[0].tv_sec = 0;
+	ts[0].tv_nsec = UTIME_NOW;
+	ts[1] = m->mtime;
+
+	if (fd != -1) {
+		if (same_owner && fchown(fd, m->uid, m->gid))
+			return vztt_error(VZT_SYSTEM, errno, "fchown(%s)", path);
+		if (fchmod(fd, m->mode))
+			return vztt_error(VZT_SYSTEM, errno, "fchmod(%s)", path);
+		if (tar_set_xattrs(fd, path, m))
+			return VZT_EATTR_ERR;
+		if (futimens(fd, ts))
+			return vztt_error(VZT_SYSTEM, errno, "futimens(%s)", path);
+		return 0;
+	}
+
+	if (same_owner && lchown(path, m->uid, m->gid))
+		return vztt_error(VZT_SYSTEM, errno, "lchown(%s)", path);
+	/* symlink permissions can not be changed */
+	if (m->type != '2' && chmod(path, m->mode))
+		return vztt_error(VZT_SYSTEM, errno, "chmod(%s)", path);
+	if (tar_set_xattrs(-1, path, m))
+		return VZT_EATTR_ERR;
+	if (utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW))
+		return vztt_error(VZT_SYSTEM, errno, "utimensat(%s)", path);
+	return 0;
+}
+
+static int tar_open_file(const char *path)
+{
+	int fd, retries = 0;
+
+	while ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+			0600)) == -1 && tar_retry(path, &retries))
+		;
+	if (fd == -1)
+		return vztt_error(-1, errno, "open(%s)", path);
+	return fd;
+}
+
+static void tar_file_free(struct tar_file *f)
+{
+	VZTT_FREE_STR(f->path);
+	VZTT_FREE_STR(f->data);
+	tar_member_clean(&f->m);
+	free(f);
+}
+
+/* writer thread job: create small regular file */
+static int tar_file_job(void *arg)
+{
+	struct tar_file *f = (struct tar_file *)arg;
+	int fd, rc = 0;
+
+	if ((fd = tar_open_file(f->path)) == -1) {
+		tar_file_free(f);
+		return VZT_CANT_CREATE;
+	}
+	if (f->m.size && write_all(fd, f->data, f->m.size))
+		rc = vztt_error(VZT_CANT_WRITE, errno, "write(%s)", f->path);
+	if (rc == 0)
+		rc = tar_set_attrs(fd, f->path, &f->m, f->same_owner);
+	if (close(fd) && rc == 0)
+		rc = vztt_error(VZT_CANT_WRITE, errno, "close(%s)", f->path);
+	tar_file_free(f);
+	return rc;
+}
+
+/* write large regular file directly from decompressed blocks */
+static int tar_extract_file(
+		struct tar_extractor *x,
+		const char *path,
+		struct tar_member *m)
+{
+	unsigned long long size = m->size;
+	const char *ptr;
+	ssize_t n;
+	int fd, rc = 0;
+
+	if ((fd = tar_open_file(path)) == -1)
+		return VZT_CANT_CREATE;
+	while (size) {
+		n = lz4r_get(x->r, &ptr, size < SSIZE_MAX ? size : SSIZE_MAX);
+		if (n <= 0) {
+			rc = vztt_error(VZT_CANT_READ, 0,
+				"Unexpected end of archive");
+			break;
+		}
+		if (write_all(fd, ptr, n)) {
+			rc = vztt_error(VZT_CANT_WRITE, errno, "write(%s)", path);
+			break;
+		}
+		size -= n;
+	}
+	if (rc == 0)
+		rc = tar_set_attrs(fd, path, m, x->same_owner);
+	if (close(fd) && rc == 0)
+		rc = vztt_error(VZT_CANT_WRITE, errno, "close(%s)", path);
+	if (rc == 0)
+		rc = tar_skip_pad(x->r, m->size);
+	return rc;
+}
+
+/* check member name and build destination path, <rel> is name
+   relative to extraction root without "." and empty components */
+static int tar_member_path(
+		struct tar_extractor *x,
+		const char *name,
+		char **path,
+		const char **rel)
+{
+	const char *p;
+	char *d;
+	size_t len;
+
+	for (p = name; *p; ) {
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+			return 1;
+		if ((p = strchr(p, '/')) == NULL)
+			break;
+		while (*p == '/')
+			p++;
+	}
+	len = strlen(x->where);
+	if ((*path = malloc(len + strlen(name) + 2)) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+	memcpy(*path, x->where, len);
+	d = *path + len;
+	for (p = name; *p; ) {
+		while (*p == '/')
+			p++;
+		if (p[0] == '.' && (p[1] == '/' || p[1] == '\0')) {
+			p++;
+			continue;
+		}
+		if (*p == '\0')
+			break;
+		*d++ = '/';
+		while (*p && *p != '/')
+			*d++ = *p++;
+	}
+	*d = '\0';
+	*rel = *path + len;
+	if (**rel == '/')
+		(*rel)++;
+	return 0;
+}
+
+static int tar_link_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct tar_link *)a)->name,
+		((const struct tar_link *)b)->name);
+}
+
+static void tar_link_nofree(void *p)
+{
+	(void)p;
+}
+
+/* deferred link with name <name> */
+static struct tar_link *tar_find_link(struct tar_extractor *x, const char *name)
+{
+	struct tar_link key;
+	void *p;
+
+	if (x->links_tree == NULL)
+		return NULL;
+	key.name = name;
+	if ((p = tfind(&key, &x->links_tree, tar_link_cmp)) == NULL)
+		return NULL;
+	return *(struct tar_link **)p;
+}
+
+/* is any parent directory of <name> deferred link? */
+static int tar_under_link(struct tar_extractor *x, const char *name)
+{
+	char buf[PATH_MAX+1];
+	char *p;
+
+	if (x->links_tree == NULL)
+		return 0;
+	if (strlen(name) >= sizeof(buf))
+		return 1;
+	strcpy(buf, name);
+	for (p = buf; (p = strchr(p, '/')); *p++ = '/') {
+		*p = '\0';
+		if (tar_find_link(x, buf))
+			return 1;
+	}
+	return 0;
+}
+
+/* member <name> replaces deferred link */
+static void tar_forget_link(struct tar_extractor *x, const char *name)
+{
+	struct tar_link *l;
+
+	if ((l = tar_find_link(x, name)) == NULL)
+		return;
+	l->skip = 1;
+	tdelete(l, &x->links_tree, tar_link_cmp);
+}
+
+/* defer link creation, link owns <path>, <target> and member now */
+static int tar_defer_link(
+		struct tar_extractor *x,
+		char *path,
+		const char *name,
+		char *target,
+		struct tar_member *m)
+{
+	struct tar_link *l;
+
+	if ((l = calloc(1, sizeof(*l))) == NULL) {
+		free(path);
+		free(target);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	}
+	l->path = path;
+	l->name = name;
+	l->target = target;
+	l->m = *m;
+	memset(m, 0, sizeof(*m));
+	if (x->links_tail == NULL)
+		x->links_tail = &x->links;
+	*x->links_tail = l;
+	x->links_tail = &l->next;
+
+	tar_forget_link(x, name);
+	if (tsearch(l, &x->links_tree, tar_link_cmp) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "tsearch()");
+	return 0;
+}
+
+/* create deferred links in archive order */
+static int tar_finish_links(struct tar_extractor *x, int create)
+{
+	struct tar_link *l;
+	int rc = 0, retries;
+
+	if (x->links_tree)
+		tdestroy(x->links_tree, tar_link_nofree);
+	x->links_tree = NULL;
+	while ((l = x->links)) {
+		x->links = l->next;
+		if (create && rc == 0 && !l->skip) {
+			retries = 0;
+			if (l->m.type == '2') {
+				while ((rc = symlink(l->m.linkname, l->path)) &&
+						tar_retry(l->path, &retries))
+					;
+				if (rc)
+					rc = vztt_error(VZT_CANT_CREATE, errno,
+						"symlink(%s)", l->path);
+				else
+					rc = tar_set_attrs(-1, l->path, &l->m,
+						x->same_owner);
+			} else {
+				while ((rc = link(l->target, l->path)) &&
+						tar_retry(l->path, &retries))
+					;
+				if (rc)
+					rc = vztt_error(VZT_CANT_CREATE, errno,
+						"link(%s, %s)", l->target, l->path);
+			}
+		}
+		VZTT_FREE_STR(l->path);
+		VZTT_FREE_STR(l->target);
+		tar_member_clean(&l->m);
+		free(l);
+	}
+	x->links_tail = NULL;
+	return rc;
+}
+
+static int tar_extract_member(struct tar_extractor *x, struct tar_member *m)
+{
+	struct tar_file *f;
+	char *path = NULL, *target = NULL;
+	const char *name, *tname;
+	unsigned long long size = m->size;
+	mode_t type;
+	int rc, retries = 0;
+
+	if ((rc = tar_member_path(x, m->name, &path, &name)) == 1) {
+		vztt_logger(0, 0, "%s: member name contains '..', skipped",
+			m->name);
+		return tar_skip(x->r, m->size);
+	} else if (rc) {
+		return rc;
+	}
+	if (tar_under_link(x, name)) {
+		vztt_logger(0, 0, "%s: member is under symlink, skipped",
+			m->name);
+		free(path);
+		return tar_skip(x->r, m->size);
+	}
+	if (m->type != '2')
+		tar_forget_link(x, name);
+
+	switch (m->type) {
+	case '0':
+	case '7':
+		if (m->size > TAR_SMALL_FILE) {
+			rc = tar_extract_file(x, path, m);
+			break;
+		}
+		if ((f = calloc(1, sizeof(*f))) == NULL) {
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+			break;
+		}
+		if ((f->data = malloc(m->size + 1)) == NULL) {
+			free(f);
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+			break;
+		}
+		if (lz4r_read(x->r, f->data, m->size) ||
+			tar_skip_pad(x->r, m->size)) {
+			free(f->data);
+			free(f);
+			rc = vztt_error(VZT_CANT_READ, 0,
+				"Unexpected end of archive");
+			break;
+		}
+		/* job owns path and member now */
+		f->path = path;
+		f->same_owner = x->same_owner;
+		f->m = *m;
+		path = NULL;
+		memset(m, 0, sizeof(*m));
+		rc = workqueue_add(x->wq, tar_file_job, f, f->m.size);
+		break;
+	case '1':
+		/* link target should be already written */
+		if ((rc = workqueue_wait(x->wq)))
+			break;
+		if ((rc = tar_member_path(x, m->linkname, &target, &tname))) {
+			if (rc == 1)
+				rc = vztt_error(VZT_CANT_CREATE, 0,
+					"%s: invalid link target", m->linkname);
+			break;
+		}
+		if (tar_under_link(x, tname)) {
+			rc = vztt_error(VZT_CANT_CREATE, 0,
+				"%s: link target is under symlink",
+				m->linkname);
+			break;
+		}
+		/* link to symlink which is not created yet */
+		if (tar_find_link(x, tname)) {
+			rc = tar_defer_link(x, path, name, target, m);
+			path = target = NULL;
+			rc = rc ? rc : tar_skip(x->r, size);
+			break;
+		}
+		while ((rc = link(target, path)) && tar_retry(path, &retries))
+			;
+		if (rc)
+			rc = vztt_error(VZT_CANT_CREATE, errno,
+				"link(%s, %s)", target, path);
+		rc = rc ? rc : tar_skip(x->r, m->size);
+		break;
+	case '2':
+		rc = tar_defer_link(x, path, name, NULL, m);
+		path = NULL;
+		rc = rc ? rc : tar_skip(x->r, size);
+		break;
+	case '3':
+	case '4':
+	case '6':
+		if (m->type == '3')
+			type = S_IFCHR;
+		else if (m->type == '4')
+			type = S_IFBLK;
+		else
+			type = S_IFIFO;
+		while ((rc = mknod(path, type | (m->mode & 0777),
+				makedev(m->devmajor, m->devminor))) &&
+				tar_retry(path, &retries))
+			;
+		if (rc)
+			rc = vztt_error(VZT_CANT_CREATE, errno,
+				"mknod(%s)", path);
+		else
+			rc = tar_set_attrs(-1, path, m, x->same_owner);
+		rc = rc ? rc : tar_skip(x->r, m->size);
+		break;
+	case '5':
+	{
+		struct stat st;
+
+		/* existing directory is reused */
+		while (mkdir(path, 0700)) {
+			if (errno == EEXIST && stat(path, &st) == 0 &&
+				S_ISDIR(st.st_mode))
+				break;
+			if (!tar_retry(path, &retries)) {
+				rc = vztt_error(VZT_CANT_CREATE, errno,
+					"mkdir(%s)", path);
+				break;
+			}
+		}
+		if (rc)
+			break;
+		if (x->ndirs == x->dirs_size) {
+			size_t size = x->dirs_size ? 2 * x->dirs_size : 1024;
+			struct tar_file *dirs;
+
+			if ((dirs = realloc(x->dirs, size * sizeof(*dirs))) == NULL) {
+				rc = vztt_error(VZT_CANT_ALLOC_MEM, errno,
+					"realloc()");
+				break;
+			}
+			x->dirs = dirs;
+			x->dirs_size = size;
+		}
+		x->dirs[x->ndirs].path = path;
+		x->dirs[x->ndirs].data = NULL;
+		x->dirs[x->ndirs].m = *m;
+		x->ndirs++;
+		path = NULL;
+		memset(m, 0, sizeof(*m));
+		rc = tar_skip(x->r, x->dirs[x->ndirs - 1].m.size);
+		break;
+	}
+	default:
+		rc = vztt_error(VZT_CANT_PARSE, 0,
+			"%s: unsupported tar member type '%c'", m->name, m->type);
+		break;
+	}
+
+	VZTT_FREE_STR(path);
+	VZTT_FREE_STR(target);
+	return rc;
+}
+
+/* set deferred directory attributes, nested directories first */
+static int tar_finish_dirs(struct tar_extractor *x)
+{
+	struct tar_file *d;
+	int rc = 0;
+
+	while (x->ndirs) {
+		d = &x->dirs[--x->ndirs];
+		if (rc == 0)
+			rc = tar_set_attrs(-1, d->path, &d->m, x->same_owner);
+		VZTT_FREE_STR(d->path);
+		tar_member_clean(&d->m);
+	}
+	VZTT_FREE_STR(x->dirs);
+	x->dirs_size = 0;
+	return rc;
+}
+
+static int archive_unpack_lz4(
+		struct lz4r *r,
+		const char *where)
+{
+	struct tar_extractor x;
+	struct tar_member m;
+	int rc, rc2;
+
+	memset(&x, 0, sizeof(x));
+	x.r = r;
+	x.where = where;
+	x.same_owner = (geteuid() == 0);
+	if ((rc = workqueue_create(&x.wq, archive_threads(),
+			TAR_QUEUE_WEIGHT)))
+		return rc;
+
+	while ((rc = tar_next(r, &m)) == 0) {
+		rc = tar_extract_member(&x, &m);
+		tar_member_clean(&m);
+		if (rc)
+			break;
+	}
+	if (rc == TAR_END)
+		rc = 0;
+
+	rc2 = workqueue_destroy(x.wq);
+	if (rc == 0)
+		rc = rc2;
+	rc2 = tar_finish_links(&x, rc == 0);
+	if (rc == 0)
+		rc = rc2;
+	rc2 = tar_finish_dirs(&x);
+	if (rc == 0)
+		rc = rc2;
+	return rc;
+}
+
+/*
+ * content-addressed chunk store.
+ * Tar stream is cut to content-defined chunks, each chunk is compressed
+ * separately and stored once as <cache>/chunks/<xx>/<md5>. Cache file
+ * itself is a manifest with list of chunks.
+ * Writers hold shared lock of <cache>/chunks/.lock from first stored chunk
+ * up to written manifest, gc takes it exclusively.
+ */
+#define CHUNK_MIN		(64*1024)
+#define CHUNK_MAX		ARCHIVE_LZ4_BLOCK_SIZE
+/* 19 upper bits of gear hash give ~512Kb average chunk size */
+#define CHUNK_MASK		0xFFFFE00000000000ULL
+/* gear hash depends on last 64 bytes only */
+#define CHUNK_WINDOW		64
+#define CHUNK_MANIFEST_MAGIC	"# vztt chunk manifest 1"
+/* unreferenced chunks younger than this are not removed by gc */
+#define CHUNK_GC_GRACE		(24*60*60)
+#define CHUNK_LOCK		".lock"
+
+struct chunk_ref {
+	unsigned char md5[16];
+	size_t size;
+};
+
+struct chunk_writer {
+	char *chunkdir;
+	struct workqueue *wq;
+	uint64_t gear[256];
+	uint64_t hash;
+	char *buf;
+	size_t len;
+	/* chunks in stream order, filled by writer threads */
+	struct chunk_ref **refs;
+	size_t nrefs;
+	size_t refs_size;
+	unsigned long stored;
+	/* store lock */
+	int lockfd;
+};
+
+struct chunk_job {
+	struct chunk_writer *w;
+	struct chunk_ref *ref;
+	char *data;
+};
+
+static void chunk_name(const unsigned char md5[16], char name[33])
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		sprintf(name + 2 * i, "%02x", md5[i]);
+}
+
+static int chunk_path(
+		const char *chunkdir,
+		const unsigned char md5[16],
+		char *path,
+		size_t size)
+{
+	char name[33];
+	int n;
+
+	chunk_name(md5, name);
+	n = snprintf(path, size, "%s/%.2s/%s", chunkdir, name, name);
+	return (n > 0 && (size_t)n < size) ? 0 : -1;
+}
+
+/* chunk store directory for cache file: <dirname>/chunks */
+static char *chunk_dir(const char *file)
+{
+	const char *p;
+	char *dir;
+
+	if ((p = strrchr(file, '/')) == NULL) {
+		dir = strdup("chunks");
+	} else if (asprintf(&dir, "%.*s/chunks", (int)(p - file), file) == -1) {
+		dir = NULL;
+	}
+	if (dir == NULL)
+		vztt_logger(0, errno, "Can`t alloc memory");
+	return dir;
+}
+
+/* open lock file of chunk store and lock it */
+static int chunk_lock(const char *chunkdir, int op, int *fd)
+{
+	char path[PATH_MAX+1];
+
+	if (snprintf(path, sizeof(path), "%s/" CHUNK_LOCK, chunkdir) >=
+			(int)sizeof(path))
+		return vztt_error(VZT_INTERNAL, 0, "Too long chunk path");
+	if ((*fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", path);
+	while (flock(*fd, op)) {
+		if (errno == EINTR)
+			continue;
+		close(*fd);
+		*fd = -1;
+		if (errno == EWOULDBLOCK)
+			return VZT_CANT_LOCK;
+		return vztt_error(VZT_CANT_LOCK, errno, "flock(%s)", path);
+	}
+	return 0;
+}
+
+/* writer thread job: store chunk if it is not in the store yet */
+static int chunk_job(void *arg)
+{
+	struct chunk_job *job = (struct chunk_job *)arg;
+	struct chunk_ref *ref = job->ref;
+	struct MD5Context ctx;
+	char path[PATH_MAX+1];
+	char tmp[PATH_MAX+16];
+	char *out = NULL;
+	const char *data;
+	size_t len;
+	char *p;
+	int fd, n, rc = 0;
+
+	MD5Init(&ctx);
+	MD5Update(&ctx, (md5byte *)job->data, ref->size);
+	MD5Final(ref->md5, &ctx);
+
+	if (chunk_path(job->w->chunkdir, ref->md5, path, sizeof(path))) {
+		rc = vztt_error(VZT_INTERNAL, 0, "Too long chunk path");
+		goto cleanup;
+	}
+	/* already stored: refresh mtime to protect it from gc */
+	if (utimensat(AT_FDCWD, path, NULL, 0) == 0)
+		goto cleanup;
+
+	if ((out = malloc(ref->size)) == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+		goto cleanup;
+	}
+	/* store chunk as is if it can not be compressed */
+	n = LZ4_compress_default(job->data, out, (int)ref->size,
+		(int)ref->size - 1);
+	if (n > 0) {
+		data = out;
+		len = n;
+	} else {
+		data = job->data;
+		len = ref->size;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s", path);
+	if ((p = strrchr(tmp, '/')))
+		*p = '\0';
+	if (mkdir(tmp, 0755) && errno != EEXIST) {
+		rc = vztt_error(VZT_CANT_CREATE, errno, "mkdir(%s)", tmp);
+		goto cleanup;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		rc = vztt_error(VZT_CANT_CREATE, errno, "mkstemp(%s)", tmp);
+		goto cleanup;
+	}
+	if (write_all(fd, data, len) || fchmod(fd, 0644)) {
+		rc = vztt_error(VZT_CANT_WRITE, errno, "write(%s)", tmp);
+		close(fd);
+		unlink(tmp);
+		goto cleanup;
+	}
+	if (close(fd) || rename(tmp, path)) {
+		rc = vztt_error(VZT_CANT_RENAME, errno, "rename(%s)", tmp);
+		unlink(tmp);
+		goto cleanup;
+	}
+	__sync_fetch_and_add(&job->w->stored, 1);
+
+cleanup:
+	VZTT_FREE_STR(out);
+	free(job->data);
+	free(job);
+	return rc;
+}
+
+/* pass current chunk to writer threads */
+static int chunk_emit(struct chunk_writer *w)
+{
+	struct chunk_job *job;
+	struct chunk_ref **refs;
+	char *data;
+	size_t size;
+
+	if (w->len == 0)
+		return 0;
+
+	if (w->nrefs == w->refs_size) {
+		size = w->refs_size ? 2 * w->refs_size : 1024;
+		if ((refs = realloc(w->refs, size * sizeof(*refs))) == NULL)
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno, "realloc()");
+		w->refs = refs;
+		w->refs_size = size;
+	}
+	if ((job = calloc(1, sizeof(*job))) == NULL ||
+		(job->ref = calloc(1, sizeof(*job->ref))) == NULL) {
+		VZTT_FREE_STR(job);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	}
+	if ((data = realloc(w->buf, w->len)))
+		w->buf = data;
+	job->w = w;
+	job->data = w->buf;
+	job->ref->size = w->len;
+	w->refs[w->nrefs++] = job->ref;
+
+	w->len = 0;
+	w->hash = 0;
+	if ((w->buf = malloc(CHUNK_MAX)) == NULL) {
+		free(job->data);
+		free(job);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+	}
+
+	return workqueue_add(w->wq, chunk_job, job, job->ref->size);
+}
+
+/* tar writer sink: cut stream to content-defined chunks */
+static int chunk_write(void *data, const void *buf, size_t len)
+{
+	struct chunk_writer *w = (struct chunk_writer *)data;
+	const unsigned char *p = (const unsigned char *)buf;
+	size_t n;
+
+	while (len) {
+		/* boundary can not be found before minimal chunk size */
+		if (w->len < CHUNK_MIN - CHUNK_WINDOW) {
+			n = CHUNK_MIN - CHUNK_WINDOW - w->len;
+			if (n > len)
+				n = len;
+			memcpy(w->buf + w->len, p, n);
+			w->len += n;
+			p += n;
+			len -= n;
+			continue;
+		}
+		w->buf[w->len++] = *p;
+		w->hash = (w->hash << 1) + w->gear[*p];
+		p++;
+		len--;
+		if ((w->len >= CHUNK_MIN && (w->hash & CHUNK_MASK) == 0) ||
+				w->len == CHUNK_MAX) {
+			if (chunk_emit(w)) {
+				errno = EIO;
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int chunk_writer_open(struct chunk_writer *w, const char *file)
+{
+	uint64_t x = 0x9E3779B97F4A7C15ULL;
+	uint64_t z;
+	int i, rc;
+
+	memset(w, 0, sizeof(*w));
+	w->lockfd = -1;
+	/* gear table should be the same for all runs: splitmix64 sequence */
+	for (i = 0; i < 256; i++) {
+		z = (x += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		w->gear[i] = z ^ (z >> 31);
+	}
+
+	if ((w->chunkdir = chunk_dir(file)) == NULL)
+		return VZT_CANT_ALLOC_MEM;
+	if (mkdir(w->chunkdir, 0755) && errno != EEXIST) {
+		rc = vztt_error(VZT_CANT_CREATE, errno, "mkdir(%s)", w->chunkdir);
+		VZTT_FREE_STR(w->chunkdir);
+		return rc;
+	}
+	/* stored and refreshed chunks are not referred by manifest yet */
+	if ((rc = chunk_lock(w->chunkdir, LOCK_SH, &w->lockfd))) {
+		VZTT_FREE_STR(w->chunkdir);
+		return rc;
+	}
+	if ((w->buf = malloc(CHUNK_MAX)) == NULL) {
+		close(w->lockfd);
+		VZTT_FREE_STR(w->chunkdir);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+	}
+	if ((rc = workqueue_create(&w->wq, archive_threads(),
+			TAR_QUEUE_WEIGHT))) {
+		close(w->lockfd);
+		VZTT_FREE_STR(w->buf);
+		VZTT_FREE_STR(w->chunkdir);
+		return rc;
+	}
+	return 0;
+}
+
+/* flush last chunk, wait for writers and free writer */
+static int chunk_writer_close(struct chunk_writer *w, int rc)
+{
+	int rc2;
+
+	if (rc == 0)
+		rc = chunk_emit(w);
+	rc2 = workqueue_destroy(w->wq);
+	if (rc == 0)
+		rc = rc2;
+	if (rc)
+		return rc;
+
+	vztt_logger(2, 0, "%lu of %lu chunks stored in %s",
+		w->stored, (unsigned long)w->nrefs, w->chunkdir);
+	return 0;
+}
+
+static void chunk_writer_free(struct chunk_writer *w)
+{
+	size_t i;
+
+	for (i = 0; i < w->nrefs; i++)
+		free(w->refs[i]);
+	VZTT_FREE_STR(w->refs);
+	VZTT_FREE_STR(w->buf);
+	VZTT_FREE_STR(w->chunkdir);
+	/* manifest is written or removed already */
+	if (w->lockfd != -1)
+		close(w->lockfd);
+}
+
+/* manifest is written aside and renamed into place: truncated manifest
+   would stop archive_chunks_gc() forever */
+static int chunk_write_manifest(struct chunk_writer *w, const char *file)
+{
+	char name[33];
+	char tmp[PATH_MAX+1];
+	FILE *fp;
+	size_t i;
+	int fd, rc;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file) >= (int)sizeof(tmp))
+		return vztt_error(VZT_INTERNAL, 0, "Too long path %s", file);
+	if ((fd = mkstemp(tmp)) == -1)
+		return vztt_error(VZT_CANT_CREATE, errno, "mkstemp(%s)", tmp);
+	if (fchmod(fd, 0644) || (fp = fdopen(fd, "w")) == NULL) {
+		rc = vztt_error(VZT_CANT_CREATE, errno, "fdopen(%s)", tmp);
+		close(fd);
+		goto err;
+	}
+	fprintf(fp, CHUNK_MANIFEST_MAGIC "\n");
+	for (i = 0; i < w->nrefs; i++) {
+		chunk_name(w->refs[i]->md5, name);
+		fprintf(fp, "%s %lu\n", name, (unsigned long)w->refs[i]->size);
+	}
+	if (fflush(fp) || fsync(fileno(fp))) {
+		rc = vztt_error(VZT_CANT_WRITE, errno, "write(%s)", tmp);
+		fclose(fp);
+		goto err;
+	}
+	if (fclose(fp)) {
+		rc = vztt_error(VZT_CANT_WRITE, errno, "fclose(%s)", tmp);
+		goto err;
+	}
+	if (rename(tmp, file)) {
+		rc = vztt_error(VZT_CANT_RENAME, errno, "rename(%s, %s)",
+			tmp, file);
+		goto err;
+	}
+	return 0;
+
+err:
+	unlink(tmp);
+	return rc;
+}
+
+static int archive_pack_chunks(
+		const char *file,
+		const char *dir,
+		const char *const what[],
+		struct options_vztt *opts_vztt)
+{
+	struct chunk_writer w;
+	struct tar_writer t;
+	int rc;
+
+	/* drop chunks of removed caches before writing new ones */
+	archive_chunks_gc(file);
+
+	memset(&t, 0, sizeof(t));
+	if ((t.buf = malloc(TAR_BUF_SIZE)) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+	t.progress_fd = opts_vztt->progress_fd;
+
+	if ((rc = chunk_writer_open(&w, file))) {
+		tar_writer_free(&t);
+		return rc;
+	}
+	t.write = chunk_write;
+	t.data = &w;
+	rc = tar_write(&t, dir, what);
+	rc = chunk_writer_close(&w, rc);
+	if (rc == 0)
+		rc = chunk_write_manifest(&w, file);
+	chunk_writer_free(&w);
+	tar_writer_free(&t);
+	if (rc)
+		unlink(file);
+	return rc;
+}
+
+static int hex2bin(const char *hex, unsigned char *bin, size_t len)
+{
+	size_t i;
+	unsigned int c;
+
+	for (i = 0; i < len; i++) {
+		if (!isxdigit(hex[2 * i]) || !isxdigit(hex[2 * i + 1]) ||
+			sscanf(hex + 2 * i, "%2x", &c) != 1)
+			return -1;
+		bin[i] = c;
+	}
+	return 0;
+}
+
+/* read manifest to array of chunks */
+static int chunk_read_manifest(
+		const char *file,
+		struct chunk_ref **chunks,
+		size_t *nchunks)
+{
+	char buf[STRSIZ];
+	struct chunk_ref *refs = NULL, *p;
+	size_t n = 0, size = 0;
+	unsigned long len;
+	FILE *fp;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		return vztt_error(VZT_CANT_OPEN, errno, "fopen(%s)", file);
+	if (fgets(buf, sizeof(buf), fp) == NULL ||
+		strncmp(buf, CHUNK_MANIFEST_MAGIC, strlen(CHUNK_MANIFEST_MAGIC))) {
+		fclose(fp);
+		return vztt_error(VZT_CANT_PARSE, 0,
+			"%s is not a chunk manifest", file);
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (n == size) {
+			size = size ? 2 * size : 1024;
+			if ((p = realloc(refs, size * sizeof(*refs))) == NULL) {
+				fclose(fp);
+				free(refs);
+				return vztt_error(VZT_CANT_ALLOC_MEM, errno,
+					"realloc()");
+			}
+			refs = p;
+		}
+		if (strlen(buf) < 34 || buf[32] != ' ' ||
+			hex2bin(buf, refs[n].md5, 16) ||
+			(len = strtoul(buf + 33, NULL, 10)) == 0 ||
+			len > CHUNK_MAX) {
+			fclose(fp);
+			free(refs);
+			return vztt_error(VZT_CANT_PARSE, 0,
+				"Invalid chunk record in %s", file);
+		}
+		refs[n++].size = len;
+	}
+	fclose(fp);
+
+	*chunks = refs;
+	*nchunks = n;
+	return 0;
+}
+
+/* reader thread: read next chunk to slot */
+static int chunk_read_block(struct lz4r *r, struct lz4r_slot *s)
+{
+	struct chunk_ref *ref;
+	char path[PATH_MAX+1];
+	struct stat st;
+	int fd;
+	ssize_t n;
+
+	if (r->next_chunk == r->nchunks)
+		return 1;
+	ref = &r->chunks[r->next_chunk++];
+
+	if (s->insize < CHUNK_MAX) {
+		free(s->in);
+		if ((s->in = malloc(CHUNK_MAX)) == NULL) {
+			s->insize = 0;
+			return vztt_error(-1, errno, "malloc()");
+		}
+		s->insize = CHUNK_MAX;
+	}
+	chunk_path(r->chunkdir, ref->md5, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return vztt_error(-1, errno, "open(%s)", path);
+	if (fstat(fd, &st)) {
+		close(fd);
+		return vztt_error(-1, errno, "fstat(%s)", path);
+	}
+	if (st.st_size > (off_t)ref->size) {
+		close(fd);
+		return vztt_error(-1, 0, "Invalid chunk %s", path);
+	}
+	n = read_full(fd, s->in, st.st_size);
+	close(fd);
+	if (n == -1)
+		return vztt_error(-1, errno, "read(%s)", path);
+	if (n != st.st_size)
+		return vztt_error(-1, 0, "Unexpected end of file %s", path);
+
+	s->inlen = n;
+	s->raw = ((size_t)n == ref->size);
+	s->outlen = ref->size;
+	s->has_md5 = 1;
+	memcpy(s->md5, ref->md5, sizeof(s->md5));
+	r->in_bytes += ref->size;
+	return 0;
+}
+
+static int lz4r_open_chunks(struct lz4r *r, const char *file, int progress_fd)
+{
+	size_t i;
+	int rc;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+	r->progress_fd = progress_fd;
+	if ((rc = chunk_read_manifest(file, &r->chunks, &r->nchunks)))
+		return rc;
+	if ((r->chunkdir = chunk_dir(file)) == NULL) {
+		VZTT_FREE_STR(r->chunks);
+		return VZT_CANT_ALLOC_MEM;
+	}
+	if (progress_fd)
+		for (i = 0; i < r->nchunks; i++)
+			r->total += r->chunks[i].size;
+	r->block_max = CHUNK_MAX;
+
+	return lz4r_start(r);
+}
+
+/* collect chunk references of all manifests in cache directory */
+static int chunk_gc_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, 16);
+}
+
+int archive_chunks_gc(const char *file)
+{
+	char path[PATH_MAX+1];
+	char *chunkdir, *cachedir, *p;
+	struct chunk_ref *refs = NULL, *chunks, *tmp;
+	size_t nrefs = 0, nchunks;
+	unsigned char md5[16];
+	DIR *dir, *sub;
+	struct dirent *de, *se;
+	struct stat st;
+	time_t now = time(NULL);
+	int lockfd, rc = 0;
+
+	if ((chunkdir = chunk_dir(file)) == NULL)
+		return VZT_CANT_ALLOC_MEM;
+	if (access(chunkdir, F_OK)) {
+		free(chunkdir);
+		return 0;
+	}
+	/* other writers store chunks now, collect them next time */
+	if ((rc = chunk_lock(chunkdir, LOCK_EX | LOCK_NB, &lockfd))) {
+		if (rc == VZT_CANT_LOCK) {
+			vztt_logger(2, 0, "Chunk store %s is busy", chunkdir);
+			rc = 0;
+		}
+		free(chunkdir);
+		return rc;
+	}
+	cachedir = strdup(chunkdir);
+	if (cachedir == NULL) {
+		close(lockfd);
+		free(chunkdir);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup()");
+	}
+	*strrchr(cachedir, '/') = '\0';
+
+	/* manifests and their backups */
+	if ((dir = opendir(cachedir)) == NULL) {
+		rc = vztt_error(VZT_CANT_OPEN, errno, "opendir(%s)", cachedir);
+		goto cleanup;
+	}
+	while ((de = readdir(dir))) {
+		if (strstr(de->d_name, TARCHUNKS_SUFFIX) == NULL)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cachedir, de->d_name);
+		if ((rc = chunk_read_manifest(path, &chunks, &nchunks)))
+			break;
+		if ((tmp = realloc(refs, (nrefs + nchunks) * sizeof(*refs))) == NULL) {
+			free(chunks);
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "realloc()");
+			break;
+		}
+		refs = tmp;
+		memcpy(refs + nrefs, chunks, nchunks * sizeof(*refs));
+		nrefs += nchunks;
+		free(chunks);
+	}
+	closedir(dir);
+	/* do not remove anything if some manifest can not be read */
+	if (rc)
+		goto cleanup;
+	qsort(refs, nrefs, sizeof(*refs), chunk_gc_cmp);
+
+	if ((dir = opendir(chunkdir)) == NULL) {
+		rc = vztt_error(VZT_CANT_OPEN, errno, "opendir(%s)", chunkdir);
+		goto cleanup;
+	}
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", chunkdir, de->d_name);
+		if ((sub = opendir(path)) == NULL)
+			continue;
+		while ((se = readdir(sub))) {
+			if (se->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "%s/%s/%s", chunkdir,
+				de->d_name, se->d_name);
+			if (lstat(path, &st) || now - st.st_mtime < CHUNK_GC_GRACE)
+				continue;
+			/* temporary files of crashed writers are removed too */
+			if ((p = strchr(se->d_name, '.')) == NULL &&
+				strlen(se->d_name) == 32 &&
+				hex2bin(se->d_name, md5, 16) == 0 &&
+				bsearch(md5, refs, nrefs, sizeof(*refs),
+					chunk_gc_cmp))
+				continue;
+			vztt_logger(2, 0, "Remove unused chunk %s", path);
+			unlink(path);
+		}
+		closedir(sub);
+	}
+	closedir(dir);
+
+cleanup:
+	close(lockfd);
+	VZTT_FREE_STR(refs);
+	free(cachedir);
+	free(chunkdir);
+	return rc;
+}
+
+int archive_pack(
+		const char *file,
+		const char *dir,
+		const char *const what[],
+		struct options_vztt *opts_vztt)
+{
+	char cmd[2*PATH_MAX+1];
+	char opts[PATH_MAX+1];
+	char files[PATH_MAX+1];
+	size_t len = 0;
+	int i, rc;
+
+	if (get_archive_type(file) == VZT_ARCHIVE_LZ4)
+		return archive_pack_lz4(file, dir, what, opts_vztt);
+	else if (get_archive_type(file) == VZT_ARCHIVE_CHUNKS)
+		return archive_pack_chunks(file, dir, what, opts_vztt);
+
+	/* other archivers are external programs */
+	files[0] = '\0';
+	for (i = 0; what[i]; i++) {
+		rc = snprintf(files + len, sizeof(files) - len, "%s%s",
+			i ? " " : "", what[i]);
+		if (rc < 0 || (size_t)rc >= sizeof(files) - len)
+			return vztt_error(VZT_INTERNAL, 0, "Too long file list");
+		len += rc;
+	}
+	snprintf(opts, sizeof(opts), "--numeric-owner -C %s", dir);
+	if (get_pack_cmd(cmd, sizeof(cmd), file, files, opts) < 0)
+		return vztt_error(VZT_INTERNAL, 0,
+			"Unknown archive type of %s", file);
+
+	if ((rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET)))) {
+		vztt_logger(0, 0, "system(%s) error", cmd);
+		return VZT_CANT_EXEC;
+	}
+	return 0;
+}
+
+int archive_unpack(
+		const char *file,
+		const char *where,
+		struct options_vztt *opts_vztt)
+{
+	char cmd[2*PATH_MAX+1];
+	struct lz4r r;
+	int fd, rc;
+
+	if (get_archive_type(file) == VZT_ARCHIVE_CHUNKS) {
+		if ((rc = lz4r_open_chunks(&r, file, opts_vztt->progress_fd)))
+			return rc;
+		rc = archive_unpack_lz4(&r, where);
+		lz4r_close(&r);
+		if (rc)
+			vztt_logger(0, 0, "Can not unpack %s", file);
+		return rc;
+	} else if (get_archive_type(file) == VZT_ARCHIVE_LZ4) {
+		if ((fd = open(file, O_RDONLY|O_CLOEXEC)) == -1)
+			return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", file);
+		if ((rc = lz4r_open(&r, fd, opts_vztt->progress_fd)) == 0) {
+			rc = archive_unpack_lz4(&r, where);
+			lz4r_close(&r);
+			close(fd);
+			if (rc)
+				vztt_logger(0, 0, "Can not unpack %s", file);
+			return rc;
+		}
+		close(fd);
+		if (rc != 1)
+			return rc;
+		/* legacy or linked-blocks lz4 stream */
+	}
+
+	if (get_unpack_cmd(cmd, sizeof(cmd), file, where, "--numeric-owner") < 0)
+		return vztt_error(VZT_INTERNAL, 0,
+			"Unknown archive type of %s", file);
+	if ((rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET)))) {
+		vztt_logger(0, 0, "system(%s) error", cmd);
+		return VZT_CANT_EXEC;
+	}
+	return 0;
+}
+
+/* compare member names ignoring leading "./" */
+static int tar_name_cmp(const char *a, const char *b)
+{
+	while (a[0] == '.' && a[1] == '/')
+		a += 2;
+	while (b[0] == '.' && b[1] == '/')
+		b += 2;
+	return strcmp(a, b);
+}
+
+static int archive_read_member_lz4(
+		struct lz4r *r,
+		const char *member,
+		char **data,
+		size_t *size)
+{
+	struct tar_member m;
+	int rc;
+
+	while ((rc = tar_next(r, &m)) == 0) {
+		if (strchr("07", m.type) && tar_name_cmp(m.name, member) == 0) {
+			if ((*data = malloc(m.size + 1)) == NULL) {
+				rc = vztt_error(VZT_CANT_ALLOC_MEM, errno,
+					"malloc()");
+			} else if (lz4r_read(r, *data, m.size)) {
+				VZTT_FREE_STR(*data);
+				rc = vztt_error(VZT_CANT_READ, 0,
+					"Unexpected end of archive");
+			} else {
+				(*data)[m.size] = '\0';
+				*size = m.size;
+			}
+			tar_member_clean(&m);
+			return rc;
+		}
+		rc = tar_skip(r, m.size);
+		tar_member_clean(&m);
+		if (rc)
+			return rc;
+	}
+	if (rc == TAR_END)
+		rc = vztt_error(VZT_FILE_NFOUND, 0, "%s not found", member);
+	return rc;
+}
+
+int archive_read_member(
+		const char *file,
+		const char *member,
+		char **data,
+		size_t *size)
+{
+	char cmd[2*PATH_MAX+1];
+	char opts[PATH_MAX+1];
+	char buf[BUFSIZ];
+	struct lz4r r;
+	FILE *fp;
+	char *p;
+	size_t n;
+	int fd, rc;
+
+	*data = NULL;
+	*size = 0;
+
+	if (get_archive_type(file) == VZT_ARCHIVE_CHUNKS) {
+		if ((rc = lz4r_open_chunks(&r, file, 0)))
+			return rc;
+		rc = archive_read_member_lz4(&r, member, data, size);
+		lz4r_close(&r);
+		return rc;
+	} else if (get_archive_type(file) == VZT_ARCHIVE_LZ4) {
+		if ((fd = open(file, O_RDONLY|O_CLOEXEC)) == -1)
+			return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", file);
+		if ((rc = lz4r_open(&r, fd, 0)) == 0) {
+			rc = archive_read_member_lz4(&r, member, data, size);
+			lz4r_close(&r);
+			close(fd);
+			return rc;
+		}
+		close(fd);
+		if (rc != 1)
+			return rc;
+	}
+
+	snprintf(opts, sizeof(opts), "-O %s", member);
+	if (get_unpack_cmd(cmd, sizeof(cmd), file, ".", opts) < 0)
+		return vztt_error(VZT_INTERNAL, 0,
+			"Unknown archive type of %s", file);
+	vztt_logger(2, 0, "%s", cmd);
+	if ((fp = popen(cmd, "r")) == NULL)
+		return vztt_error(VZT_CANT_EXEC, errno, "popen(%s)", cmd);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		if ((p = realloc(*data, *size + n + 1)) == NULL) {
+			pclose(fp);
+			VZTT_FREE_STR(*data);
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno, "realloc()");
+		}
+		*data = p;
+		memcpy(*data + *size, buf, n);
+		*size += n;
+		(*data)[*size] = '\0';
+	}
+	rc = pclose(fp);
+	if (WEXITSTATUS(rc)) {
+		VZTT_FREE_STR(*data);
+		*size = 0;
+		vztt_logger(0, errno, "Unable to execute %s", cmd);
+		return VZT_CANT_EXEC;
+	}
+	if (*data == NULL && (*data = strdup("")) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup()");
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * bump allocator
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN	sizeof(void *)
+
+struct arena_block {
+	struct arena_block *next;
+	/* pad header up to ARENA_ALIGN */
+	void *data[];
+};
+
+/* add new block with at least <size> free bytes */
+static int arena_grow(struct arena *a, size_t size)
+{
+	struct arena_block *b;
+	size_t bsize = ARENA_BLOCK_SIZE;
+
+	if (size > bsize - sizeof(struct arena_block))
+		bsize = size + sizeof(struct arena_block);
+	if ((b = (struct arena_block *)malloc(bsize)) == NULL)
+		return -1;
+	b->next = a->head;
+	a->head = b;
+	a->ptr = (char *)b->data;
+	a->end = (char *)b + bsize;
+	return 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (size == 0)
+		size = ARENA_ALIGN;
+	if ((size_t)(a->end - a->ptr) < size) {
+		/* the rest of current block is dropped */
+		if (arena_grow(a, size))
+			return NULL;
+	}
+	p = a->ptr;
+	a->ptr += size;
+	return p;
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	if ((p = (char *)arena_alloc(a, len)) == NULL)
+		return NULL;
+	memcpy(p, s, len);
+	return p;
+}
+
+void arena_reset(struct arena *a)
+{
+	struct arena_block *b;
+
+	while ((b = a->head)) {
+		a->head = b->next;
+		free((void *)b);
+	}
+	a->ptr = a->end = NULL;
+}
@@ -52,6 +52,7 @@
 #include "tmplset.h"
 #include "lock.h"
 #include "ploop.h"
+#include "archive.h"
 #include "cache.h"
 #include "progress_messages.h"
 
@@ -73,7 +74,6 @@ static int create_cache(
 	char *ve_private = NULL;
 	char *ve_config = NULL;
 	char *myinit = NULL;
-	char *pwd = NULL;
 	char *cachename = NULL;
 	char *ploop_dir = NULL;
 	char *ve_private_template = NULL;
@@ -103,9 +103,6 @@ static int create_cache(
 	string_list_init(&packages1);
 	string_list_init(&packages);
 
-	if (getcwd(path, sizeof(path)))
-		pwd = strdup(path);
-
 	/* read global vz config */
 	if ((rc = global_config_read(&gc, opts_vztt)))
 		return rc;
@@ -189,7 +186,8 @@ static int create_cache(
 	}
 
 	if ((rc = cache_lock(&gc, cachename, LOCK_WRITE, opts_vztt->flags,
-			&cache_lockdata, opts_vztt->timeout)))
+			&cache_lockdata, opts_vztt->timeout,
+			opts_vztt->progress_fd)))
 		goto cleanup_0;
 
 	if ((access(cachename, F_OK) == 0) &&
@@ -425,7 +423,8 @@ static int create_cache(
 /* TODO: check_vzfs_mnt $rootdir */
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_4;
 
 	/* Call pre-cache script in VE0 context. */
@@ -569,17 +568,9 @@ static int create_cache(
 
 		remove_directory(ve_root);
 	} else {
-		if (chdir(ve_private) == -1) {
-			vztt_logger(0, errno, "chdir(%s) failed", ve_private);
-			if (backup)
-				move_file(cachename, path);
-			goto cleanup_3;
-		}
-		get_pack_cmd(cmd, sizeof(cmd), cachename, ".", " --numeric-owner");
-		rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET));
-		if (pwd)
-			if (chdir(pwd) == -1)
-				vztt_logger(0, errno, "chdir(%s) failed", pwd);
+		const char *what[] = {".", NULL};
+
+		rc = archive_pack(cachename, ve_private, what, opts_vztt);
 	}
 
 	if (rc) {
@@ -654,7 +645,6 @@ int update_cache(
 	char *ve_root = NULL;
 	char *ve_private = NULL;
 	char *ve_config = NULL;
-	char *pwd = NULL;
 	char *cachename = NULL;
 	char *ploop_dir = NULL;
 	char *ve_private_template = NULL;
@@ -685,9 +675,6 @@ int update_cache(
 	string_list_init(&packages);
 	string_list_init(&args);
 
-	if (getcwd(path, sizeof(path)))
-		pwd = strdup(path);
-
 	/* read global vz config */
 	if ((rc = global_config_read(&gc, opts_vztt)))
 		return rc;
@@ -826,8 +813,7 @@ int update_cache(
 		fclose(fp);
 
 		vztt_logger(1, 0, "Unpacking ploop %s", cachename);
-		get_unpack_cmd(cmd, sizeof(cmd), cachename, ploop_dir, "");
-		if ((rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET))))
+		if ((rc = archive_unpack(cachename, ploop_dir, opts_vztt)))
 			goto cleanup_3;
 
 		/* Get the required the ploop size */
@@ -873,8 +859,7 @@ int update_cache(
 			goto cleanup_3;
 	} else {
 		vztt_logger(1, 0, "Unpacking %s", cachename);
-		get_unpack_cmd(cmd, sizeof(cmd), cachename, ve_private, "");
-		if ((rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET))))
+		if ((rc = archive_unpack(cachename, ve_private, opts_vztt)))
 			goto cleanup_3;
 	}
 
@@ -903,7 +888,8 @@ int update_cache(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_4;
 
 	/* Call pre-cache script in VE0 context. */
@@ -978,17 +964,9 @@ int update_cache(
 		rc = pack_ploop(ploop_dir, cachename, opts_vztt);
 	}
 	else {
-		if (chdir(ve_private) == -1) {
-			vztt_logger(0, errno, "chdir(%s) failed", ve_private);
-			if (backup)
-				move_file(cachename, path);
-			goto cleanup_3;
-		}
-		get_pack_cmd(cmd, sizeof(cmd), cachename, ".", " --numeric-owner");
-		rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET));
-		if (pwd)
-			if (chdir(pwd) == -1)
-				vztt_logger(0, errno, "chdir(%s) failed", pwd);
+		const char *what[] = {".", NULL};
+
+		rc = archive_pack(cachename, ve_private, what, opts_vztt);
 	}
 
 	if (rc) {
@@ -1147,7 +1125,8 @@ int lock_and_remove_cache(const char *path, void *data)
 
 	/* lock template area on read */
 	if (tmpl_lock(cdata->gc, cdata->tmpl->base,
-			LOCK_READ, cdata->opts_vztt->flags, &lockdata)) {
+			LOCK_READ, cdata->opts_vztt->flags, &lockdata,
+			cdata->opts_vztt->progress_fd)) {
 		rc = -1;
 		goto cleanup;
 	}
@@ -1158,6 +1137,9 @@ int lock_and_remove_cache(const char *path, void *data)
 		rc = VZT_CANT_REMOVE;
 		goto cleanup;
 	}
+	/* release chunks which are not used by other caches */
+	if (get_archive_type(path) == VZT_ARCHIVE_CHUNKS)
+		archive_chunks_gc(path);
 
 cleanup:
 	tmpl_unlock(lockdata, cdata->opts_vztt->flags);
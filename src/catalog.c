@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ *
+ * base OS templates catalog: parallel scanner of template area and
+ * on-disk cache of its result
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "vzcommon.h"
+#include "vztt_error.h"
+#include "util.h"
+#include "workqueue.h"
+#include "catalog.h"
+
+/* mtime of directory, relative to template area */
+struct catalog_stamp {
+	char *path;
+	struct timespec mtim;
+};
+
+struct catalog_stamps {
+	struct catalog_stamp *s;
+	size_t n;
+	size_t size;
+};
+
+/* scanner result for one OS name directory */
+struct catalog_os {
+	char *osname;
+	struct string_list names;
+	struct catalog_stamps stamps;
+};
+
+struct catalog_job {
+	int dfd;
+	struct catalog_os *os;
+};
+
+static int catalog_stamp_add(
+		struct catalog_stamps *st,
+		const char *path,
+		const struct timespec *mtim)
+{
+	struct catalog_stamp *p;
+
+	if (st->n == st->size) {
+		p = (struct catalog_stamp *)realloc(st->s,
+			(st->size + 16) * sizeof(*p));
+		if (p == NULL)
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno,
+				"realloc() :");
+		st->s = p;
+		st->size += 16;
+	}
+	if ((st->s[st->n].path = strdup(path)) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup() :");
+	st->s[st->n++].mtim = *mtim;
+	return 0;
+}
+
+static void catalog_stamps_clean(struct catalog_stamps *st)
+{
+	size_t i;
+
+	for (i = 0; i < st->n; i++)
+		free(st->s[i].path);
+	free(st->s);
+	st->s = NULL;
+	st->n = st->size = 0;
+}
+
+/* is entry a directory (without following symlinks) */
+static int catalog_is_dir(int dfd, struct dirent *de)
+{
+	struct stat st;
+
+	if (de->d_type != DT_UNKNOWN)
+		return de->d_type == DT_DIR;
+	if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+		return 0;
+	return S_ISDIR(st.st_mode);
+}
+
+/* is <dfd>/<path>/<name> a regular file */
+static int catalog_is_file(int dfd, const char *path, const char *name)
+{
+	char buf[PATH_MAX+1];
+	struct stat st;
+
+	snprintf(buf, sizeof(buf), "%s/%s", path, name);
+	if (fstatat(dfd, buf, &st, 0))
+		return 0;
+	return S_ISREG(st.st_mode);
+}
+
+/* space separated list of available architectures, catalog is stale if
+   it was written for other set */
+static void catalog_archs(char *buf, size_t size)
+{
+	char **archs = get_available_archs();
+	size_t len = 0;
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; archs[i] && len < size; i++)
+		len += snprintf(buf + len, size - len, "%s%s",
+			i ? " " : "", archs[i]);
+}
+
+/*
+probe <osname>/<osver>/<arch>/config/os/default relative to OS name
+directory <ofd>: add template name if it is base OS template and stamp of
+deepest existing directory
+*/
+static int catalog_probe(int ofd, struct catalog_os *os, const char *osver,
+		const char *arch)
+{
+	static const char *comps[] = {"config", "os", DEFSETNAME, NULL};
+	char path[PATH_MAX+1];
+	char name[PATH_MAX+1];
+	struct stat st;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/%s", osver, arch);
+	/* absent arch is covered by stamp of version directory */
+	if (fstatat(ofd, path, &st, 0) || !S_ISDIR(st.st_mode))
+		return 0;
+	for (i = 0; comps[i]; i++) {
+		struct stat sub;
+		size_t len = strlen(path);
+
+		snprintf(path + len, sizeof(path) - len, "/%s", comps[i]);
+		if (fstatat(ofd, path, &sub, 0) || !S_ISDIR(sub.st_mode)) {
+			path[len] = '\0';
+			break;
+		}
+		st = sub;
+	}
+	snprintf(name, sizeof(name), "%s/%s", os->osname, path);
+	if (catalog_stamp_add(&os->stamps, name, &st.st_mtim))
+		return VZT_CANT_ALLOC_MEM;
+	if (comps[i])
+		return 0;
+
+	/* see is_base_os_tmpl() */
+	if (!catalog_is_file(ofd, path, "packages") ||
+			!catalog_is_file(ofd, path, "package_manager"))
+		return 0;
+	snprintf(name, sizeof(name), "%s-%s-%s", os->osname, osver, arch);
+	return string_list_add(&os->names, name);
+}
+
+/* scan OS name directory: all versions and architectures */
+static int catalog_scan_os(void *arg)
+{
+	struct catalog_job *job = (struct catalog_job *)arg;
+	struct catalog_os *os = job->os;
+	int rc = 0;
+	int ofd, i;
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX+1];
+	char **archs = get_available_archs();
+
+	if ((ofd = openat(job->dfd, os->osname,
+			O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+		rc = vztt_error(VZT_CANT_OPEN, errno, "open(%s) error",
+			os->osname);
+		goto cleanup;
+	}
+	if (fstat(ofd, &st)) {
+		close(ofd);
+		rc = vztt_error(VZT_CANT_LSTAT, errno, "stat(%s) error",
+			os->osname);
+		goto cleanup;
+	}
+	if ((rc = catalog_stamp_add(&os->stamps, os->osname, &st.st_mtim))) {
+		close(ofd);
+		goto cleanup;
+	}
+	if ((dir = fdopendir(ofd)) == NULL) {
+		close(ofd);
+		rc = vztt_error(VZT_CANT_OPEN, errno, "opendir(%s) error",
+			os->osname);
+		goto cleanup;
+	}
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.' || !catalog_is_dir(ofd, de))
+			continue;
+		if (fstatat(ofd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", os->osname, de->d_name);
+		if ((rc = catalog_stamp_add(&os->stamps, path, &st.st_mtim)))
+			break;
+		/* seek all available template architectures */
+		for (i = 0; archs[i] && rc == 0; i++)
+			rc = catalog_probe(ofd, os, de->d_name, archs[i]);
+		if (rc)
+			break;
+	}
+	closedir(dir);
+
+cleanup:
+	free(job);
+	return rc;
+}
+
+/*
+read catalog and check its stamps, returns 0 if it is valid. Catalog
+without trailer "E <stamps> <templates>" is truncated one.
+*/
+static int catalog_read(int dfd, struct string_list *ls)
+{
+	int rc = 0;
+	int fd;
+	FILE *fp;
+	char str[PATH_MAX+100];
+	char archs[PATH_MAX+1];
+	char *p;
+	long long sec;
+	long nsec;
+	int pos, end = 0, arch = 0;
+	size_t ndirs = 0, ntmpls = 0, n1, n2;
+	struct stat st;
+	struct string_list names;
+
+	snprintf(str, sizeof(str), CATALOG_SUBDIR "/" CATALOG_BASE_FILE);
+	if ((fd = openat(dfd, str, O_RDONLY|O_CLOEXEC)) == -1)
+		return VZT_FILE_NFOUND;
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return VZT_FILE_NFOUND;
+	}
+	catalog_archs(archs, sizeof(archs));
+	string_list_init(&names);
+	while (rc == 0 && fgets(str, sizeof(str), fp)) {
+		if ((p = strchr(str, '\n')))
+			*p = '\0';
+		/* nothing is allowed after trailer */
+		if (end) {
+			rc = VZT_FILE_NFOUND;
+		} else if (str[0] == 'D' && sscanf(str, "D %lld %ld %n",
+				&sec, &nsec, &pos) == 2) {
+			ndirs++;
+			if (fstatat(dfd, str + pos, &st, 0) ||
+					st.st_mtim.tv_sec != sec ||
+					st.st_mtim.tv_nsec != nsec)
+				rc = VZT_FILE_NFOUND;
+		} else if (str[0] == 'T' && str[1] == ' ') {
+			ntmpls++;
+			rc = string_list_add(&names, str + 2);
+		} else if (str[0] == 'A' && str[1] == ' ') {
+			arch = 1;
+			if (strcmp(str + 2, archs))
+				rc = VZT_FILE_NFOUND;
+		} else if (str[0] == 'E' && sscanf(str, "E %zu %zu",
+				&n1, &n2) == 2) {
+			end = 1;
+			if (n1 != ndirs || n2 != ntmpls)
+				rc = VZT_FILE_NFOUND;
+		} else if (str[0] != '#') {
+			rc = VZT_FILE_NFOUND;
+		}
+	}
+	fclose(fp);
+	if (rc == 0 && (!end || !arch))
+		rc = VZT_FILE_NFOUND;
+	if (rc == 0)
+		rc = string_list_copy(ls, &names);
+	string_list_clean(&names);
+	return rc;
+}
+
+/* write catalog atomically, errors are ignored: it is cache only */
+static void catalog_write(
+		const char *tmpldir,
+		int dfd,
+		struct catalog_stamps *stamps,
+		struct string_list *names)
+{
+	char tmp[PATH_MAX+1];
+	char archs[PATH_MAX+1];
+	int fd;
+	FILE *fp;
+	size_t i;
+	struct string_list_el *p;
+	time_t now = time(NULL);
+
+	/* directory could be changed in the same time tick after reading */
+	for (i = 0; i < stamps->n; i++)
+		if (stamps->s[i].mtim.tv_sec >= now - 1)
+			return;
+
+	if (snprintf(tmp, sizeof(tmp), "%s/" CATALOG_SUBDIR "/."
+			CATALOG_BASE_FILE ".XXXXXX", tmpldir) >= (int)sizeof(tmp))
+		return;
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+	if (fchmod(fd, 0644) || (fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	catalog_archs(archs, sizeof(archs));
+	fprintf(fp, "# base OS templates catalog\n");
+	fprintf(fp, "A %s\n", archs);
+	for (i = 0; i < stamps->n; i++)
+		fprintf(fp, "D %lld %ld %s\n",
+			(long long)stamps->s[i].mtim.tv_sec,
+			stamps->s[i].mtim.tv_nsec, stamps->s[i].path);
+	string_list_for_each(names, p)
+		fprintf(fp, "T %s\n", p->s);
+	fprintf(fp, "E %zu %zu\n", stamps->n, string_list_size(names));
+	if (fflush(fp) || fsync(fileno(fp)) || ferror(fp)) {
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+	fclose(fp);
+	if (renameat(AT_FDCWD, tmp, dfd, CATALOG_SUBDIR "/" CATALOG_BASE_FILE))
+		unlink(tmp);
+}
+
+/* scan template area <dfd> by pool of threads */
+static int catalog_scan(
+		const char *tmpldir,
+		int dfd,
+		struct catalog_stamps *stamps,
+		struct string_list *ls)
+{
+	int rc = 0, rc2;
+	int dupfd, shared = 0;
+	int nthreads;
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX+1];
+	struct catalog_os **oses = NULL, **p;
+	struct catalog_job *job;
+	struct workqueue *wq;
+	size_t i, n = 0, size = 0;
+
+	if (fstat(dfd, &st))
+		return vztt_error(VZT_CANT_LSTAT, errno, "stat(%s) error",
+			tmpldir);
+	if ((rc = catalog_stamp_add(stamps, ".", &st.st_mtim)))
+		return rc;
+
+	/* OS name directories, in directory order */
+	if ((dupfd = dup(dfd)) == -1)
+		return vztt_error(VZT_SYSTEM, errno, "dup() :");
+	if ((dir = fdopendir(dupfd)) == NULL) {
+		close(dupfd);
+		return vztt_error(VZT_CANT_OPEN, errno, "opendir(%s) error",
+			tmpldir);
+	}
+	rewinddir(dir);
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.' || !catalog_is_dir(dfd, de))
+			continue;
+		/* is it standard template directory?
+		  seek /vz/template/<template name>/conf directory */
+		snprintf(path, sizeof(path), "%s/conf", de->d_name);
+		if (fstatat(dfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+				S_ISDIR(st.st_mode))
+			continue;
+		if (n == size) {
+			p = (struct catalog_os **)realloc(oses,
+				(size + 16) * sizeof(*p));
+			if (p == NULL) {
+				rc = vztt_error(VZT_CANT_ALLOC_MEM, errno,
+					"realloc() :");
+				break;
+			}
+			oses = p;
+			size += 16;
+		}
+		if ((oses[n] = (struct catalog_os *)calloc(1,
+				sizeof(struct catalog_os))) == NULL) {
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc() :");
+			break;
+		}
+		string_list_init(&oses[n]->names);
+		if ((oses[n++]->osname = strdup(de->d_name)) == NULL) {
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup() :");
+			break;
+		}
+	}
+	closedir(dir);
+	if (rc || n == 0)
+		goto cleanup;
+
+	/* every lookup costs network round trip on shared area */
+	is_shared_fs(tmpldir, &shared);
+	nthreads = shared ? CATALOG_MAX_THREADS : CATALOG_LOCAL_THREADS;
+	if (nthreads > (int)n)
+		nthreads = n;
+	if ((rc = workqueue_create(&wq, nthreads, 0)))
+		goto cleanup;
+	for (i = 0; i < n; i++) {
+		if ((job = (struct catalog_job *)malloc(sizeof(*job))) == NULL) {
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc() :");
+			break;
+		}
+		job->dfd = dfd;
+		job->os = oses[i];
+		if ((rc = workqueue_add(wq, catalog_scan_os, job, 0)))
+			break;
+	}
+	rc2 = workqueue_destroy(wq);
+	if (rc == 0)
+		rc = rc2;
+	if (rc)
+		goto cleanup;
+
+	/* merge in directory order */
+	for (i = 0; i < n && rc == 0; i++) {
+		if ((rc = string_list_copy(ls, &oses[i]->names)))
+			break;
+		for (size = 0; size < oses[i]->stamps.n && rc == 0; size++)
+			rc = catalog_stamp_add(stamps,
+				oses[i]->stamps.s[size].path,
+				&oses[i]->stamps.s[size].mtim);
+	}
+
+cleanup:
+	for (i = 0; i < n; i++) {
+		free(oses[i]->osname);
+		string_list_clean(&oses[i]->names);
+		catalog_stamps_clean(&oses[i]->stamps);
+		free(oses[i]);
+	}
+	free(oses);
+	return rc;
+}
+
+int catalog_get_all_base(const char *tmpldir, struct string_list *ls)
+{
+	int rc;
+	int dfd;
+	struct string_list names;
+	struct catalog_stamps stamps = {NULL, 0, 0};
+
+	if ((dfd = open(tmpldir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+		if (errno != ENOENT)
+			return vztt_error(VZT_CANT_OPEN, errno,
+				"opendir(\"%s\") error", tmpldir);
+		/* skip ENOENT (#116418) */
+		vztt_logger(1, 0, "Warning: template area directory %s "\
+			"does not exist", tmpldir);
+		return 0;
+	}
+
+	if (catalog_read(dfd, ls) == 0) {
+		close(dfd);
+		return 0;
+	}
+
+	/* create catalog directory before scanning: it changes mtime of
+	   template area */
+	if (mkdirat(dfd, CATALOG_SUBDIR, 0755) && errno != EEXIST)
+		vztt_logger(2, errno, "Can not create %s/" CATALOG_SUBDIR,
+			tmpldir);
+
+	string_list_init(&names);
+	if ((rc = catalog_scan(tmpldir, dfd, &stamps, &names)) == 0) {
+		catalog_write(tmpldir, dfd, &stamps, &names);
+		rc = string_list_copy(ls, &names);
+	}
+	string_list_clean(&names);
+	catalog_stamps_clean(&stamps);
+	close(dfd);
+	return rc;
+}
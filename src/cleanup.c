@@ -104,7 +104,8 @@ static int clean_local_cache(char *ostemplate, struct options_vztt *opts_vztt)
 
 	/* lock */
 	if ((rc = tmpl_lock(&gc, tmpl->base, 
-			LOCK_WRITE, opts_vztt->flags, &lockdata)))
+			LOCK_WRITE, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_2;
 
 	/* clean apt & yum local cache */
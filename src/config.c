@@ -37,6 +37,8 @@
 #include <dirent.h>
 #include <error.h>
 #include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
 #include <vzctl/libvzctl.h>
 #include <ploop/libploop.h>
 
@@ -44,6 +46,7 @@
 #include "vzcommon.h"
 #include "config.h"
 #include "util.h"
+#include "watch.h"
 
 #define READ_CONFIG_ALL 0
 #define READ_CONFIG_SELECTED 1
@@ -139,7 +142,7 @@ static int parse_config_rec(char *str, char **var, char **val)
  or
  VARIABLE="value"
 */
-static int read_config(
+static int read_config_file(
 	char const *path,
 	int (*reader)(char *var, char *val, void *data), 
 	void *data)
@@ -173,6 +176,146 @@ static int read_config(
 	return rc;
 }
 
+/* parsed records of config file, cached in process with enabled
+   watching (vzttd), see watch.h */
+struct config_cache {
+	char *path;
+	struct watch_stamp stamp;
+	/* var and val pairs */
+	char **rec;
+	size_t n;
+	size_t size;
+	struct config_cache *next;
+};
+
+static pthread_mutex_t config_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct config_cache *config_cache = NULL;
+
+static void config_cache_free_rec(struct config_cache *c)
+{
+	size_t i;
+
+	for (i = 0; i < 2 * c->n; i++)
+		free(c->rec[i]);
+	free(c->rec);
+	c->rec = NULL;
+	c->n = 0;
+	c->size = 0;
+}
+
+static int config_cache_reader(char *var, char *val, void *data)
+{
+	struct config_cache *c = (struct config_cache *)data;
+	char **rec;
+
+	if (c->n == c->size) {
+		rec = (char **)realloc(c->rec,
+			2 * (c->size + 32) * sizeof(char *));
+		if (rec == NULL)
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno,
+				"realloc() :");
+		c->rec = rec;
+		c->size += 32;
+	}
+	if ((c->rec[2 * c->n] = strdup(var)) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup() :");
+	if ((c->rec[2 * c->n + 1] = strdup(val)) == NULL) {
+		free(c->rec[2 * c->n]);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup() :");
+	}
+	c->n++;
+	return 0;
+}
+
+/* get cached records of <path>, read it if absent or stale.
+   Returns VZT_FILE_NFOUND if directory of <path> is not watched */
+static int config_cache_get(char const *path, struct config_cache **cache)
+{
+	int rc;
+	char dir[PATH_MAX + 1];
+	struct watch_stamp stamp;
+	struct config_cache *c, n;
+
+	for (c = config_cache; c; c = c->next)
+		if (strcmp(c->path, path) == 0)
+			break;
+	if (c && watch_check(&c->stamp)) {
+		*cache = c;
+		return 0;
+	}
+
+	/* stamp is taken before reading: change during reading
+	   invalidates the records */
+	strncpy(dir, path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = '\0';
+	if ((rc = watch_get(dirname(dir), &stamp)))
+		return rc;
+
+	memset(&n, 0, sizeof(n));
+	if ((rc = read_config_file(path, config_cache_reader, &n))) {
+		config_cache_free_rec(&n);
+		return rc;
+	}
+	if (c == NULL) {
+		if ((c = (struct config_cache *)calloc(1, sizeof(*c))) == NULL) {
+			config_cache_free_rec(&n);
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno,
+				"calloc() :");
+		}
+		if ((c->path = strdup(path)) == NULL) {
+			free(c);
+			config_cache_free_rec(&n);
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno,
+				"strdup() :");
+		}
+		c->next = config_cache;
+		config_cache = c;
+	}
+	config_cache_free_rec(c);
+	c->rec = n.rec;
+	c->n = n.n;
+	c->size = n.size;
+	c->stamp = stamp;
+	*cache = c;
+	return 0;
+}
+
+/* read config file, from cache if watching is enabled */
+static int read_config(
+	char const *path,
+	int (*reader)(char *var, char *val, void *data),
+	void *data)
+{
+	int rc;
+	size_t i;
+	char var[STRSIZ];
+	char val[STRSIZ];
+	struct config_cache *c = NULL;
+
+	if (!watch_enabled())
+		return read_config_file(path, reader, data);
+
+	watch_sync();
+	pthread_mutex_lock(&config_cache_mutex);
+	if ((rc = config_cache_get(path, &c))) {
+		pthread_mutex_unlock(&config_cache_mutex);
+		if (rc == VZT_FILE_NFOUND)
+			rc = read_config_file(path, reader, data);
+		return rc;
+	}
+	/* reader can modify values */
+	for (i = 0; i < c->n && rc == 0; i++) {
+		strncpy(var, c->rec[2 * i], sizeof(var) - 1);
+		var[sizeof(var) - 1] = '\0';
+		strncpy(val, c->rec[2 * i + 1], sizeof(val) - 1);
+		val[sizeof(val) - 1] = '\0';
+		rc = (*reader)(var, val, data);
+	}
+	pthread_mutex_unlock(&config_cache_mutex);
+
+	return rc;
+}
+
 /* replace $VEID to VEID value */
 static char *replace_VEID(const char *ctid, char *src)
 {
@@ -1202,6 +1345,8 @@ static int vztt_config_reader(char *var, char *val, void *data)
 			tc->archive = VZT_ARCHIVE_LZRW;
 		else if (!strcmp(val, "gz"))
 			tc->archive = VZT_ARCHIVE_GZ;
+		else if (!strcmp(val, "chunks"))
+			tc->archive = VZT_ARCHIVE_CHUNKS;
 		else
 			vztt_logger(0, 0, \
 				"Bad ARCHIVE in vz config, use default value");
@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ *
+ * vzttd: resident process serving read-only vzpkg commands
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+
+#include "vztt_error.h"
+#include "vztt_options.h"
+#include "vztt.h"
+#include "config.h"
+#include "util.h"
+#include "tmplset.h"
+#include "watch.h"
+
+#define DAEMON_VERSION		1
+/* max size of request */
+#define DAEMON_MSG_MAX		(64 * 1024)
+/* max number of arguments */
+#define DAEMON_MAX_ARGS		1024
+/* max number of commands run at once */
+#define DAEMON_MAX_CHILDREN	64
+/* time to receive request after connect, in seconds */
+#define DAEMON_RECV_TIMEOUT	5
+
+/*
+Request: header and <argc> NUL-terminated arguments in one packet,
+stdin, stdout and stderr of client are passed with it by SCM_RIGHTS.
+Every command is run by child forked from daemon, so it gets
+caches of daemon (see watch.h) and can not spoil daemon state.
+*/
+struct daemon_request {
+	unsigned int version;
+	unsigned int argc;
+};
+
+/* reply: exit code of command, or signal which killed it */
+struct daemon_reply {
+	int rc;
+	int sig;
+};
+
+struct daemon_child {
+	pid_t pid;
+	/* -1 if client is gone */
+	int conn;
+};
+
+/* read-only commands are served by daemon */
+static const char *daemon_cmds[] = {"list", "status", "info", NULL};
+
+static int daemon_cmd_allowed(int argc, char **argv)
+{
+	int i;
+
+	if (argc < 2)
+		return 0;
+	for (i = 0; daemon_cmds[i]; i++)
+		if (strcmp(argv[1], daemon_cmds[i]) == 0)
+			break;
+	if (daemon_cmds[i] == NULL)
+		return 0;
+	/* progress descriptor of client can not be used by daemon */
+	for (i = 2; i < argc; i++)
+		if (strncmp(argv[i], "--progress", 10) == 0)
+			return 0;
+	return 1;
+}
+
+static int daemon_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return vztt_error(VZT_BAD_PARAM, 0,
+			"Too long socket path %s", path);
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int vztt_daemon_call(const char *path, int argc, char **argv, int *rc)
+{
+	int ret = 0;
+	int sock, i;
+	size_t len, sz;
+	ssize_t n;
+	char *buf;
+	int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct sockaddr_un addr;
+	struct daemon_request *req;
+	struct daemon_reply reply;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+
+	if (!daemon_cmd_allowed(argc, argv) || getenv("VZ_PROGRESS_FD") ||
+			getenv("VZTTD_DISABLE"))
+		return VZT_BAD_PARAM;
+	for (i = 0; i < 3; i++)
+		if (fcntl(fds[i], F_GETFD) == -1)
+			return VZT_BAD_PARAM;
+	if (daemon_addr(path, &addr))
+		return VZT_BAD_PARAM;
+
+	len = sizeof(*req);
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (argc > DAEMON_MAX_ARGS || len > DAEMON_MSG_MAX)
+		return VZT_BAD_PARAM;
+	if ((buf = (char *)malloc(len)) == NULL)
+		return VZT_CANT_ALLOC_MEM;
+	req = (struct daemon_request *)buf;
+	req->version = DAEMON_VERSION;
+	req->argc = argc;
+	for (i = 0, sz = sizeof(*req); i < argc; i++) {
+		strcpy(buf + sz, argv[i]);
+		sz += strlen(argv[i]) + 1;
+	}
+
+	/* daemon is not running: command will be run by caller */
+	if ((sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0)) == -1) {
+		ret = VZT_CANT_OPEN;
+		goto cleanup_0;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		ret = VZT_CANT_OPEN;
+		goto cleanup_1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)len) {
+		ret = VZT_CANT_OPEN;
+		goto cleanup_1;
+	}
+
+	/* command is started by daemon, do not run it again */
+	while ((n = recv(sock, &reply, sizeof(reply), 0)) == -1)
+		if (errno != EINTR)
+			break;
+	if (n != sizeof(reply)) {
+		vztt_logger(0, errno, "Connection to vzttd is lost");
+		*rc = VZT_INTERNAL;
+	} else if (reply.sig) {
+		vztt_logger(0, 0, "Command is killed by signal %d", reply.sig);
+		*rc = VZT_PROG_SIGNALED;
+	} else {
+		*rc = reply.rc;
+	}
+
+cleanup_1:
+	close(sock);
+cleanup_0:
+	free(buf);
+	return ret;
+}
+
+/* fill parsed configs and template sets caches of daemon */
+static void daemon_warm(void)
+{
+	struct global_config gc;
+	struct vztt_config tc;
+	struct options_vztt *opts_vztt;
+	struct string_list ls;
+	struct string_list_el *p;
+	struct tmpl_set *tmpl;
+
+	if ((opts_vztt = vztt_options_create()) == NULL)
+		return;
+	opts_vztt->flags |= OPT_VZTT_QUIET;
+	global_config_init(&gc);
+	vztt_config_init(&tc);
+	string_list_init(&ls);
+	if (global_config_read(&gc, opts_vztt) ||
+			vztt_config_read(gc.template_dir, &tc))
+		goto cleanup;
+
+	/* templates sets for 'vzpkg list' */
+	if (tmplset_get_all_base(gc.template_dir, &ls))
+		goto cleanup;
+	string_list_for_each(&ls, p) {
+		if (tmplset_load_shared(gc.template_dir, p->s,
+				TMPLSET_LOAD_OS_LIST|TMPLSET_LOAD_APP_LIST,
+				&tmpl, opts_vztt) == 0)
+			tmplset_clean(tmpl);
+	}
+
+cleanup:
+	string_list_clean(&ls);
+	vztt_config_clean(&tc);
+	global_config_clean(&gc);
+	vztt_options_free(opts_vztt);
+}
+
+/* receive request from <conn>: arguments are in <buf>, <argv> is malloc'ed */
+static int daemon_recv(
+		int conn,
+		char *buf,
+		int fds[3],
+		int *argc,
+		char ***argv)
+{
+	int rc = 0;
+	int nfds = 0;
+	int i, n;
+	ssize_t len;
+	size_t sz;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct daemon_request req;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct ucred cred;
+	socklen_t clen = sizeof(cred);
+	struct timeval tv = {DAEMON_RECV_TIMEOUT, 0};
+
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &clen) ||
+			cred.uid != 0)
+		return vztt_error(VZT_USER_NOT_ROOT, 0,
+			"vzttd client should run from root");
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = DAEMON_MSG_MAX;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	while ((len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1)
+		if (errno != EINTR)
+			return vztt_error(VZT_CANT_READ, errno, "recvmsg() :");
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+				cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (nfds == 0 && n == 3) {
+			memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+			nfds = 3;
+			continue;
+		}
+		/* unexpected descriptors */
+		for (i = 0; i < n; i++)
+			close(((int *)CMSG_DATA(cmsg))[i]);
+	}
+	if (nfds != 3 || (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) ||
+			(size_t)len < sizeof(req)) {
+		rc = vztt_error(VZT_BAD_PARAM, 0, "Invalid vzttd request");
+		goto cleanup;
+	}
+	memcpy(&req, buf, sizeof(req));
+	if (req.version != DAEMON_VERSION || req.argc < 2 ||
+			req.argc > DAEMON_MAX_ARGS) {
+		rc = vztt_error(VZT_BAD_PARAM, 0, "Invalid vzttd request");
+		goto cleanup;
+	}
+	if ((*argv = (char **)calloc(req.argc + 1, sizeof(char *))) == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc() :");
+		goto cleanup;
+	}
+	for (i = 0, sz = sizeof(req); i < (int)req.argc; i++) {
+		if (sz >= (size_t)len || memchr(buf + sz, '\0', len - sz) == NULL)
+			break;
+		(*argv)[i] = buf + sz;
+		sz += strlen(buf + sz) + 1;
+	}
+	*argc = req.argc;
+	if (i != (int)req.argc || !daemon_cmd_allowed(*argc, *argv)) {
+		free(*argv);
+		rc = vztt_error(VZT_BAD_PARAM, 0, "Invalid vzttd request");
+		goto cleanup;
+	}
+	return 0;
+
+cleanup:
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	return rc;
+}
+
+static void daemon_reply(int conn, int status)
+{
+	struct daemon_reply reply;
+
+	reply.rc = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+	reply.sig = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+	send(conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+int vztt_daemon_serve(const char *path, int (*handler)(int argc, char **argv))
+{
+	int rc = 0;
+	int sock, sigfd, ifd, conn;
+	int stop = 0;
+	int argc = 0, status, i, n, fds[3];
+	char **argv = NULL;
+	char *buf;
+	pid_t pid;
+	sigset_t mask, oldmask;
+	struct signalfd_siginfo si;
+	struct sockaddr_un addr;
+	struct daemon_child children[DAEMON_MAX_CHILDREN];
+	int nchildren = 0;
+	struct pollfd pfd[DAEMON_MAX_CHILDREN + 3];
+	/* index of child in children[] for pfd[] item */
+	int pchild[DAEMON_MAX_CHILDREN + 3];
+	int npfd;
+	char c;
+
+	if ((rc = daemon_addr(path, &addr)))
+		return rc;
+	if ((buf = (char *)malloc(DAEMON_MSG_MAX)) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc() :");
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	if ((sigfd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1) {
+		rc = vztt_error(VZT_SYSTEM, errno, "signalfd() :");
+		goto cleanup_0;
+	}
+
+	if ((sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0)) == -1) {
+		rc = vztt_error(VZT_SYSTEM, errno, "socket() :");
+		goto cleanup_1;
+	}
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		rc = vztt_error(VZT_SYSTEM, errno, "bind(%s) :", path);
+		goto cleanup_2;
+	}
+	chmod(path, 0600);
+	if (listen(sock, DAEMON_MAX_CHILDREN)) {
+		rc = vztt_error(VZT_SYSTEM, errno, "listen(%s) :", path);
+		goto cleanup_3;
+	}
+
+	/* without watching caches can not be invalidated, so are not used */
+	if ((ifd = watch_enable()) == -1)
+		vztt_logger(0, 0, "Caches are disabled");
+	else
+		daemon_warm();
+	vztt_logger(1, 0, "vzttd is listening on %s", path);
+
+	while (!stop || nchildren) {
+		npfd = 0;
+		pfd[npfd].fd = sigfd;
+		pfd[npfd].events = POLLIN;
+		pchild[npfd++] = -1;
+		if (ifd != -1) {
+			pfd[npfd].fd = ifd;
+			pfd[npfd].events = POLLIN;
+			pchild[npfd++] = -1;
+		}
+		if (!stop && nchildren < DAEMON_MAX_CHILDREN) {
+			pfd[npfd].fd = sock;
+			pfd[npfd].events = POLLIN;
+			pchild[npfd++] = -1;
+		}
+		for (i = 0; i < nchildren; i++) {
+			if (children[i].conn == -1)
+				continue;
+			pfd[npfd].fd = children[i].conn;
+			pfd[npfd].events = POLLIN;
+			pchild[npfd++] = i;
+		}
+		if (poll(pfd, npfd, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			rc = vztt_error(VZT_SYSTEM, errno, "poll() :");
+			break;
+		}
+
+		for (n = 0; n < npfd; n++) {
+			if (!pfd[n].revents)
+				continue;
+			if (pfd[n].fd == sigfd) {
+				if (read(sigfd, &si, sizeof(si)) != sizeof(si))
+					continue;
+				if (si.ssi_signo != SIGCHLD) {
+					/* finish running commands and exit */
+					vztt_logger(1, 0, "vzttd is stopped by "
+						"signal %d", si.ssi_signo);
+					stop = 1;
+					for (i = 0; i < nchildren; i++)
+						kill(children[i].pid, SIGTERM);
+				}
+			} else if (pfd[n].fd == ifd) {
+				if (watch_sync())
+					daemon_warm();
+			} else if (pfd[n].fd == sock) {
+				if ((conn = accept4(sock, NULL, NULL,
+						SOCK_CLOEXEC)) == -1)
+					continue;
+				if (daemon_recv(conn, buf, fds, &argc, &argv)) {
+					close(conn);
+					continue;
+				}
+				/* caches should not be stale for the command */
+				if (watch_sync())
+					daemon_warm();
+				if ((pid = fork()) == 0) {
+					close(sock);
+					close(sigfd);
+					close(conn);
+					for (i = 0; i < nchildren; i++)
+						if (children[i].conn != -1)
+							close(children[i].conn);
+					for (i = 0; i < 3; i++) {
+						dup2(fds[i], i);
+						close(fds[i]);
+					}
+					sigprocmask(SIG_SETMASK, &oldmask, NULL);
+					exit(handler(argc, argv));
+				}
+				for (i = 0; i < 3; i++)
+					close(fds[i]);
+				free(argv);
+				if (pid == -1) {
+					vztt_logger(0, errno, "fork() failed");
+					daemon_reply(conn, VZT_CANT_FORK << 8);
+					close(conn);
+					continue;
+				}
+				children[nchildren].pid = pid;
+				children[nchildren++].conn = conn;
+			} else if ((i = pchild[n]) != -1) {
+				/* client is gone: stop its command */
+				if (recv(children[i].conn, &c, 1, MSG_DONTWAIT) != -1 ||
+						errno != EAGAIN) {
+					kill(children[i].pid, SIGTERM);
+					close(children[i].conn);
+					children[i].conn = -1;
+				}
+			}
+		}
+
+		/* reap finished commands */
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < nchildren; i++)
+				if (children[i].pid == pid)
+					break;
+			if (i == nchildren)
+				continue;
+			if (children[i].conn != -1) {
+				daemon_reply(children[i].conn, status);
+				close(children[i].conn);
+			}
+			children[i] = children[--nchildren];
+		}
+	}
+
+cleanup_3:
+	unlink(path);
+cleanup_2:
+	close(sock);
+cleanup_1:
+	close(sigfd);
+cleanup_0:
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	free(buf);
+	return rc;
+}
@@ -31,211 +31,527 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
-#include <sys/mman.h>
+#include <sys/time.h>
 #include <unistd.h>
-#include <libgen.h>
-#include <utime.h>
-#include <sched.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <curl/curl.h>
 
 #include "downloader.h"
 #include "vztt_error.h"
 #include "vzcommon.h"
 #include "util.h"
+#include "progress_messages.h"
 
-struct _clone_param {
-	int fds[2];
-	char *const *argv;
+/* connections, dns and tls sessions are shared by all downloads of process */
+static pthread_once_t fetch_once = PTHREAD_ONCE_INIT;
+static CURLcode fetch_init_res;
+static CURLSH *fetch_share;
+static pthread_mutex_t fetch_locks[CURL_LOCK_DATA_LAST];
+
+struct fetch_batch {
+	size_t n;
+	size_t done;
+	int progress_fd;
+	int percent;
+	time_t reported;
+	struct transfer *transfers;
 };
 
-#define STACK_SIZE 2 * 4096
+struct transfer {
+	const char *url;
+	const char *dst;
+	struct fetch_batch *batch;
+	CURL *h;
+	struct curl_slist *headers;
+	char part[PATH_MAX+1];
+	int fd;
+	int active;
+	/* part was loaded from scratch after failed resume */
+	int retried;
+	/* size of partially loaded file */
+	curl_off_t offset;
+	/* bytes loaded by this request and expected, 0 if unknown */
+	curl_off_t now;
+	curl_off_t total;
+	char errbuf[CURL_ERROR_SIZE];
+};
 
-/* Clone the process */
-static int run_clone(void *data)
+static void fetch_lock(
+		CURL *h,
+		curl_lock_data data,
+		curl_lock_access access,
+		void *userptr)
 {
-	struct _clone_param *param = (struct _clone_param *)data;
-	int fd;
+	pthread_mutex_lock(&fetch_locks[data]);
+}
+
+static void fetch_unlock(CURL *h, curl_lock_data data, void *userptr)
+{
+	pthread_mutex_unlock(&fetch_locks[data]);
+}
+
+static void fetch_global_init(void)
+{
+	int i;
 
-	fd = open("/dev/null", O_RDWR);
+	/* not thread-safe, so once per process */
+	if ((fetch_init_res = curl_global_init(CURL_GLOBAL_ALL)) != CURLE_OK)
+		return;
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&fetch_locks[i], NULL);
+	/* downloads work without sharing too */
+	if ((fetch_share = curl_share_init()) == NULL)
+		return;
+	curl_share_setopt(fetch_share, CURLSHOPT_LOCKFUNC, fetch_lock);
+	curl_share_setopt(fetch_share, CURLSHOPT_UNLOCKFUNC, fetch_unlock);
+	curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(fetch_share, CURLSHOPT_SHARE,
+		CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
 
-	/* allow C-c for child */
-	signal(SIGINT, SIG_DFL);
-	/* allow sigquit for child */
-	signal(SIGQUIT, SIG_DFL);
+/* only http part can be validated by If-Range on resume */
+static int is_http(const char *url)
+{
+	return strncasecmp(url, "http://", 7) == 0 ||
+		strncasecmp(url, "https://", 8) == 0;
+}
 
-	close(param->fds[0]);
+/* HTTP-date of <t>, independent of locale */
+static void http_date(time_t t, char *buf, size_t size)
+{
+	static const char *days[] =
+		{"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+	static const char *months[] =
+		{"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	struct tm tm;
 
-	dup2(fd, STDIN_FILENO);
-	dup2(param->fds[1], STDERR_FILENO);
-	dup2(param->fds[1], STDOUT_FILENO);
+	gmtime_r(&t, &tm);
+	snprintf(buf, size, "%s, %02d %s %d %02d:%02d:%02d GMT",
+		days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon],
+		tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
 
-	close(param->fds[1]);
+/* report loaded bytes of batch, not more often than once per second
+   if percent is not changed */
+static void batch_progress(struct fetch_batch *b, int force)
+{
+	char msg[PATH_MAX];
+	long long loaded = 0, total = 0;
+	double sum = b->done;
+	struct transfer *t;
+	time_t now;
+	int percent;
+	size_t i;
+
+	if (b->progress_fd == 0)
+		return;
+	for (i = 0; i < b->n; i++) {
+		t = &b->transfers[i];
+		loaded += t->offset + t->now;
+		if (t->total <= 0)
+			continue;
+		total += t->offset + t->total;
+		if (t->active)
+			sum += (double)(t->offset + t->now) /
+				(t->offset + t->total);
+	}
+	percent = (int)(sum * 100 / b->n);
+	now = time(NULL);
+	if (!force && percent == b->percent && now == b->reported)
+		return;
+	b->percent = percent;
+	b->reported = now;
+	snprintf(msg, sizeof(msg), PROGRESS_DOWNLOAD, loaded, total);
+	progress(msg, percent, b->progress_fd);
+}
+
+static int xferinfo_cb(
+		void *data,
+		curl_off_t dltotal,
+		curl_off_t dlnow,
+		curl_off_t ultotal,
+		curl_off_t ulnow)
+{
+	struct transfer *t = (struct transfer *)data;
 
-	execvp(param->argv[0], param->argv);
-	vztt_logger(0, errno, "execve(%s...) failed", param->argv[0]);
-	return VZT_CANT_EXEC;
+	t->now = dlnow;
+	t->total = dltotal;
+	batch_progress(t->batch, 0);
+	return 0;
+}
+
+static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	struct transfer *t = (struct transfer *)data;
+	size_t len = size * nmemb, done;
+	ssize_t w;
+
+	for (done = 0; done < len; done += w) {
+		if ((w = write(t->fd, ptr + done, len - done)) == -1) {
+			if (errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			snprintf(t->errbuf, sizeof(t->errbuf),
+				"write of part: %m");
+			return 0;
+		}
+	}
+	return len;
 }
 
 /*
-  To download <file> tp <dst>. Will use curl binary:
-  curl --silent --output <path> --create-dirs --proxy <host[:port]>\
-		 --proxy-user <user[:password]> <url>
+ prepare download of <t->url> to <t->dst>.part. Existing http part is
+ resumed with If-Range of its mtime: part is kept only if server sent
+ Last-Modified, see transfer_done(), so for changed file or part without
+ validator server sends whole file, curl fails with range error and
+ file is loaded from scratch by fetch().
 */
-int fetch_file(const char *tmpdir, const char *file, struct _url *u, const char *dst, int debug)
+static int transfer_init(
+		struct transfer *t,
+		struct _url *u,
+		int cond,
+		int debug)
 {
-	int rc = 0;
-	int i;
-	char *cmd = "curl";
-	char *argv[100];
-	char *proxy = NULL;
-	char *proxy_user = NULL;
-
-	struct sigaction act_chld, act_quit, act_int;
-	pid_t chpid, pid;
-	int status;
-	void *stack;
-	int flags = 0;
-	int ndx = 0;
-	struct _clone_param param;
-	int sa_flags;
-
-	FILE *fp;
-	char buffer[BUFSIZ];
-
-	argv[ndx++] = cmd;
-	argv[ndx++] = "--silent";
-	argv[ndx++] = "--show-error";
-	argv[ndx++] = "--output";
-	argv[ndx++] = (char *)dst;
+	struct stat st;
+	char buf[PATH_MAX+1];
+	int len;
+
+	t->fd = -1;
+	t->offset = 0;
+	t->now = 0;
+	t->total = 0;
+	t->errbuf[0] = '\0';
+	if (t->h)
+		curl_easy_reset(t->h);
+	else if ((t->h = curl_easy_init()) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, 0, "curl_easy_init()");
+	if (t->headers)
+		curl_slist_free_all(t->headers);
+	t->headers = NULL;
+
+	/* conditional download of other version is not continuation */
+	if ((t->fd = open(t->part, O_WRONLY | O_CREAT | O_CLOEXEC |
+			((cond || !is_http(t->url)) ? O_TRUNC : 0), 0644)) == -1)
+		return vztt_error(VZT_CANT_CREATE, errno, "open(%s)", t->part);
+	if (fstat(t->fd, &st))
+		return vztt_error(VZT_SYSTEM, errno, "stat(%s)", t->part);
+	if (st.st_size) {
+		if (lseek(t->fd, 0, SEEK_END) == -1)
+			return vztt_error(VZT_SYSTEM, errno, "lseek(%s)", t->part);
+		t->offset = st.st_size;
+		len = snprintf(buf, sizeof(buf), "If-Range: ");
+		http_date(st.st_mtime, buf + len, sizeof(buf) - len);
+		if ((t->headers = curl_slist_append(NULL, buf)) == NULL)
+			return vztt_error(VZT_CANT_ALLOC_MEM, 0,
+				"curl_slist_append()");
+	}
+
+	if (debug >= 4)
+		vztt_logger(2, 0, "Fetch %s to %s%s", t->url, t->dst,
+			t->offset ? " (resume)" : "");
+
+	curl_easy_setopt(t->h, CURLOPT_URL, t->url);
+	curl_easy_setopt(t->h, CURLOPT_PRIVATE, t);
+	if (fetch_share)
+		curl_easy_setopt(t->h, CURLOPT_SHARE, fetch_share);
+	curl_easy_setopt(t->h, CURLOPT_WRITEFUNCTION, write_cb);
+	curl_easy_setopt(t->h, CURLOPT_WRITEDATA, t);
+	curl_easy_setopt(t->h, CURLOPT_ERRORBUFFER, t->errbuf);
+	if (t->batch->progress_fd) {
+		curl_easy_setopt(t->h, CURLOPT_XFERINFOFUNCTION, xferinfo_cb);
+		curl_easy_setopt(t->h, CURLOPT_XFERINFODATA, t);
+		curl_easy_setopt(t->h, CURLOPT_NOPROGRESS, 0L);
+	}
+	/* http errors are not content */
+	curl_easy_setopt(t->h, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(t->h, CURLOPT_FOLLOWLOCATION, 1L);
+	/* can be used from several threads */
+	curl_easy_setopt(t->h, CURLOPT_NOSIGNAL, 1L);
+	/* validator of part */
+	curl_easy_setopt(t->h, CURLOPT_FILETIME, 1L);
+	if (t->offset) {
+		curl_easy_setopt(t->h, CURLOPT_RESUME_FROM_LARGE, t->offset);
+		curl_easy_setopt(t->h, CURLOPT_HTTPHEADER, t->headers);
+	}
+
 	if (u && u->server && u->proto) {
-		size_t size;
-		size = strlen(u->proto) + strlen(u->server) + 20;
-		if ((proxy = (char *)malloc(size)) == NULL)
-		{
-			vztt_logger(0, errno, "malloc() : %m");
-			rc = VZT_CANT_ALLOC_MEM;
-			goto cleanup_0;
-		}
 		if (u->port)
-			snprintf(proxy, size, "%s://%s:%s", u->proto, u->server, u->port);
+			snprintf(buf, sizeof(buf), "%s://%s:%s",
+				u->proto, u->server, u->port);
 		else
-			snprintf(proxy, size, "%s://%s", u->proto, u->server);
-		argv[ndx++] = "--proxy";
-		argv[ndx++] = proxy;
-		size = strlen(u->proto) + strlen(u->server) + 20;
+			snprintf(buf, sizeof(buf), "%s://%s",
+				u->proto, u->server);
+		curl_easy_setopt(t->h, CURLOPT_PROXY, buf);
 		if (u->user) {
-			size = strlen(u->user) + 3;
-			if (u->passwd)
-				size += strlen(u->passwd);
-			if ((proxy_user = (char *)malloc(size)) == NULL) {
-				vztt_logger(0, errno, "malloc() : %m");
-				rc = VZT_CANT_ALLOC_MEM;
-				goto cleanup_0;
-			}
-			if (u->passwd)
-				snprintf(proxy_user, size, "%s:%s", u->user, u->passwd);
-			else
-				strncpy(proxy_user, u->user, size);
-			argv[ndx++] = "--proxy_user";
-			argv[ndx++] = proxy_user;
+			snprintf(buf, sizeof(buf), "%s:%s", u->user,
+				u->passwd ? u->passwd : "");
+			curl_easy_setopt(t->h, CURLOPT_PROXYUSERPWD, buf);
 		}
 	}
-	argv[ndx++] = (char *)file;
-	argv[ndx] = NULL;
-	param.argv = (char *const *)argv;
-
-	if (debug >= 4) {
-		vztt_logger(2, 0, "Run %s with parameters:", argv[0]);
-		for (i = 1; argv[i]; ++i)
-			vztt_logger(2, 0, "\t%s", argv[i]);
-	}
 
-	/* Allocate stack */
-	stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE,
-			MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN, 0, 0);
-	if (stack == MAP_FAILED) {
-		vztt_logger(0, 0, "Can't allocate stack");
-		rc = VZT_INTERNAL;
-		goto cleanup_0;
+	if (cond && stat(t->dst, &st) == 0) {
+		curl_easy_setopt(t->h, CURLOPT_TIMECONDITION,
+			(long)CURL_TIMECOND_IFMODSINCE);
+		curl_easy_setopt(t->h, CURLOPT_TIMEVALUE, (long)st.st_mtime);
 	}
+	return 0;
+}
 
-	flags = SIGCHLD;
+/* finish download: rename part to destination */
+static int transfer_done(struct transfer *t, CURLcode res, int cond)
+{
+	struct timeval tv[2];
+	long unmet = 0, filetime = -1, code = 0;
+	int rc = 0;
 
-	/* set default sigchld handler */
-	sigaction(SIGCHLD, NULL, &act_chld);
-	sa_flags = act_chld.sa_flags;
-	act_chld.sa_flags = SA_NOCLDSTOP;
-	sigaction(SIGCHLD, &act_chld, NULL);
+	if (close(t->fd) && res == CURLE_OK) {
+		snprintf(t->errbuf, sizeof(t->errbuf), "close of part: %m");
+		res = CURLE_WRITE_ERROR;
+	}
+	t->fd = -1;
+	curl_easy_getinfo(t->h, CURLINFO_FILETIME, &filetime);
+	tv[0].tv_sec = tv[1].tv_sec = filetime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
 
-	/* ignore sigquit & sigint in parent */
-	sigaction(SIGQUIT, NULL, &act_quit);
-	signal(SIGQUIT, SIG_IGN);
-	sigaction(SIGINT, NULL, &act_int);
-	signal(SIGINT, SIG_IGN);
+	if (res != CURLE_OK) {
+		curl_easy_getinfo(t->h, CURLINFO_RESPONSE_CODE, &code);
+		vztt_logger(0, 0, "Can not fetch %s: %s", t->url,
+			t->errbuf[0] ? t->errbuf : curl_easy_strerror(res));
+		/* keep part for resume on network errors only,
+		   its mtime is validator */
+		if (res == CURLE_HTTP_RETURNED_ERROR ||
+				res == CURLE_RANGE_ERROR || code == 416 ||
+				cond || !is_http(t->url) || filetime < 0 ||
+				utimes(t->part, tv))
+			unlink(t->part);
+		return VZT_CANT_FETCH;
+	}
 
-	if (pipe(param.fds) < 0) {
-		vztt_logger(0, errno, "pipe() error");
-		rc = VZT_CANT_OPEN;
-		goto cleanup_1;
+	if (cond) {
+		curl_easy_getinfo(t->h, CURLINFO_CONDITION_UNMET, &unmet);
+		if (unmet) {
+			/* existing file is up2date */
+			unlink(t->part);
+			return 0;
+		}
+	}
+	if (rename(t->part, t->dst)) {
+		rc = vztt_error(VZT_CANT_RENAME, errno, "rename(%s, %s)",
+			t->part, t->dst);
+		unlink(t->part);
+		return rc;
 	}
+	if (cond && filetime >= 0)
+		utimes(t->dst, tv);
+	return 0;
+}
+
+static void transfer_clean(struct transfer *t)
+{
+	if (t->fd != -1)
+		close(t->fd);
+	t->fd = -1;
+	if (t->h)
+		curl_easy_cleanup(t->h);
+	t->h = NULL;
+	if (t->headers)
+		curl_slist_free_all(t->headers);
+	t->headers = NULL;
+	t->active = 0;
+}
+
+/* start download of <t> in <multi> */
+static int transfer_start(
+		CURLM *multi,
+		struct transfer *t,
+		struct _url *u,
+		int cond,
+		int debug)
+{
+	CURLMcode mres;
+	int rc;
 
-	if ((fp = fdopen(param.fds[0], "r")) == NULL) {
-		close(param.fds[1]);
-		vztt_logger(0, errno, "fdopen() error");
-		rc = VZT_CANT_OPEN;
-		goto cleanup_2;
+	if ((rc = transfer_init(t, u, cond, debug)))
+		return rc;
+	if ((mres = curl_multi_add_handle(multi, t->h)) != CURLM_OK)
+		return vztt_error(VZT_INTERNAL, 0,
+			"curl_multi_add_handle(): %s",
+			curl_multi_strerror(mres));
+	t->active = 1;
+	return 0;
+}
+
+/*
+ download <items> by up to <nparallel> transfers of one curl multi handle,
+ connections are kept in process-wide share, so they outlive the batch
+*/
+static int fetch(
+		struct fetch_item *items,
+		size_t n,
+		struct _url *u,
+		int nparallel,
+		int progress_fd,
+		int cond,
+		int debug)
+{
+	CURLM *multi;
+	CURLMsg *msg;
+	CURLMcode mres;
+	CURLcode res;
+	struct fetch_batch batch;
+	struct transfer *t;
+	size_t i, next = 0, active = 0;
+	int running, left, rc = 0;
+	long code;
+
+	pthread_once(&fetch_once, fetch_global_init);
+	if (fetch_init_res != CURLE_OK)
+		return vztt_error(VZT_INTERNAL, 0, "curl_global_init(): %s",
+			curl_easy_strerror(fetch_init_res));
+	if (n == 0)
+		return 0;
+	if (nparallel < 1)
+		nparallel = 1;
+	if (nparallel > FETCH_MAX_PARALLEL)
+		nparallel = FETCH_MAX_PARALLEL;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.n = n;
+	batch.progress_fd = progress_fd;
+	batch.percent = -1;
+	if ((batch.transfers = (struct transfer *)calloc(n,
+			sizeof(struct transfer))) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	for (i = 0; i < n; i++) {
+		t = &batch.transfers[i];
+		t->url = items[i].url;
+		t->dst = items[i].dst;
+		t->batch = &batch;
+		t->fd = -1;
+		items[i].rc = 0;
 	}
 
-	if ((chpid = clone(run_clone, stack + STACK_SIZE, flags, (void *)&param)) < 0) {
-		close(param.fds[1]);
-		vztt_logger(0, errno, "clone() failed");
-		rc = VZT_CANT_FORK;
-		goto cleanup_3;
+	if ((multi = curl_multi_init()) == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, 0, "curl_multi_init()");
+		goto cleanup;
 	}
-	close(param.fds[1]);
+	curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+		(long)nparallel);
 
-	while(fgets(buffer, sizeof(buffer), fp))
-		vztt_logger(0, 0, "%s : %s", param.argv[0], buffer);
+	while (next < n || active) {
+		while (next < n && active < (size_t)nparallel) {
+			t = &batch.transfers[next];
+			if (snprintf(t->part, sizeof(t->part), "%s.part",
+					t->dst) >= (int)sizeof(t->part))
+				items[next].rc = vztt_error(VZT_INTERNAL, 0,
+					"Too long path %s", t->dst);
+			else
+				items[next].rc = transfer_start(multi, t, u,
+					cond, debug);
+			if (items[next].rc) {
+				transfer_clean(t);
+				batch.done++;
+			} else {
+				active++;
+			}
+			next++;
+		}
 
-	while ((pid = waitpid(chpid, &status, 0)) == -1)
-		if (errno != EINTR)
+		if ((mres = curl_multi_perform(multi, &running)) != CURLM_OK) {
+			rc = vztt_error(VZT_INTERNAL, 0,
+				"curl_multi_perform(): %s",
+				curl_multi_strerror(mres));
 			break;
-
-	if (pid == chpid) {
-		if (WIFEXITED(status)) {
-			int retcode;
-			if ((retcode = WEXITSTATUS(status))) {
-				vztt_logger(0, 0, "%s failed, exitcode=%d", argv[0], retcode);
-				rc = VZT_PM_FAILED;
+		}
+		while ((msg = curl_multi_info_read(multi, &left))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			res = msg->data.result;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+				(char **)&t);
+			curl_multi_remove_handle(multi, t->h);
+			t->active = 0;
+			i = t - batch.transfers;
+			code = 0;
+			curl_easy_getinfo(t->h, CURLINFO_RESPONSE_CODE, &code);
+			if (t->offset && !t->retried++ &&
+					(res == CURLE_RANGE_ERROR || code == 416)) {
+				/* server can't resume or part is stale:
+				   load from scratch */
+				close(t->fd);
+				unlink(t->part);
+				if ((items[i].rc = transfer_start(multi, t, u,
+						cond, debug)) == 0)
+					continue;
 			} else {
-				rc = 0;
+				items[i].rc = transfer_done(t, res, cond);
 			}
-		} else if (WIFSIGNALED(status)) {
-			vztt_logger(0, 0,  "Got signal %d", WTERMSIG(status));
-			rc = VZT_PROG_SIGNALED;
+			/* loaded file is complete */
+			t->total = t->now;
+			transfer_clean(t);
+			batch.done++;
+			active--;
+			batch_progress(&batch, 1);
+		}
+		if (active && (mres = curl_multi_wait(multi, NULL, 0,
+				1000, NULL)) != CURLM_OK) {
+			rc = vztt_error(VZT_INTERNAL, 0,
+				"curl_multi_wait(): %s",
+				curl_multi_strerror(mres));
+			break;
 		}
-	} else if (pid < 0) {
-		vztt_logger(0, errno, "Error in waitpid()");
-		rc = VZT_INTERNAL;
 	}
 
-cleanup_3:
-	fclose(fp);
-cleanup_2:
-	close(param.fds[0]);
-cleanup_1:
-	sigaction(SIGINT, &act_int, NULL);
-	sigaction(SIGQUIT, &act_quit, NULL);
-	act_chld.sa_flags = sa_flags;
-	sigaction(SIGCHLD, &act_chld, NULL);
-	munmap(stack, STACK_SIZE);
-cleanup_0:
-	if (proxy)
-		free(proxy);
-	if (proxy_user)
-		free(proxy_user);
+	for (i = 0; i < n; i++) {
+		t = &batch.transfers[i];
+		/* interrupted and not started downloads */
+		if (t->active || i >= next) {
+			if (t->active)
+				curl_multi_remove_handle(multi, t->h);
+			items[i].rc = rc;
+		}
+		transfer_clean(t);
+		if (rc == 0)
+			rc = items[i].rc;
+	}
+	curl_multi_cleanup(multi);
+cleanup:
+	free(batch.transfers);
 	return rc;
 }
+
+/* download <file> to <dst> */
+int fetch_file(const char *tmpdir, const char *file, struct _url *u, const char *dst, int debug)
+{
+	struct fetch_item item = { (char *)file, (char *)dst, 0 };
+
+	return fetch(&item, 1, u, 1, 0, 0, debug);
+}
+
+int fetch_file_cond(const char *file, struct _url *u, const char *dst, int debug)
+{
+	struct fetch_item item = { (char *)file, (char *)dst, 0 };
+
+	return fetch(&item, 1, u, 1, 0, 1, debug);
+}
+
+int fetch_files(
+		struct fetch_item *items,
+		size_t n,
+		struct _url *u,
+		int nparallel,
+		int progress_fd,
+		int debug)
+{
+	return fetch(items, n, u, nparallel, progress_fd, 0, debug);
+}
@@ -41,6 +41,7 @@
 #include "util.h"
 #include "vztt_error.h"
 #include "progress_messages.h"
+#include "evrcmp.h"
 
 /*
  Naive lenght calclulation of specific rpms attributes such as
@@ -146,36 +147,25 @@ int read_rpm_info(FILE *fp, void *data)
 	return 0;
 }
 
-/* try ot download mirrorlist to local temparary file */
-int fetch_mirrorlist(
-		struct Transaction *pm,
-		char *mirrorlist,
-		char *buf,
-		int size)
+/* is mirrorlist in network ? */
+static int is_net_mirrorlist(const char *mirrorlist)
 {
 	char *net_protos[] = {"http:", "https:", "ftp:"};
-	int islocal = 1;
 	size_t i;
-	int md;
-	int rc = 0;
-	struct _url *proxy = NULL;
 
-	/* is mirrorlist in network ? */
-	for (i = 0; i < sizeof(net_protos)/sizeof(char *); i++) {
+	for (i = 0; i < sizeof(net_protos)/sizeof(char *); i++)
 		if (strncmp(mirrorlist, net_protos[i], \
-			strlen(net_protos[i])) == 0) {
-			islocal = 0;
-			break;
-		}
-	}
-	if (islocal) {
-		/* copy first location */
-		strncpy(buf, mirrorlist, size);
-		return 0;
-	}
+				strlen(net_protos[i])) == 0)
+			return 1;
+	return 0;
+}
+
+/* create temporary file for mirrorlist */
+static int mirrorlist_tmpfile(struct Transaction *pm, char *buf, int size)
+{
+	int md;
+	int rc;
 
-	/* download mirrorlist */
-	/* create temporary file */
 	snprintf(buf, size, "%s/mirrorlist.XXXXXX", pm->tmpdir);
 	if ((md = mkstemp(buf)) == -1) {
 		vztt_logger(0, errno, "mkstemp(%s) error", buf);
@@ -186,20 +176,92 @@ int fetch_mirrorlist(
 
 	if (rc == -1)
 		return vztt_error(VZT_SYSTEM, errno, "write()");
+	return 0;
+}
 
-	/* fetch file */
+static struct _url *mirrorlist_proxy(struct Transaction *pm)
+{
 	if (pm->http_proxy.server)
-		proxy = &pm->http_proxy;
+		return &pm->http_proxy;
 	else if (pm->ftp_proxy.server)
-		proxy = &pm->ftp_proxy;
+		return &pm->ftp_proxy;
 	else if (pm->https_proxy.server)
-		proxy = &pm->https_proxy;
-	if ((rc = fetch_file(pm->tmpdir, mirrorlist, proxy, buf, pm->debug)))
+		return &pm->https_proxy;
+	return NULL;
+}
+
+/* try ot download mirrorlist to local temparary file */
+int fetch_mirrorlist(
+		struct Transaction *pm,
+		char *mirrorlist,
+		char *buf,
+		int size)
+{
+	int rc = 0;
+
+	if (!is_net_mirrorlist(mirrorlist)) {
+		/* copy first location */
+		strncpy(buf, mirrorlist, size);
+		return 0;
+	}
+
+	/* download mirrorlist */
+	if ((rc = mirrorlist_tmpfile(pm, buf, size)))
+		return rc;
+
+	/* fetch file */
+	if ((rc = fetch_file(pm->tmpdir, mirrorlist, mirrorlist_proxy(pm),
+			buf, pm->debug)))
 		unlink(buf);
 
 	return rc;
 }
 
+/* try to download <n> mirrorlists at once, see fetch_mirrorlist() */
+int fetch_mirrorlists(
+		struct Transaction *pm,
+		char **mirrorlists,
+		char (*bufs)[PATH_MAX+1],
+		size_t n)
+{
+	int rc = 0;
+	size_t i, count = 0;
+	struct fetch_item *items;
+
+	if ((items = (struct fetch_item *)calloc(n, sizeof(*items))) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+
+	for (i = 0; i < n; i++) {
+		bufs[i][0] = '\0';
+		if (mirrorlists[i] == NULL)
+			continue;
+		if (!is_net_mirrorlist(mirrorlists[i])) {
+			strncpy(bufs[i], mirrorlists[i], PATH_MAX);
+			bufs[i][PATH_MAX] = '\0';
+			continue;
+		}
+		if ((rc = mirrorlist_tmpfile(pm, bufs[i], PATH_MAX+1)))
+			goto cleanup;
+		items[count].url = mirrorlists[i];
+		items[count++].dst = bufs[i];
+	}
+
+	/* failed mirrorlist is not error for caller: alternative location
+	   can be used */
+	fetch_files(items, count, mirrorlist_proxy(pm), FETCH_MAX_PARALLEL,
+		pm->progress_fd, pm->debug);
+	for (i = 0; i < count; i++) {
+		if (items[i].rc == 0)
+			continue;
+		unlink(items[i].dst);
+		items[i].dst[0] = '\0';
+	}
+
+cleanup:
+	free(items);
+	return rc;
+}
+
 /* Read rpm package(s) data from <fp>, parse and
    put into struct package * list <ls> */
 static int read_rpm(FILE *fp, void *data)
@@ -210,7 +272,7 @@ static int read_rpm(FILE *fp, void *data)
 	int rc;
 
 	while(fgets(buf, sizeof(buf), fp)) {
-		if ((rc = parse_p(buf, &pkg)))
+		if ((rc = parse_p_arena(buf, packages->arena, &pkg)))
 			return rc;
 
 		package_list_insert(packages, pkg);
@@ -514,74 +576,13 @@ int env_compat_find_pkg_area_ex(
 	return find_pkg(pm, pkg, pm->basesubdir, dir, size);
 }
 
-static int ver_cmp(const char *str1, const char *str2)
-{
-	const char *p1, *p2;
-	int ret;
-
-	p1 = str1;
-	p2 = str2;
-	while (1) {
-		/* skip till the next valuable block */
-		while (*p1 && (!isalnum(*p1) || *p1 == '0'))
-			p1++;
-		while (*p2 && (!isalnum(*p2) || *p2 == '0'))
-			p2++;
-		if (!*p1 || !*p2)
-			break;
-
-		str1 = p1;
-		str2 = p2;
-		if (isdigit(*p1)) {
-			/* compare numeric */
-			if (!isdigit(*p2))
-				return -1;
-			while (*p1 && isdigit(*p1))
-				p1++;
-			while (*p2 && isdigit(*p2))
-				p2++;
-			if ((p1 - str1) > (p2 - str2))
-				return 1;
-			else if ((p1 - str1) < (p2 - str2))
-				return -1;
-			else {
-				ret = strncmp(str1, str2, p1 - str1);
-				if (ret)
-					return ret;
-			}
-		} else {
-			/* compare strings */
-			if (!isalpha(*p2))
-				return -1;
-			while (*p1 && isalpha(*p1) && *p2 && isalpha(*p2)) {
-				if (*p1 > *p2)
-					return 1;
-				else if (*p2 > *p1)
-					return -1;
-				p1++;
-				p2++;
-			}
-			if ((!*p1 || !isalpha(*p1)) && *p2 && isalpha(*p2))
-				return -1;
-			else if (*p1 && isalpha(*p1) && (!*p2 || !isalpha(*p2)))
-				return 1;
-		}
-	}
-	/* the only way to escape from cycle is one string's end */
-	if (!*p2 && *p1)
-		return 1;
-	else if (!*p1 && *p2)
-		return -1;
-	return 0;
-}
-
 /* compare two versions:
  *eval = 1: a is newer than b
          0: a and b are the same version
         -1: b is newer than a */
 int env_compat_ver_cmp(struct Transaction *pm, const char * a, const char * b, int *eval)
 {
-	*eval = ver_cmp(a,b);
+	*eval = rpm_evrcmp(a, b);
 	return 0;
 }
 
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * rpm and dpkg version comparison
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "evrcmp.h"
+
+/* locale-independent ctype */
+static inline int c_isdigit(int c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline int c_isalpha(int c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline int c_isalnum(int c)
+{
+	return c_isdigit(c) || c_isalpha(c);
+}
+
+static inline int sign(int v)
+{
+	return (v > 0) - (v < 0);
+}
+
+int rpm_vercmp(const char *a, const char *b)
+{
+	const char *one = a, *two = b;
+	const char *s1, *s2;
+	size_t l1, l2;
+	int isnum, rc;
+
+	if (strcmp(a, b) == 0)
+		return 0;
+
+	while (*one || *two) {
+		while (*one && !c_isalnum(*one) && *one != '~' && *one != '^')
+			one++;
+		while (*two && !c_isalnum(*two) && *two != '~' && *two != '^')
+			two++;
+
+		/* tilde sorts before everything else */
+		if (*one == '~' || *two == '~') {
+			if (*one != '~')
+				return 1;
+			if (*two != '~')
+				return -1;
+			one++;
+			two++;
+			continue;
+		}
+		/* caret is like tilde, but base version (ended string)
+		   is older */
+		if (*one == '^' || *two == '^') {
+			if (!*one)
+				return -1;
+			if (!*two)
+				return 1;
+			if (*one != '^')
+				return 1;
+			if (*two != '^')
+				return -1;
+			one++;
+			two++;
+			continue;
+		}
+		if (!(*one && *two))
+			break;
+
+		/* grab first completely alpha or completely numeric segment */
+		s1 = one;
+		s2 = two;
+		if (c_isdigit(*s1)) {
+			while (c_isdigit(*s1))
+				s1++;
+			while (c_isdigit(*s2))
+				s2++;
+			isnum = 1;
+		} else {
+			while (c_isalpha(*s1))
+				s1++;
+			while (c_isalpha(*s2))
+				s2++;
+			isnum = 0;
+		}
+		/* segments of different types: numeric one is newer */
+		if (two == s2)
+			return isnum ? 1 : -1;
+
+		if (isnum) {
+			while (*one == '0' && one < s1)
+				one++;
+			while (*two == '0' && two < s2)
+				two++;
+			/* longer number is larger */
+			if ((s1 - one) != (s2 - two))
+				return ((s1 - one) > (s2 - two)) ? 1 : -1;
+		}
+		l1 = s1 - one;
+		l2 = s2 - two;
+		if ((rc = memcmp(one, two, l1 < l2 ? l1 : l2)))
+			return sign(rc);
+		if (l1 != l2)
+			return (l1 > l2) ? 1 : -1;
+		one = s1;
+		two = s2;
+	}
+	if (!*one && !*two)
+		return 0;
+	return *one ? 1 : -1;
+}
+
+struct evr {
+	unsigned long epoch;
+	const char *v;
+	size_t vlen;
+	/* NULL if absent */
+	const char *r;
+};
+
+/* split [epoch:]version[-release] <evr>, release is after last dash
+   both for rpm and dpkg */
+static void evr_split(const char *evr, struct evr *e)
+{
+	const char *p, *dash;
+
+	e->epoch = 0;
+	for (p = evr; c_isdigit(*p); p++) ;
+	if (*p == ':') {
+		e->epoch = strtoul(evr, NULL, 10);
+		evr = p + 1;
+	}
+	e->v = evr;
+	dash = strrchr(evr, '-');
+	if (dash) {
+		e->vlen = dash - evr;
+		e->r = dash + 1;
+	} else {
+		e->vlen = strlen(evr);
+		e->r = NULL;
+	}
+}
+
+/* compare first <la>/<lb> chars of <a>/<b> with <cmp> */
+static int cmp_n(int (*cmp)(const char *, const char *),
+		const char *a, size_t la, const char *b, size_t lb)
+{
+	char sa[la + 1], sb[lb + 1];
+
+	memcpy(sa, a, la);
+	sa[la] = '\0';
+	memcpy(sb, b, lb);
+	sb[lb] = '\0';
+	return cmp(sa, sb);
+}
+
+int rpm_evrcmp(const char *a, const char *b)
+{
+	struct evr ea, eb;
+	int rc;
+
+	if (strcmp(a, b) == 0)
+		return 0;
+	evr_split(a, &ea);
+	evr_split(b, &eb);
+	if (ea.epoch != eb.epoch)
+		return (ea.epoch > eb.epoch) ? 1 : -1;
+	if ((rc = cmp_n(rpm_vercmp, ea.v, ea.vlen, eb.v, eb.vlen)))
+		return rc;
+	if (ea.r && eb.r)
+		return rpm_vercmp(ea.r, eb.r);
+	return 0;
+}
+
+/* dpkg character weight: '~' before end of string before letters
+   before other characters */
+static int deb_order(int c)
+{
+	if (c_isdigit(c))
+		return 0;
+	if (c_isalpha(c))
+		return c;
+	if (c == '~')
+		return -1;
+	if (c)
+		return c + 256;
+	return 0;
+}
+
+/* dpkg verrevcmp() */
+static int deb_vercmp(const char *a, const char *b)
+{
+	while (*a || *b) {
+		int first_diff = 0;
+
+		while ((*a && !c_isdigit(*a)) || (*b && !c_isdigit(*b))) {
+			int ac = deb_order(*a);
+			int bc = deb_order(*b);
+
+			if (ac != bc)
+				return sign(ac - bc);
+			a++;
+			b++;
+		}
+		while (*a == '0')
+			a++;
+		while (*b == '0')
+			b++;
+		while (c_isdigit(*a) && c_isdigit(*b)) {
+			if (!first_diff)
+				first_diff = *a - *b;
+			a++;
+			b++;
+		}
+		if (c_isdigit(*a))
+			return 1;
+		if (c_isdigit(*b))
+			return -1;
+		if (first_diff)
+			return sign(first_diff);
+	}
+	return 0;
+}
+
+int deb_evrcmp(const char *a, const char *b)
+{
+	struct evr ea, eb;
+	int rc;
+
+	if (strcmp(a, b) == 0)
+		return 0;
+	evr_split(a, &ea);
+	evr_split(b, &eb);
+	if (ea.epoch != eb.epoch)
+		return (ea.epoch > eb.epoch) ? 1 : -1;
+	if ((rc = cmp_n(deb_vercmp, ea.v, ea.vlen, eb.v, eb.vlen)))
+		return rc;
+	/* absent revision is the same as empty one */
+	return deb_vercmp(ea.r ? ea.r : "", eb.r ? eb.r : "");
+}
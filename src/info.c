@@ -81,7 +81,8 @@ static int get_tmpl_pkg_info(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(gc, tmpl->base, 
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_1;
 
 	rc = to->pm_tmpl_get_info(to, package, pi);
@@ -412,7 +413,7 @@ int vztt2_get_os_tmpl_info(
 		goto cleanup_0;
 
 	/* load templates */
-	if (((rc = tmplset_selective_load(gc.template_dir, arg, NULL, \
+	if (((rc = tmplset_load_shared(gc.template_dir, arg, \
 		0, &tmpl, opts_vztt))) && is_veid(arg, ctid))
 	{
 		/* read OS template from VE config */
@@ -420,24 +421,19 @@ int vztt2_get_os_tmpl_info(
 				&gc, &vc)))
 			goto cleanup_1;
 
-		if ((rc = tmplset_selective_load(gc.template_dir, \
-					vc.ostemplate, NULL, \
+		if ((rc = tmplset_load_shared(gc.template_dir, \
+					vc.ostemplate, \
 					0, &tmpl, opts_vztt)))
 			goto cleanup_2;
 	}
 	else if (rc)
 		goto cleanup_1;
 
-	/* select only OS */
-	if ((rc = tmplset_mark(tmpl, NULL, TMPLSET_MARK_OS, NULL)))
-		goto cleanup_3;
-
 	memset((void *)info, 0, sizeof(struct tmpl_info));
 
-	/* get template info */
-	rc = tmplset_get_info(&gc, tmpl, &tc.url_map, info);
+	/* get OS template info: shared set can not be marked */
+	rc = os_tmpl_get_info(&gc, tmpl->os, tmpl->base, &tc.url_map, info);
 
-cleanup_3:
 	tmplset_clean(tmpl);
 
 cleanup_2:
@@ -533,7 +529,8 @@ static int get_tmpl_group_info(
 		goto cleanup_2;
 
 	/* lock template area on read */
-	if ((rc = tmpl_lock(&gc, tmpl->base, LOCK_READ, opts_vztt->flags, &lockdata)))
+	if ((rc = tmpl_lock(&gc, tmpl->base, LOCK_READ, opts_vztt->flags,
+			&lockdata, opts_vztt->progress_fd)))
 		goto cleanup_2;
 
 	rc = to->pm_get_group_info(to, group, info);
@@ -40,7 +40,6 @@
 #include <limits.h>
 #include <time.h>
 #include <poll.h>
-#include <signal.h>
 #include <vzctl/libvzctl.h>
 #include <libgen.h>
 
@@ -48,16 +47,20 @@
 #include "util.h"
 #include "template.h"
 #include "lock.h"
+#include "progress_messages.h"
 
 #include <vzctl/libvzctl.h>
 
 /*
 vzpkg write lock operations:
- update metadata - done (change on onread ?)
  clean - done
  remove template - done
  upgrade area - done (change on onread ?)
 
+vzpkg metadata lock operations (template area on read for yum
+repositories, on write for metadata updated in place):
+ update metadata
+
 vzpkg read lock operations:
  create cache - done
  update cache - done
@@ -82,6 +85,21 @@ vzpkg non lock operations:
  verify area
  get_backup_apps
 
+Lock hierarchy, locks are acquired in this order only:
+ 1. template cache file (<cache>.lock)
+ 2. metadata of base OS template (<basedir>/.lock.metadata)
+ 3. template area of base OS template (<basedir>/.lock)
+ 4. package downloads into shared yum repository directories
+    (<store entry>.download), see mdstore_download_lock()
+Metadata lock serializes metadata updaters only: they take it on write
+and keep template area on read, readers do not take it at all, since
+metadata are replaced atomically (lists by rename(), yum repository
+caches by switching of store entry generation, see mdstore.h).
+Package managers which update metadata in place (apt, zypper and yum
+without repositories) keep template area on write instead.
+Apt package areas (download caches) need no lock, see pkgcache.h.
+Locking of outer level while inner one is held by the same thread
+is refused.
 */
 
 #define LOCK_MECH_NONE 0
@@ -90,84 +108,235 @@ vzpkg non lock operations:
 static int lock_mech = LOCK_MECH_NONE;
 static time_t default_timeout = 600;
 
+/* levels of lock hierarchy */
+enum {
+	LOCK_LEVEL_CACHE,
+	LOCK_LEVEL_METADATA,
+	LOCK_LEVEL_AREA,
+	LOCK_LEVEL_DOWNLOAD,
+	LOCK_LEVELS,
+};
+
+static const char *lock_level_names[LOCK_LEVELS] = {
+	"template cache",
+	"metadata",
+	"template area",
+	"package download",
+};
+
+/* number of locks of every level, held by thread */
+static __thread int lock_held[LOCK_LEVELS];
+
+struct lock_data {
+	int fd;
+	int mode;
+	int level;
+};
+
+/* refuse lock of <level> if more inner one is held */
+static int lock_order_check(int level)
+{
+	int i;
+
+	for (i = level + 1; i < LOCK_LEVELS; i++)
+		if (lock_held[i])
+			return vztt_error(VZT_INTERNAL, 0,
+				"%s lock is requested while %s lock is held",
+				lock_level_names[level], lock_level_names[i]);
+	return 0;
+}
+
 /************************************
   fcntl() template lock module
 ************************************/
-static void alarm_handler(int sig)
+/*
+Open file description (OFD) locks belong to the lock handle, not to the
+process: threads of one process exclude each other, and closing of one
+handle does not release locks of other handles on the same file.
+F_OFD_SETLKW can not be interrupted without signal, so lock is waited
+by polling with backoff, that gives per call timeout.
+Lock descriptors are close-on-exec, but forked child without exec keeps
+the lock until exit.
+Process-associated locks are used on kernels without OFD locks.
+*/
+#ifndef F_OFD_GETLK
+#define F_OFD_GETLK	36
+#define F_OFD_SETLK	37
+#endif
+
+#define LOCK_POLL_MIN_MS	10
+#define LOCK_POLL_MAX_MS	500
+/* period of waiting reports, in seconds */
+#define LOCK_REPORT_PERIOD	5
+
+static int lock_cmd_set = F_OFD_SETLK;
+static int lock_cmd_get = F_OFD_GETLK;
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* find pid of process which holds conflicting lock, -1 if unknown.
+   OFD lock has no owner process, so writer stores its pid in lock file */
+static pid_t lock_holder(int fd, const struct flock *want)
 {
-	return;
+	struct flock fl;
+	char buf[32];
+	ssize_t n;
+	long pid;
+
+	fl = *want;
+	fl.l_pid = 0;
+	if (fcntl(fd, lock_cmd_get, &fl) || fl.l_type == F_UNLCK)
+		return -1;
+	/* process-associated lock */
+	if (fl.l_pid > 0)
+		return fl.l_pid;
+	if (fl.l_type != F_WRLCK)
+		return -1;
+	if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0)
+		return -1;
+	buf[n] = '\0';
+	pid = strtol(buf, NULL, 10);
+	return (pid > 0) ? (pid_t)pid : -1;
+}
+
+/* report lock waiting to log and progress fd */
+static void lock_wait_report(
+		int fd,
+		const struct flock *fl,
+		int level,
+		long waited,
+		int progress_fd)
+{
+	char msg[PATH_MAX + 1];
+	pid_t pid;
+
+	if ((pid = lock_holder(fd, fl)) > 0)
+		snprintf(msg, sizeof(msg), PROGRESS_LOCK_WAIT_PID,
+			lock_level_names[level], (int)pid, waited);
+	else
+		snprintf(msg, sizeof(msg), PROGRESS_LOCK_WAIT,
+			lock_level_names[level], waited);
+	vztt_logger(1, 0, "%s", msg);
+	progress(msg, 0, progress_fd);
 }
 
 static int file_lock(
 		const char *path,
 		int mode,
+		int level,
 		void **lockdata,
-		int timeout)
+		int timeout,
+		int progress_fd)
 {
 	int rc;
 	int fd;
+	int cmd;
 	struct flock fl;
-	struct sigaction act;
-	struct sigaction old_act;
+	struct lock_data *ld;
+	struct timespec start, delay;
+	long waited;
+	long sleep_ms = LOCK_POLL_MIN_MS;
+	long reported = -1;
+	char pid[32];
+
+	if ((rc = lock_order_check(level)))
+		return rc;
 
-	if ((*lockdata = (void *)malloc(sizeof(fd))) == NULL)
+	if ((ld = (struct lock_data *)malloc(sizeof(*ld))) == NULL)
 		return vztt_error(VZT_SYSTEM, errno, "malloc() :");
+	*lockdata = NULL;
 
+	/* lock file of writer keeps its pid, so do not truncate it here */
 	if (mode == LOCK_WRITE)
-		fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+		fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
 	else
-		fd = open(path, O_RDONLY|O_CREAT, 0600);
+		fd = open(path, O_RDONLY|O_CREAT|O_CLOEXEC, 0600);
 	if (fd < 0) {
-		free((void *)*lockdata);
-		*lockdata = NULL;
+		free(ld);
 		return vztt_error(VZT_SYSTEM, errno, "open(%s) :", path);
 	}
-	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	memset(&fl, 0, sizeof(fl));
 	fl.l_type = (mode == LOCK_WRITE) ? F_WRLCK : F_RDLCK;
 	fl.l_start=0;
 	fl.l_whence = SEEK_SET;
 	fl.l_len = 0; /* until EOF */
 
-	if (timeout) {
-		act.sa_flags = 0;
-		sigemptyset(&act.sa_mask);
-		act.sa_handler = alarm_handler;
-		sigaction(SIGALRM, &act, &old_act);
-		alarm(timeout);
-	}
-
-	rc = fcntl(fd, F_SETLKW, &fl);
-
-	if (timeout) {
-		alarm(0);
-		sigaction(SIGALRM, &old_act, NULL);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (1) {
+		cmd = lock_cmd_set;
+		if (fcntl(fd, cmd, &fl) == 0)
+			break;
+		if (errno == EINVAL && cmd == F_OFD_SETLK) {
+			/* kernel without OFD locks */
+			vztt_logger(2, 0, "OFD locks are not supported, "
+				"use process-associated locks");
+			lock_cmd_set = F_SETLK;
+			lock_cmd_get = F_GETLK;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EACCES && errno != EAGAIN) {
+			rc = vztt_error(VZT_SYSTEM, errno,
+				"fcntl(%s, F_SETLK, ...) :", path);
+			goto cleanup;
+		}
 
-	if (rc) {
-		if (errno == EINTR) {
-			rc = vztt_error(VZT_CANT_LOCK, 0, 
-				"lock timeout exceeded");
-		} else if (errno == EACCES || errno == EAGAIN) {
+		waited = elapsed_ms(&start);
+		if (timeout && waited >= timeout * 1000L) {
+			lock_wait_report(fd, &fl, level, waited / 1000,
+				progress_fd);
 			rc = vztt_error(VZT_CANT_LOCK, 0,
-				"template cache file locked");
-		} else {
-			rc = vztt_error(VZT_SYSTEM, errno, 
-				"fcntl(%s, F_SETLKW, ...) :", path);
+				"lock timeout exceeded");
+			goto cleanup;
 		}
-		free(*lockdata);
-		*lockdata = NULL;
-		close(fd);
-		return rc;
+		if (reported < 0 || waited - reported >= LOCK_REPORT_PERIOD * 1000) {
+			lock_wait_report(fd, &fl, level, waited / 1000,
+				progress_fd);
+			reported = waited;
+		}
+
+		if (timeout && sleep_ms > timeout * 1000L - waited)
+			sleep_ms = timeout * 1000L - waited;
+		delay.tv_sec = sleep_ms / 1000;
+		delay.tv_nsec = (sleep_ms % 1000) * 1000000;
+		nanosleep(&delay, NULL);
+		sleep_ms = MIN(sleep_ms * 2, LOCK_POLL_MAX_MS);
+	}
+	if (mode == LOCK_WRITE) {
+		snprintf(pid, sizeof(pid), "%d\n", (int)getpid());
+		if (ftruncate(fd, 0) == 0)
+			pwrite(fd, pid, strlen(pid), 0);
 	}
-	memcpy(*lockdata, &fd, sizeof(fd));
+	ld->fd = fd;
+	ld->mode = mode;
+	ld->level = level;
+	lock_held[level]++;
+	*lockdata = ld;
 	vztt_logger(2, 0, "lock file %s locked", path);
 	return 0;
+
+cleanup:
+	free(ld);
+	close(fd);
+	return rc;
 }
 
 static int file_unlock(void *lockdata)
 {
-	int fd = *((int *)lockdata);
-	close(fd);
+	struct lock_data *ld = (struct lock_data *)lockdata;
+
+	if (ld->mode == LOCK_WRITE)
+		ftruncate(ld->fd, 0);
+	close(ld->fd);
+	lock_held[ld->level]--;
 	vztt_logger(2, 0, "lock file unlocked");
 	return 0;
 }
@@ -188,7 +357,8 @@ int tmpl_lock(
 		struct base_os_tmpl *tmpl,
 		int mode,
 		int vztt,
-		void **lockdata)
+		void **lockdata,
+		int progress_fd)
 {
 	int rc;
 	char lock[PATH_MAX + 1];
@@ -204,7 +374,8 @@ int tmpl_lock(
 
 	if (lock_mech == LOCK_MECH_LCK) {
 		snprintf(lock, sizeof(lock) - 1, "%s/.lock", tmpl->basedir);
-		rc = file_lock(lock, mode, lockdata, default_timeout);
+		rc = file_lock(lock, mode, LOCK_LEVEL_AREA, lockdata,
+			default_timeout, progress_fd);
 	} else {
 		return vztt_error(VZT_INTERNAL, 0, "Undefined lock type in tmpl_lock()");
 	}
@@ -220,7 +391,8 @@ int cache_lock(
 		int mode,
 		int vztt,
 		void **lockdata,
-		unsigned int timeout)
+		unsigned int timeout,
+		int progress_fd)
 {
 	int rc;
 	char lock[PATH_MAX + 1];
@@ -236,7 +408,8 @@ int cache_lock(
 
 	if (lock_mech == LOCK_MECH_LCK) {
 		snprintf(lock, sizeof(lock) - 1, "%s.lock", cache_path);
-		rc = file_lock(lock, mode, lockdata, timeout);
+		rc = file_lock(lock, mode, LOCK_LEVEL_CACHE, lockdata, timeout,
+			progress_fd);
 	} else {
 		return vztt_error(VZT_INTERNAL, 0, "Undefined lock type in cache_lock()");
 	}
@@ -246,6 +419,41 @@ int cache_lock(
 	return rc;
 }
 
+/* lock metadata of base os template */
+int metadata_lock(
+		struct global_config *gc,
+		struct base_os_tmpl *tmpl,
+		int mode,
+		int vztt,
+		void **lockdata,
+		int progress_fd)
+{
+	int rc;
+	char lock[PATH_MAX + 1];
+
+	if (vztt & OPT_VZTT_SKIP_LOCK)
+		return 0;
+
+	if (lock_mech == LOCK_MECH_NONE) {
+		/* locking not initialized yet */
+		if ((rc = lock_init(gc->template_dir)))
+			return rc;
+	}
+
+	if (lock_mech == LOCK_MECH_LCK) {
+		snprintf(lock, sizeof(lock) - 1, "%s/.lock.metadata",
+			tmpl->basedir);
+		rc = file_lock(lock, mode, LOCK_LEVEL_METADATA, lockdata,
+			default_timeout, progress_fd);
+	} else {
+		return vztt_error(VZT_INTERNAL, 0, "Undefined lock type in metadata_lock()");
+	}
+
+	if (rc == 0)
+		vztt_logger(2, 0, "metadata of %s locked", tmpl->name);
+	return rc;
+}
+
 static int do_unlock(void *lockdata, int vztt, int timeout)
 {
 	int rc = 0;
@@ -281,6 +489,28 @@ int cache_unlock(void *lockdata, int vztt)
 	return rc;
 }
 
+int metadata_unlock(void *lockdata, int vztt)
+{
+	int rc = do_unlock(lockdata, vztt, default_timeout);
+	if (rc == 0)
+		vztt_logger(2, 0, "metadata unlocked");
+	return rc;
+}
+
+/* lock package download area, several ones are locked in the same
+   order by all callers */
+int download_lock(const char *path, void **lockdata, int progress_fd)
+{
+	return file_lock(path, LOCK_WRITE, LOCK_LEVEL_DOWNLOAD, lockdata,
+			default_timeout, progress_fd);
+}
+
+void download_unlock(void *lockdata)
+{
+	file_unlock(lockdata);
+	free(lockdata);
+}
+
 int lock_ve(const char *ctid, int vztt, void **lockdata)
 {
 	const char *status;
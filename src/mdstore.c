@@ -0,0 +1,1060 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * shared repository metadata store
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "vztt_error.h"
+#include "util.h"
+#include "md5.h"
+#include "downloader.h"
+#include "lock.h"
+#include "mdstore.h"
+
+/* stamp content: checksum of upstream index file and time of last change */
+#define MDSTORE_NOSUM	"-"
+/* suffixes of files near entry */
+#define MDSTORE_STAMP		".stamp"
+#define MDSTORE_INDEX		".index"
+#define MDSTORE_REFS		".refs"
+#define MDSTORE_GEN_LOCK	".lock"
+#define MDSTORE_DOWNLOAD	".download"
+
+void mdstore_expand_url(
+		const char *url,
+		const struct mdstore_var *vars,
+		char *buf,
+		size_t size)
+{
+	const struct mdstore_var *v;
+	const char *s;
+	size_t len, i;
+
+	if (size == 0)
+		return;
+	for (s = url, i = 0; *s && i < size - 1;) {
+		for (v = vars; v && v->name; v++) {
+			len = strlen(v->name);
+			if (strncmp(s, v->name, len) == 0 &&
+					!isalnum(s[len]) && s[len] != '_')
+				break;
+		}
+		if (v && v->name) {
+			i += snprintf(buf + i, size - i, "%s", v->value);
+			if (i > size - 1)
+				i = size - 1;
+			s += strlen(v->name);
+		} else {
+			buf[i++] = *s++;
+		}
+	}
+	buf[i] = '\0';
+}
+
+/* expand <vars> in <url> and normalize result to <buf> */
+static void normalize_url(
+		const char *url,
+		const struct mdstore_var *vars,
+		char *buf,
+		size_t size)
+{
+	char exp[2*PATH_MAX];
+	const char *s;
+	char *d, *path;
+	size_t i;
+
+	mdstore_expand_url(url, vars, exp, sizeof(exp));
+
+	/* scheme and host are case insensitive */
+	if ((path = strstr(exp, "://")))
+		path += 3;
+	else
+		path = exp;
+	for (d = exp; *d && d < path; d++)
+		*d = tolower(*d);
+	for (; *d && *d != '/'; d++)
+		*d = tolower(*d);
+
+	/* collapse duplicated slashes in path and drop trailing ones */
+	for (s = d, i = d - exp; *s && i < sizeof(exp); s++) {
+		if (*s == '/' && i > 0 && exp[i - 1] == '/')
+			continue;
+		exp[i++] = *s;
+	}
+	while (i > 0 && exp[i - 1] == '/' && &exp[i - 1] >= path)
+		i--;
+	exp[i] = '\0';
+
+	snprintf(buf, size, "%s", exp);
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int mdstore_fingerprint(
+		const char *kind,
+		struct string_list *urls,
+		const struct mdstore_var *vars,
+		char *fp,
+		size_t size)
+{
+	struct MD5Context ctx;
+	unsigned char md5[16];
+	struct string_list_el *p;
+	char **norm;
+	size_t i, n;
+	int rc = 0;
+
+	if (size < MDSTORE_FP_LEN + 1)
+		return vztt_error(VZT_INTERNAL, 0, "Too small fingerprint buffer");
+
+	n = string_list_size(urls);
+	if ((norm = (char **)calloc(n + 1, sizeof(*norm))) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	i = 0;
+	string_list_for_each(urls, p) {
+		if ((norm[i] = (char *)malloc(2*PATH_MAX)) == NULL) {
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+			goto cleanup;
+		}
+		normalize_url(p->s, vars, norm[i], 2*PATH_MAX);
+		i++;
+	}
+	qsort(norm, n, sizeof(*norm), cmp_str);
+
+	MD5Init(&ctx);
+	MD5Update(&ctx, (md5byte const *)kind, strlen(kind) + 1);
+	for (i = 0; i < n; i++)
+		MD5Update(&ctx, (md5byte const *)norm[i], strlen(norm[i]) + 1);
+	MD5Final(md5, &ctx);
+
+	for (i = 0; i < sizeof(md5); i++)
+		sprintf(fp + 2*i, "%02x", md5[i]);
+
+cleanup:
+	for (i = 0; i < n; i++)
+		free(norm[i]);
+	free(norm);
+	return rc;
+}
+
+/* create store directory, concurrent creation is not error */
+static int create_store_dir(const char *path)
+{
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return vztt_error(VZT_CANT_CREATE, errno, "mkdir(%s)", path);
+	return 0;
+}
+
+/* <tmpldir>/.mdstore/<name><suffix>, too long path is error */
+static int store_path(
+		char *buf,
+		size_t size,
+		const char *tmpldir,
+		const char *name,
+		const char *suffix)
+{
+	int n;
+
+	n = snprintf(buf, size, "%s/" MDSTORE_SUBDIR "/%s%s",
+		tmpldir, name, suffix);
+	if (n < 0 || (size_t)n >= size)
+		return vztt_error(VZT_INTERNAL, 0, "Too long path %s/"
+			MDSTORE_SUBDIR "/%s%s", tmpldir, name, suffix);
+	return 0;
+}
+
+/* md5 of string in hex */
+static void str_md5(const char *str, char *sum)
+{
+	struct MD5Context ctx;
+	unsigned char md5[16];
+	size_t i;
+
+	MD5Init(&ctx);
+	MD5Update(&ctx, (md5byte const *)str, strlen(str));
+	MD5Final(md5, &ctx);
+	for (i = 0; i < sizeof(md5); i++)
+		sprintf(sum + 2*i, "%02x", md5[i]);
+}
+
+/*
+register template cache directory <path> as reference to entry <fp>:
+<tmpldir>/.mdstore/<fp>.refs/<md5 of path> contains <path>. Reference is
+valid while <path> is symlink to entry, see gc_entry().
+*/
+static int add_ref(const char *tmpldir, const char *fp, const char *path)
+{
+	char refs[PATH_MAX+1];
+	char sum[MDSTORE_FP_LEN+1];
+	size_t len = strlen(path);
+	int rc, fd;
+
+	if ((rc = store_path(refs, sizeof(refs), tmpldir, fp, MDSTORE_REFS)))
+		return rc;
+	if ((rc = create_store_dir(refs)))
+		return rc;
+	str_md5(path, sum);
+	if ((fd = openat(AT_FDCWD, refs, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", refs);
+	rc = 0;
+	if (faccessat(fd, sum, F_OK, AT_SYMLINK_NOFOLLOW)) {
+		int ffd = openat(fd, sum, O_WRONLY | O_CREAT | O_TRUNC |
+			O_CLOEXEC, 0644);
+		if (ffd == -1 || write(ffd, path, len) != (ssize_t)len)
+			rc = vztt_error(VZT_CANT_WRITE, errno,
+				"write(%s/%s)", refs, sum);
+		if (ffd != -1)
+			close(ffd);
+	}
+	close(fd);
+	return rc;
+}
+
+int mdstore_link(const char *tmpldir, const char *fp, const char *path)
+{
+	char store[PATH_MAX+1];
+	char entry[PATH_MAX+1];
+	char tmp[PATH_MAX+1];
+	char buf[PATH_MAX+1];
+	struct stat st;
+	ssize_t len;
+	int rc;
+
+	if ((rc = store_path(store, sizeof(store), tmpldir, "", "")))
+		return rc;
+	if ((rc = create_store_dir(store)))
+		return rc;
+	if ((rc = store_path(entry, sizeof(entry), tmpldir, fp, "")))
+		return rc;
+	if ((rc = add_ref(tmpldir, fp, path)))
+		return rc;
+
+	if (lstat(path, &st) == 0) {
+		if (S_ISLNK(st.st_mode)) {
+			len = readlink(path, buf, sizeof(buf) - 1);
+			if (len > 0) {
+				buf[len] = '\0';
+				if (strcmp(buf, entry) == 0 &&
+						access(entry, F_OK) == 0)
+					return 0;
+			}
+		} else if (S_ISDIR(st.st_mode)) {
+			/* move already loaded metadata into the store,
+			   or drop it if other template did it before */
+			if (rename(path, entry)) {
+				if (errno == EXDEV) {
+					/* can't share it */
+					vztt_logger(2, 0, "%s is not on the same "
+						"filesystem as %s", path, store);
+					return 0;
+				}
+				if (errno != EEXIST && errno != ENOTEMPTY &&
+						errno != ENOTDIR)
+					return vztt_error(VZT_CANT_RENAME, errno,
+						"rename(%s, %s)", path, entry);
+				if ((rc = remove_directory(path)))
+					return rc;
+			}
+		}
+	}
+	if ((rc = create_store_dir(entry)))
+		return rc;
+
+	/* replace existing symlink atomically */
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid()) >= (int)sizeof(tmp))
+		return vztt_error(VZT_INTERNAL, 0, "Too long path %s", path);
+	unlink(tmp);
+	if (symlink(entry, tmp))
+		return vztt_error(VZT_SYSTEM, errno,
+			"symlink(%s, %s)", entry, tmp);
+	if (rename(tmp, path)) {
+		rc = vztt_error(VZT_CANT_RENAME, errno,
+			"rename(%s, %s)", tmp, path);
+		unlink(tmp);
+		return rc;
+	}
+	return 0;
+}
+
+/*
+ open stamp <path> of entry and lock it by flock <op>. gc_entry() removes
+ stamp under exclusive lock, so lock taken on removed stamp is taken again
+ on the current one: all holders of entry lock share the same inode.
+ Returns VZT_CANT_LOCK without message if non-blocking lock is busy.
+*/
+static int lock_stamp(const char *path, int op, int *fd)
+{
+	struct stat st, pst;
+	struct timespec ts[2];
+	int err;
+
+	while (1) {
+		if ((*fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+				0644)) != -1) {
+			/* new entry was never updated */
+			memset(ts, 0, sizeof(ts));
+			futimens(*fd, ts);
+		} else if (errno != EEXIST ||
+				(*fd = open(path, O_RDWR | O_CLOEXEC)) == -1) {
+			/* removed between two opens */
+			if (errno == ENOENT)
+				continue;
+			return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", path);
+		}
+
+		if (flock(*fd, op)) {
+			err = errno;
+			close(*fd);
+			*fd = -1;
+			if (err == EINTR)
+				continue;
+			if (err == EWOULDBLOCK)
+				return VZT_CANT_LOCK;
+			return vztt_error(VZT_CANT_LOCK, err, "flock(%s)", path);
+		}
+		if (fstat(*fd, &st) == 0 && stat(path, &pst) == 0 &&
+				st.st_dev == pst.st_dev && st.st_ino == pst.st_ino)
+			return 0;
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+int mdstore_lock(const char *tmpldir, const char *fp, int *fd)
+{
+	char path[PATH_MAX+1];
+	int rc;
+
+	if ((rc = store_path(path, sizeof(path), tmpldir, "", "")))
+		return rc;
+	if ((rc = create_store_dir(path)))
+		return rc;
+	if ((rc = store_path(path, sizeof(path), tmpldir, fp, MDSTORE_STAMP)))
+		return rc;
+	return lock_stamp(path, LOCK_EX, fd);
+}
+
+int mdstore_share(int fd)
+{
+	while (flock(fd, LOCK_SH)) {
+		if (errno == EINTR)
+			continue;
+		return vztt_error(VZT_CANT_LOCK, errno, "flock()");
+	}
+	return 0;
+}
+
+int mdstore_is_fresh(int fd, int expire)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return 0;
+	return time(NULL) - st.st_mtime <= expire;
+}
+
+int mdstore_touch(int fd)
+{
+	if (futimens(fd, NULL))
+		return vztt_error(VZT_SYSTEM, errno, "futimens()");
+	return 0;
+}
+
+static void read_stamp(int fd, char *sum, size_t size, time_t *changed)
+{
+	char buf[128];
+	char str[MDSTORE_FP_LEN+1];
+	long long t = 0;
+	ssize_t n;
+
+	snprintf(sum, size, MDSTORE_NOSUM);
+	*changed = 0;
+	if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0)
+		return;
+	buf[n] = '\0';
+	if (sscanf(buf, "%32s %lld", str, &t) != 2)
+		return;
+	snprintf(sum, size, "%s", str);
+	*changed = (time_t)t;
+}
+
+/* md5 of file content in hex */
+static int file_md5(const char *path, char *sum, size_t size)
+{
+	struct MD5Context ctx;
+	unsigned char md5[16];
+	char buf[BUFSIZ];
+	ssize_t n;
+	size_t i;
+	int fd;
+
+	if (size < MDSTORE_FP_LEN + 1)
+		return VZT_INTERNAL;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", path);
+	MD5Init(&ctx);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		MD5Update(&ctx, (md5byte const *)buf, n);
+	close(fd);
+	if (n == -1)
+		return vztt_error(VZT_CANT_READ, errno, "read(%s)", path);
+	MD5Final(md5, &ctx);
+	for (i = 0; i < sizeof(md5); i++)
+		sprintf(sum + 2*i, "%02x", md5[i]);
+	return 0;
+}
+
+int mdstore_revalidate(
+		const char *tmpldir,
+		const char *fp,
+		int fd,
+		const char *url,
+		struct _url *proxy,
+		int debug)
+{
+	char path[PATH_MAX+1];
+	char sum[MDSTORE_FP_LEN+1];
+	char old[MDSTORE_FP_LEN+1];
+	time_t changed;
+
+	if (store_path(path, sizeof(path), tmpldir, fp, MDSTORE_INDEX))
+		return 1;
+	if (fetch_file_cond(url, proxy, path, debug)) {
+		/* load it again next time */
+		unlink(path);
+		return 1;
+	}
+	if (file_md5(path, sum, sizeof(sum)))
+		return 1;
+	read_stamp(fd, old, sizeof(old), &changed);
+
+	return strcmp(sum, old) ? 1 : 0;
+}
+
+int mdstore_updated(
+		const char *tmpldir,
+		const char *fp,
+		int fd,
+		int validated,
+		time_t changed)
+{
+	char path[PATH_MAX+1];
+	char sum[MDSTORE_FP_LEN+1];
+	char buf[128];
+	int len;
+
+	snprintf(sum, sizeof(sum), MDSTORE_NOSUM);
+	if (validated) {
+		if (store_path(path, sizeof(path), tmpldir, fp, MDSTORE_INDEX) ||
+				file_md5(path, sum, sizeof(sum)))
+			snprintf(sum, sizeof(sum), MDSTORE_NOSUM);
+	}
+	len = snprintf(buf, sizeof(buf), "%s %lld\n", sum, (long long)changed);
+	if (ftruncate(fd, 0) || pwrite(fd, buf, len, 0) != len)
+		return vztt_error(VZT_CANT_WRITE, errno, "write stamp of %s", fp);
+
+	return mdstore_touch(fd);
+}
+
+time_t mdstore_changed(int fd)
+{
+	char sum[MDSTORE_FP_LEN+1];
+	time_t changed;
+
+	read_stamp(fd, sum, sizeof(sum), &changed);
+	return changed;
+}
+
+void mdstore_unlock(int fd)
+{
+	if (fd == -1)
+		return;
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+/* recreate directory tree <src> in <dst> by hard links */
+static int link_tree(int sfd, int dfd, const char *path)
+{
+	int rc = 0, sub, dsub;
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char buf[PATH_MAX+1];
+	ssize_t len;
+
+	if ((dir = fdopendir(sfd)) == NULL) {
+		close(sfd);
+		return vztt_error(VZT_CANT_OPEN, errno, "opendir(%s)", path);
+	}
+	while ((de = readdir(dir))) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (fstatat(sfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			if (mkdirat(dfd, de->d_name, st.st_mode & 07777) ||
+				(sub = openat(sfd, de->d_name,
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+				rc = vztt_error(VZT_CANT_CREATE, errno,
+					"%s/%s", path, de->d_name);
+				break;
+			}
+			if ((dsub = openat(dfd, de->d_name,
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+				close(sub);
+				rc = vztt_error(VZT_CANT_OPEN, errno,
+					"%s/%s", path, de->d_name);
+				break;
+			}
+			rc = link_tree(sub, dsub, path);
+			close(dsub);
+			if (rc)
+				break;
+		} else if (S_ISLNK(st.st_mode)) {
+			if ((len = readlinkat(sfd, de->d_name, buf,
+					sizeof(buf) - 1)) < 0)
+				continue;
+			buf[len] = '\0';
+			if (symlinkat(buf, dfd, de->d_name)) {
+				rc = vztt_error(VZT_SYSTEM, errno,
+					"symlink(%s)", de->d_name);
+				break;
+			}
+		} else if (linkat(sfd, de->d_name, dfd, de->d_name, 0)) {
+			rc = vztt_error(VZT_SYSTEM, errno,
+				"link(%s/%s)", path, de->d_name);
+			break;
+		}
+	}
+	closedir(dir);
+	return rc;
+}
+
+/* is <name> generation directory of entry <fp>: mkdtemp() suffix or
+   directory of previous version moved away by mdstore_commit() */
+static int is_generation(const char *name, const char *fp)
+{
+	const char *s;
+
+	if (strncmp(name, fp, MDSTORE_FP_LEN) || name[MDSTORE_FP_LEN] != '.')
+		return 0;
+	s = name + MDSTORE_FP_LEN + 1;
+	if (strncmp(s, "old.", 4) == 0)
+		return 1;
+	return strlen(s) == 6 && strchr(s, '.') == NULL;
+}
+
+/* try to lock generation <name> of store <sfd> exclusively and remove it */
+static int remove_generation(const char *tmpldir, int sfd, const char *name)
+{
+	char path[PATH_MAX+1];
+	char lock[NAME_MAX+1];
+	struct stat st;
+	int fd;
+
+	if (snprintf(lock, sizeof(lock), "%s" MDSTORE_GEN_LOCK, name) >=
+			(int)sizeof(lock))
+		return VZT_INTERNAL;
+	if ((fd = openat(sfd, lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		return VZT_CANT_OPEN;
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		/* it is read now */
+		close(fd);
+		return VZT_CANT_LOCK;
+	}
+	if (fstatat(sfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+			store_path(path, sizeof(path), tmpldir, name, "") == 0)
+		remove_directory(path);
+	unlinkat(sfd, lock, 0);
+	close(fd);
+	return 0;
+}
+
+/*
+remove generations of entry <fp> except current one (or all of them if
+<all> is set), if they are not locked by readers. Entry should be locked by
+mdstore_lock(), so there is no new generation which is not committed yet.
+Returns number of generations which are busy.
+*/
+static int gc_generations(const char *tmpldir, const char *fp, int all)
+{
+	char store[PATH_MAX+1];
+	char cur[NAME_MAX+1];
+	char name[NAME_MAX+1];
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	ssize_t len;
+	size_t n;
+	int sfd, busy = 0;
+
+	if (store_path(store, sizeof(store), tmpldir, "", ""))
+		return 0;
+	if ((sfd = open(store, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return 0;
+	if ((len = readlinkat(sfd, fp, cur, sizeof(cur) - 1)) < 0)
+		len = 0;
+	cur[len] = '\0';
+	if ((dir = fdopendir(sfd)) == NULL) {
+		close(sfd);
+		return 0;
+	}
+	while ((de = readdir(dir))) {
+		snprintf(name, sizeof(name), "%.*s", NAME_MAX, de->d_name);
+		n = strlen(name);
+		/* lock file of removed generation */
+		if (n > strlen(MDSTORE_GEN_LOCK) && strcmp(name + n -
+				strlen(MDSTORE_GEN_LOCK), MDSTORE_GEN_LOCK) == 0) {
+			name[n - strlen(MDSTORE_GEN_LOCK)] = '\0';
+			/* generation itself is processed separately */
+			if (fstatat(sfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+				continue;
+		}
+		if (!is_generation(name, fp) || strcmp(name, cur) == 0)
+			continue;
+		if (remove_generation(tmpldir, sfd, name))
+			busy++;
+	}
+	/* current generation is the last one */
+	if (all && cur[0] && busy == 0 && is_generation(cur, fp) &&
+			remove_generation(tmpldir, sfd, cur))
+		busy++;
+	closedir(dir);
+	return busy;
+}
+
+/*
+remove entry <fp> if no one template cache directory refers to it and
+nobody uses it now
+*/
+static void gc_entry(const char *tmpldir, const char *fp)
+{
+	char path[PATH_MAX+1];
+	char ref[PATH_MAX+1];
+	char buf[PATH_MAX+1];
+	char entry[PATH_MAX+1];
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	ssize_t len;
+	int fd, rfd, ffd;
+	int refs = 0;
+
+	if (store_path(entry, sizeof(entry), tmpldir, fp, ""))
+		return;
+	if (store_path(path, sizeof(path), tmpldir, fp, MDSTORE_STAMP))
+		return;
+	/* entry is updated or read by package manager now */
+	if (lock_stamp(path, LOCK_EX | LOCK_NB, &fd))
+		return;
+
+	/* drop stale references */
+	if (store_path(path, sizeof(path), tmpldir, fp, MDSTORE_REFS))
+		goto cleanup;
+	if ((rfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+		if ((dir = fdopendir(rfd)) == NULL) {
+			close(rfd);
+			goto cleanup;
+		}
+		while ((de = readdir(dir))) {
+			if (de->d_name[0] == '.')
+				continue;
+			len = -1;
+			if ((ffd = openat(rfd, de->d_name,
+					O_RDONLY | O_CLOEXEC)) != -1) {
+				len = read(ffd, ref, sizeof(ref) - 1);
+				close(ffd);
+			}
+			if (len > 0) {
+				ref[len] = '\0';
+				len = readlink(ref, buf, sizeof(buf) - 1);
+			}
+			if (len > 0) {
+				buf[len] = '\0';
+				if (strcmp(buf, entry) == 0) {
+					refs++;
+					continue;
+				}
+			}
+			unlinkat(rfd, de->d_name, 0);
+		}
+		closedir(dir);
+	}
+	if (refs)
+		goto cleanup;
+	if (gc_generations(tmpldir, fp, 1))
+		goto cleanup;
+
+	vztt_logger(2, 0, "Remove unused metadata %s", entry);
+	if (lstat(entry, &st) == 0) {
+		if (S_ISDIR(st.st_mode))
+			remove_directory(entry);
+		else
+			unlink(entry);
+	}
+	if (store_path(path, sizeof(path), tmpldir, fp, MDSTORE_REFS) == 0)
+		remove_directory(path);
+	if (store_path(path, sizeof(path), tmpldir, fp, MDSTORE_INDEX) == 0)
+		unlink(path);
+	if (store_path(path, sizeof(path), tmpldir, fp, MDSTORE_DOWNLOAD) == 0)
+		unlink(path);
+	if (store_path(path, sizeof(path), tmpldir, fp, MDSTORE_STAMP) == 0)
+		unlink(path);
+
+cleanup:
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+void mdstore_gc(const char *tmpldir)
+{
+	char store[PATH_MAX+1];
+	DIR *dir;
+	struct dirent *de;
+	size_t i;
+
+	if (store_path(store, sizeof(store), tmpldir, "", ""))
+		return;
+	if ((dir = opendir(store)) == NULL)
+		return;
+	while ((de = readdir(dir))) {
+		/* entry is <fp> */
+		for (i = 0; i < MDSTORE_FP_LEN; i++)
+			if (!isxdigit(de->d_name[i]))
+				break;
+		if (i == MDSTORE_FP_LEN && de->d_name[i] == '\0')
+			gc_entry(tmpldir, de->d_name);
+	}
+	closedir(dir);
+}
+
+int mdstore_begin(
+		const char *tmpldir,
+		const char *fp,
+		char *gen,
+		size_t size)
+{
+	char entry[PATH_MAX+1];
+	int sfd, dfd, rc;
+
+	gc_generations(tmpldir, fp, 0);
+
+	if ((rc = store_path(entry, sizeof(entry), tmpldir, fp, "")))
+		return rc;
+	if (snprintf(gen, size, "%s.XXXXXX", entry) >= (int)size)
+		return vztt_error(VZT_INTERNAL, 0, "Too long path %s", entry);
+	if (mkdtemp(gen) == NULL)
+		return vztt_error(VZT_CANT_CREATE, errno, "mkdtemp(%s)", gen);
+	chmod(gen, 0755);
+
+	if ((sfd = open(entry, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		/* new entry */
+		if (errno == ENOENT)
+			return 0;
+		rc = vztt_error(VZT_CANT_OPEN, errno, "open(%s)", entry);
+		rmdir(gen);
+		return rc;
+	}
+	if ((dfd = open(gen, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		rc = vztt_error(VZT_CANT_OPEN, errno, "open(%s)", gen);
+		close(sfd);
+		rmdir(gen);
+		return rc;
+	}
+	rc = link_tree(sfd, dfd, entry);
+	close(dfd);
+	if (rc)
+		remove_directory(gen);
+	return rc;
+}
+
+int mdstore_commit(const char *tmpldir, const char *fp, const char *gen)
+{
+	char entry[PATH_MAX+1];
+	char lnk[PATH_MAX+1];
+	char old[PATH_MAX+1];
+	const char *name;
+	struct stat st;
+	int rc;
+
+	if ((rc = store_path(entry, sizeof(entry), tmpldir, fp, "")))
+		return rc;
+	if (snprintf(lnk, sizeof(lnk), "%s.lnk.%d", entry, getpid()) >=
+			(int)sizeof(lnk))
+		return vztt_error(VZT_INTERNAL, 0, "Too long path %s", entry);
+	name = strrchr(gen, '/') ? strrchr(gen, '/') + 1 : gen;
+	unlink(lnk);
+	if (symlink(name, lnk))
+		return vztt_error(VZT_SYSTEM, errno, "symlink(%s, %s)", name, lnk);
+
+	if (lstat(entry, &st) == 0 && S_ISDIR(st.st_mode)) {
+		/* entry of previous version: directory can not be
+		   replaced by symlink atomically, move it away */
+		if (snprintf(old, sizeof(old), "%s.old.%d", entry, getpid()) >=
+				(int)sizeof(old)) {
+			unlink(lnk);
+			return vztt_error(VZT_INTERNAL, 0, "Too long path %s",
+				entry);
+		}
+		if (rename(entry, old)) {
+			rc = vztt_error(VZT_CANT_RENAME, errno,
+				"rename(%s, %s)", entry, old);
+			unlink(lnk);
+			return rc;
+		}
+	}
+	if (rename(lnk, entry)) {
+		rc = vztt_error(VZT_CANT_RENAME, errno,
+			"rename(%s, %s)", lnk, entry);
+		unlink(lnk);
+		return rc;
+	}
+
+	/* previous generation is removed when nobody reads it */
+	gc_generations(tmpldir, fp, 0);
+	return 0;
+}
+
+void mdstore_abort(const char *gen)
+{
+	char path[PATH_MAX+1];
+
+	remove_directory(gen);
+	snprintf(path, sizeof(path), "%s" MDSTORE_GEN_LOCK, gen);
+	unlink(path);
+}
+
+/* lock generation <gen> for reading, it is not removed until unlock */
+static int lock_generation(const char *gen, int *fd)
+{
+	char path[PATH_MAX+1];
+	struct stat st;
+
+	if (snprintf(path, sizeof(path), "%s" MDSTORE_GEN_LOCK, gen) >=
+			(int)sizeof(path))
+		return vztt_error(VZT_INTERNAL, 0, "Too long path %s", gen);
+	if ((*fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", path);
+	while (flock(*fd, LOCK_SH)) {
+		if (errno == EINTR)
+			continue;
+		close(*fd);
+		*fd = -1;
+		return vztt_error(VZT_CANT_LOCK, errno, "flock(%s)", path);
+	}
+	/* generation was removed before we got the lock */
+	if (stat(gen, &st)) {
+		close(*fd);
+		*fd = -1;
+		return VZT_FILE_NFOUND;
+	}
+	return 0;
+}
+
+int mdstore_read_lock(const char *cachedir, int **fds)
+{
+	int rc = 0, i, try;
+	size_t n = 0, size = 0;
+	int *p;
+	DIR *dir;
+	struct dirent *de;
+	char path[PATH_MAX+1];
+	char gen[PATH_MAX+1];
+	const char *name;
+
+	*fds = NULL;
+	if ((dir = opendir(cachedir)) == NULL)
+		return 0;
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (n + 2 > size) {
+			if ((p = (int *)realloc(*fds,
+					(size + 16) * sizeof(int))) == NULL) {
+				rc = vztt_error(VZT_CANT_ALLOC_MEM, errno,
+					"realloc()");
+				break;
+			}
+			*fds = p;
+			size += 16;
+		}
+		(*fds)[n] = -1;
+		snprintf(path, sizeof(path), "%s/%s", cachedir, de->d_name);
+		/* symlink is switched to new generation meanwhile */
+		for (try = 0, i = VZT_FILE_NFOUND; i == VZT_FILE_NFOUND &&
+				try < 10; try++) {
+			if (realpath(path, gen) == NULL)
+				break;
+			name = strrchr(gen, '/') + 1;
+			if (strlen(name) <= MDSTORE_FP_LEN ||
+					name[MDSTORE_FP_LEN] != '.')
+				break;
+			i = lock_generation(gen, &(*fds)[n]);
+		}
+		if (i && i != VZT_FILE_NFOUND) {
+			rc = i;
+			break;
+		}
+		if ((*fds)[n] != -1)
+			n++;
+	}
+	closedir(dir);
+	if (*fds)
+		(*fds)[n] = -1;
+	if (rc) {
+		mdstore_read_unlock(*fds);
+		*fds = NULL;
+	}
+	return rc;
+}
+
+void mdstore_read_unlock(int *fds)
+{
+	int *p;
+
+	if (fds == NULL)
+		return;
+	for (p = fds; *p != -1; p++)
+		close(*p);
+	free(fds);
+}
+
+int mdstore_download_lock(
+		const char *cachedir,
+		int progress_fd,
+		void ***lockdata)
+{
+	int rc = 0;
+	size_t i, n = 0, size = 0;
+	char **locks = NULL, **p;
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX+1];
+	char buf[PATH_MAX+1];
+	ssize_t len;
+
+	*lockdata = NULL;
+	if ((dir = opendir(cachedir)) == NULL)
+		return 0;
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cachedir, de->d_name);
+		if (lstat(path, &st))
+			continue;
+		if (S_ISLNK(st.st_mode)) {
+			/* shared entry: packages of all template areas */
+			if ((len = readlink(path, buf, sizeof(buf) - 1)) <= 0)
+				continue;
+			buf[len] = '\0';
+			len = snprintf(path, sizeof(path), "%s" MDSTORE_DOWNLOAD,
+				buf);
+		} else if (S_ISDIR(st.st_mode)) {
+			len = snprintf(path, sizeof(path), "%s/.%s" MDSTORE_DOWNLOAD,
+				cachedir, de->d_name);
+		} else {
+			continue;
+		}
+		if (len >= (ssize_t)sizeof(path)) {
+			rc = vztt_error(VZT_INTERNAL, 0, "Too long path %s", buf);
+			break;
+		}
+		if (n == size) {
+			if ((p = (char **)realloc(locks,
+					(size + 16) * sizeof(char *))) == NULL) {
+				rc = vztt_error(VZT_CANT_ALLOC_MEM, errno,
+					"realloc()");
+				break;
+			}
+			locks = p;
+			size += 16;
+		}
+		if ((locks[n] = strdup(path)) == NULL) {
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup()");
+			break;
+		}
+		n++;
+	}
+	closedir(dir);
+	if (rc || n == 0)
+		goto cleanup;
+
+	if ((*lockdata = (void **)calloc(n + 1, sizeof(void *))) == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+		goto cleanup;
+	}
+	/* the same order in all runs, each lock once */
+	qsort(locks, n, sizeof(char *), cmp_str);
+	for (i = 0, size = 0; i < n; i++) {
+		if (i && strcmp(locks[i], locks[i - 1]) == 0)
+			continue;
+		vztt_logger(3, 0, "Wait for downloads into %s", locks[i]);
+		if ((rc = download_lock(locks[i], &(*lockdata)[size],
+				progress_fd)))
+			break;
+		size++;
+	}
+	(*lockdata)[size] = NULL;
+	if (rc) {
+		mdstore_download_unlock(*lockdata);
+		*lockdata = NULL;
+	}
+
+cleanup:
+	for (i = 0; i < n; i++)
+		free(locks[i]);
+	free(locks);
+	return rc;
+}
+
+void mdstore_download_unlock(void **lockdata)
+{
+	void **p;
+
+	if (lockdata == NULL)
+		return;
+	/* in reverse order */
+	for (p = lockdata; *p; p++)
+		;
+	while (p-- > lockdata)
+		download_unlock(*p);
+	free(lockdata);
+}
@@ -47,6 +47,10 @@
 #include "tmplset.h"
 #include "config.h"
 #include "lock.h"
+#include "workqueue.h"
+
+/* max number of secondary templates which metadata are updated at once */
+#define METADATA_THREADS 4
 
 /* is metadata up2date? */
 int check_metadata(
@@ -135,20 +139,77 @@ static int copy_existed_app_metadata(
 	return -1;
 }
 
-/* update metadata for non-base os or app template */
-static int update_secondary_metadata(
+/* locks of metadata updater: metadata on write and template area on
+   read, so readers of template area are not blocked by update. Package
+   managers which update metadata in place lock template area on write */
+struct metadata_locks {
+	void *metadata;
+	void *area;
+	int area_level;
+};
+
+static int lock_metadata_update(
+	struct global_config *gc,
+	struct base_os_tmpl *base,
+	struct Transaction *to,
+	int flags,
+	int progress_fd,
+	struct metadata_locks *locks)
+{
+	int rc;
+	int level = (to->pm_is_metadata_staged &&
+		to->pm_is_metadata_staged(to)) ? LOCK_READ : LOCK_WRITE;
+
+	if (locks->metadata == NULL &&
+			(rc = metadata_lock(gc, base, LOCK_WRITE, flags,
+				&locks->metadata, progress_fd)))
+		return rc;
+	if (locks->area && (locks->area_level == LOCK_WRITE ||
+			level == LOCK_READ))
+		return 0;
+	/* template area is relocked on write under metadata lock */
+	if (locks->area) {
+		tmpl_unlock(locks->area, flags);
+		locks->area = NULL;
+	}
+	if ((rc = tmpl_lock(gc, base, level, flags, &locks->area,
+			progress_fd))) {
+		locks->area = NULL;
+		metadata_unlock(locks->metadata, flags);
+		locks->metadata = NULL;
+		return rc;
+	}
+	locks->area_level = level;
+	return 0;
+}
+
+static void unlock_metadata_update(struct metadata_locks *locks, int flags)
+{
+	if (locks->area)
+		tmpl_unlock(locks->area, flags);
+	if (locks->metadata)
+		metadata_unlock(locks->metadata, flags);
+	locks->area = NULL;
+	locks->metadata = NULL;
+}
+
+/* prepare metadata update for non-base os or app template:
+   create package manager wrapper in <to>, or set it to NULL
+   if metadata is up2date or was cloned from other template */
+static int prepare_secondary_metadata(
 	struct tmpl *tmpl,
 	struct global_config *gc,
 	struct vztt_config *tc,
 	struct tmpl_set *tmplset,
 	int mask,
-	void **lockdata,
-	struct options_vztt *opts_vztt)
+	struct metadata_locks *locks,
+	struct options_vztt *opts_vztt,
+	struct Transaction **to)
 {
 	int rc;
-	struct Transaction *to;
 	struct string_list ls;
 
+	*to = NULL;
 	if (repo_list_empty(&tmpl->repositories) &&
 			repo_list_empty(&tmpl->zypp_repositories) &&
 			repo_list_empty(&tmpl->mirrorlist))
@@ -164,37 +225,102 @@ static int update_secondary_metadata(
 		return rc;
 	if ((rc = tmplset_mark(tmplset, &ls, mask, NULL)))
 		goto cleanup_0;
-	if ((rc = pm_init(0, gc, tc, tmplset, opts_vztt, &to)))
-		goto cleanup_1;
-	if ((rc = pm_create_tmp_root(to)))
-		goto cleanup_2;
+	/* repositories are copied into wrapper, so marks are not needed
+	   after initialization */
+	rc = pm_init(0, gc, tc, tmplset, opts_vztt, to);
+	tmplset_unmark_all(tmplset);
+	if (rc) {
+		*to = NULL;
+		rc = 0;
+		goto cleanup_0;
+	}
 
 	/* it's for plesk app templates: they include the same repos 
 	in all templates. To avoid loading already loaded metadata,
 	seek repo set of this app template in alredy updated */
-	if (to->pm_clone_metadata && copy_existed_app_metadata(to, tmplset, tmpl) == 0)
-		goto cleanup_2;
+	if ((*to)->pm_clone_metadata &&
+			copy_existed_app_metadata(*to, tmplset, tmpl) == 0)
+		goto cleanup_1;
 
-	if (*lockdata == NULL) {
-		/* if can't lock - terminate all */
-		if ((rc = tmpl_lock(gc, tmplset->base, 
-				LOCK_WRITE, opts_vztt->flags, lockdata)))
-			goto cleanup_1;
-	}
-	vztt_logger(2, 0, "update metadata for %s", tmpl->name);
-	if (to->pm_update_metadata(to, tmpl->name))
-		vztt_logger(0, 0, 
-			"Can not update metadata for %s. Skipped.", tmpl->name);
+	/* if can't lock - terminate all */
+	if ((rc = lock_metadata_update(gc, tmplset->base, *to,
+			opts_vztt->flags, opts_vztt->progress_fd, locks)))
+		goto cleanup_1;
+	goto cleanup_0;
 
-cleanup_2:
-	pm_clean(to);
 cleanup_1:
-	tmplset_unmark_all(tmplset);
+	pm_clean(*to);
+	*to = NULL;
 cleanup_0:
 	string_list_clean(&ls);
+	return rc;
+}
+
+struct metadata_job {
+	struct Transaction *to;
+	const char *name;
+};
+
+static int update_secondary_metadata_job(void *data)
+{
+	struct metadata_job *job = (struct metadata_job *)data;
+	int rc;
+
+	if ((rc = pm_create_tmp_root(job->to)) == 0) {
+		vztt_logger(2, 0, "update metadata for %s", job->name);
+		rc = job->to->pm_update_metadata(job->to, job->name);
+	}
+	if (rc)
+		vztt_logger(0, 0, 
+			"Can not update metadata for %s. Skipped.", job->name);
+	free(job);
+	/* errors ignored */
 	return 0;
 }
 
+/* update metadata of prepared non-base os and app templates by pool
+   of threads: every wrapper has own temporary root, saving of metadata
+   is serialized by pm_save_metadata() */
+static int update_secondary_metadata(
+	struct Transaction **tos,
+	const char **names,
+	size_t n,
+	int nthreads)
+{
+	int rc, rc2;
+	size_t i;
+	struct workqueue *wq;
+	struct metadata_job *job;
+
+	if (n == 0)
+		return 0;
+	if (nthreads > (int)n)
+		nthreads = n;
+	if ((rc = workqueue_create(&wq, nthreads, 0)))
+		return rc;
+
+	for (i = 0; i < n; i++) {
+		if ((job = malloc(sizeof(*job))) == NULL) {
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+			break;
+		}
+		job->to = tos[i];
+		job->name = names[i];
+		if ((rc = workqueue_add(wq, update_secondary_metadata_job,
+				job, 0))) {
+			/* jobs do not fail, so job was not queued,
+			   its wrapper is cleaned by caller with others */
+			free(job);
+			break;
+		}
+	}
+
+	rc2 = workqueue_destroy(wq);
+	if (rc == 0)
+		rc = rc2;
+	return rc;
+}
+
 /* update OS and apps templates metadata
    ! lock template by request and unlock on exit
 */
@@ -205,10 +331,13 @@ int update_metadata(
 	struct options_vztt *opts_vztt)
 {
 	int rc = 0;
-	void *lockdata = NULL;
+	struct metadata_locks locks = { NULL, NULL, LOCK_READ };
+	size_t i, n = 0, size = 0;
 
 	struct tmpl_set *tmpl;
 	struct Transaction *to;
+	struct Transaction **tos = NULL;
+	const char **names = NULL;
 
 	struct os_tmpl_list_el *o;
 	struct app_tmpl_list_el *a;
@@ -239,8 +368,8 @@ int update_metadata(
 	/* load/update metadata from all repositories */
 	if (check_metadata(tmpl->base->basedir, tmpl->base->name, 
 			tc->metadata_expire, opts_vztt->data_source)) {
-		if ((rc = tmpl_lock(gc, tmpl->base, 
-				LOCK_WRITE, opts_vztt->flags, &lockdata)))
+		if ((rc = lock_metadata_update(gc, tmpl->base, to,
+				opts_vztt->flags, opts_vztt->progress_fd, &locks)))
 			goto cleanup_1;
 		vztt_logger(2, 0, "update metadata for %s", tmpl->base->name);
 		if ((rc = to->pm_update_metadata(to, tmpl->base->name)))
@@ -251,27 +380,58 @@ int update_metadata(
 	pm_clean(to);
 
 	/* step 2: update metadate for non-base os template
-	   if it have repositories/mirrorlist. Errors ignored. */
+	   if it have repositories/mirrorlist. Errors ignored.
+	   Templates are prepared one by one and then updated in parallel,
+	   apt uses common lists directory - so update it serially */
+	for (o = tmpl->oses.tqh_first; o != NULL; o = o->e.tqe_next)
+		size++;
+	for (a = tmpl->avail_apps.tqh_first; a != NULL; a = a->e.tqe_next)
+		size++;
+	if (size == 0)
+		goto cleanup_0;
+	tos = (struct Transaction **)calloc(size, sizeof(*tos));
+	names = (const char **)calloc(size, sizeof(*names));
+	if (tos == NULL || names == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+		goto cleanup_2;
+	}
+
 	for (o = tmpl->oses.tqh_first; o != NULL; o = o->e.tqe_next) {
-		if ((rc = update_secondary_metadata((struct tmpl *)o->tmpl, gc, tc, 
-				tmpl, TMPLSET_MARK_OS_LIST, &lockdata, opts_vztt)))
-			goto cleanup_0;
+		if ((rc = prepare_secondary_metadata((struct tmpl *)o->tmpl,
+				gc, tc, tmpl, TMPLSET_MARK_OS_LIST, &locks,
+				opts_vztt, &tos[n])))
+			goto cleanup_2;
+		if (tos[n])
+			names[n++] = o->tmpl->name;
 	}
 
 	/* load available application template list */
 	for (a = tmpl->avail_apps.tqh_first; a != NULL; a = a->e.tqe_next) {
-		if ((rc = update_secondary_metadata((struct tmpl *)a->tmpl, gc, tc, 
-			tmpl, TMPLSET_MARK_AVAIL_APP_LIST, &lockdata, opts_vztt)))
-			goto cleanup_0;
+		if ((rc = prepare_secondary_metadata((struct tmpl *)a->tmpl,
+				gc, tc, tmpl, TMPLSET_MARK_AVAIL_APP_LIST,
+				&locks, opts_vztt, &tos[n])))
+			goto cleanup_2;
+		if (tos[n])
+			names[n++] = a->tmpl->name;
 	}
+
+	rc = update_secondary_metadata(tos, names, n,
+		PACKAGE_MANAGER_IS_DPKG(tmpl->base->package_manager) ?
+			1 : METADATA_THREADS);
+
+cleanup_2:
+	/* remove temporary dirs */
+	for (i = 0; i < n; i++)
+		pm_clean(tos[i]);
+	free(tos);
+	free(names);
 	goto cleanup_0;
 
 cleanup_1:
 	/* remove temporary dir */
 	pm_clean(to);
 cleanup_0:
-	if (lockdata)
-		tmpl_unlock(lockdata, opts_vztt->flags);
+	unlock_metadata_update(&locks, opts_vztt->flags);
 	tmplset_clean(tmpl);
 
 	return rc;
@@ -49,6 +49,11 @@
 #include "config.h"
 #include "lock.h"
 #include "progress_messages.h"
+#include "workqueue.h"
+#include "mdstore.h"
+
+/* number of concurrent package manager runs in vztt2_fetch_separately() */
+#define FETCH_THREADS 4
 
 /* get VE status - up2date or not */
 int vztt_get_ve_status(
@@ -77,6 +82,7 @@ int vztt2_get_ve_status(
 	void *lockdata;
 
 	struct package_list installed;
+	struct arena arena;
 
 	struct ve_config vc;
 	struct global_config gc;
@@ -94,7 +100,8 @@ int vztt2_get_ve_status(
 	vztt_config_init(&tc);
 	ve_config_init(&vc);
 	string_list_init(&ls);
-	package_list_init(&installed);
+	arena_init(&arena);
+	package_list_init_arena(&installed, &arena);
 
 	/* read global vz config */
 	if ((rc = global_config_read(&gc, opts_vztt)))
@@ -139,7 +146,8 @@ int vztt2_get_ve_status(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_1;
 
 	/* get list of installed into ve templates with repositories */
@@ -206,12 +214,14 @@ static int is_cache_tarball_up2date(
 
 	/* list of packages installed in VE */
 	struct package_list installed;
+	struct arena arena;
 	struct Transaction *to;
 	struct string_list ls;
 
 
 	string_list_init(&ls);
-	package_list_init(&installed);
+	arena_init(&arena);
+	package_list_init_arena(&installed, &arena);
 
 	/* create & init package manager wrapper */
 	if ((rc = pm_init(0, gc, tc, tmpl, opts_vztt, &to)))
@@ -226,7 +236,8 @@ static int is_cache_tarball_up2date(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_0;
 
 	if ((rc = tmplset_get_repos(tmpl, &ls)))
@@ -643,7 +654,8 @@ int vztt2_fetch(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_1;
 	/* start of processing */
 	rc = to->pm_action(to, VZPKG_FETCH, &args);
@@ -664,67 +676,163 @@ cleanup_0:
 	return rc;
 }
 
+/* fetch of one template, planned by plan_fetch() */
+struct fetch_job {
+	char *name;
+	/* packages of this template, not planned by previous templates */
+	struct string_list packages;
+	struct Transaction *to;
+	int rc;
+	int skipped;
+	/* set by first failed job, NULL if fetch should be continued
+	   after errors */
+	int *stop;
+	int progress_fd;
+};
+
+struct fetch_ref {
+	char *name;
+	size_t job;
+};
+
+static int cmp_fetch_ref(const void *a, const void *b)
+{
+	const struct fetch_ref *r1 = (const struct fetch_ref *)a;
+	const struct fetch_ref *r2 = (const struct fetch_ref *)b;
+	int rc;
+
+	if ((rc = strcmp(r1->name, r2->name)))
+		return rc;
+	return (r1->job > r2->job) - (r1->job < r2->job);
+}
+
 /*
- Fetch packages for one template
+ Collect packages of every template and assign each package to the first
+ template which requires it, so packages of base OS template are fetched
+ once instead of once per OS and app template.
 */
-static int fetch_one_template(
-	char *template,
-	struct global_config *gc,
-	struct vztt_config *tc,
+static int plan_fetch(
 	struct tmpl_set *tmpl,
-	struct options_vztt *opts_vztt)
+	struct fetch_job *jobs,
+	size_t n)
 {
 	int rc = 0;
-	struct Transaction *to;
-
-	/* list for one template */
+	size_t i, j, count = 0;
+	struct string_list *all;
 	struct string_list ls;
-	/* list of transaction packages */
-	struct string_list packages;
-	char progress_stage[PATH_MAX];
+	struct string_list_el *p;
+	struct fetch_ref *refs = NULL;
 
-	snprintf(progress_stage, sizeof(progress_stage),
-		PROGRESS_FETCH_TEMPLATE, template);
-	progress(progress_stage, 0, opts_vztt->progress_fd);
+	if ((all = calloc(n, sizeof(*all))) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	for (i = 0; i < n; i++)
+		string_list_init(&all[i]);
 
-	/* struct initialization: should be first block */
-	string_list_init(&ls);
-	string_list_init(&packages);
-
-	/* select only OS, only app or both */
-	string_list_add(&ls, template);
-	if ((rc = tmplset_mark(tmpl, &ls,
-			TMPLSET_MARK_OS | \
-			TMPLSET_MARK_OS_LIST | \
-			TMPLSET_MARK_AVAIL_APP_LIST,
-			NULL)))
-		goto cleanup_0;
+	for (i = 0; i < n; i++) {
+		string_list_init(&ls);
+		if ((rc = string_list_add(&ls, jobs[i].name)))
+			goto cleanup;
+		rc = tmplset_mark(tmpl, &ls, TMPLSET_MARK_OS | \
+			TMPLSET_MARK_OS_LIST | TMPLSET_MARK_AVAIL_APP_LIST, NULL);
+		string_list_clean(&ls);
+		if (rc)
+			goto cleanup;
+		rc = tmplset_get_marked_pkgs(tmpl, &all[i]);
+		tmplset_unmark_all(tmpl);
+		if (rc)
+			goto cleanup;
+		count += string_list_size(&all[i]);
+	}
 
-	if ((rc = tmplset_get_marked_pkgs(tmpl, &packages)))
-		goto cleanup_1;
+	if (count == 0)
+		goto cleanup;
+	if ((refs = malloc(count * sizeof(*refs))) == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+		goto cleanup;
+	}
+	for (i = 0, j = 0; i < n; i++) {
+		string_list_for_each(&all[i], p) {
+			refs[j].name = p->s;
+			refs[j++].job = i;
+		}
+	}
+	qsort(refs, count, sizeof(*refs), cmp_fetch_ref);
 
-	/* create & init package manager wrapper */
-	if ((rc = pm_init(0, gc, tc, tmpl, opts_vztt, &to)))
-		goto cleanup_1;
+	for (j = 0; j < count; j++) {
+		if (j && strcmp(refs[j].name, refs[j - 1].name) == 0)
+			continue;
+		if ((rc = string_list_add(&jobs[refs[j].job].packages,
+				refs[j].name)))
+			goto cleanup;
+	}
 
-	/* prepare transaction for packages downloading */
-	if ((rc = pm_create_tmp_root(to)))
-		goto cleanup_2;
+cleanup:
+	free(refs);
+	for (i = 0; i < n; i++)
+		string_list_clean(&all[i]);
+	free(all);
+	return rc;
+}
 
-	/* start of processing */
-	rc = to->pm_action(to, VZPKG_FETCH, &packages);
+/* create package manager wrapper for planned template */
+static int init_fetch_job(
+	struct fetch_job *job,
+	struct global_config *gc,
+	struct vztt_config *tc,
+	struct tmpl_set *tmpl,
+	struct options_vztt *opts_vztt)
+{
+	int rc;
+	struct string_list ls;
 
-cleanup_2:
-	pm_clean(to);
-cleanup_1:
+	string_list_init(&ls);
+	if ((rc = string_list_add(&ls, job->name)))
+		return rc;
+	if ((rc = tmplset_mark(tmpl, &ls, TMPLSET_MARK_OS | \
+			TMPLSET_MARK_OS_LIST | TMPLSET_MARK_AVAIL_APP_LIST, NULL)))
+		goto cleanup;
+	/* repositories are copied into wrapper, so marks are not needed
+	   after initialization */
+	if ((rc = pm_init(0, gc, tc, tmpl, opts_vztt, &job->to)))
+		job->to = NULL;
 	tmplset_unmark_all(tmpl);
-cleanup_0:
-	string_list_clean(&packages);
+cleanup:
 	string_list_clean(&ls);
+	return rc;
+}
 
-	progress(progress_stage, 100, opts_vztt->progress_fd);
+/*
+ Fetch packages of one planned template. Argument is owned by caller,
+ which reads result from it.
+*/
+static int fetch_template_job(void *data)
+{
+	struct fetch_job *job = (struct fetch_job *)data;
+	char progress_stage[PATH_MAX];
 
-	return rc;
+	if (job->to == NULL)
+		return 0;
+	if (job->stop && __sync_fetch_and_add(job->stop, 0)) {
+		job->skipped = 1;
+		return 0;
+	}
+
+	snprintf(progress_stage, sizeof(progress_stage),
+		PROGRESS_FETCH_TEMPLATE, job->name);
+	progress(progress_stage, 0, job->progress_fd);
+
+	vztt_logger(2, 0, "Fetch %s", job->name);
+	if ((job->rc = pm_create_tmp_root(job->to)) == 0)
+		job->rc = job->to->pm_action(job->to, VZPKG_FETCH,
+				&job->packages);
+	if (job->rc) {
+		vztt_logger(0, 0, "Can not fetch packages for %s", job->name);
+		if (job->stop)
+			__sync_lock_test_and_set(job->stop, 1);
+	}
+
+	progress(progress_stage, 100, job->progress_fd);
+	return 0;
 }
 
 /*
@@ -751,12 +859,15 @@ int vztt_fetch_separately(char *ostemplate,
 int vztt2_fetch_separately(char *ostemplate,
 		struct options_vztt *opts_vztt)
 {
-	int rc;
+	int rc, rc2, stop = 0, nthreads;
+	size_t i, n = 0, failed = 0, skipped = 0;
 	struct global_config gc;
 	struct vztt_config tc;
 	struct tmpl_set *tmpl;
 	struct os_tmpl_list_el *o;
 	struct app_tmpl_list_el *a;
+	struct fetch_job *jobs = NULL;
+	struct workqueue *wq;
 	void *lockdata;
 
 	/* struct initialization: should be first block */
@@ -783,35 +894,97 @@ int vztt2_fetch_separately(char *ostemplate,
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_1;
-	if (opts_vztt->templates & OPT_TMPL_OS) {
-		vztt_logger(2, 0, "Fetch %s base ostemplate", tmpl->base->name);
-		if ((rc = fetch_one_template(tmpl->base->name,
-				&gc, &tc, tmpl, opts_vztt)) &&
-				!(opts_vztt->flags & OPT_VZTT_FORCE))
-			goto cleanup_2;
 
-		for (o = tmpl->oses.tqh_first; o != NULL; o = o->e.tqe_next) {
-			vztt_logger(2, 0, "Fetch %s ostemplate", o->tmpl->name);
-			if ((rc = fetch_one_template(o->tmpl->name,
-					&gc, &tc, tmpl, opts_vztt))
-					&& !(opts_vztt->flags & OPT_VZTT_FORCE))
-				goto cleanup_2;
-
-		}
+	/* base template goes first: its packages are required by all
+	   other templates */
+	i = 1;
+	for (o = tmpl->oses.tqh_first; o != NULL; o = o->e.tqe_next)
+		i++;
+	for (a = tmpl->avail_apps.tqh_first; a != NULL; a = a->e.tqe_next)
+		i++;
+	if ((jobs = calloc(i, sizeof(*jobs))) == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+		goto cleanup_2;
+	}
+	if (opts_vztt->templates & OPT_TMPL_OS) {
+		jobs[n++].name = tmpl->base->name;
+		for (o = tmpl->oses.tqh_first; o != NULL; o = o->e.tqe_next)
+			jobs[n++].name = o->tmpl->name;
 	}
 	if (opts_vztt->templates & OPT_TMPL_APP) {
 		for (a = tmpl->avail_apps.tqh_first; a != NULL;
-				a = a->e.tqe_next){
-			vztt_logger(2, 0, "Fetch %s apptemplate", a->tmpl->name);
-			if ((rc = fetch_one_template(a->tmpl->name,
-					&gc, &tc, tmpl, opts_vztt))
-					&& !(opts_vztt->flags & OPT_VZTT_FORCE))
-				goto cleanup_2;
+				a = a->e.tqe_next)
+			jobs[n++].name = a->tmpl->name;
+	}
+	for (i = 0; i < n; i++) {
+		string_list_init(&jobs[i].packages);
+		jobs[i].stop = (opts_vztt->flags & OPT_VZTT_FORCE) ? NULL : &stop;
+		jobs[i].progress_fd = opts_vztt->progress_fd;
+	}
+
+	if ((rc = plan_fetch(tmpl, jobs, n)))
+		goto cleanup_3;
+
+	for (i = 0; i < n; i++) {
+		if (string_list_empty(&jobs[i].packages)) {
+			vztt_logger(2, 0, "All packages of %s are fetched "
+				"with previous templates", jobs[i].name);
+			continue;
+		}
+		if ((jobs[i].rc = init_fetch_job(&jobs[i],
+				&gc, &tc, tmpl, opts_vztt)) &&
+				!(opts_vztt->flags & OPT_VZTT_FORCE)) {
+			rc = jobs[i].rc;
+			goto cleanup_3;
 		}
 	}
 
+	/* fetch base template alone to get its packages into cache before
+	   other templates, which require the same dependencies */
+	if (n) {
+		fetch_template_job(&jobs[0]);
+		/* apt runs download into own stages of shared cache, see
+		   pkgcache.h, yum runs wait for each other on download locks
+		   of shared repositories, see mdstore_download_lock() */
+		nthreads = FETCH_THREADS;
+		if (nthreads > (int)n)
+			nthreads = n;
+		if ((rc = workqueue_create(&wq, nthreads, 0)))
+			goto cleanup_3;
+		for (i = 1; i < n; i++)
+			if ((rc = workqueue_add(wq, fetch_template_job,
+					&jobs[i], 0)))
+				break;
+		rc2 = workqueue_destroy(wq);
+		if (rc == 0)
+			rc = rc2;
+		if (rc)
+			goto cleanup_3;
+	}
+
+	/* the first failed template defines the result */
+	for (i = 0; i < n; i++) {
+		if (jobs[i].skipped) {
+			skipped++;
+		} else if (jobs[i].rc) {
+			if (failed++ == 0)
+				rc = jobs[i].rc;
+		}
+	}
+	if (failed || skipped)
+		vztt_logger(1, 0, "Can not fetch packages for %zu of %zu "
+			"templates, %zu skipped", failed + skipped, n, skipped);
+
+cleanup_3:
+	for (i = 0; i < n; i++) {
+		if (jobs[i].to)
+			pm_clean(jobs[i].to);
+		string_list_clean(&jobs[i].packages);
+	}
+	free(jobs);
 cleanup_2:
 	tmpl_unlock(lockdata, opts_vztt->flags);
 cleanup_1:
@@ -819,7 +992,7 @@ cleanup_1:
 cleanup_0:
 	global_config_clean(&gc);
 	vztt_config_clean(&tc);
-	return 0;
+	return rc;
 }
 
 
@@ -1479,7 +1652,8 @@ int vztt2_remove_os_template(char *arg, struct options_vztt *opts_vztt)
 
 	/* lock OS template */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_WRITE, opts_vztt->flags, &lockdata)))
+			LOCK_WRITE, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_2;
 
 	/* remove rpm, provides this template */
@@ -1491,6 +1665,8 @@ int vztt2_remove_os_template(char *arg, struct options_vztt *opts_vztt)
 			/* ok, we removed base template just now,
 			and remove template area too */
 			remove_directory(tmpl->base->basedir);
+			/* shared metadata of its repositories */
+			mdstore_gc(gc.template_dir);
 		} else {
 			if (access(tmpl->os->confdir, F_OK) == 0)
 				remove_directory(tmpl->os->confdir);
@@ -1705,7 +1881,8 @@ int vztt2_remove_app_template(char *app, struct options_vztt *opts_vztt)
 
 	/* lock base OS template */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_WRITE, opts_vztt->flags, &lockdata)))
+			LOCK_WRITE, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_2;
 
 	/* remove rpm, provides this template */
@@ -1758,7 +1935,7 @@ int vztt_lock_ostemplate(const char *ostemplate, void **lockdata)
 		return rc;
 
        	/* lock all template area */
-	rc = tmpl_lock(&gc, tmpl->base, LOCK_READ, 0, lockdata);
+	rc = tmpl_lock(&gc, tmpl->base, LOCK_READ, 0, lockdata, 0);
 
 	tmplset_clean(tmpl);
 	global_config_clean(&gc);
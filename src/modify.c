@@ -48,160 +48,246 @@
 #include "lock.h"
 #include "appcache.h"
 #include "progress_messages.h"
+#include "workqueue.h"
 
-/* install/update/remove packages set <packages> in VE <veid> */
-static int cmd_modify(
-	int cmd,
-	const char *ctid,
-	char *packages[],
-	size_t size,
-	struct package ***pkg_added,
-	struct package ***pkg_removed,
-	struct options_vztt *opts_vztt)
-{
-	int rc = 0;
-	size_t i;
-	struct sigaction act;
-	struct sigaction act_int;
-	void *lockdata, *velockdata;
+/* number of concurrent VE transactions in batch operations by default */
+#define MODIFY_THREADS 4
 
-	struct package_list existed;
-	struct package_list removed;
-	struct package_list added;
-
-	struct string_list args;
-	struct string_list apps;
+/* templates set shared by VEs of batch operation with the same os
+   template and app templates list: it is loaded and marked once and
+   is read-only during transactions */
+struct modify_tmpl {
+	const char *ostemplate;
+	struct string_list *templates;
+	struct tmpl_set *tmpl;
+	int rc;
+};
+
+/* package operation in one VE */
+struct modify_ve {
+	int cmd;
+	const char *ctid;
+	struct global_config *gc;
+	struct vztt_config *tc;
+	struct options_vztt *opts_vztt;
 
-	struct global_config gc;
-	struct vztt_config tc;
 	struct ve_config vc;
-
 	struct tmpl_set *tmpl;
+	/* owner of <tmpl> if it is shared, NULL for private one */
+	struct modify_tmpl *shared;
 	struct Transaction *to;
 
-	progress(PROGRESS_MODIFY, 0, opts_vztt->progress_fd);
+	struct package_list existed;
+	struct package_list removed;
+	struct package_list added;
+	struct string_list args;
 
-	/* struct initialization: should be first block */
-	global_config_init(&gc);
-	vztt_config_init(&tc);
-	ve_config_init(&vc);
-	package_list_init(&existed);
-	package_list_init(&removed);
-	package_list_init(&added);
-	string_list_init(&args);
-	string_list_init(&apps);
+	/* output arrays, may be NULL */
+	struct package ***pkg_added;
+	struct package ***pkg_removed;
+	int rc;
+};
 
-	/* read global vz config */
-	if ((rc = global_config_read(&gc, opts_vztt)))
-		return rc;
+static void modify_ve_init(
+	struct modify_ve *m,
+	int cmd,
+	const char *ctid,
+	struct global_config *gc,
+	struct vztt_config *tc,
+	struct options_vztt *opts_vztt)
+{
+	m->cmd = cmd;
+	m->ctid = ctid;
+	m->gc = gc;
+	m->tc = tc;
+	m->opts_vztt = opts_vztt;
+	ve_config_init(&m->vc);
+	m->tmpl = NULL;
+	m->shared = NULL;
+	m->to = NULL;
+	package_list_init(&m->existed);
+	package_list_init(&m->removed);
+	package_list_init(&m->added);
+	string_list_init(&m->args);
+	m->pkg_added = NULL;
+	m->pkg_removed = NULL;
+	m->rc = 0;
+}
 
-	/* read vztt config */
-	if ((rc = vztt_config_read(gc.template_dir, &tc)))
-		return rc;
+static void modify_ve_clean(struct modify_ve *m)
+{
+	/* cleanup without exit */
+	if (m->to)
+		pm_clean(m->to);
+	if (m->tmpl && m->shared == NULL)
+		tmplset_clean(m->tmpl);
+	m->to = NULL;
+	m->tmpl = NULL;
+	m->shared = NULL;
+
+	package_list_clean(&m->existed);
+	package_list_clean(&m->removed);
+	package_list_clean(&m->added);
+	string_list_clean(&m->args);
+	ve_config_clean(&m->vc);
+}
 
-	if ((rc = check_n_load_ve_config(ctid,
-			(opts_vztt->flags & OPT_VZTT_TEST) ?
+/* read VE config */
+static int modify_ve_config(struct modify_ve *m)
+{
+	return check_n_load_ve_config(m->ctid,
+			(m->opts_vztt->flags & OPT_VZTT_TEST) ?
 			ENV_STATUS_MOUNTED : ENV_STATUS_RUNNING,
-			&gc, &vc)))
-		return rc;
+			m->gc, &m->vc);
+}
+
+/* load os template of VE in configs directory and mark its templates */
+static int modify_ve_load(struct modify_ve *m)
+{
+	int rc;
 
 	/* load corresponding os template in configs directory */
-	if ((rc = tmplset_load(gc.template_dir, vc.ostemplate, &vc.templates, \
-			TMPLSET_LOAD_APP_LIST, &tmpl, opts_vztt->flags)))
+	if ((rc = tmplset_load(m->gc->template_dir, m->vc.ostemplate,
+			&m->vc.templates, TMPLSET_LOAD_APP_LIST, &m->tmpl,
+			m->opts_vztt->flags))) {
+		m->tmpl = NULL;
 		return rc;
+	}
 
 	/* Check for pkg operations allowed */
-	if (tmpl->base->no_pkgs_actions || tmpl->os->no_pkgs_actions) {
+	if (m->tmpl->base->no_pkgs_actions || m->tmpl->os->no_pkgs_actions) {
 		vztt_logger(0, 0, "The OS template this Container is based " \
 			"on does not support operations with packages.");
-		rc = VZT_TMPL_PKGS_OPS_NOT_ALLOWED;
-		goto cleanup_0;
+		return VZT_TMPL_PKGS_OPS_NOT_ALLOWED;
 	}
 
-	/* check & update metadata */
-	if ((rc = update_metadata(vc.ostemplate, &gc, &tc, opts_vztt)))
-		goto cleanup_0;
-
 	/* this mark will use for get_urls only */
-	if ((rc = tmplset_mark(tmpl, &vc.templates, \
-			TMPLSET_MARK_OS|TMPLSET_MARK_USED_APP_LIST, NULL)))
-		goto cleanup_0;
+	return tmplset_mark(m->tmpl, &m->vc.templates, \
+			TMPLSET_MARK_OS|TMPLSET_MARK_USED_APP_LIST, NULL);
+}
+
+/* create package manager wrapper for VE with updated metadata */
+static int modify_ve_prepare(
+	struct modify_ve *m,
+	char *packages[],
+	size_t size)
+{
+	int rc;
+	size_t i;
 
 	/* create & init package manager wrapper */
-	if ((rc = pm_init(ctid, &gc, &tc, tmpl, opts_vztt, &to)))
-		goto cleanup_0;
+	if ((rc = pm_init(m->ctid, m->gc, m->tc, m->tmpl, m->opts_vztt,
+			&m->to))) {
+		m->to = NULL;
+		return rc;
+	}
 
-	if ((rc = pm_set_root_dir(to, vc.ve_root)))
-		goto cleanup_1;
+	if ((rc = pm_set_root_dir(m->to, m->vc.ve_root)))
+		return rc;
 
 	/* use only local (per-VE) veformat from VE private */
-	if ((rc = pm_set_veformat(to, vc.veformat)))
-		goto cleanup_1;
+	if ((rc = pm_set_veformat(m->to, m->vc.veformat)))
+		return rc;
 
 	/* add global custom exclude */
-	if ((rc = pm_add_exclude(to, tc.exclude)))
-		goto cleanup_1;
+	if ((rc = pm_add_exclude(m->to, m->tc->exclude)))
+		return rc;
 	/* add per_VE exclude */
-	if ((rc = pm_add_exclude(to, vc.exclude)))
-		goto cleanup_1;
+	if ((rc = pm_add_exclude(m->to, m->vc.exclude)))
+		return rc;
 
 	for (i = 0; i < size; i++)
-		string_list_add(&args, packages[i]);
-
+		string_list_add(&m->args, packages[i]);
 
 	/* Get installed vz packages list */
-	if ((rc = pm_get_installed_vzpkg(to, vc.ve_private, &existed))) {
+	if ((rc = pm_get_installed_vzpkg(m->to, m->vc.ve_private,
+			&m->existed))) {
 		if (rc != VZT_CANT_OPEN)
-			goto cleanup_1;
+			return rc;
 		/* Recreate vzpackages if missing */
-		if ((rc = vztt2_sync_vzpackages(ctid, opts_vztt)))
-			goto cleanup_1;
-		if ((rc = pm_get_installed_vzpkg(to, vc.ve_private, &existed)))
-			goto cleanup_1;
+		if ((rc = vztt2_sync_vzpackages(m->ctid, m->opts_vztt)))
+			return rc;
+		if ((rc = pm_get_installed_vzpkg(m->to, m->vc.ve_private,
+				&m->existed)))
+			return rc;
 	}
-	/* lock VE */
-	if ((rc = lock_ve(ctid, opts_vztt->flags, &velockdata)))
-		goto cleanup_1;
+	return 0;
+}
 
-	/* ignore SIGINT */
-	sigaction(SIGINT, NULL, &act_int);
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = 0;
-	act.sa_handler = SIG_IGN;
-	sigaction(SIGINT, &act, NULL);
+/* check app templates of VE after packages install/remove:
+   tmplset_check_apps() changes used app templates list of set, so
+   shared set is checked via its copy with own list */
+static int modify_ve_check_apps(struct modify_ve *m, struct string_list *apps)
+{
+	int rc = 0;
+	struct tmpl_set t;
+	struct app_tmpl_list_el *a;
+
+	if (m->shared == NULL)
+		return tmplset_check_apps(m->tmpl, m->to, m->vc.ve_private,
+			&m->existed, apps);
+
+	t = *m->tmpl;
+	app_tmpl_list_init(&t.used_apps);
+	app_tmpl_list_for_each(&m->tmpl->used_apps, a)
+		if ((rc = app_tmpl_list_add(&t.used_apps, a->tmpl)))
+			goto cleanup;
+	tmplset_check_apps(&t, m->to, m->vc.ve_private, &m->existed, apps);
+cleanup:
+	app_tmpl_list_clean(&t.used_apps);
+	return rc;
+}
+
+/* run prepared transaction in VE and save its results,
+   SIGINT should be ignored or handled by caller */
+static int modify_ve_run(struct modify_ve *m)
+{
+	int rc = 0;
+	void *lockdata, *velockdata;
+	struct string_list apps;
+	struct options_vztt *opts_vztt = m->opts_vztt;
+
+	string_list_init(&apps);
+
+	/* lock VE */
+	if ((rc = lock_ve(m->ctid, opts_vztt->flags, &velockdata)))
+		return rc;
 
 	/* lock template area on read */
-	if ((rc = tmpl_lock(&gc, tmpl->base, 
-			LOCK_READ, opts_vztt->flags, &lockdata)))
-		goto cleanup_3;
-	switch(cmd) {
+	if ((rc = tmpl_lock(m->gc, m->tmpl->base,
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
+		goto cleanup_0;
+	switch(m->cmd) {
 		case VZPKG_INSTALL:
 			/* Install packages into VE */
-			if ((rc = pm_modify(to, VZPKG_INSTALL, &args, \
-					&added, &removed)))
-				goto cleanup_4;
+			if ((rc = pm_modify(m->to, VZPKG_INSTALL, &m->args, \
+					&m->added, &m->removed)))
+				goto cleanup_1;
 			break;
 		case VZPKG_UPDATE:
 			/* Call pre-update script */
 			if (!(opts_vztt->flags & OPT_VZTT_TEST)) {
-				if ((rc = tmplset_run_ve_scripts(tmpl, ctid, vc.ve_root, \
-						"pre-update", 0, opts_vztt->progress_fd)))
-					goto cleanup_4;
+				if ((rc = tmplset_run_ve_scripts(m->tmpl, m->ctid,
+						m->vc.ve_root, "pre-update", 0,
+						opts_vztt->progress_fd)))
+					goto cleanup_1;
 			}
 
 			/* Install packages into VE */
-			if (string_list_empty(&args))
-				string_list_add(&args, "*");
+			if (string_list_empty(&m->args))
+				string_list_add(&m->args, "*");
 
-			if ((rc = pm_modify(to, VZPKG_UPDATE, &args, \
-					&added, &removed)))
-				goto cleanup_4;
+			if ((rc = pm_modify(m->to, VZPKG_UPDATE, &m->args, \
+					&m->added, &m->removed)))
+				goto cleanup_1;
 
 			/* Call post-update script */
 			if (!(opts_vztt->flags & OPT_VZTT_TEST)) {
-				if ((rc = tmplset_run_ve_scripts(tmpl, ctid, vc.ve_root, \
-						"post-update", 0, opts_vztt->progress_fd)))
-					goto cleanup_4;
+				if ((rc = tmplset_run_ve_scripts(m->tmpl, m->ctid,
+						m->vc.ve_root, "post-update", 0,
+						opts_vztt->progress_fd)))
+					goto cleanup_1;
 			}
 			break;
 		case VZPKG_REMOVE: {
@@ -210,86 +296,351 @@ static int cmd_modify(
 			progress(PROGRESS_REMOVE_PACKAGES, 0, opts_vztt->progress_fd);
 			package_list_init(&installed);
 			/* Get installed packages list */
-			if ((rc = to->pm_get_install_pkg(to, &installed)))
-				goto cleanup_4;
+			if ((rc = m->to->pm_get_install_pkg(m->to, &installed)))
+				goto cleanup_1;
 
 			/* Remove packages from VE */
-			if ((rc = to->pm_remove_pkg(to, &args, \
-					&installed, &removed)))
-				goto cleanup_4;
+			if ((rc = m->to->pm_remove_pkg(m->to, &m->args, \
+					&installed, &m->removed)))
+				goto cleanup_1;
 			package_list_clean(&installed);
 			progress(PROGRESS_REMOVE_PACKAGES, 100, opts_vztt->progress_fd);
 			break;
 		}
 		case VZPKG_GROUPINSTALL:
 			/* Install groups of packages into VE */
-			if ((rc = pm_modify(to, VZPKG_GROUPINSTALL, &args, &added, &removed)))
-				goto cleanup_4;
+			if ((rc = pm_modify(m->to, VZPKG_GROUPINSTALL, &m->args,
+					&m->added, &m->removed)))
+				goto cleanup_1;
 			break;
 		case VZPKG_GROUPUPDATE:
 			/* Update groups of packages in VE */
-			if ((rc = pm_modify(to, VZPKG_GROUPUPDATE, &args, &added, &removed)))
-				goto cleanup_4;
+			if ((rc = pm_modify(m->to, VZPKG_GROUPUPDATE, &m->args,
+					&m->added, &m->removed)))
+				goto cleanup_1;
 			break;
 		case VZPKG_GROUPREMOVE:
 			/* Remove groups of packages from VE */
-			if ((rc = pm_modify(to, VZPKG_GROUPREMOVE, &args, &added, &removed)))
-				goto cleanup_4;
+			if ((rc = pm_modify(m->to, VZPKG_GROUPREMOVE, &m->args,
+					&m->added, &m->removed)))
+				goto cleanup_1;
 			break;
 	}
 	tmpl_unlock(lockdata, opts_vztt->flags);
 
 	/* fill output packages arrays */
-	if (pkg_added)
-		if ((rc = package_list_to_array(&added, pkg_added)))
-			goto cleanup_3;
-	if (pkg_removed)
-		if ((rc = package_list_to_array(&removed, pkg_removed)))
-			goto cleanup_3;
+	if (m->pkg_added)
+		if ((rc = package_list_to_array(&m->added, m->pkg_added)))
+			goto cleanup_0;
+	if (m->pkg_removed)
+		if ((rc = package_list_to_array(&m->removed, m->pkg_removed)))
+			goto cleanup_0;
 
 	/* if it's test transaction - success */
 	if (opts_vztt->flags & OPT_VZTT_TEST)
-		goto cleanup_3;
+		goto cleanup_0;
 
-	if ((rc = merge_pkg_lists(&added, &removed, &existed)))
-		goto cleanup_3;
+	if ((rc = merge_pkg_lists(&m->added, &m->removed, &m->existed)))
+		goto cleanup_0;
 
 	/* and save it */
-	if ((rc = save_vzpackages(vc.ve_private, &existed)))
-		goto cleanup_3;
+	if ((rc = save_vzpackages(m->vc.ve_private, &m->existed)))
+		goto cleanup_0;
 
 	/* if application template autodetection is off - do not change
 	   CT app templates list during packages install/remove */
-	if (tc.apptmpl_autodetect) {
+	if (m->tc->apptmpl_autodetect) {
 		/* process templates */
-		tmplset_check_apps(tmpl, to, vc.ve_private, &existed, &apps);
+		if ((rc = modify_ve_check_apps(m, &apps)))
+			goto cleanup_0;
 
 		/* save new app templates set in VE config */
-		if ((rc = ve_config1_save(vc.config, &apps)))
-			goto cleanup_3;
+		if ((rc = ve_config1_save(m->vc.config, &apps)))
+			goto cleanup_0;
 	}
 
-	goto cleanup_3;
-cleanup_4:
-	tmpl_unlock(lockdata, opts_vztt->flags);
-cleanup_3:
-	sigaction(SIGINT, &act_int, NULL);
-cleanup_2:
-	unlock_ve(ctid, velockdata, opts_vztt->flags);
+	goto cleanup_0;
 cleanup_1:
-	/* cleanup without exit */
-	pm_clean(to);
+	tmpl_unlock(lockdata, opts_vztt->flags);
 cleanup_0:
-	tmplset_clean(tmpl);
-
-	package_list_clean(&existed);
-	package_list_clean(&removed);
-	package_list_clean(&added);
-	string_list_clean(&args);
+	unlock_ve(m->ctid, velockdata, opts_vztt->flags);
 	string_list_clean(&apps);
+	return rc;
+}
+
+/* install/update/remove packages set <packages> in VE <veid> */
+static int cmd_modify(
+	int cmd,
+	const char *ctid,
+	char *packages[],
+	size_t size,
+	struct package ***pkg_added,
+	struct package ***pkg_removed,
+	struct options_vztt *opts_vztt)
+{
+	int rc = 0;
+	struct sigaction act;
+	struct sigaction act_int;
+
+	struct global_config gc;
+	struct vztt_config tc;
+	struct modify_ve m;
+
+	progress(PROGRESS_MODIFY, 0, opts_vztt->progress_fd);
+
+	/* struct initialization: should be first block */
+	global_config_init(&gc);
+	vztt_config_init(&tc);
+	modify_ve_init(&m, cmd, ctid, &gc, &tc, opts_vztt);
+	m.pkg_added = pkg_added;
+	m.pkg_removed = pkg_removed;
+
+	/* read global vz config */
+	if ((rc = global_config_read(&gc, opts_vztt)))
+		return rc;
+
+	/* read vztt config */
+	if ((rc = vztt_config_read(gc.template_dir, &tc)))
+		return rc;
+
+	if ((rc = modify_ve_config(&m)))
+		goto cleanup;
+
+	if ((rc = modify_ve_load(&m)))
+		goto cleanup;
+
+	/* check & update metadata */
+	if ((rc = update_metadata(m.vc.ostemplate, &gc, &tc, opts_vztt)))
+		goto cleanup;
+
+	if ((rc = modify_ve_prepare(&m, packages, size)))
+		goto cleanup;
+
+	/* ignore SIGINT */
+	sigaction(SIGINT, NULL, &act_int);
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	act.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &act, NULL);
+
+	rc = modify_ve_run(&m);
+
+	sigaction(SIGINT, &act_int, NULL);
+cleanup:
+	modify_ve_clean(&m);
+	global_config_clean(&gc);
+	vztt_config_clean(&tc);
+
+	progress(PROGRESS_MODIFY, 100, opts_vztt->progress_fd);
+
+	return rc;
+}
+
+/* set by SIGINT during batch operation */
+static volatile sig_atomic_t modify_cancelled;
+
+static void modify_cancel(int sig)
+{
+	modify_cancelled = 1;
+}
+
+static int modify_ve_job(void *data)
+{
+	struct modify_ve *m = (struct modify_ve *)data;
+
+	if (modify_cancelled) {
+		vztt_logger(0, 0, "Packages operation in CT %s is cancelled",
+			m->ctid);
+		m->rc = VZT_PROG_SIGNALED;
+		return 0;
+	}
+	if ((m->rc = modify_ve_run(m)))
+		vztt_logger(0, 0, "Can not modify packages in CT %s", m->ctid);
+	/* errors are returned per VE */
+	return 0;
+}
+
+/* are app templates lists <a> and <b> the same? */
+static int same_templates(struct string_list *a, struct string_list *b)
+{
+	struct string_list_el *p, *q;
+
+	for (p = a->tqh_first, q = b->tqh_first; p && q;
+			p = p->e.tqe_next, q = q->e.tqe_next)
+		if (strcmp(p->s, q->s))
+			return 0;
+	return p == NULL && q == NULL;
+}
+
+/*
+ install/update packages set <packages> in VEs <ctids>: configs are read
+ once, metadata of every os template is checked once and templates set
+ is loaded and marked once for all VEs with the same os template and app
+ templates, then transactions are run by pool of <nthreads> workers.
+ Every VE has own package manager wrapper, since it keeps VE root,
+ veformat and excludes.
+ SIGINT interrupts running transactions with their package managers, as
+ for single VE, and cancels transactions which are not started yet.
+*/
+static int cmd_modify_many(
+	int cmd,
+	const char *ctids[],
+	size_t nct,
+	char *packages[],
+	size_t size,
+	struct options_vztt *opts_vztt,
+	int nthreads,
+	struct vztt_ct_result *results)
+{
+	int rc = 0, rc2;
+	size_t i, j, nos = 0, nsets = 0;
+	struct sigaction act;
+	struct sigaction act_int;
+	struct workqueue *wq;
+
+	struct global_config gc;
+	struct vztt_config tc;
+	struct modify_ve *ves = NULL;
+	struct modify_tmpl *sets = NULL;
+	/* os templates with checked metadata and result of check */
+	struct {
+		const char *ostemplate;
+		int rc;
+	} *oses = NULL;
+
+	for (i = 0; i < nct; i++) {
+		results[i].rc = 0;
+		results[i].pkg_added = NULL;
+		results[i].pkg_removed = NULL;
+	}
+	if (nct == 0)
+		return 0;
+
+	progress(PROGRESS_MODIFY, 0, opts_vztt->progress_fd);
+
+	/* struct initialization: should be first block */
+	global_config_init(&gc);
+	vztt_config_init(&tc);
+
+	/* read global vz config */
+	if ((rc = global_config_read(&gc, opts_vztt)))
+		goto cleanup;
+
+	/* read vztt config */
+	if ((rc = vztt_config_read(gc.template_dir, &tc)))
+		goto cleanup;
+
+	if ((ves = calloc(nct, sizeof(*ves))) == NULL ||
+			(oses = calloc(nct, sizeof(*oses))) == NULL ||
+			(sets = calloc(nct, sizeof(*sets))) == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+		goto cleanup;
+	}
+	for (i = 0; i < nct; i++) {
+		modify_ve_init(&ves[i], cmd, ctids[i], &gc, &tc, opts_vztt);
+		ves[i].pkg_added = &results[i].pkg_added;
+		ves[i].pkg_removed = &results[i].pkg_removed;
+	}
+
+	/* preparation is serial: templates set marks are not thread-safe */
+	for (i = 0; i < nct; i++) {
+		if ((ves[i].rc = modify_ve_config(&ves[i])))
+			goto failed;
+
+		/* load & mark templates set once per os & app templates */
+		for (j = 0; j < nsets; j++)
+			if (strcmp(sets[j].ostemplate, ves[i].vc.ostemplate) == 0 &&
+					same_templates(sets[j].templates,
+						&ves[i].vc.templates))
+				break;
+		if (j == nsets) {
+			sets[nsets].ostemplate = ves[i].vc.ostemplate;
+			sets[nsets].templates = &ves[i].vc.templates;
+			sets[nsets].rc = modify_ve_load(&ves[i]);
+			sets[nsets++].tmpl = ves[i].tmpl;
+		}
+		ves[i].tmpl = sets[j].tmpl;
+		ves[i].shared = &sets[j];
+		if ((ves[i].rc = sets[j].rc))
+			goto failed;
+
+		/* check & update metadata once per os template */
+		for (j = 0; j < nos; j++)
+			if (strcmp(oses[j].ostemplate, ves[i].vc.ostemplate) == 0)
+				break;
+		if (j == nos) {
+			oses[nos].ostemplate = ves[i].vc.ostemplate;
+			oses[nos++].rc = update_metadata(ves[i].vc.ostemplate,
+					&gc, &tc, opts_vztt);
+		}
+		if ((ves[i].rc = oses[j].rc))
+			goto failed;
+
+		if ((ves[i].rc = modify_ve_prepare(&ves[i], packages, size)))
+			goto failed;
+		continue;
+failed:
+		vztt_logger(0, 0, "Can not prepare packages operation in CT %s",
+			ctids[i]);
+	}
+
+	if (nthreads <= 0)
+		nthreads = MODIFY_THREADS;
+	if (nthreads > (int)nct)
+		nthreads = nct;
+
+	/* cancel queued transactions on SIGINT */
+	modify_cancelled = 0;
+	sigaction(SIGINT, NULL, &act_int);
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_RESTART;
+	act.sa_handler = modify_cancel;
+	sigaction(SIGINT, &act, NULL);
+
+	i = 0;
+	if ((rc = workqueue_create(&wq, nthreads, 0)) == 0) {
+		for (; i < nct; i++) {
+			if (ves[i].rc)
+				continue;
+			if ((rc = workqueue_add(wq, modify_ve_job, &ves[i], 0)))
+				break;
+		}
+		rc2 = workqueue_destroy(wq);
+		if (rc == 0)
+			rc = rc2;
+	}
+	/* VEs which were not queued */
+	for (; rc && i < nct; i++)
+		if (ves[i].rc == 0)
+			ves[i].rc = rc;
+
+	sigaction(SIGINT, &act_int, NULL);
+
+	/* the first failed VE defines the result */
+	for (i = 0; i < nct; i++) {
+		results[i].rc = ves[i].rc;
+		if (rc == 0)
+			rc = ves[i].rc;
+	}
+
+cleanup:
+	if (sets) {
+		/* oses[] and sets[] refer to VE configs */
+		for (i = 0; i < nct; i++)
+			modify_ve_clean(&ves[i]);
+		for (i = 0; i < nsets; i++)
+			if (sets[i].tmpl)
+				tmplset_clean(sets[i].tmpl);
+		free(sets);
+	} else {
+		/* nothing was done: the same error for all VEs */
+		for (i = 0; i < nct; i++)
+			results[i].rc = rc;
+	}
+	free(oses);
+	free(ves);
 	global_config_clean(&gc);
 	vztt_config_clean(&tc);
-	ve_config_clean(&vc);
 
 	progress(PROGRESS_MODIFY, 100, opts_vztt->progress_fd);
 
@@ -365,6 +716,34 @@ int vztt2_update(
 		pkg_updated, pkg_removed, opts_vztt);
 }
 
+/* install packages into several VEs */
+int vztt2_install_many(
+	const char *ctids[],
+	size_t nct,
+	char *packages[],
+	size_t size,
+	struct options_vztt *opts_vztt,
+	int nthreads,
+	struct vztt_ct_result *results)
+{
+	return cmd_modify_many(VZPKG_INSTALL, ctids, nct, packages, size, \
+		opts_vztt, nthreads, results);
+}
+
+/* update packages in several VEs */
+int vztt2_update_many(
+	const char *ctids[],
+	size_t nct,
+	char *packages[],
+	size_t size,
+	struct options_vztt *opts_vztt,
+	int nthreads,
+	struct vztt_ct_result *results)
+{
+	return cmd_modify_many(VZPKG_UPDATE, ctids, nct, packages, size, \
+		opts_vztt, nthreads, results);
+}
+
 /* remove packages from VE */
 int vztt_remove(
 	const char *ctid,
@@ -682,7 +1061,8 @@ int vztt2_install_tmpl(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base, 
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_3;
 
 	/* Call pre-install HN script */
@@ -936,7 +1316,8 @@ int vztt2_update_tmpl(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base, 
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_3;
 
 	/* Call pre-update script */
@@ -1183,7 +1564,8 @@ int vztt2_remove_tmpl(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base, 
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_3;
 
 	/* Call pre-remove script */
@@ -1405,7 +1787,8 @@ static int cmd_local(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base, 
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_3;
 
 	switch(cmd) {
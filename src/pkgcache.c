@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * shared package download cache
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "vztt_error.h"
+#include "util.h"
+#include "pkgcache.h"
+
+static int has_suffix(const char *name, const char *suffix)
+{
+	size_t len = strlen(name), slen = strlen(suffix);
+
+	return len > slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+/* last change time of stage <name> in <dfd>: files are moved into stage
+   when downloaded, so partial/ is checked too */
+static time_t stage_mtime(int dfd, const char *name)
+{
+	char path[PATH_MAX+1];
+	struct stat st;
+	time_t mtime;
+
+	if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) ||
+			!S_ISDIR(st.st_mode))
+		return 0;
+	mtime = st.st_mtime;
+	snprintf(path, sizeof(path), "%s/partial", name);
+	if (fstatat(dfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+			st.st_mtime > mtime)
+		mtime = st.st_mtime;
+	return mtime;
+}
+
+/* remove stages of killed runs in <cachedir> opened as <dfd> */
+static void pkgcache_reap(const char *cachedir, int dfd)
+{
+	DIR *dir;
+	struct dirent *de;
+	time_t mtime, now = time(NULL);
+	char path[PATH_MAX+1];
+	int fd;
+
+	if ((fd = dup(dfd)) == -1)
+		return;
+	if ((dir = fdopendir(fd)) == NULL) {
+		close(fd);
+		return;
+	}
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, PKGCACHE_STAGE_PREFIX,
+				strlen(PKGCACHE_STAGE_PREFIX)))
+			continue;
+		if ((mtime = stage_mtime(dfd, de->d_name)) == 0 ||
+				mtime + PKGCACHE_STAGE_TTL > now)
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", cachedir,
+				de->d_name) >= (int)sizeof(path))
+			continue;
+		vztt_logger(2, 0, "Remove stale stage %s", path);
+		remove_directory(path);
+	}
+	closedir(dir);
+}
+
+int pkgcache_stage(
+		const char *cachedir,
+		char *stage,
+		size_t size)
+{
+	int rc = 0;
+	int dfd;
+
+	if (snprintf(stage, size, "%s/" PKGCACHE_STAGE_PREFIX "XXXXXX",
+			cachedir) >= (int)size)
+		return vztt_error(VZT_INTERNAL, 0, "Too long path %s", cachedir);
+
+	/* stages are created and reaped under lock of cache */
+	if ((dfd = open(cachedir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", cachedir);
+	while (flock(dfd, LOCK_EX)) {
+		if (errno == EINTR)
+			continue;
+		rc = vztt_error(VZT_CANT_LOCK, errno, "flock(%s)", cachedir);
+		goto cleanup;
+	}
+
+	pkgcache_reap(cachedir, dfd);
+
+	if (mkdtemp(stage) == NULL)
+		rc = vztt_error(VZT_CANT_CREATE, errno, "mkdtemp(%s)", stage);
+cleanup:
+	close(dfd);
+	return rc;
+}
+
+int pkgcache_seed(
+		const char *cachedir,
+		const char *stage,
+		const char *suffix)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	int dfd, sfd;
+
+	if ((dir = opendir(cachedir)) == NULL)
+		return vztt_error(VZT_CANT_OPEN, errno, "opendir(%s)", cachedir);
+	if ((sfd = open(stage, O_RDONLY | O_DIRECTORY)) == -1) {
+		closedir(dir);
+		return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", stage);
+	}
+	dfd = dirfd(dir);
+	while ((de = readdir(dir))) {
+		if (!has_suffix(de->d_name, suffix))
+			continue;
+		if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+				!S_ISREG(st.st_mode))
+			continue;
+		/* not linked package will be downloaded again */
+		if (linkat(dfd, de->d_name, sfd, de->d_name, 0) &&
+				errno != EEXIST)
+			vztt_logger(2, errno, "linkat(%s/%s)", cachedir,
+				de->d_name);
+	}
+	close(sfd);
+	closedir(dir);
+	return 0;
+}
+
+int pkgcache_publish(
+		const char *cachedir,
+		const char *stage,
+		const char *suffix)
+{
+	int rc = 0, rc2;
+	DIR *dir;
+	struct dirent *de;
+	struct stat st, cst;
+	int dfd, cfd;
+
+	if ((dir = opendir(stage)) == NULL)
+		return vztt_error(VZT_CANT_OPEN, errno, "opendir(%s)", stage);
+	if ((cfd = open(cachedir, O_RDONLY | O_DIRECTORY)) == -1) {
+		closedir(dir);
+		return vztt_error(VZT_CANT_OPEN, errno, "open(%s)", cachedir);
+	}
+	dfd = dirfd(dir);
+	while ((de = readdir(dir))) {
+		if (!has_suffix(de->d_name, suffix))
+			continue;
+		if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+				!S_ISREG(st.st_mode))
+			continue;
+		/* seeded from cache or published by concurrent run */
+		if (fstatat(cfd, de->d_name, &cst, AT_SYMLINK_NOFOLLOW) == 0 &&
+				cst.st_ino == st.st_ino && cst.st_dev == st.st_dev)
+			continue;
+		if (renameat(dfd, de->d_name, cfd, de->d_name)) {
+			rc = vztt_error(VZT_CANT_RENAME, errno,
+				"rename(%s/%s, %s)", stage, de->d_name, cachedir);
+			break;
+		}
+	}
+	close(cfd);
+	closedir(dir);
+
+	if ((rc2 = remove_directory(stage)) && rc == 0)
+		rc = rc2;
+	return rc;
+}
+
+void pkgcache_abort(const char *stage)
+{
+	remove_directory(stage);
+}
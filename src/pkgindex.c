@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * binary package list index
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vztt_error.h"
+#include "util.h"
+#include "md5.h"
+#include "pkgindex.h"
+
+#define PKGINDEX_MAGIC		"VZPKGIDX"
+#define PKGINDEX_VERSION	2
+/* offset of absent string */
+#define PKGINDEX_NOSTR		UINT32_MAX
+
+struct pkgindex_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint32_t strsize;
+	uint32_t reserved;
+	/* text file size and mtime in nanoseconds */
+	uint64_t src_size;
+	int64_t src_mtime;
+	/* md5 of all data after header */
+	unsigned char md5[16];
+};
+
+struct pkgindex_rec {
+	uint32_t name;
+	uint32_t arch;
+	uint32_t evr;
+	/* version comparison key: epoch and version-release without it */
+	uint32_t ver;
+	uint32_t epoch;
+};
+
+struct pkgindex {
+	void *map;
+	size_t size;
+	uint32_t count;
+	const struct pkgindex_rec *recs;
+	const uint32_t *order;
+	const char *strs;
+	uint32_t strsize;
+};
+
+static int64_t stat_mtime(const struct stat *st)
+{
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+const char *pkgindex_evr_key(const char *evr, unsigned long *epoch)
+{
+	const char *p;
+
+	*epoch = 0;
+	for (p = evr; isdigit(*p); p++) ;
+	if (p == evr || *p != ':')
+		return evr;
+	*epoch = strtoul(evr, NULL, 10);
+	return p + 1;
+}
+
+/* NULL and empty arch are the same for cmp_pkg() */
+static const char *pkg_arch(struct package *pkg)
+{
+	return pkg->arch ? pkg->arch : "";
+}
+
+/* list element with its position */
+struct pkgindex_item {
+	struct package *p;
+	uint32_t pos;
+};
+
+static int cmp_by_name_arch(const void *a, const void *b)
+{
+	const struct pkgindex_item *i1 = (const struct pkgindex_item *)a;
+	const struct pkgindex_item *i2 = (const struct pkgindex_item *)b;
+	int rc;
+
+	if ((rc = strcmp(i1->p->name, i2->p->name)))
+		return rc;
+	if ((rc = strcmp(pkg_arch(i1->p), pkg_arch(i2->p))))
+		return rc;
+	/* stable */
+	return (i1->pos > i2->pos) - (i1->pos < i2->pos);
+}
+
+/* string table under construction */
+struct strtab {
+	char *buf;
+	size_t size;
+	size_t alloc;
+};
+
+/* add string <s> and put its offset in <off> */
+static int strtab_add(struct strtab *t, const char *s, uint32_t *off)
+{
+	size_t len;
+	char *p;
+
+	if (s == NULL) {
+		*off = PKGINDEX_NOSTR;
+		return 0;
+	}
+	len = strlen(s) + 1;
+	if (t->size + len >= PKGINDEX_NOSTR)
+		return -1;
+	if (t->size + len > t->alloc) {
+		size_t n = t->alloc ? t->alloc * 2 : 64*1024;
+		while (n < t->size + len)
+			n *= 2;
+		if ((p = (char *)realloc(t->buf, n)) == NULL)
+			return -1;
+		t->buf = p;
+		t->alloc = n;
+	}
+	memcpy(t->buf + t->size, s, len);
+	*off = (uint32_t)t->size;
+	t->size += len;
+	return 0;
+}
+
+int pkgindex_save(
+		const char *path,
+		const char *src,
+		struct package_list *packages)
+{
+	int rc = 0;
+	int fd = -1;
+	char tmp[PATH_MAX+1];
+	struct stat st;
+	struct pkgindex_header hdr;
+	struct pkgindex_rec *recs = NULL;
+	struct pkgindex_item *items = NULL;
+	uint32_t *order = NULL;
+	struct strtab strs = { NULL, 0, 0 };
+	struct package_list_el *i;
+	struct MD5Context ctx;
+	size_t count, n;
+	uint32_t arch = PKGINDEX_NOSTR;
+	FILE *fp;
+
+	if (stat(src, &st))
+		return vztt_error(VZT_CANT_LSTAT, errno, "stat(%s)", src);
+
+	count = package_list_size(packages);
+	if (count >= PKGINDEX_NOSTR)
+		return vztt_error(VZT_INTERNAL, 0, "too many packages: %zu", count);
+	recs = (struct pkgindex_rec *)calloc(count + 1, sizeof(*recs));
+	items = (struct pkgindex_item *)calloc(count + 1, sizeof(*items));
+	order = (uint32_t *)calloc(count + 1, sizeof(*order));
+	if (recs == NULL || items == NULL || order == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+		goto cleanup;
+	}
+
+	n = 0;
+	package_list_for_each(packages, i) {
+		items[n].p = i->p;
+		items[n].pos = n;
+		n++;
+	}
+	qsort(items, count, sizeof(*items), cmp_by_name_arch);
+
+	/* strings are placed in name order, the same arch is shared */
+	for (n = 0; n < count; n++) {
+		struct package *p = items[n].p;
+		struct pkgindex_rec *r = &recs[items[n].pos];
+
+		if (strtab_add(&strs, p->name, &r->name))
+			goto nomem;
+		if (p->arch && arch != PKGINDEX_NOSTR &&
+				strcmp(strs.buf + arch, p->arch) == 0)
+			r->arch = arch;
+		else if (strtab_add(&strs, p->arch, &r->arch))
+			goto nomem;
+		arch = r->arch;
+		if (strtab_add(&strs, p->evr, &r->evr))
+			goto nomem;
+		r->ver = r->evr;
+		if (p->evr) {
+			unsigned long epoch;
+			const char *ver = pkgindex_evr_key(p->evr, &epoch);
+
+			r->ver += (uint32_t)(ver - p->evr);
+			r->epoch = (epoch > UINT32_MAX) ? UINT32_MAX :
+					(uint32_t)epoch;
+		}
+		order[n] = items[n].pos;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PKGINDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = PKGINDEX_VERSION;
+	hdr.count = (uint32_t)count;
+	hdr.strsize = (uint32_t)strs.size;
+	hdr.src_size = (uint64_t)st.st_size;
+	hdr.src_mtime = stat_mtime(&st);
+	MD5Init(&ctx);
+	MD5Update(&ctx, (md5byte const *)recs, count * sizeof(*recs));
+	MD5Update(&ctx, (md5byte const *)order, count * sizeof(*order));
+	MD5Update(&ctx, (md5byte const *)strs.buf, strs.size);
+	MD5Final(hdr.md5, &ctx);
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		rc = vztt_error(VZT_CANT_CREATE, errno, "mkstemp(%s)", tmp);
+		goto cleanup;
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		rc = vztt_error(VZT_CANT_OPEN, errno, "fdopen(%s)", tmp);
+		close(fd);
+		unlink(tmp);
+		goto cleanup;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(recs, sizeof(*recs), count, fp);
+	fwrite(order, sizeof(*order), count, fp);
+	if (strs.size)
+		fwrite(strs.buf, 1, strs.size, fp);
+	fchmod(fd, 0644);
+	if (ferror(fp) | fclose(fp)) {
+		rc = vztt_error(VZT_CANT_WRITE, errno, "write(%s)", tmp);
+		unlink(tmp);
+		goto cleanup;
+	}
+	if (rename(tmp, path)) {
+		rc = vztt_error(VZT_CANT_RENAME, errno,
+				"rename(%s, %s)", tmp, path);
+		unlink(tmp);
+		goto cleanup;
+	}
+	goto cleanup;
+
+nomem:
+	rc = vztt_error(VZT_CANT_ALLOC_MEM, ENOMEM, "string table");
+cleanup:
+	free(strs.buf);
+	free(order);
+	free(items);
+	free(recs);
+	return rc;
+}
+
+int pkgindex_open(const char *path, const char *src, struct pkgindex **idx)
+{
+	int fd;
+	struct stat st;
+	struct pkgindex_header hdr;
+	struct pkgindex *x;
+	struct MD5Context ctx;
+	unsigned char md5[16];
+	size_t size;
+	void *map;
+	uint32_t n;
+
+	*idx = NULL;
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return VZT_FILE_NFOUND;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(hdr)) {
+		close(fd);
+		return VZT_FILE_NFOUND;
+	}
+	size = (size_t)st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return VZT_FILE_NFOUND;
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if (memcmp(hdr.magic, PKGINDEX_MAGIC, sizeof(hdr.magic)) ||
+			hdr.version != PKGINDEX_VERSION ||
+			size != sizeof(hdr) +
+				(size_t)hdr.count * (sizeof(struct pkgindex_rec) +
+					sizeof(uint32_t)) + hdr.strsize) {
+		vztt_logger(2, 0, "Index %s is invalid, ignored", path);
+		goto invalid;
+	}
+	if (src) {
+		if (stat(src, &st) || (uint64_t)st.st_size != hdr.src_size ||
+				stat_mtime(&st) != hdr.src_mtime) {
+			vztt_logger(2, 0, "Index %s is stale, ignored", path);
+			goto invalid;
+		}
+	}
+	MD5Init(&ctx);
+	MD5Update(&ctx, (md5byte const *)map + sizeof(hdr),
+			size - sizeof(hdr));
+	MD5Final(md5, &ctx);
+	if (memcmp(md5, hdr.md5, sizeof(md5))) {
+		vztt_logger(2, 0, "Index %s is corrupted, ignored", path);
+		goto invalid;
+	}
+
+	if ((x = (struct pkgindex *)malloc(sizeof(*x))) == NULL) {
+		munmap(map, size);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+	}
+	x->map = map;
+	x->size = size;
+	x->count = hdr.count;
+	x->recs = (const struct pkgindex_rec *)((char *)map + sizeof(hdr));
+	x->order = (const uint32_t *)(x->recs + hdr.count);
+	x->strs = (const char *)(x->order + hdr.count);
+	x->strsize = hdr.strsize;
+
+	/* check offsets once, so lookups need not */
+	if (x->strsize && x->strs[x->strsize - 1] != '\0')
+		goto bad;
+	for (n = 0; n < x->count; n++) {
+		const struct pkgindex_rec *r = &x->recs[n];
+		if (x->order[n] >= x->count || r->name >= x->strsize ||
+				(r->arch != PKGINDEX_NOSTR &&
+					r->arch >= x->strsize) ||
+				(r->evr != PKGINDEX_NOSTR &&
+					(r->evr >= x->strsize ||
+					r->ver < r->evr ||
+					r->ver >= x->strsize)))
+			goto bad;
+	}
+	*idx = x;
+	return 0;
+
+bad:
+	vztt_logger(2, 0, "Index %s is invalid, ignored", path);
+	free(x);
+invalid:
+	munmap(map, size);
+	return VZT_FILE_NFOUND;
+}
+
+void pkgindex_close(struct pkgindex *idx)
+{
+	if (idx == NULL)
+		return;
+	munmap(idx->map, idx->size);
+	free(idx);
+}
+
+size_t pkgindex_count(struct pkgindex *idx)
+{
+	return idx->count;
+}
+
+static const char *pkgindex_str(struct pkgindex *idx, uint32_t off)
+{
+	return (off == PKGINDEX_NOSTR) ? NULL : idx->strs + off;
+}
+
+long pkgindex_find(struct pkgindex *idx, const char *name)
+{
+	long lo = 0, hi = idx->count, mid;
+
+	/* lower bound */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(idx->strs + idx->recs[idx->order[mid]].name,
+				name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < (long)idx->count &&
+			strcmp(idx->strs + idx->recs[idx->order[lo]].name,
+				name) == 0)
+		return lo;
+	return -1;
+}
+
+int pkgindex_get(struct pkgindex *idx, long n, struct package *pkg)
+{
+	const struct pkgindex_rec *r;
+
+	if (n < 0 || n >= (long)idx->count)
+		return -1;
+	r = &idx->recs[idx->order[n]];
+	/* read-only mapping, should not be changed */
+	pkg->name = (char *)pkgindex_str(idx, r->name);
+	pkg->arch = (char *)pkgindex_str(idx, r->arch);
+	pkg->evr = (char *)pkgindex_str(idx, r->evr);
+	pkg->descr = NULL;
+	pkg->marker = 0;
+	return 0;
+}
+
+int pkgindex_entry(struct pkgindex *idx, long n, struct pkgindex_entry *e)
+{
+	const struct pkgindex_rec *r;
+
+	if (n < 0 || n >= (long)idx->count)
+		return -1;
+	e->pos = idx->order[n];
+	r = &idx->recs[e->pos];
+	e->name = idx->strs + r->name;
+	e->arch = pkgindex_str(idx, r->arch);
+	e->evr = pkgindex_str(idx, r->evr);
+	e->ver = pkgindex_str(idx, r->ver);
+	e->epoch = r->epoch;
+	return 0;
+}
+
+int pkgindex_read(struct pkgindex *idx, struct package_list *packages)
+{
+	int rc;
+	uint32_t n;
+	struct package *p;
+	struct package_list_el *i;
+
+	for (n = 0; n < idx->count; n++) {
+		const struct pkgindex_rec *r = &idx->recs[n];
+
+		if ((p = create_structp_arena(packages->arena,
+				pkgindex_str(idx, r->name),
+				pkgindex_str(idx, r->arch),
+				pkgindex_str(idx, r->evr), NULL)) == NULL)
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno,
+					"Can't alloc memory");
+		/* remove record with the same name & arch */
+		if ((i = package_list_find(packages, p)))
+			package_list_remove(packages, i);
+		if ((rc = package_list_insert(packages, p)))
+			return rc;
+	}
+	return 0;
+}
@@ -52,6 +52,7 @@
 #include "util.h"
 #include "progress_messages.h"
 #include "ploop.h"
+#include "archive.h"
 #include "transaction.h"
 
 #define PLOOP_IMAGE_NAME	"root.hds"
@@ -101,7 +102,6 @@ int convert_ploop(const char *old_cache, char *cache,
 		struct options_vztt *opts_vztt)
 {
 	int rc;
-	char cmd[PATH_MAX];
 	char from[PATH_MAX];
 	char to[PATH_MAX];
 	char *old_tmpdir = NULL;
@@ -117,12 +117,8 @@ int convert_ploop(const char *old_cache, char *cache,
 	rc = create_tmp_dir(&old_tmpdir);
 	if (rc)
 		return rc;
-	get_unpack_cmd(cmd, sizeof(cmd), old_cache, old_tmpdir, "--numeric-owner");
-	if ((rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET)))) {
-		vztt_logger(0, errno, "system(%s) error", cmd);
-		rc = VZT_CANT_EXEC;
+	if ((rc = archive_unpack(old_cache, old_tmpdir, opts_vztt)))
 		goto err;
-	}
 
 	/* 2. Mount old ploop */
 	snprintf(from, sizeof(from), "%s/mnt", old_tmpdir);
@@ -182,14 +178,14 @@ err:
 	if (old_tmpdir) {
 		if (old_mounted)
 			umount_ploop(old_tmpdir, opts_vztt);
-		remove_directory(old_tmpdir);
+		remove_directory_bg(old_tmpdir);
 		free(old_tmpdir);
 	}
 
 	if (new_tmpdir) {
 		if (new_mounted)
 			umount_ploop(new_tmpdir, opts_vztt);
-		remove_directory(new_tmpdir);
+		remove_directory_bg(new_tmpdir);
 		free(new_tmpdir);
 	}
 
@@ -354,37 +350,16 @@ cleanup_0:
 
 int pack_ploop(char *ploop_dir, char *to_file, struct options_vztt *opts_vztt)
 {
-	int rc = 0;
 	char path[PATH_MAX+1];
-	char cmd[2*PATH_MAX+1];
-	char *pwd = NULL;
-	const char *files;
-
-	if (getcwd(path, sizeof(path)))
-		pwd = strdup(path);
-
-	if (chdir(ploop_dir) == -1) {
-		vztt_logger(0, errno, "chdir(%s) error", ploop_dir);
-		return VZT_CANT_CHDIR;
-	}
+	const char *ploop_files[] = {PLOOP_IMAGE_NAME, "templates",
+		DESCRIPTOR_NAME, NULL};
+	const char *qcow_files[] = {QCOW_IMAGE_NAME, "templates", NULL};
 
-	if (access(DESCRIPTOR_NAME, F_OK) == 0)
-		files = PLOOP_IMAGE_NAME " templates " DESCRIPTOR_NAME;
+	snprintf(path, sizeof(path), "%s/" DESCRIPTOR_NAME, ploop_dir);
+	if (access(path, F_OK) == 0)
+		return archive_pack(to_file, ploop_dir, ploop_files, opts_vztt);
 	else
-		files = QCOW_IMAGE_NAME " templates";
-
-	get_pack_cmd(cmd, sizeof(cmd), to_file, files, "--numeric-owner");
-
-	if ((rc = exec_cmd(cmd, (opts_vztt->flags & OPT_VZTT_QUIET)))) {
-		vztt_logger(0, errno, "system(%s) error", cmd);
-		rc = VZT_CANT_EXEC;
-	}
-	if (pwd)
-		if (chdir(pwd) == -1)
-			vztt_logger(0, errno, "chdir(%s) error", ploop_dir);
-
-	VZTT_FREE_STR(pwd);
-	return rc;
+		return archive_pack(to_file, ploop_dir, qcow_files, opts_vztt);
 }
 
 int resize_ploop(char *ploop_dir, struct options_vztt *opts_vztt, unsigned long long size)
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
@@ -47,10 +48,22 @@
 /* 
  char* double-linked list 
 */
-static struct string_list_el *string_list_create_el(char *str)
+static struct string_list_el *string_list_create_el(
+		struct string_list *ls,
+		char *str)
 {
 	struct string_list_el *p;
 
+	if (ls->arena) {
+		p = (struct string_list_el *)arena_alloc(ls->arena,
+				sizeof(struct string_list_el));
+		if (p == NULL || (p->s = arena_strdup(ls->arena, str)) == NULL) {
+			vztt_logger(0, ENOMEM, "Cannot alloc memory");
+			return NULL;
+		}
+		return p;
+	}
+
 	p = (struct string_list_el *)malloc(sizeof(struct string_list_el));
 	if (p == NULL) {
 		vztt_logger(0, errno, "Cannot alloc memory");
@@ -69,7 +82,7 @@ int string_list_add(struct string_list *ls, char *str)
 {
 	struct string_list_el *p;
 
-	p = string_list_create_el(str);
+	p = string_list_create_el(ls, str);
 	if (p == NULL)
 		return VZT_CANT_ALLOC_MEM;
 	TAILQ_INSERT_TAIL(ls, p, e);
@@ -82,7 +95,7 @@ int string_list_add_head(struct string_list *ls, char *str)
 {
 	struct string_list_el *p;
 
-	p = string_list_create_el(str);
+	p = string_list_create_el(ls, str);
 	if (p == NULL)
 		return VZT_CANT_ALLOC_MEM;
 	TAILQ_INSERT_HEAD(ls, p, e);
@@ -95,6 +108,11 @@ void string_list_clean(struct string_list *ls)
 {
 	struct string_list_el *el;
 
+	if (ls->arena) {
+		arena_reset(ls->arena);
+		TAILQ_INIT(ls);
+		return;
+	}
 	while (ls->tqh_first != NULL) {
 		el = ls->tqh_first;
 		TAILQ_REMOVE(ls, ls->tqh_first, e);
@@ -118,21 +136,35 @@ struct string_list_el *string_list_find(struct string_list *ls, char *str)
 	return NULL;
 }
 
-/* remove element and its content and return pointer to previous elem */
+/* remove element and its content and return pointer to previous elem,
+   NULL for the first one */
 struct string_list_el *string_list_remove(
 		struct string_list *ls,
 		struct string_list_el *el)
 {
-	/* get previous element */
-	struct string_list_el *prev = *el->e.tqe_prev;
+	struct string_list_el *prev = NULL;
+
+	/* tqe_prev of not first element points to tqe_next of previous one */
+	if (el != ls->tqh_first)
+		prev = (struct string_list_el *)((char *)el->e.tqe_prev -
+			offsetof(struct string_list_el, e.tqe_next));
 
 	TAILQ_REMOVE(ls, el, e);
-	free((void *)el->s);
-	free((void *)el);
+	if (ls->arena == NULL) {
+		free((void *)el->s);
+		free((void *)el);
+	}
 
 	return prev;
 }
 
+/* move all elements of <src> in tail of <dst>, <src> becomes empty.
+   Both lists should be without arena */
+void string_list_move(struct string_list *dst, struct string_list *src)
+{
+	TAILQ_CONCAT(dst, src, e);
+}
+
 /*
  read strings from file and add into list
  leading and tailing spaces omitted
@@ -495,18 +527,137 @@ int pkg_info_list_to_array(struct pkg_info_list *ls, struct pkg_info ***a)
 	return 0;
 }
 
+/* open addressing hash index of package list by package name */
+struct package_index {
+	struct package_list_el **slots;
+	/* power of 2 */
+	size_t size;
+	/* used and deleted slots */
+	size_t used;
+};
+
+/* marker of deleted slot: probe sequence continues through it */
+static struct package_list_el package_index_deleted;
+#define PKG_INDEX_DELETED	(&package_index_deleted)
+#define PKG_INDEX_MIN_SIZE	64
+
+/* FNV-1a: package name only, because arch is optional for cmp_pkg() */
+static size_t package_index_hash(const char *name)
+{
+	size_t h = 2166136261u;
+
+	for (; *name; name++) {
+		h ^= (unsigned char)*name;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void package_index_free(struct package_list *ls)
+{
+	if (ls->index == NULL)
+		return;
+	free(ls->index->slots);
+	free(ls->index);
+	ls->index = NULL;
+}
+
+static void package_index_put(
+		struct package_index *idx,
+		struct package_list_el *el)
+{
+	size_t mask = idx->size - 1;
+	size_t i = package_index_hash(el->p->name) & mask;
+
+	/* deleted slots are not reused to keep insertion order of probe */
+	while (idx->slots[i])
+		i = (i + 1) & mask;
+	idx->slots[i] = el;
+	idx->used++;
+}
+
+/* (re)build index of all list elements, in list order */
+static int package_index_build(struct package_list *ls)
+{
+	struct package_index *idx;
+	struct package_list_el *el;
+	size_t size = PKG_INDEX_MIN_SIZE;
+	size_t n = 0;
+
+	for (el = ls->tqh_first; el != NULL; el = el->e.tqe_next)
+		n++;
+	/* load factor <= 1/2 */
+	while (size < 2 * n)
+		size *= 2;
+
+	package_index_free(ls);
+	if ((idx = calloc(1, sizeof(*idx))) == NULL)
+		return VZT_CANT_ALLOC_MEM;
+	if ((idx->slots = calloc(size, sizeof(*idx->slots))) == NULL) {
+		free(idx);
+		return VZT_CANT_ALLOC_MEM;
+	}
+	idx->size = size;
+	for (el = ls->tqh_first; el != NULL; el = el->e.tqe_next)
+		package_index_put(idx, el);
+	ls->index = idx;
+
+	return 0;
+}
+
+/* add new list tail element to index */
+static void package_index_add(
+		struct package_list *ls,
+		struct package_list_el *el)
+{
+	if (ls->index == NULL)
+		return;
+	/* load factor > 3/4: grow, without index lookups are linear */
+	if (4 * (ls->index->used + 1) > 3 * ls->index->size) {
+		if (package_index_build(ls))
+			package_index_free(ls);
+		return;
+	}
+	package_index_put(ls->index, el);
+}
+
+static void package_index_del(
+		struct package_list *ls,
+		struct package_list_el *el)
+{
+	struct package_index *idx = ls->index;
+	size_t mask, i;
+
+	if (idx == NULL)
+		return;
+	mask = idx->size - 1;
+	for (i = package_index_hash(el->p->name) & mask; idx->slots[i];
+			i = (i + 1) & mask) {
+		if (idx->slots[i] == el) {
+			idx->slots[i] = PKG_INDEX_DELETED;
+			return;
+		}
+	}
+}
+
 /* insert struct package <p> as element in tail of queue */
 int package_list_insert(struct package_list *ls, struct package *p)
 {
 	struct package_list_el *u;
 
-	u = (struct package_list_el *)malloc(sizeof(struct package_list_el));
+	if (ls->arena)
+		u = (struct package_list_el *)arena_alloc(ls->arena,
+				sizeof(struct package_list_el));
+	else
+		u = (struct package_list_el *)malloc(
+				sizeof(struct package_list_el));
 	if (u == NULL) {
 		vztt_logger(0, errno, "Cannot alloc memory");
 		return VZT_CANT_ALLOC_MEM;
 	}
 	u->p = p;
 	TAILQ_INSERT_TAIL(ls, u, e);
+	package_index_add(ls, u);
 
 	return 0;
 }
@@ -515,38 +666,39 @@ int package_list_insert(struct package_list *ls, struct package *p)
 int package_list_add(struct package_list *ls, struct package *s)
 {
 	struct package *t;
-	struct package_list_el *u;
+	int rc;
 
-	if ((t = create_structp(s->name, s->arch, s->evr, s->descr)) == NULL) {
+	if ((t = create_structp_arena(ls->arena,
+			s->name, s->arch, s->evr, s->descr)) == NULL) {
 		vztt_logger(0, errno, "Can't alloc memory");
 		return VZT_CANT_ALLOC_MEM;
 	}
-	u = (struct package_list_el *)malloc(sizeof(struct package_list_el));
-	if (u == NULL) {
-		vztt_logger(0, errno, "Cannot alloc memory");
-		return VZT_CANT_ALLOC_MEM;
-	}
-	u->p = t;
-	TAILQ_INSERT_TAIL(ls, u, e);
+	if ((rc = package_list_insert(ls, t)) && ls->arena == NULL)
+		erase_structp(t);
 
-	return 0;
+	return rc;
 }
 
-/* remove element and its content and return pointer to previous elem */
+/* remove element and its content and return pointer to previous elem,
+   NULL for the first one */
 struct package_list_el *package_list_remove(
 		struct package_list *ls,
 		struct package_list_el *el)
 {
-	/* get previous element */
-	struct package_list_el *prev = *el->e.tqe_prev;
-	struct package_list_el *next = el->e.tqe_next;
+	struct package_list_el *prev = NULL;
+
+	/* tqe_prev of not first element points to tqe_next of previous one */
+	if (el != ls->tqh_first)
+		prev = (struct package_list_el *)((char *)el->e.tqe_prev -
+			offsetof(struct package_list_el, e.tqe_next));
 
-	/* remove content */
-	erase_structp(el->p);
+	package_index_del(ls, el);
 	TAILQ_REMOVE(ls, el, e);
-	/* Somehow this free() breaks our queue we should restore after next element*/
-	free((void *)el);
-	prev->e.tqe_next = next;
+	/* remove content, arena memory is released by package_list_clean() */
+	if (ls->arena == NULL) {
+		erase_structp(el->p);
+		free((void *)el);
+	}
 	return prev;
 }
 
@@ -555,6 +707,12 @@ void package_list_clean(struct package_list *ls)
 {
 	struct package_list_el *el;
 
+	package_index_free(ls);
+	if (ls->arena) {
+		arena_reset(ls->arena);
+		TAILQ_INIT(ls);
+		return;
+	}
 	while (ls->tqh_first != NULL) {
 		el = ls->tqh_first;
 		TAILQ_REMOVE(ls, ls->tqh_first, e);
@@ -579,11 +737,26 @@ struct package_list_el *package_list_find(
 		struct package_list *packages,
 		struct package *pkg)
 {
+	struct package_index *idx;
 	struct package_list_el *i;
+	size_t mask, n;
 
-	for (i = packages->tqh_first; i != NULL; i = i->e.tqe_next)
-		if (cmp_pkg(pkg, i->p) == 0)
+	if (packages->index == NULL && packages->tqh_first != NULL)
+		package_index_build(packages);
+
+	if ((idx = packages->index) == NULL) {
+		for (i = packages->tqh_first; i != NULL; i = i->e.tqe_next)
+			if (cmp_pkg(pkg, i->p) == 0)
+				return i;
+		return NULL;
+	}
+
+	mask = idx->size - 1;
+	for (n = package_index_hash(pkg->name) & mask; (i = idx->slots[n]);
+			n = (n + 1) & mask) {
+		if (i != PKG_INDEX_DELETED && cmp_pkg(pkg, i->p) == 0)
 			return i;
+	}
 	return NULL;
 }
 
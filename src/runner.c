@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ *
+ * process runner: clone(CLONE_VM|CLONE_VFORK) + execve, pidfd wait
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "vztt_error.h"
+#include "util.h"
+#include "runner.h"
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD	0x00001000
+#endif
+#ifndef P_PIDFD
+#define P_PIDFD		3
+#endif
+
+/* child runs on this stack until exec only */
+#define RUNNER_STACK_SIZE	(64 * 1024)
+
+extern char **environ;
+
+/* shared by parent and child, since child runs in parent address space */
+struct runner_ctx {
+	const char *path;
+	char *const *argv;
+	char *const *envp;
+	const struct runner_opts *opts;
+	int devnull;
+	int rootfd;
+	sigset_t mask;
+	/* child failure before exec: VZT error code, errno and operation */
+	int rc;
+	int err;
+	const char *what;
+};
+
+/* parent SIGINT/SIGQUIT disposition while children are running */
+static pthread_mutex_t runner_signals_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int runner_signals_users = 0;
+static struct sigaction runner_act_int, runner_act_quit;
+
+static void runner_signals_ignore(void)
+{
+	struct sigaction act;
+
+	pthread_mutex_lock(&runner_signals_mutex);
+	if (runner_signals_users++ == 0) {
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = SIG_IGN;
+		sigemptyset(&act.sa_mask);
+		sigaction(SIGINT, &act, &runner_act_int);
+		sigaction(SIGQUIT, &act, &runner_act_quit);
+	}
+	pthread_mutex_unlock(&runner_signals_mutex);
+}
+
+static void runner_signals_restore(void)
+{
+	pthread_mutex_lock(&runner_signals_mutex);
+	if (runner_signals_users > 0 && --runner_signals_users == 0) {
+		sigaction(SIGINT, &runner_act_int, NULL);
+		sigaction(SIGQUIT, &runner_act_quit, NULL);
+	}
+	pthread_mutex_unlock(&runner_signals_mutex);
+}
+
+static int runner_child(void *data)
+{
+	struct runner_ctx *x = (struct runner_ctx *)data;
+	const struct runner_opts *o = x->opts;
+	struct sigaction act, old;
+	size_t i;
+	int sig, from;
+
+	/* all signals are blocked here: reset handlers of caller before
+	   unblocking, they must not run in shared address space.
+	   C-c and sigquit are allowed for child */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = SIG_DFL;
+	for (sig = 1; sig < _NSIG; sig++) {
+		if (sig == SIGKILL || sig == SIGSTOP)
+			continue;
+		if (sigaction(sig, NULL, &old))
+			continue;
+		if (old.sa_handler == SIG_DFL)
+			continue;
+		if (old.sa_handler == SIG_IGN &&
+				sig != SIGINT && sig != SIGQUIT)
+			continue;
+		sigaction(sig, &act, NULL);
+	}
+
+	for (i = 0; i < o->nfds; i++) {
+		from = (o->fds[i].from == RUNNER_DEVNULL) ?
+			x->devnull : o->fds[i].from;
+		if (from == o->fds[i].to) {
+			if (fcntl(from, F_SETFD, 0) == 0)
+				continue;
+		} else if (dup2(from, o->fds[i].to) != -1) {
+			continue;
+		}
+		x->rc = VZT_CANT_OPEN;
+		x->what = "dup2";
+		goto failed;
+	}
+
+	if (o->root) {
+		if (chroot(o->root) < 0) {
+			x->rc = VZT_CANT_CHROOT;
+			x->what = "chroot";
+			goto failed;
+		}
+		/* go back to make availability to unjump from chroot */
+		if (fchdir(x->rootfd) < 0) {
+			x->rc = VZT_CANT_CHDIR;
+			x->what = "fchdir";
+			goto failed;
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &x->mask, NULL);
+	execve(x->path, x->argv, x->envp);
+	x->rc = VZT_CANT_EXEC;
+	x->what = "execve";
+failed:
+	x->err = errno;
+	_exit(127);
+}
+
+int runner_spawn(
+		const char *path,
+		char *const argv[],
+		const struct runner_opts *opts,
+		struct runner_child *child)
+{
+	int rc = 0;
+	int flags;
+	size_t i;
+	void *stack;
+	sigset_t all;
+	struct runner_ctx x;
+	struct runner_opts noopts;
+	int pidfd = -1;
+	pid_t pid;
+
+	if (opts == NULL) {
+		memset(&noopts, 0, sizeof(noopts));
+		opts = &noopts;
+	}
+	memset(&x, 0, sizeof(x));
+	x.path = path;
+	x.argv = argv;
+	x.envp = opts->envp ? opts->envp : environ;
+	x.opts = opts;
+	x.devnull = -1;
+	x.rootfd = -1;
+	child->pid = -1;
+	child->pidfd = -1;
+	child->ignore_int = 0;
+
+	for (i = 0; i < opts->nfds; i++) {
+		if (opts->fds[i].from != RUNNER_DEVNULL)
+			continue;
+		/* open /dev/null here, it can be absent in chroot */
+		if ((x.devnull = open("/dev/null", O_RDWR|O_CLOEXEC)) == -1)
+			return vztt_error(VZT_CANT_OPEN, errno,
+				"open(/dev/null) :");
+		break;
+	}
+	if (opts->root) {
+		if ((x.rootfd = open("/", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+			rc = vztt_error(VZT_CANT_OPEN, errno,
+				"Can not open / directory");
+			goto cleanup_0;
+		}
+	}
+
+	stack = mmap(NULL, RUNNER_STACK_SIZE, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK|MAP_NORESERVE, -1, 0);
+	if (stack == MAP_FAILED) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "mmap() :");
+		goto cleanup_0;
+	}
+
+	if (opts->ignore_int)
+		runner_signals_ignore();
+
+	/* block signals of this thread only, child restores the mask */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &x.mask);
+
+	flags = CLONE_VM|CLONE_VFORK|CLONE_PIDFD|SIGCHLD;
+	if (opts->newuts)
+		flags |= CLONE_NEWUTS;
+	pid = clone(runner_child, (char *)stack + RUNNER_STACK_SIZE, flags,
+		&x, &pidfd);
+	if (pid == -1 && errno == EINVAL) {
+		/* kernel without pidfd */
+		pidfd = -1;
+		pid = clone(runner_child, (char *)stack + RUNNER_STACK_SIZE,
+			flags & ~CLONE_PIDFD, &x);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &x.mask, NULL);
+	munmap(stack, RUNNER_STACK_SIZE);
+
+	if (pid == -1) {
+		rc = vztt_error(VZT_CANT_FORK, errno, "clone() failed");
+		if (opts->ignore_int)
+			runner_signals_restore();
+		goto cleanup_0;
+	}
+
+	child->pid = pid;
+	child->pidfd = pidfd;
+	child->ignore_int = opts->ignore_int;
+
+	/* child is exec'ed or exited already */
+	if (x.rc) {
+		runner_wait(child, NULL);
+		rc = vztt_error(x.rc, x.err, "%s(%s) failed", x.what,
+			(x.rc == VZT_CANT_CHROOT) ? opts->root : path);
+	}
+
+cleanup_0:
+	if (x.rootfd != -1)
+		close(x.rootfd);
+	if (x.devnull != -1)
+		close(x.devnull);
+
+	return rc;
+}
+
+int runner_wait(struct runner_child *child, int *status)
+{
+	int rc = 0;
+	int st = 0;
+	int err;
+	siginfo_t si;
+	pid_t pid;
+
+	if (child->pid == -1)
+		return vztt_error(VZT_INTERNAL, 0, "No child to wait");
+
+	if (child->pidfd != -1) {
+		memset(&si, 0, sizeof(si));
+		while ((rc = waitid(P_PIDFD, child->pidfd, &si, WEXITED)) == -1)
+			if (errno != EINTR)
+				break;
+		err = errno;
+		close(child->pidfd);
+		child->pidfd = -1;
+		if (rc == 0) {
+			if (si.si_code == CLD_EXITED)
+				st = (si.si_status & 0xff) << 8;
+			else if (si.si_code == CLD_DUMPED)
+				st = (si.si_status & 0x7f) | 0x80;
+			else
+				st = si.si_status & 0x7f;
+			goto done;
+		}
+		/* kernel without waitid(P_PIDFD) */
+		if (err != EINVAL) {
+			rc = vztt_error(VZT_INTERNAL, err,
+				"waitid(%d) error", child->pid);
+			goto done;
+		}
+		rc = 0;
+	}
+
+	/* wait for own child only: other threads can run commands too */
+	while ((pid = waitpid(child->pid, &st, 0)) == -1)
+		if (errno != EINTR)
+			break;
+	if (pid == -1)
+		rc = vztt_error(VZT_INTERNAL, errno,
+			"waitpid(%d) error", child->pid);
+done:
+	child->pid = -1;
+	if (child->ignore_int) {
+		child->ignore_int = 0;
+		runner_signals_restore();
+	}
+	if (status && rc == 0)
+		*status = st;
+	return rc;
+}
+
+int runner_run(
+		const char *path,
+		char *const argv[],
+		const struct runner_opts *opts,
+		int *status)
+{
+	int rc;
+	struct runner_child child;
+
+	if ((rc = runner_spawn(path, argv, opts, &child)))
+		return rc;
+	return runner_wait(&child, status);
+}
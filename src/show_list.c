@@ -149,7 +149,8 @@ int vztt2_get_custom_pkgs(
 		goto cleanup_1;
 
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_1;
 	rc = pm_get_available(t, &installed, &available);
 	tmpl_unlock(lockdata, opts_vztt->flags);
@@ -213,6 +214,7 @@ int vztt2_get_ve_pkgs(
 
 	/* list of packages installed in VE */
 	struct package_list installed;
+	struct arena arena;
 
 	struct ve_config vc;
 	struct global_config gc;
@@ -227,7 +229,8 @@ int vztt2_get_ve_pkgs(
 	global_config_init(&gc);
 	vztt_config_init(&tc);
 	ve_config_init(&vc);
-	package_list_init(&installed);
+	arena_init(&arena);
+	package_list_init_arena(&installed, &arena);
 
 	/* read global vz config */
 	if ((rc = global_config_read(&gc, opts_vztt)))
@@ -356,7 +359,8 @@ int vztt2_get_ve_groups(
 	if ((rc = pm_set_root_dir(t, buf)))
 		goto cleanup_1;
 
-	if ((rc = tmpl_lock(&gc, tmpl->base, LOCK_READ, opts_vztt->flags, &lockdata)))
+	if ((rc = tmpl_lock(&gc, tmpl->base, LOCK_READ, opts_vztt->flags,
+			&lockdata, opts_vztt->progress_fd)))
 		goto cleanup_1;
 	rc = t->pm_get_group_list(t, groups);
 	tmpl_unlock(lockdata, opts_vztt->flags);
@@ -461,7 +465,8 @@ int vztt2_get_vzdir(const char *ctid, struct options_vztt *opts_vztt, char ***vz
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_1;
 
 	for (p = vzpackages.tqh_first; p != NULL; p = p->e.tqe_next) {
@@ -573,7 +578,8 @@ int vztt2_get_template_pkgs(
 		goto cleanup_1;
 
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_1;
 
 	rc = pm_modify(to, VZPKG_LIST, NULL, &available, &empty);
@@ -672,7 +678,8 @@ int vztt2_get_template_groups(
 	if ((rc = pm_create_tmp_root(to)))
 		goto cleanup_1;
 
-	if ((rc = tmpl_lock(&gc, tmpl->base, LOCK_READ, opts_vztt->flags, &lockdata)))
+	if ((rc = tmpl_lock(&gc, tmpl->base, LOCK_READ, opts_vztt->flags,
+			&lockdata, opts_vztt->progress_fd)))
 		goto cleanup_1;
 	rc = to->pm_get_group_list(to, groups);
 	tmpl_unlock(lockdata, opts_vztt->flags);
@@ -754,7 +761,7 @@ int vztt2_get_templates_list(
             return list_avail_get_list( ostemplate, ls , opts_vztt->templates );
 
 	/* load all OS and app templates */
-	if ((rc = tmplset_selective_load(gc.template_dir, ostemplate, NULL,\
+	if ((rc = tmplset_load_shared(gc.template_dir, ostemplate,
 			TMPLSET_LOAD_OS_LIST|TMPLSET_LOAD_APP_LIST, &tmpl,
 			opts_vztt)))
 		return rc;
@@ -1046,7 +1053,8 @@ int vztt2_get_cache_vzdir(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_2;
 
 	for (p = vzpackages.tqh_first; p != NULL; p = p->e.tqe_next) {
@@ -1121,7 +1129,8 @@ int vztt2_get_all_pkgs_vzdir(
 
 	/* lock template area on read */
 	if ((rc = tmpl_lock(&gc, tmpl->base,
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_1;
 
 	snprintf(template_dir, sizeof(template_dir), "%s/%s", \
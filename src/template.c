@@ -40,6 +40,7 @@
 #include <limits.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "vzcommon.h"
 #include "config.h"
@@ -61,6 +62,8 @@ static void init_tmpl(struct tmpl *tmpl)
 	repo_list_init(&tmpl->zypp_repositories);
 	repo_list_init(&tmpl->mirrorlist);
 	tmpl->golden_image = 1;
+	tmpl->loaded = 0;
+	tmpl->lazy = 0;
 }
 
 /* to initialize application template data */
@@ -256,6 +259,217 @@ void base_os_tmpl_clean(struct base_os_tmpl *tmpl)
 	tmpl_clean((struct tmpl *)tmpl);
 }
 
+/*
+Lines of template config files: the same files are read for every template
+set loading, so keep them while file is not changed (stat() only instead of
+open/read/close).
+*/
+struct tmpl_file {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtim;
+	struct timespec ctim;
+	struct string_list lines;
+	struct tmpl_file *next;
+};
+
+#define TMPL_FILE_HASH_SIZE 256
+
+static struct tmpl_file *tmpl_files[TMPL_FILE_HASH_SIZE];
+static pthread_mutex_t tmpl_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned tmpl_file_hash(const char *path)
+{
+	unsigned h = 5381;
+
+	while (*path)
+		h = h * 33 + (unsigned char)*path++;
+	return h % TMPL_FILE_HASH_SIZE;
+}
+
+static int tmpl_file_same(struct tmpl_file *f, struct stat *st)
+{
+	return f->dev == st->st_dev && f->ino == st->st_ino &&
+		f->size == st->st_size &&
+		f->mtim.tv_sec == st->st_mtim.tv_sec &&
+		f->mtim.tv_nsec == st->st_mtim.tv_nsec &&
+		f->ctim.tv_sec == st->st_ctim.tv_sec &&
+		f->ctim.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/*
+ add non-empty and non-comment lines of file <path> (leading and tailing
+ spaces omitted) into <lines>. Returns VZT_FILE_NFOUND if file is absent
+*/
+static int tmpl_file_read(const char *path, struct string_list *lines)
+{
+	int rc = 0;
+	char str[STRSIZ];
+	char *sp;
+	FILE *fp;
+	struct stat st;
+	struct tmpl_file *f, *n;
+	unsigned h = tmpl_file_hash(path);
+
+	if (stat(path, &st))
+		return VZT_FILE_NFOUND;
+
+	pthread_mutex_lock(&tmpl_files_mutex);
+	for (f = tmpl_files[h]; f; f = f->next)
+		if (strcmp(f->path, path) == 0)
+			break;
+	if (f && tmpl_file_same(f, &st)) {
+		rc = string_list_copy(lines, &f->lines);
+		pthread_mutex_unlock(&tmpl_files_mutex);
+		return rc;
+	}
+	pthread_mutex_unlock(&tmpl_files_mutex);
+
+	if ((n = (struct tmpl_file *)calloc(1, sizeof(*n))) == NULL) {
+		vztt_logger(0, errno, "Cannot alloc memory");
+		return VZT_CANT_ALLOC_MEM;
+	}
+	string_list_init(&n->lines);
+	if (!(fp = fopen(path, "r"))) {
+		free(n);
+		vztt_logger(0, errno, "Can not open %s", path);
+		return VZT_CANT_OPEN;
+	}
+	/* stat of opened file corresponds to read content */
+	if (fstat(fileno(fp), &st) == 0) {
+		while (fgets(str, sizeof(str), fp)) {
+			if ((sp = cut_off_string(str)) == NULL)
+				continue;
+			if ((rc = string_list_add(&n->lines, sp)))
+				break;
+		}
+	}
+	fclose(fp);
+	if (rc == 0)
+		rc = string_list_copy(lines, &n->lines);
+
+	/* file could be changed in the same time tick after reading */
+	if (rc || st.st_mtim.tv_sec >= time(NULL) - 1 ||
+			(n->path = strdup(path)) == NULL) {
+		string_list_clean(&n->lines);
+		free(n);
+		return rc;
+	}
+	n->dev = st.st_dev;
+	n->ino = st.st_ino;
+	n->size = st.st_size;
+	n->mtim = st.st_mtim;
+	n->ctim = st.st_ctim;
+
+	pthread_mutex_lock(&tmpl_files_mutex);
+	for (f = tmpl_files[h]; f; f = f->next) {
+		if (strcmp(f->path, path) == 0) {
+			/* replace stale record */
+			string_list_clean(&f->lines);
+			string_list_move(&f->lines, &n->lines);
+			f->dev = n->dev;
+			f->ino = n->ino;
+			f->size = n->size;
+			f->mtim = n->mtim;
+			f->ctim = n->ctim;
+			free(n->path);
+			free(n);
+			n = NULL;
+			break;
+		}
+	}
+	if (n) {
+		n->next = tmpl_files[h];
+		tmpl_files[h] = n;
+	}
+	pthread_mutex_unlock(&tmpl_files_mutex);
+
+	return 0;
+}
+
+/* the same as string_list_read(), via template files cache */
+static int tmpl_string_list_read(const char *path, struct string_list *ls)
+{
+	int rc;
+
+	if ((rc = tmpl_file_read(path, ls)) == VZT_FILE_NFOUND)
+		return 0;
+	return rc;
+}
+
+/* the same as string_list_read2(), via template files cache */
+static int tmpl_string_list_read2(const char *path, struct string_list *ls)
+{
+	int rc;
+	char str[STRSIZ];
+	char *ep, *token;
+	char *saveptr;
+	struct string_list lines;
+	struct string_list_el *p;
+
+	string_list_init(&lines);
+	if ((rc = tmpl_file_read(path, &lines))) {
+		string_list_clean(&lines);
+		return (rc == VZT_FILE_NFOUND) ? 0 : rc;
+	}
+	string_list_for_each(&lines, p) {
+		strncpy(str, p->s, sizeof(str) - 1);
+		str[sizeof(str) - 1] = '\0';
+		for (ep = str; ;ep = NULL) {
+			if ((token = strtok_r(ep, " 	", &saveptr)) == NULL)
+				break;
+			if ((rc = string_list_add(ls, token)))
+				break;
+		}
+		if (rc)
+			break;
+	}
+	string_list_clean(&lines);
+	return rc;
+}
+
+/* the same as read_string(), via template files cache */
+static int tmpl_read_string(char *path, char **str)
+{
+	int rc;
+	struct string_list lines;
+
+	string_list_init(&lines);
+	if ((rc = tmpl_file_read(path, &lines)) == 0 &&
+			!string_list_empty(&lines)) {
+		if ((*str = strdup(lines.tqh_first->s)) == NULL) {
+			vztt_logger(0, errno, "Cannot alloc memory");
+			rc = VZT_CANT_ALLOC_MEM;
+		}
+	}
+	string_list_clean(&lines);
+	return (rc == VZT_FILE_NFOUND) ? 0 : rc;
+}
+
+/* the same as repo_list_read(), via template files cache */
+static int tmpl_repo_list_read(
+		char *path,
+		char *id,
+		int *num,
+		struct repo_list *ls)
+{
+	int rc;
+	struct string_list lines;
+	struct string_list_el *p;
+
+	string_list_init(&lines);
+	if ((rc = tmpl_file_read(path, &lines)) == 0) {
+		string_list_for_each(&lines, p) {
+			if ((rc = repo_list_add(ls, p->s, id, (*num)++)))
+				break;
+		}
+	}
+	string_list_clean(&lines);
+	return (rc == VZT_FILE_NFOUND) ? 0 : rc;
+}
+
 /* load common templates data from files */
 static int load_tmpl(unsigned long fld_mask, struct tmpl *tmpl)
 {
@@ -264,6 +478,9 @@ static int load_tmpl(unsigned long fld_mask, struct tmpl *tmpl)
 	int rc;
 	int num = 0;
 
+	/* already loaded fields are not read again */
+	fld_mask &= ~tmpl->loaded;
+
 	/* read os template package list */
 	if (fld_mask & VZTT_INFO_PACKAGES) {
 		snprintf(path, sizeof(path), "%s/packages", tmpl->confdir);
@@ -272,7 +489,7 @@ static int load_tmpl(unsigned long fld_mask, struct tmpl *tmpl)
 				"%s EZ template", tmpl->name);
 			return VZT_TMPL_BROKEN;
 		}
-		if ((rc = string_list_read2(path, &tmpl->packages)) != 0) {
+		if ((rc = tmpl_string_list_read2(path, &tmpl->packages)) != 0) {
 			vztt_logger(0, 0, "Can not read packages file for "\
 				"%s EZ template", tmpl->name);
 			return VZT_TMPL_BROKEN;
@@ -282,29 +499,29 @@ static int load_tmpl(unsigned long fld_mask, struct tmpl *tmpl)
 	/* read repositories and mirrorlist */
 	if (fld_mask & VZTT_INFO_REPOSITORIES) {
 		snprintf(path, sizeof(path), "%s/repositories", tmpl->confdir);
-		repo_list_read(path, tmpl->reponame, &num, &tmpl->repositories);
+		tmpl_repo_list_read(path, tmpl->reponame, &num, &tmpl->repositories);
 		snprintf(path, sizeof(path), "%s/zypp_repositories", tmpl->confdir);
-		repo_list_read(path, tmpl->reponame, &num, &tmpl->zypp_repositories);
+		tmpl_repo_list_read(path, tmpl->reponame, &num, &tmpl->zypp_repositories);
 	}
 	if (fld_mask & VZTT_INFO_MIRRORLIST) {
 		snprintf(path, sizeof(path), "%s/mirrorlist", tmpl->confdir);
-		repo_list_read(path, tmpl->reponame, &num, &tmpl->mirrorlist);
+		tmpl_repo_list_read(path, tmpl->reponame, &num, &tmpl->mirrorlist);
 	}
 
 	/* description & summary */
 	if (fld_mask & VZTT_INFO_DESCRIPTION) {
 		snprintf(path, sizeof(path), "%s/description", tmpl->confdir);
-		string_list_read(path, &tmpl->description);
+		tmpl_string_list_read(path, &tmpl->description);
 	}
 	if (fld_mask & VZTT_INFO_SUMMARY) {
 		snprintf(path, sizeof(path), "%s/summary", tmpl->confdir);
-		read_string(path, &tmpl->summary);
+		tmpl_read_string(path, &tmpl->summary);
 	}
 
 	/* Check for golden image support */
 	if (fld_mask & VZTT_INFO_GOLDEN_IMAGE) {
 		snprintf(path, sizeof(path), "%s/golden_image", tmpl->confdir);
-		read_string(path, &val);
+		tmpl_read_string(path, &val);
 		if (is_disabled(val))
 			tmpl->golden_image = 0;
 		free(val);
@@ -317,6 +534,8 @@ static int load_tmpl(unsigned long fld_mask, struct tmpl *tmpl)
 			tmpl->no_pkgs_actions = 1;
 	}
 
+	tmpl->loaded |= fld_mask;
+	tmpl->lazy &= ~fld_mask;
 	return 0;
 }
 
@@ -332,21 +551,23 @@ int load_os_tmpl(unsigned long fld_mask, struct os_tmpl *tmpl)
 	char path[PATH_MAX+1];
 	int rc;
 
+	fld_mask &= ~tmpl->loaded;
+
 	/* read common part */
 	if ((rc = load_tmpl(fld_mask, (struct tmpl *)tmpl)))
 		return rc;
 
 	if (fld_mask & VZTT_INFO_ENVIRONMENT) {
 		snprintf(path, sizeof(path), "%s/environment", tmpl->confdir);
-		string_list_read(path, &tmpl->environment);
+		tmpl_string_list_read(path, &tmpl->environment);
 	}
 	if (fld_mask & VZTT_INFO_PACKAGES0) {
 		snprintf(path, sizeof(path), "%s/packages_0", tmpl->confdir);
-		string_list_read(path, &tmpl->packages0);
+		tmpl_string_list_read(path, &tmpl->packages0);
 	}
 	if (fld_mask & VZTT_INFO_PACKAGES1) {
 		snprintf(path, sizeof(path), "%s/packages_1", tmpl->confdir);
-		string_list_read2(path, &tmpl->packages1);
+		tmpl_string_list_read2(path, &tmpl->packages1);
 	}
 
 	return 0;
@@ -397,19 +618,12 @@ static int known_jquota(char *osname, char *osver, int *jquota)
 	return 0;
 }
 
-/* load base os template data from files */
-int load_base_os_tmpl(unsigned long fld_mask, struct base_os_tmpl *tmpl)
+/* read mandatory base os template data */
+static int load_base_os_tmpl_mandatory(struct base_os_tmpl *tmpl)
 {
 	char path[PATH_MAX+1];
 	char *cache_type, *multiarch;
 	int rc;
-	struct string_list technologies;
-	struct string_list_el *p;
-	unsigned long tech;
-
-	/* read common os template part */
-	if ((rc = load_os_tmpl(fld_mask, (struct os_tmpl *)tmpl)))
-		return rc;
 
 	/* mandatory read package manager */
 	snprintf(path, sizeof(path), "%s/package_manager", 
@@ -419,7 +633,7 @@ int load_base_os_tmpl(unsigned long fld_mask, struct base_os_tmpl *tmpl)
 			"for %s EZ template", tmpl->name);
 		return VZT_TMPL_BROKEN;
 	}
-	if ((rc = read_string(path, &tmpl->package_manager))) {
+	if ((rc = tmpl_read_string(path, &tmpl->package_manager))) {
 		vztt_logger(0, 0, "Can not read package_manager file "\
 			"for %s EZ os template", tmpl->name);
 		return VZT_TMPL_BROKEN;
@@ -451,9 +665,58 @@ int load_base_os_tmpl(unsigned long fld_mask, struct base_os_tmpl *tmpl)
 	}
 #endif
 
+	/* enable multiarch (allow 32bit pkgs on 64bit arch?) */
+	snprintf(path, sizeof(path), "%s/multiarch", tmpl->confdir);
+	if(access(path, F_OK) == 0) {
+		if((rc = tmpl_read_string(path, &multiarch))) {
+			vztt_logger(0, 0, "Can not read multiarch file " \
+			    "for %s EZ os template", tmpl->name);
+			return VZT_TMPL_BROKEN;
+		}
+		tmpl->multiarch = !is_disabled(multiarch);
+		free(multiarch);
+	}
+
+	/* Cache type. Ignore if unavailable */
+	snprintf(path, sizeof(path), "%s/cache_type", tmpl->confdir);
+	if (access(path, F_OK))
+		return 0;
+
+	if ((rc = tmpl_read_string(path, &cache_type))) {
+		vztt_logger(0, 0, "Can not read cache_type file " \
+			"for %s EZ os template", tmpl->name);
+		return VZT_TMPL_BROKEN;
+	}
+
+	tmpl->cache_type = atol(cache_type);
+	free(cache_type);
+
+	return 0;
+}
+
+/* load base os template data from files */
+int load_base_os_tmpl(unsigned long fld_mask, struct base_os_tmpl *tmpl)
+{
+	char path[PATH_MAX+1];
+	int rc;
+	struct string_list technologies;
+	struct string_list_el *p;
+	unsigned long tech;
+
+	fld_mask &= ~tmpl->loaded;
+
+	/* read common os template part */
+	if ((rc = load_os_tmpl(fld_mask, (struct os_tmpl *)tmpl)))
+		return rc;
+
+	/* mandatory part is read on first loading only */
+	if (tmpl->package_manager == NULL &&
+			(rc = load_base_os_tmpl_mandatory(tmpl)))
+		return rc;
+
 	if (fld_mask & VZTT_INFO_OSRELEASE) {
 		snprintf(path, sizeof(path), "%s/osrelease", tmpl->confdir);
-		read_string(path, &tmpl->osrelease);
+		tmpl_read_string(path, &tmpl->osrelease);
 	}
 
 	if (fld_mask & VZTT_INFO_JQUOTA) {
@@ -473,26 +736,26 @@ int load_base_os_tmpl(unsigned long fld_mask, struct base_os_tmpl *tmpl)
 
 	if (fld_mask & VZTT_INFO_DISTRIBUTION) {
 		snprintf(path, sizeof(path), "%s/distribution", tmpl->confdir);
-		read_string(path, &tmpl->distribution);
+		tmpl_read_string(path, &tmpl->distribution);
 	}
 
 	if (fld_mask & VZTT_INFO_UPGRADABLE_VERSIONS) {
 		snprintf(path, sizeof(path), "%s/upgradable_versions", 
 			tmpl->confdir);
 		if (!access(path, F_OK))
-			string_list_read2(path, &tmpl->upgradable_versions);
+			tmpl_string_list_read2(path, &tmpl->upgradable_versions);
 	}
 
 	if (fld_mask & VZTT_INFO_TECHNOLOGIES) {
 		/* read technologies to temporary list */
 		string_list_init(&technologies);
 		snprintf(path, sizeof(path), "%s/technologies", tmpl->confdir);
-		string_list_read2(path, &technologies);
+		tmpl_string_list_read2(path, &technologies);
 
 		/* add technologies from package manager */
 		snprintf(path, sizeof(path), VZ_PKGENV_DIR "%s/technologies", \
 			tmpl->package_manager);
-		string_list_read2(path, &technologies);
+		tmpl_string_list_read2(path, &technologies);
 		/* convert list into ulong */
 		for (p = technologies.tqh_first; p != NULL; p = p->e.tqe_next) {
 			if ((tech = vzctl2_name2tech(p->s)) == 0) {
@@ -505,32 +768,7 @@ int load_base_os_tmpl(unsigned long fld_mask, struct base_os_tmpl *tmpl)
 		string_list_clean(&technologies);
 	}
 
-	/* enable multiarch (allow 32bit pkgs on 64bit arch?) */
-	snprintf(path, sizeof(path), "%s/multiarch", tmpl->confdir);
-	if(access(path, F_OK) == 0) {
-		if((rc = read_string(path, &multiarch))) {
-			vztt_logger(0, 0, "Can not read multiarch file " \
-			    "for %s EZ os template", tmpl->name);
-			return VZT_TMPL_BROKEN;
-		}
-		tmpl->multiarch = !is_disabled(multiarch);
-		free(multiarch);
-	}
-
-	/* Cache type. Ignore if unavailable */
-	snprintf(path, sizeof(path), "%s/cache_type", tmpl->confdir);
-	if (access(path, F_OK))
-		return 0;
-
-	if ((rc = read_string(path, &cache_type))) {
-		vztt_logger(0, 0, "Can not read cache_type file " \
-			"for %s EZ os template", tmpl->name);
-		return VZT_TMPL_BROKEN;
-	}
-
-	tmpl->cache_type = atol(cache_type);
-	free(cache_type);
-
+	tmpl->loaded |= fld_mask;
 	return 0;
 }
 
@@ -611,6 +849,8 @@ int app_tmpl_get_info(
 {
 	int rc;
 
+	if (app->lazy && (rc = load_app_tmpl(app->lazy, app)))
+		return rc;
 	if ((rc = tmpl_get_info((struct tmpl *)app, url_map, info)))
 		return rc;
 	return 0;
@@ -629,6 +869,8 @@ int os_tmpl_get_info(
 	const char *t;
 	char path[PATH_MAX+1];
 
+	if (os->lazy && (rc = load_os_tmpl(os->lazy, os)))
+		return rc;
 	if ((rc = tmpl_get_info((struct tmpl *)os, url_map, info)))
 		return rc;
 
@@ -1135,7 +1377,7 @@ int tmpl_get_rpm(struct tmpl *tmpl, char **rpm)
 int compare_template_package_version(char *tname, char *package, char *version, int *eval)
 {
 	int rc = 0;
-	void *lockdata;
+	void *lockdata, *mdlockdata = NULL;
 	char *buf = 0;
 	char *pv;
 
@@ -1195,18 +1437,25 @@ int compare_template_package_version(char *tname, char *package, char *version,
 	if (check_metadata(tmpl->base->basedir, tmpl->base->name,
 			METADATA_EXPIRE_MAX, opts_vztt->data_source))
 	{
-		if ((rc = tmpl_lock(&gc, tmpl->base,
-				LOCK_WRITE, opts_vztt->flags, &lockdata)))
-			goto cleanup_1;
-
-		if ((rc = to->pm_update_metadata(to, tmpl->base->name)))
+		if ((rc = metadata_lock(&gc, tmpl->base,
+				LOCK_WRITE, opts_vztt->flags, &mdlockdata,
+				opts_vztt->progress_fd)))
 			goto cleanup_1;
 	}
-	else
-	{
-		if ((rc = tmpl_lock(&gc, tmpl->base,
-				LOCK_READ, opts_vztt->flags, &lockdata)))
+	if ((rc = tmpl_lock(&gc, tmpl->base,
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd))) {
+		if (mdlockdata)
+			metadata_unlock(mdlockdata, opts_vztt->flags);
+		goto cleanup_1;
+	}
+	if (mdlockdata) {
+		rc = to->pm_update_metadata(to, tmpl->base->name);
+		metadata_unlock(mdlockdata, opts_vztt->flags);
+		if (rc) {
+			tmpl_unlock(lockdata, opts_vztt->flags);
 			goto cleanup_1;
+		}
 	}
 
 	rc = pm_modify(to, VZPKG_LIST, NULL, &available, &empty);
@@ -39,6 +39,8 @@
 #include <error.h>
 #include <limits.h>
 #include <string.h>
+#include <libgen.h>
+#include <pthread.h>
 
 #include "vzcommon.h"
 #include "config.h"
@@ -46,6 +48,8 @@
 #include "util.h"
 #include "tmplset.h"
 #include "vztt.h"
+#include "watch.h"
+#include "catalog.h"
 
 /*
 Templates are OS & Application templates.
@@ -478,6 +482,7 @@ static int tmplset_init_template(
 	app_tmpl_list_init(&(*tmpl)->avail_apps);
 	app_tmpl_list_init(&(*tmpl)->used_apps);
 	(*tmpl)->mode = TMPLSET_DEF_MODE;
+	(*tmpl)->refs = 0;
 
 	if (((*tmpl)->base = (struct base_os_tmpl *)\
 			malloc(sizeof(struct base_os_tmpl))) == NULL) {
@@ -537,16 +542,20 @@ static int tmplset_init_template(
 }
 
 /*
- load data from files for already initialized base os, extra os and application
+ load data from files for already initialized base os, extra os and application.
+ If <lazy> is set, TMPLSET_LAZY_FIELDS of os and application templates lists
+ are read on first access only (info or marking)
 */
 static int tmplset_load_template(
 		struct tmpl_set *t,
 		int mask,
-		unsigned long fld_mask)
+		unsigned long fld_mask,
+		int lazy)
 {
 	int rc;
 	struct os_tmpl_list_el *o;
 	struct app_tmpl_list_el *a;
+	unsigned long deferred = lazy ? (fld_mask & TMPLSET_LAZY_FIELDS) : 0;
 
 	if ((rc = load_base_os_tmpl(fld_mask, t->base)))
 		return rc;
@@ -559,16 +568,20 @@ static int tmplset_load_template(
 
 	/* os templates list */
 	if (mask & TMPLSET_LOAD_OS_LIST) {
-		for (o = t->oses.tqh_first; o != NULL; o = o->e.tqe_next)
-			if ((rc = load_os_tmpl(fld_mask, o->tmpl)))
+		for (o = t->oses.tqh_first; o != NULL; o = o->e.tqe_next) {
+			if ((rc = load_os_tmpl(fld_mask & ~deferred, o->tmpl)))
 				return rc;
+			o->tmpl->lazy |= deferred;
+		}
 	}
 
 	/* load available application template list */
 	if (mask & TMPLSET_LOAD_APP_LIST) {
-		for (a = t->avail_apps.tqh_first; a != NULL; a = a->e.tqe_next)
-			if ((rc = load_app_tmpl(fld_mask, a->tmpl)))
+		for (a = t->avail_apps.tqh_first; a != NULL; a = a->e.tqe_next) {
+			if ((rc = load_app_tmpl(fld_mask & ~deferred, a->tmpl)))
 				return rc;
+			a->tmpl->lazy |= deferred;
+		}
 	}
 
 	return 0;
@@ -795,11 +808,38 @@ fail:
 	return rc;
 }
 
+/*
+Shared template sets cache: parsed sets are kept while config directories
+of their templates are not changed (see watch.h).
+*/
+struct tmplset_cache {
+	char *tmpldir;
+	char *ostemplate;
+	int mask;
+	struct tmpl_set *tmpl;
+	struct watch_stamp *stamps;
+	size_t nstamps;
+	struct tmplset_cache *next;
+};
+
+static pthread_mutex_t tmplset_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct tmplset_cache *tmplset_cache;
+
 /* clean template structure */
 void tmplset_clean(struct tmpl_set *t)
 {
 	struct os_tmpl_list_el *o;
 	struct app_tmpl_list_el *a;
+	int refs;
+
+	/* shared set: release reference only */
+	if (t->refs) {
+		pthread_mutex_lock(&tmplset_cache_mutex);
+		refs = --t->refs;
+		pthread_mutex_unlock(&tmplset_cache_mutex);
+		if (refs)
+			return;
+	}
 
 	/* clean used structures */
 	if (t->base)
@@ -846,7 +886,7 @@ int tmplset_load(
 	if ((rc = tmplset_init(tmpldir, ostemplate, apps, mask, tmpl, flags)))
 		return rc;
 
-	if ((rc = tmplset_load_template(*tmpl, mask, VZTT_INFO_TMPL_ALL)))
+	if ((rc = tmplset_load_template(*tmpl, mask, VZTT_INFO_TMPL_ALL, 1)))
 		return rc;
 
 	return 0;
@@ -870,12 +910,224 @@ int tmplset_selective_load(
 		opts_vztt->flags & ~OPT_VZTT_USE_VZUP2DATE)))
 		return rc;
 
-	if ((rc = tmplset_load_template(*tmpl, mask, opts_vztt->fld_mask)))
+	if ((rc = tmplset_load_template(*tmpl, mask, opts_vztt->fld_mask, 1)))
 		return rc;
 
 	return 0;
 }
 
+/* free cache entry, returns its set if it is not used anymore.
+   Should be called with tmplset_cache_mutex locked */
+static struct tmpl_set *tmplset_cache_free(struct tmplset_cache *c)
+{
+	struct tmpl_set *t = c->tmpl;
+
+	free(c->tmpldir);
+	free(c->ostemplate);
+	free(c->stamps);
+	free(c);
+	if (t && --t->refs == 0)
+		return t;
+	return NULL;
+}
+
+static int tmplset_cache_valid(struct tmplset_cache *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->nstamps; i++)
+		if (!watch_check(&c->stamps[i]))
+			return 0;
+	return 1;
+}
+
+static int tmplset_cache_add_dir(struct string_list *dirs, char *dir)
+{
+	if (string_list_find(dirs, dir))
+		return 0;
+	return string_list_add(dirs, dir);
+}
+
+/* get stamps of config directories of all templates of <t> */
+static int tmplset_cache_stamps(struct tmpl_set *t, struct tmplset_cache *c)
+{
+	int rc = 0;
+	char path[PATH_MAX+1];
+	struct string_list dirs;
+	struct string_list_el *p;
+	struct os_tmpl_list_el *o;
+	struct app_tmpl_list_el *a;
+	size_t i;
+
+	string_list_init(&dirs);
+
+	/* templates lists */
+	snprintf(path, sizeof(path), "%s/config", t->base->basedir);
+	if ((rc = tmplset_cache_add_dir(&dirs, path)))
+		goto cleanup;
+	snprintf(path, sizeof(path), "%s/config/os", t->base->basedir);
+	if ((rc = tmplset_cache_add_dir(&dirs, path)))
+		goto cleanup;
+	snprintf(path, sizeof(path), "%s/config/app", t->base->basedir);
+	if (access(path, F_OK) == 0 &&
+			(rc = tmplset_cache_add_dir(&dirs, path)))
+		goto cleanup;
+
+	/* templates data */
+	if ((rc = tmplset_cache_add_dir(&dirs, t->base->confdir)))
+		goto cleanup;
+	if ((rc = tmplset_cache_add_dir(&dirs, t->os->confdir)))
+		goto cleanup;
+	os_tmpl_list_for_each(&t->oses, o) {
+		if ((rc = tmplset_cache_add_dir(&dirs, o->tmpl->confdir)))
+			goto cleanup;
+	}
+	app_tmpl_list_for_each(&t->avail_apps, a) {
+		if ((rc = tmplset_cache_add_dir(&dirs, a->tmpl->confdir)))
+			goto cleanup;
+		strncpy(path, a->tmpl->confdir, sizeof(path) - 1);
+		path[sizeof(path) - 1] = '\0';
+		if ((rc = tmplset_cache_add_dir(&dirs, dirname(path))))
+			goto cleanup;
+	}
+
+	c->nstamps = string_list_size(&dirs);
+	if ((c->stamps = (struct watch_stamp *)calloc(c->nstamps,
+			sizeof(struct watch_stamp))) == NULL) {
+		vztt_logger(0, errno, "Cannot alloc memory");
+		rc = VZT_CANT_ALLOC_MEM;
+		goto cleanup;
+	}
+	i = 0;
+	string_list_for_each(&dirs, p) {
+		if ((rc = watch_get(p->s, &c->stamps[i++])))
+			break;
+	}
+
+cleanup:
+	string_list_clean(&dirs);
+	return rc;
+}
+
+/*
+ get template set for os template <ostemplate> from cache of shared sets,
+ load and add it into cache if absent or stale.
+ Without watching private set is loaded according fields mask.
+*/
+int tmplset_load_shared(
+		char *tmpldir,
+		char *ostemplate,
+		int mask,
+		struct tmpl_set **tmpl,
+		struct options_vztt *opts_vztt)
+{
+	int rc;
+	int flags = opts_vztt->flags & ~OPT_VZTT_USE_VZUP2DATE;
+	struct tmplset_cache *c, **pc;
+	struct tmpl_set *t, *stale = NULL;
+
+	if (!watch_enabled())
+		return tmplset_selective_load(tmpldir, ostemplate, NULL,
+			mask, tmpl, opts_vztt);
+
+	watch_sync();
+	pthread_mutex_lock(&tmplset_cache_mutex);
+	for (pc = &tmplset_cache; (c = *pc); pc = &c->next) {
+		if (c->mask == mask && strcmp(c->ostemplate, ostemplate) == 0 &&
+				strcmp(c->tmpldir, tmpldir) == 0)
+			break;
+	}
+	if (c && tmplset_cache_valid(c)) {
+		c->tmpl->refs++;
+		*tmpl = c->tmpl;
+		pthread_mutex_unlock(&tmplset_cache_mutex);
+		/* cached set could be loaded with force option */
+		if (!(flags & OPT_VZTT_FORCE) &&
+				(rc = tmplset_check_arch((*tmpl)->base->osarch))) {
+			tmplset_clean(*tmpl);
+			return rc;
+		}
+		return 0;
+	}
+	if (c) {
+		*pc = c->next;
+		stale = tmplset_cache_free(c);
+	}
+	pthread_mutex_unlock(&tmplset_cache_mutex);
+	if (stale)
+		tmplset_clean(stale);
+
+	if ((rc = tmplset_init(tmpldir, ostemplate, NULL, mask, &t, flags)))
+		return rc;
+
+	/* stamps are taken before templates data reading,
+	   set which can not be cached is returned as private one */
+	if ((c = (struct tmplset_cache *)calloc(1, sizeof(*c))) != NULL) {
+		c->mask = mask;
+		c->tmpldir = strdup(tmpldir);
+		c->ostemplate = strdup(ostemplate);
+		if (c->tmpldir == NULL || c->ostemplate == NULL ||
+				tmplset_cache_stamps(t, c)) {
+			tmplset_cache_free(c);
+			c = NULL;
+		}
+	}
+
+	/* shared set is read-only, so it is loaded completely */
+	if ((rc = tmplset_load_template(t, mask, VZTT_INFO_TMPL_ALL, 0))) {
+		if (c)
+			tmplset_cache_free(c);
+		tmplset_clean(t);
+		return rc;
+	}
+	*tmpl = t;
+	if (c == NULL)
+		return 0;
+
+	/* changed during reading or cached by other thread */
+	watch_sync();
+	pthread_mutex_lock(&tmplset_cache_mutex);
+	for (pc = &tmplset_cache; *pc; pc = &(*pc)->next) {
+		if ((*pc)->mask == mask &&
+				strcmp((*pc)->ostemplate, ostemplate) == 0 &&
+				strcmp((*pc)->tmpldir, tmpldir) == 0)
+			break;
+	}
+	if (*pc == NULL && tmplset_cache_valid(c)) {
+		/* reference of cache and of caller */
+		t->refs = 2;
+		c->tmpl = t;
+		c->next = tmplset_cache;
+		tmplset_cache = c;
+		c = NULL;
+	}
+	pthread_mutex_unlock(&tmplset_cache_mutex);
+	if (c)
+		tmplset_cache_free(c);
+
+	return 0;
+}
+
+/* read deferred fields of marked templates: they are used by operations */
+static int tmplset_load_marked(struct tmpl_set *t)
+{
+	int rc;
+	struct os_tmpl_list_el *o;
+	struct app_tmpl_list_el *a;
+
+	os_tmpl_list_for_each(&t->oses, o) {
+		if (o->tmpl->marker && o->tmpl->lazy &&
+				(rc = load_os_tmpl(o->tmpl->lazy, o->tmpl)))
+			return rc;
+	}
+	app_tmpl_list_for_each(&t->avail_apps, a) {
+		if (a->tmpl->marker && a->tmpl->lazy &&
+				(rc = load_app_tmpl(a->tmpl->lazy, a->tmpl)))
+			return rc;
+	}
+	return 0;
+}
+
 /* mark templates in <t> according names from <ls>
    use os, oses, avail_apps and used_apps fields according <mask>
    not found names will add into <nf>, if it is not NULL
@@ -910,7 +1162,7 @@ int tmplset_mark(
 			os_tmpl_list_for_each(&t->oses, o)
 				o->tmpl->marker = 1;
 		}
-		return 0;
+		return tmplset_load_marked(t);
 	}
 
 	struct string_list found;
@@ -947,7 +1199,8 @@ int tmplset_mark(
 		if (nf)
 			string_list_add(nf, p->s);
 	}
-	return 0;
+	string_list_clean(&found);
+	return tmplset_load_marked(t);
 }
 
 /* unmark all templates */
@@ -1346,7 +1599,7 @@ static int cutout_whole_pkgset(
 		struct package_list *dst,
 		struct string_list *src)
 {
-	struct package_list_el *d;
+	struct package_list_el *d, *next;
 
 	/* clear markers */
 	package_list_for_each(dst, d) {
@@ -1358,9 +1611,10 @@ static int cutout_whole_pkgset(
 		return 1;
 
 	/* remove marked packages from dst */
-	package_list_for_each(dst, d) {
+	for (d = dst->tqh_first; d != NULL; d = next) {
+		next = d->e.tqe_next;
 		if (d->p->marker)
-			d = package_list_remove(dst, d);
+			package_list_remove(dst, d);
 	}
 
 	return 0;
@@ -1730,7 +1984,7 @@ int tmplset_find_upgrade(
 	}
 
 	if ((rc = tmplset_load_template(*dst, TMPLSET_LOAD_APP_LIST,
-			VZTT_INFO_TMPL_ALL)))
+			VZTT_INFO_TMPL_ALL, 1)))
 		return rc;
 
 	return 0;
@@ -1922,136 +2176,12 @@ int tmplset_get_os_names(struct tmpl_set *t, struct string_list *names)
         return 0;
 }
 
-/* seek base OS templates in /vz/template/<osname> directory */
-static int tmplset_seek_base(
-		char *dirname,
-		char *osname,
-		struct string_list *ls)
-{
-	char buf[PATH_MAX+1];
-	DIR * dir;
-	char dirent_buf[sizeof(struct dirent) + PATH_MAX + 1];
-	struct dirent *de = (struct dirent *) dirent_buf;
-	struct dirent *result;
-	int retval;
-	struct stat st;
-	int rc = 0, i;
-	char **archs = get_available_archs();
-
-	if ((dir = opendir(dirname)) == NULL) {
-		vztt_logger(0, errno, "opendir(\"%s\") error", dirname);
-		return VZT_CANT_OPEN;
-	}
-
-	while (1) {
-		if ((retval = readdir_r(dir, de, &result)) != 0)
-		{
-			vztt_logger(0, retval, "readdir_r(\"%s\") error",
-					dirname);
-			rc = VZT_CANT_READ;
-			break;
-		}
-
-		if (result == NULL)
-			break;
-
-		if(strcmp(de->d_name, ".") == 0)
-			continue;
-		if(strcmp(de->d_name, "..") == 0)
-			continue;
-
-		snprintf(buf, sizeof(buf), "%s/%s", dirname, de->d_name);
-		if (lstat(buf, &st)) {
-			vztt_logger(0, errno, "stat(\"%s\") error", buf);
-			continue;
-		}
-		if (!S_ISDIR(st.st_mode))
-			continue;
-
-		/* seek all available template architectures */
-		for (i = 0; archs[i]; i++) {
-			snprintf(buf, sizeof(buf), \
-				"%s/%s/%s/config/os/" DEFSETNAME, \
-				dirname, de->d_name, archs[i]);
-			if (is_base_os_tmpl(buf)) {
-				snprintf(buf, sizeof(buf), "%s-%s-%s", \
-					osname, de->d_name, archs[i]);
-				string_list_add(ls, buf);
-			}
-		}
-	}
-	closedir(dir);
-
-	return rc;
-}
-
 /* seek all base OS templates in <tmpldir> directory */
 int tmplset_get_all_base(
 		char *tmpldir,
 		struct string_list *ls)
 {
-	char buf[PATH_MAX+1];
-	char path[PATH_MAX+1];
-	DIR * dir;
-	char dirent_buf[sizeof(struct dirent) + PATH_MAX + 1];
-	struct dirent *de = (struct dirent *) dirent_buf;
-	struct dirent *result;
-	int retval;
-	struct stat st;
-	int rc = 0;
-
-	if ((dir = opendir(tmpldir)) == NULL) {
-		if (errno != ENOENT) {
-			vztt_logger(0, errno, "opendir(\"%s\") error", tmpldir);
-			return VZT_CANT_OPEN;
-		} else {
-			/* skip ENOENT (#116418) */
-			vztt_logger(1, 0, "Warning: template area directory %s "\
-				"does not exist", tmpldir);
-			return 0;
-		}
-	}
-
-	while (1) {
-		if ((retval = readdir_r(dir, de, &result)) != 0)
-		{
-			vztt_logger(0, retval, "readdir_r(\"%s\") error",
-					tmpldir);
-			rc = VZT_CANT_READ;
-			break;
-		}
-
-		if (result == NULL)
-			break;
-
-		if(strcmp(de->d_name, ".") == 0)
-			continue;
-		if(strcmp(de->d_name, "..") == 0)
-			continue;
-
-		snprintf(path, sizeof(path), "%s/%s", tmpldir, de->d_name);
-		if (lstat(path, &st)) {
-			vztt_logger(0, errno, "stat(\"%s\") error", path);
-			continue;
-		}
-		if (!S_ISDIR(st.st_mode))
-			continue;
-
-		/* is it standard template directory?
-		  seek /vz/template/<template name>/conf directory */
-		snprintf(buf, sizeof(buf), "%s/%s/conf", tmpldir, de->d_name);
-		if (lstat(buf, &st) ==0 ) {
-			if (S_ISDIR(st.st_mode))
-				continue;
-		}
-
-		snprintf(path, sizeof(path), "%s/%s", tmpldir, de->d_name);
-		if ((rc = tmplset_seek_base(path, de->d_name, ls)))
-			break;
-	}
-	closedir(dir);
-
-	return rc;
+	return catalog_get_all_base(tmpldir, ls);
 }
 
 /* alloc template array */
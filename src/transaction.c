@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <sched.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/utsname.h>
@@ -48,6 +49,7 @@
 #include <ctype.h>
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <vzctl/libvzctl.h>
 
 #include "vzcommon.h"
@@ -59,6 +61,8 @@
 #include "yum.h"
 #include "zypper.h"
 #include "util.h"
+#include "pkgindex.h"
+#include "runner.h"
 
 int find_tmp_dir(char **tmp_dir)
 {
@@ -351,7 +355,8 @@ int pm_clean(struct Transaction *pm)
 	repo_list_clean(&pm->mirrorlists);
 
 	if (pm->tmpdir) {
-		if ((rc = remove_directory(pm->tmpdir))) {
+		/* temporary root can be huge, do not wait for it */
+		if ((rc = remove_directory_bg(pm->tmpdir))) {
 			vztt_logger(0, 0, "Can not remove %s directory", pm->tmpdir);
 			return rc;
 		}
@@ -475,7 +480,6 @@ int add_tmpl_envs(
 
 #define K_VERSION(a,b,c) (((a) << 16) + ((b) << 8) + (c))
 #define OSRELEASE_SIZE 10
-#define STACK_SIZE 2 * 4096
 
 /* Change osrelease by the special way */
 static int change_osrelease(char *osrelease, char *out, size_t size)
@@ -536,68 +540,6 @@ static int change_osrelease(char *osrelease, char *out, size_t size)
 	return 0;
 }
 
-/* Clone the process */
-static int run_clone(void *data)
-{
-	struct clone_params *params;
-	char osrelease[OSRELEASE_SIZE] = "";
-	int dir_fd, fd;
-	int rc = 0;
-
-	params = data;
-
-	if (params->osrelease)
-		if ((rc = change_osrelease(params->osrelease, osrelease, OSRELEASE_SIZE)))
-			return rc;
-
-	/* open /dev/null in root, because of it is absent in environments */
-	fd = open("/dev/null", O_WRONLY);
-
-	/* Cd to / to make availability to unjump from chroot */
-	if ((dir_fd=open("/", O_RDONLY)) < 0) {
-		vztt_logger(-1, errno, "Can not open / directory");
-		return VZT_CANT_OPEN;
-	}
-
-	/* Next we chroot() to the target directory */
-	if (chroot(params->envdir) < 0) {
-		vztt_logger(-1, errno, "chroot(%s) failed", params->envdir);
-		return VZT_CANT_CHROOT;
-	}
-
-	/* Go back */
-	if (fchdir(dir_fd) < 0) {
-		vztt_logger(-1, errno, "fchdir(%s) failed", params->envdir);
-		return VZT_CANT_CHDIR;
-	}
-
-	/* allow C-c for child */
-	signal(SIGINT, SIG_DFL);
-	/* allow sigquit for child */
-	signal(SIGQUIT, SIG_DFL);
-
-	if (params->reader) {
-		close(STDOUT_FILENO);
-		close(params->fds[0]);
-		dup2(params->fds[1], STDOUT_FILENO);
-		close(params->fds[1]);
-	} else if ((params->debug == 0) && (fd != -1)) {
-		close(STDOUT_FILENO);
-		dup2(fd, STDOUT_FILENO);
-	}
-
-	if (params->ign_cmd_err && (fd != -1)) {
-		close(STDERR_FILENO);
-		dup2(fd, STDERR_FILENO);
-	}
-
-	execve(params->cmd, params->argv, params->envp);
-	vztt_logger(0, errno, "execve(%s...) failed", params->cmd);
-	rc = VZT_CANT_EXEC;
-
-	return rc;
-}
-
 /* run <cmd> from chroot environment <envdir> with arguments <args>
    and environments <envs>,
    redirect <cmd> output to pipe and read by <reader> */
@@ -612,21 +554,19 @@ int run_from_chroot2(
 		int reader(FILE *fp, void *data),
 		void *data)
 {
-	pid_t chpid, pid;
 	int status;
 	int rc = 0;
 	struct stat st;
-	struct sigaction act_chld, act_quit, act_int;
 	char **argv;
 	char **envp;
 	size_t i, sza, sze;
 	struct string_list_el *p;
 	int fds[2];
 	FILE *fp;
-	struct clone_params params;
-	int flags = 0;
-        void *stack;
-	int sa_flags;
+	char release[OSRELEASE_SIZE] = "";
+	struct runner_fd rfds[2];
+	struct runner_opts opts;
+	struct runner_child child;
 
 	/* environment directory checking */
 	if (envdir == NULL) {
@@ -642,13 +582,9 @@ int run_from_chroot2(
 		return VZT_INTERNAL;
 	}
 
-	/* Allocate stack */
-        stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE,
-			MAP_PRIVATE | MAP_ANON | MAP_GROWSDOWN, 0, 0);
-        if (stack == MAP_FAILED) {
-		vztt_logger(0, 0, "Can't allocate stack");
-		return VZT_INTERNAL;
-        }
+	if (osrelease)
+		if ((rc = change_osrelease(osrelease, release, sizeof(release))))
+			return rc;
 
 	/* copy arguments and environments from lists to array */
 	sza = string_list_size(args);
@@ -658,7 +594,7 @@ int run_from_chroot2(
 	if ((argv == NULL) || (envp == NULL)) {
 		vztt_logger(0, errno, "Cannot alloc memory");
 		rc = VZT_CANT_ALLOC_MEM;
-		goto cleanup_0;
+		goto cleanup_1;
 	}
 	argv[0] = (char *)cmd;
 	for (p = args->tqh_first, i = 1; p != NULL && i < sza + 1; \
@@ -681,98 +617,77 @@ int run_from_chroot2(
 	}
 
 	if (reader) {
-		if (pipe(fds) < 0) {
+		if (pipe2(fds, O_CLOEXEC) < 0) {
 			vztt_logger(0, errno, "pipe() error");
 			rc = VZT_CANT_OPEN;
 			goto cleanup_1;
 		}
 	}
 
-	/* Fill the params */
-	params.cmd = cmd;
-	params.envdir = envdir;
-	params.argv = argv;
-	params.envp = envp;
-	params.osrelease = osrelease;
-	params.fds = fds;
-	params.reader = reader;
-	params.debug = debug;
-	params.ign_cmd_err = ign_cmd_err;
-	flags = SIGCHLD;
-
-	if (osrelease)
-		flags |= CLONE_NEWUTS;
-
-	sigaction(SIGCHLD, NULL, &act_chld);
-	sa_flags = act_chld.sa_flags;
-	act_chld.sa_flags = SA_NOCLDSTOP;
-	sigaction(SIGCHLD, &act_chld, NULL);
-
-	/* ignore sigquit & sigint in parent */
-	sigaction(SIGQUIT, NULL, &act_quit);
-	signal(SIGQUIT, SIG_IGN);
-	sigaction(SIGINT, NULL, &act_int);
-	signal(SIGINT, SIG_IGN);
+	/* fill the redirections */
+	memset(&opts, 0, sizeof(opts));
+	opts.envp = envp;
+	opts.fds = rfds;
+	opts.root = envdir;
+	opts.newuts = (osrelease != NULL);
+	if (reader) {
+		rfds[opts.nfds].from = fds[1];
+		rfds[opts.nfds++].to = STDOUT_FILENO;
+	} else if (debug == 0) {
+		rfds[opts.nfds].from = RUNNER_DEVNULL;
+		rfds[opts.nfds++].to = STDOUT_FILENO;
+	}
+	if (ign_cmd_err) {
+		rfds[opts.nfds].from = RUNNER_DEVNULL;
+		rfds[opts.nfds++].to = STDERR_FILENO;
+	}
 
-	if ((chpid = clone(run_clone, stack + STACK_SIZE, flags,
-		(void *) &params)) < 0) {
-		vztt_logger(0, errno, "clone() failed");
-		rc = VZT_CANT_FORK;
-		goto cleanup_2;
+	rc = runner_spawn(cmd, argv, &opts, &child);
+	if (reader)
+		close(fds[1]);
+	if (rc) {
+		if (reader)
+			close(fds[0]);
+		goto cleanup_1;
 	}
 
 	if (reader) {
-		close(fds[1]);
 		if ((fp = fdopen(fds[0], "r")) == NULL) {
 			vztt_logger(0, errno, "fdopen() error");
-			return VZT_CANT_OPEN;
+			close(fds[0]);
+			runner_wait(&child, NULL);
+			rc = VZT_CANT_OPEN;
+			goto cleanup_1;
 		}
 		rc = reader(fp, data);
 		fclose(fp);
-		close(fds[0]);
 	}
 
-	while ((pid = waitpid(chpid, &status, 0)) == -1)
-		if (errno != EINTR)
-			break;
-
-	if (pid == chpid) {
-		if (WIFEXITED(status)) {
-			int retcode;
-			if ((retcode = WEXITSTATUS(status))) {
-				if (ign_cmd_err) {
-					rc = 0;
-				} else {
-					vztt_logger(0, 0,
-						"%s failed, exitcode=%d",
-						cmd, retcode);
-					rc = VZT_PM_FAILED;
-				}
-			} else
-				rc = 0;
-		}
-		else if (WIFSIGNALED(status)) {
-			vztt_logger(0, 0,  "Got signal %d", WTERMSIG(status));
-			rc = VZT_PROG_SIGNALED;
-		}
-	} else if (pid < 0) {
-		vztt_logger(0, errno, "Error in waitpid()");
+	if (runner_wait(&child, &status)) {
 		rc = VZT_INTERNAL;
+	} else if (WIFEXITED(status)) {
+		int retcode;
+		if ((retcode = WEXITSTATUS(status))) {
+			if (ign_cmd_err) {
+				rc = 0;
+			} else {
+				vztt_logger(0, 0,
+					"%s failed, exitcode=%d",
+					cmd, retcode);
+				rc = VZT_PM_FAILED;
+			}
+		} else
+			rc = 0;
+	}
+	else if (WIFSIGNALED(status)) {
+		vztt_logger(0, 0,  "Got signal %d", WTERMSIG(status));
+		rc = VZT_PROG_SIGNALED;
 	}
-
-cleanup_2:
-	sigaction(SIGINT, &act_int, NULL);
-	sigaction(SIGQUIT, &act_quit, NULL);
-	act_chld.sa_flags = sa_flags;
-	sigaction(SIGCHLD, &act_chld, NULL);
 
 cleanup_1:
 	free( (void *)argv);
 	free( (void *)envp);
 
-cleanup_0:
-	munmap(stack, STACK_SIZE);
-
 	return rc;
 }
 
@@ -976,10 +891,8 @@ int pm_get_installed_vzpkg(
 		struct package_list *packages)
 {
 	int rc;
-	char path[PATH_MAX+1];
 
-	snprintf(path, sizeof(path), "%s/templates/vzpackages", ve_private);
-	if ((rc = read_nevra(path, packages)) != 0)
+	if ((rc = read_vzpackages(ve_private, packages)) != 0)
 		return rc;
 
 	if (pm->debug >= 4) {
@@ -992,6 +905,28 @@ int pm_get_installed_vzpkg(
 	return 0;
 }
 
+/* find <pkg> in vzpackages index <idx>: binary search by name,
+   then evr check by package manager for each record with this name.
+   <one> is one-element list, its package is filled from index records */
+static int vzpkg_index_find(
+		struct Transaction *pm,
+		struct pkgindex *idx,
+		struct package_list *one,
+		struct package *pkg)
+{
+	long n;
+
+	if ((n = pkgindex_find(idx, pkg->name)) < 0)
+		return 0;
+	for (; pkgindex_get(idx, n, one->tqh_first->p) == 0; n++) {
+		if (strcmp(one->tqh_first->p->name, pkg->name))
+			break;
+		if (pm->pm_package_find_nevra(one, pkg))
+			return 1;
+	}
+	return 0;
+}
+
 /* get installed into VE vz packages list :
    read vzpackages and compare with packages database
    This function will mount VE if needs */
@@ -1003,20 +938,29 @@ int pm_get_installed_vzpkg2(
 {
 	int rc = 0;
 	char path[PATH_MAX+1];
+	char buf[PATH_MAX+1];
 	struct package_list vzpackages;
-	struct package_list_el *p;
+	struct arena arena;
+	struct pkgindex *idx = NULL;
+	struct package rec;
+	struct package_list_el *p, *next;
 
-	package_list_init(&vzpackages);
+	arena_init(&arena);
+	package_list_init_arena(&vzpackages, &arena);
 
-	/* get vzpackages list */
+	/* get vzpackages list: mapped index or parsed text file */
 	snprintf(path, sizeof(path), "%s/templates/vzpackages", ve_private);
-	if ((rc = read_nevra(path, &vzpackages)) != 0)
-		return rc;
-	if (pm->debug >= 4) {
-		vztt_logger(4, 0, "VZ packages are:");
-		for (p = vzpackages.tqh_first; p != NULL; p = p->e.tqe_next)
-			vztt_logger(4, 0, "\t%s %s %s", \
-				p->p->name, p->p->evr, p->p->arch);
+	if (snprintf(buf, sizeof(buf), "%s" PKGINDEX_SUFFIX, path) >=
+			(int)sizeof(buf) || pkgindex_open(buf, path, &idx)) {
+		if ((rc = read_nevra(path, &vzpackages)) != 0)
+			goto cleanup;
+		if (pm->debug >= 4) {
+			vztt_logger(4, 0, "VZ packages are:");
+			for (p = vzpackages.tqh_first; p != NULL;
+					p = p->e.tqe_next)
+				vztt_logger(4, 0, "\t%s %s %s", \
+					p->p->name, p->p->evr, p->p->arch);
+		}
 	}
 
 	/* get full installed packages list */
@@ -1029,13 +973,19 @@ int pm_get_installed_vzpkg2(
 	if (rc)
 		goto cleanup;
 
+	/* with index vzpackages list is empty: use it as one-element list
+	   for index records, pm_package_find_nevra() does not need list index */
+	if (idx && (rc = package_list_insert(&vzpackages, &rec)))
+		goto cleanup;
+
 	/* remove from installed non-vzpackages */
-	package_list_for_each(installed, p) {
+	for (p = installed->tqh_first; p != NULL; p = next) {
+		next = p->e.tqe_next;
 		/* Attn: p->p->evr should be _real_ package evr */
-		if (pm->pm_package_find_nevra(&vzpackages, p->p) == NULL) {
-			/* remove package from list and move to next el */
-			p = package_list_remove(installed, p);
-		}
+		if (idx ? vzpkg_index_find(pm, idx, &vzpackages, p->p) :
+				pm->pm_package_find_nevra(&vzpackages, p->p) != NULL)
+			continue;
+		package_list_remove(installed, p);
 	}
 	if (pm->debug >= 4) {
 		vztt_logger(4, 0, "Installed VZ packages are:");
@@ -1044,6 +994,7 @@ int pm_get_installed_vzpkg2(
 				p->p->name, p->p->evr, p->p->arch);
 	}
 cleanup:
+	pkgindex_close(idx);
 	package_list_clean(&vzpackages);
 	return rc;
 }
@@ -1085,9 +1036,10 @@ important: delimiter is _one_ space, string can not start from space
 Debian case: sometime dpkg database (/var/lib/dpkg/status) have not
 package architecture field at all, sometime for separate packages only
 
-Used by yum & apt classes for rpm & dpkg output parsing
+Used by yum & apt classes for rpm & dpkg output parsing.
+Structure is allocated in arena <a> (in heap if <a> is NULL)
 */
-int parse_p(char *str, struct package **pkg)
+int parse_p_arena(char *str, struct arena *a, struct package **pkg)
 {
 	char *sp = str;
 	char *name, *evr, *arch, *descr;
@@ -1123,13 +1075,18 @@ int parse_p(char *str, struct package **pkg)
 		*sp = ' ';
 
 	/* create new */
-	if ((*pkg = create_structp(name, arch, evr, descr)) == NULL) {
+	if ((*pkg = create_structp_arena(a, name, arch, evr, descr)) == NULL) {
 		vztt_logger(0, errno, "Can't alloc memory");
 		return VZT_CANT_ALLOC_MEM;
 	}
 	return 0;
 }
 
+int parse_p(char *str, struct package **pkg)
+{
+	return parse_p_arena(str, NULL, pkg);
+}
+
 /* run modify transaction for <packages> */
 int pm_modify(struct Transaction *pm,
 	pm_action_t action,
@@ -1204,13 +1161,37 @@ int pm_prepare_pkg_area(struct Transaction *pm, struct package *pkg)
 	return rc;
 }
 
+/* write binary index near metadata list <path>,
+   index is optional and error is not fatal */
+static void save_metadata_index(const char *path)
+{
+	char buf[PATH_MAX+1];
+	struct package_list ls;
+	struct arena arena;
+
+	arena_init(&arena);
+	package_list_init_arena(&ls, &arena);
+	snprintf(buf, sizeof(buf), "%s" PKGINDEX_SUFFIX, path);
+	if (read_nevra_f(path, &ls) || pkgindex_save(buf, path, &ls)) {
+		vztt_logger(1, 0, "Can't save %s, ignored", buf);
+		unlink(buf);
+	}
+	package_list_clean(&ls);
+}
+
+/* metadata of several templates can be updated at once (update_metadata()),
+   but list directory and indexes are shared - save them one by one */
+static pthread_mutex_t save_metadata_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* save metadata file for template <name> */
 int pm_save_metadata(struct Transaction *pm, const char *name)
 {
-	int rc;
+	int rc = 0;
 	struct stat st;
 	char path[PATH_MAX];
 
+	pthread_mutex_lock(&save_metadata_mutex);
+
 	/* remove previously created file with the same name */
 	snprintf(path, sizeof(path), "%s/%s/%s/list", \
 			pm->tmpldir, pm->basesubdir, pm->datadir);
@@ -1226,11 +1207,13 @@ int pm_save_metadata(struct Transaction *pm, const char *name)
 		if (!S_ISDIR(st.st_mode)) {
 			vztt_logger(0, errno, "%s exist, but is not "
 				"a directory", path);
-			return VZT_CANT_CREATE;
+			rc = VZT_CANT_CREATE;
+			goto cleanup;
 		}
 	} else if (mkdir(path, 0755)) {
 		vztt_logger(0, errno, "Can not create %s directory", path);
-		return VZT_CANT_CREATE;
+		rc = VZT_CANT_CREATE;
+		goto cleanup;
 	}
 
 	snprintf(path, sizeof(path), "%s/%s/%s/" PM_LIST_SUBDIR "%s", \
@@ -1238,9 +1221,148 @@ int pm_save_metadata(struct Transaction *pm, const char *name)
 	if ((rc = move_file(path, pm->outfile))) {
 		vztt_logger(0, errno, "Can not move %s to %s",
 			pm->outfile, path);
-		return rc;
+		goto cleanup;
 	}
-	return 0;
+	save_metadata_index(path);
+
+cleanup:
+	pthread_mutex_unlock(&save_metadata_mutex);
+	return rc;
+}
+
+/* mark metadata of template <name> as up2date without changes */
+int pm_touch_metadata(struct Transaction *pm, const char *name)
+{
+	int rc = 0;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s/%s/" PM_LIST_SUBDIR "%s", \
+			pm->tmpldir, pm->basesubdir, pm->datadir, name);
+
+	pthread_mutex_lock(&save_metadata_mutex);
+	if (utimes(path, NULL)) {
+		rc = vztt_error(VZT_SYSTEM, errno, "utimes(%s)", path);
+	} else {
+		/* index keeps list mtime */
+		save_metadata_index(path);
+	}
+	pthread_mutex_unlock(&save_metadata_mutex);
+
+	return rc;
+}
+
+/* open binary index of metadata list <path>,
+   for symlinked list - index of symlink target */
+static int open_metadata_index(const char *path, struct pkgindex **idx)
+{
+	char real[PATH_MAX+1];
+	char buf[PATH_MAX+1];
+
+	if (realpath(path, real) == NULL)
+		return VZT_FILE_NFOUND;
+	if (snprintf(buf, sizeof(buf), "%s" PKGINDEX_SUFFIX, real) >=
+			(int)sizeof(buf))
+		return VZT_FILE_NFOUND;
+	return pkgindex_open(buf, real, idx);
+}
+
+static int cmp_pkg_name(const void *a, const void *b)
+{
+	return strcmp((*(struct package **)a)->name,
+			(*(struct package **)b)->name);
+}
+
+/* pm_is_up2date() for metadata lists with binary indexes <idx>:
+   merge-join of sorted installed packages and sorted indexes.
+   As with lists, first matched record in <idx> order wins */
+static int is_up2date_index(
+		struct Transaction *pm,
+		struct pkgindex **idx,
+		size_t nidx,
+		struct package_list *installed,
+		int *flag)
+{
+	int rc = 0;
+	int eval;
+	size_t i, k, count;
+	long n, *cur = NULL;
+	struct package **sorted = NULL;
+	struct package_list_el *p;
+	struct pkgindex_entry e, found;
+	unsigned long epoch;
+	const char *evr, *ver;
+
+	*flag = 1;
+	if ((count = package_list_size(installed)) == 0)
+		return 0;
+	sorted = (struct package **)malloc(count * sizeof(*sorted));
+	cur = (long *)calloc(nidx, sizeof(*cur));
+	if (sorted == NULL || cur == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+		goto cleanup;
+	}
+	i = 0;
+	package_list_for_each(installed, p)
+		sorted[i++] = p->p;
+	qsort(sorted, count, sizeof(*sorted), cmp_pkg_name);
+
+	for (i = 0; i < count; i++) {
+		struct package *pkg = sorted[i];
+
+		found.name = NULL;
+		for (k = 0; k < nidx && found.name == NULL; k++) {
+			/* move cursor to the first record with this name */
+			while (pkgindex_entry(idx[k], cur[k], &e) == 0 &&
+					strcmp(e.name, pkg->name) < 0)
+				cur[k]++;
+			/* records are sorted by arch in name group,
+			   find first in list order as cmp_pkg() does */
+			for (n = cur[k]; pkgindex_entry(idx[k], n, &e) == 0 &&
+					strcmp(e.name, pkg->name) == 0; n++) {
+				if (pkg->arch && *pkg->arch && e.arch &&
+						*e.arch && strcmp(e.arch, pkg->arch))
+					continue;
+				if (found.name == NULL || e.pos < found.pos)
+					found = e;
+			}
+		}
+		if (found.name == NULL)
+			continue;
+
+		/* yum mix epoch 0 and epoch None
+		at available epoch 0 == None
+		therefore remove epoch 0 from installed */
+		if (pkg->evr[0] == '0' && pkg->evr[1] == ':')
+			evr = pkg->evr + 2;
+		else
+			evr = pkg->evr;
+		ver = pkgindex_evr_key(evr, &epoch);
+
+		if (strcmp(found.evr, evr) == 0 ||
+				(found.epoch == epoch && strcmp(found.ver, ver) == 0)) {
+			vztt_logger(3, 0, "%s.%s : %s == %s", \
+				found.name, found.arch, found.evr, evr);
+			continue;
+		}
+		/* compare versions */
+		if ((rc = pm->pm_ver_cmp(pm, found.evr, evr, &eval)))
+			goto cleanup;
+
+		if (eval == 1) {
+			/* available package pkg is newest then installed */
+			vztt_logger(3, 0, "%s.%s : %s > %s", \
+				found.name, found.arch, found.evr, evr);
+			*flag = 0;
+			break;
+		}
+		else
+			vztt_logger(3, 0, "%s.%s : %s < %s", \
+				found.name, found.arch, found.evr, evr);
+	}
+cleanup:
+	free(cur);
+	free(sorted);
+	return rc;
 }
 
 /* is packages list up2date or not */
@@ -1253,26 +1375,48 @@ int pm_is_up2date(
 	int rc;
 	char path[PATH_MAX];
 	struct package_list available;
+	struct arena arena;
 	struct package_list_el *i;
 	struct package_list_el *p;
 	char *evr;
 	int eval;
 	struct string_list_el *s;
+	struct pkgindex **idx;
+	size_t k, nidx;
+
+	/* available packages are read-only here: keep them in arena */
+	arena_init(&arena);
+	package_list_init_arena(&available, &arena);
+
+	/* use pre-parsed indexes if all of them are valid */
+	nidx = string_list_size(ls);
+	if ((idx = (struct pkgindex **)calloc(nidx + 1, sizeof(*idx))) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	for (s = ls->tqh_first, k = 0; s != NULL; s = s->e.tqe_next, k++) {
+		snprintf(path, sizeof(path), "%s/%s/%s/" PM_LIST_SUBDIR "%s", \
+				pm->tmpldir, pm->basesubdir, pm->datadir, s->s);
+		if (open_metadata_index(path, &idx[k]))
+			break;
+	}
+	if (s == NULL) {
+		rc = is_up2date_index(pm, idx, nidx, installed, flag);
+		goto cleanup;
+	}
 
-	package_list_init(&available);
 	for (s = ls->tqh_first; s != NULL; s = s->e.tqe_next) {
 		snprintf(path, sizeof(path), "%s/%s/%s/" PM_LIST_SUBDIR "%s", \
 				pm->tmpldir, pm->basesubdir, pm->datadir, s->s);
 		if (access(path, F_OK)) {
 			vztt_logger(0, 0, "metadata not found for %s template",
 					s->s);
-			return VZT_METADATA_NFOUND;
+			rc = VZT_METADATA_NFOUND;
+			goto cleanup;
 		}
 
 		/* show only VZ packages */
 		/* get list of vz packages from file */
 		if ((rc = read_nevra_f(path, &available)))
-			return rc;
+			goto cleanup;
 	}
 
 	*flag = 1;
@@ -1296,7 +1440,7 @@ int pm_is_up2date(
 		}
 		/* compare versions */
 		if ((rc = pm->pm_ver_cmp(pm, p->p->evr, evr, &eval)))
-			return rc;
+			goto cleanup;
 
 		if (eval == 1) {
 			/* available package pkg is newest then installed */
@@ -1309,9 +1453,14 @@ int pm_is_up2date(
 			vztt_logger(3, 0, "%s.%s : %s < %s", \
 				p->p->name, p->p->arch, p->p->evr, evr);
 	}
+	rc = 0;
+cleanup:
+	for (k = 0; k < nidx; k++)
+		pkgindex_close(idx[k]);
+	free(idx);
 	package_list_clean_all(&available);
 
-	return 0;
+	return rc;
 }
 
 /* find package with name <pname> in list <lst> */
@@ -328,7 +328,8 @@ int vztt2_upgrade(
 
 	/* lock target template area on read */
 	if ((rc = tmpl_lock(&gc, t_tmpl->base, 
-			LOCK_READ, opts_vztt->flags, &lockdata)))
+			LOCK_READ, opts_vztt->flags, &lockdata,
+			opts_vztt->progress_fd)))
 		goto cleanup_3;
 
 	if (!(opts_vztt->flags & OPT_VZTT_TEST)) {
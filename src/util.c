@@ -24,6 +24,7 @@
  * Functions set
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
@@ -39,6 +40,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
 #include <sys/statfs.h>
@@ -48,16 +51,21 @@
 #include <sys/vfs.h>
 #include <mntent.h>
 #include <time.h>
+#include <signal.h>
 
 #include <vzctl/libvzctl.h>
 
 #include "cache.h"
+#include "runner.h"
 #include "vzcommon.h"
 #include "config.h"
 #include "vztt_error.h"
 #include "util.h"
 #include "vztt.h"
 #include "progress_messages.h"
+#include "archive.h"
+#include "workqueue.h"
+#include "pkgindex.h"
 
 unsigned long available_technologies[] = {
 	VZ_T_I386,
@@ -264,9 +272,9 @@ int check_n_load_ve_config(
 
 /* parse next string :
 name arch [epoch:]version-release
-and create structure
+and create structure in arena <a> (in heap if <a> is NULL)
 */
-int parse_nav(char *str, struct package **pkg)
+int parse_nav_arena(char *str, struct arena *a, struct package **pkg)
 {
 	char *sp = str;
 	char *name, *arch, *evr;
@@ -300,7 +308,7 @@ int parse_nav(char *str, struct package **pkg)
 	while (*sp && !isspace(*sp)) sp++;
 	*sp = '\0';
 
-	if ((*pkg = create_structp(name, arch, evr, NULL)) == NULL) {
+	if ((*pkg = create_structp_arena(a, name, arch, evr, NULL)) == NULL) {
 		vztt_logger(0, errno, "Can't alloc memory");
 		return VZT_CANT_ALLOC_MEM;
 	}
@@ -308,6 +316,15 @@ int parse_nav(char *str, struct package **pkg)
 	return 0;
 }
 
+/* parse next string :
+name arch [epoch:]version-release
+and create structure
+*/
+int parse_nav(char *str, struct package **pkg)
+{
+	return parse_nav_arena(str, NULL, pkg);
+}
+
 int arch_is_none(const char *arch)
 {
 	/* arch "none" synonyms (in lower case )*/
@@ -516,6 +533,51 @@ struct package *create_structp(
 	return pkg;
 }
 
+/* the same as create_structp(), but alloc structure in arena <a> */
+struct package *create_structp_arena(
+	struct arena *a,
+	char const *name,
+	char const *arch,
+	char const *evr,
+	char const *descr)
+{
+	struct package *pkg;
+
+	if (a == NULL)
+		return create_structp(name, arch, evr, descr);
+
+	if (name == NULL)
+		return NULL;
+
+	pkg = (struct package *)arena_alloc(a, sizeof(struct package));
+	if (pkg == NULL)
+		goto nomem;
+
+	memset((void *)pkg, 0, sizeof(struct package));
+
+	if ((pkg->name = arena_strdup(a, name)) == NULL)
+		goto nomem;
+
+	if (arch != NULL) {
+		pkg->arch = arena_strdup(a, arch_is_none(arch) ? ARCH_NONE : arch);
+		if (pkg->arch == NULL)
+			goto nomem;
+	}
+
+	if (evr != NULL)
+		if ((pkg->evr = arena_strdup(a, evr)) == NULL)
+			goto nomem;
+
+	if (descr != NULL)
+		if ((pkg->descr = arena_strdup(a, descr)) == NULL)
+			goto nomem;
+
+	return pkg;
+nomem:
+	errno = ENOMEM;
+	return NULL;
+}
+
 /* compare package <p1> and <p2> with name and arch */
 int cmp_pkg(struct package *p1, struct package *p2)
 {
@@ -553,18 +615,14 @@ int read_nevra(const char *path, struct package_list *packages)
 	}
 
 	while (fgets(str, sizeof(str), fp)) {
-		if ((rc = parse_nav(str, &p)))
+		if ((rc = parse_nav_arena(str, packages->arena, &p)))
 			break;
 
 		if (p == NULL) continue;
 
 		/* remove record with the same name & arch */
-		for (i = packages->tqh_first; i != NULL; i = i->e.tqe_next) {
-			if (cmp_pkg(i->p, p) == 0) {
-				package_list_remove(packages, i);
-				break;
-			}
-		}
+		if ((i = package_list_find(packages, p)))
+			package_list_remove(packages, i);
 		/* add new record in tail */
 		if ((rc = package_list_insert(packages, p)))
 			break;
@@ -590,7 +648,7 @@ int read_nevra_f(const char *path, struct package_list *packages)
 	}
 
 	while (fgets(str, sizeof(str), fp)) {
-		if ((rc = parse_nav(str, &p)))
+		if ((rc = parse_nav_arena(str, packages->arena, &p)))
 			break;
 
 		if (p == NULL) continue;
@@ -606,6 +664,7 @@ int read_nevra_f(const char *path, struct package_list *packages)
 int save_vzpackages(const char *ve_private, struct package_list *packages)
 {
 	char path[PATH_MAX+1];
+	char idx[PATH_MAX+1];
 	FILE *fp;
 	struct package_list_el *i;
 
@@ -626,51 +685,67 @@ int save_vzpackages(const char *ve_private, struct package_list *packages)
 			i->p->name, i->p->arch, i->p->evr);
 	fclose(fp);
 
+	/* binary index is optional: readers fall back to the text file */
+	if (snprintf(idx, sizeof(idx), "%s" PKGINDEX_SUFFIX, path) >=
+			(int)sizeof(idx))
+		return 0;
+	if (pkgindex_save(idx, path, packages)) {
+		vztt_logger(1, 0, "Can't save %s, ignored", idx);
+		unlink(idx);
+	}
+
 	return 0;
 }
 
+/* read vzpackages file of VE, from binary index if it is up to date */
+int read_vzpackages(const char *ve_private, struct package_list *packages)
+{
+	int rc;
+	char path[PATH_MAX+1];
+	char idx[PATH_MAX+1];
+	struct pkgindex *x;
+
+	snprintf(path, sizeof(path), "%s/templates/vzpackages", ve_private);
+	if (snprintf(idx, sizeof(idx), "%s" PKGINDEX_SUFFIX, path) >=
+			(int)sizeof(idx) || pkgindex_open(idx, path, &x))
+		return read_nevra(path, packages);
+	rc = pkgindex_read(x, packages);
+	pkgindex_close(x);
+	return rc;
+}
+
 /* read vzpackages file from os template cache tarball */
 int read_tarball(
 		const char *tarball,
 		struct package_list *packages)
 {
-	char buf[PATH_MAX+1];
-	char cmd[PATH_MAX+1];
-	FILE *fd;
+	char *data, *line, *next;
+	size_t size;
 	struct package *p;
 	int rc = 0;
 
 	/* get vzpackages only */
-	get_unpack_cmd(cmd, sizeof(cmd), tarball, ".", "-O ./templates/vzpackages");
-	vztt_logger(2, 0, "%s", cmd);
-	if ((fd = popen(cmd, "r")) == NULL) {
-		vztt_logger(0, errno, "popen(%s)", cmd);
-		return VZT_CANT_EXEC;
-	}
+	if ((rc = archive_read_member(tarball, "./templates/vzpackages",
+			&data, &size)))
+		return rc;
 
-	while(fgets(buf, sizeof(buf), fd)) {
+	for (line = data; line && *line; line = next) {
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
 		// skip all records without leading space
-		if (!isspace(*buf)) continue;
+		if (!isspace(*line)) continue;
 
-		if ((rc = parse_nav(buf, &p))) {
-			fclose(fd);
-			return rc;
-		}
+		if ((rc = parse_nav_arena(line, packages->arena, &p)))
+			break;
 
 		if (p == NULL) continue;
 
-		if ((rc = package_list_insert(packages, p))) {
-			fclose(fd);
-			return rc;
-		}
-	}
-	rc = pclose(fd);
-	if (WEXITSTATUS(rc)) {
-		vztt_logger(0, errno, "Unable to execute %s", cmd);
-		return VZT_CANT_EXEC;
+		if ((rc = package_list_insert(packages, p)))
+			break;
 	}
+	free(data);
 
-	return 0;
+	return rc;
 }
 
 /*
@@ -720,7 +795,7 @@ int read_outfile(const char *path, \
 			continue;
 		}
 
-		if ((rc = parse_nav(sp, &pkg)))
+		if ((rc = parse_nav_arena(sp, packages->arena, &pkg)))
 			break;
 		if (pkg == NULL) continue;
 
@@ -732,6 +807,31 @@ int read_outfile(const char *path, \
 	return rc;
 }
 
+/* replace package field <*field> of list <ls> by copy of <value> */
+static int merge_pkg_field(
+		struct package_list *ls,
+		char **field,
+		const char *value)
+{
+	char *t = NULL;
+
+	if (value) {
+		if (ls->arena)
+			t = arena_strdup(ls->arena, value);
+		else
+			t = strdup(value);
+		if (t == NULL) {
+			vztt_logger(0, ENOMEM, "Can't alloc memory");
+			return VZT_CANT_ALLOC_MEM;
+		}
+	}
+	/* arena memory is released with the list */
+	if (*field && ls->arena == NULL)
+		free((void *)*field);
+	*field = t;
+	return 0;
+}
+
 /* merge 3 list: target, added and removed lists into target
    target is not empty: elems from <added> will add or updates,
    elems from <removed> will removed */
@@ -747,23 +847,14 @@ int merge_pkg_lists( \
 
 	/* remove packages from target list */
 	for (i = removed->tqh_first; i != NULL; i = i->e.tqe_next) {
-		for (j = target->tqh_first; j != NULL; j = j->e.tqe_next) {
-			if (cmp_pkg(i->p, j->p) == 0) {
-				package_list_remove(target, j);
-				break;
-			}
-		}
+		if ((j = package_list_find(target, i->p)))
+			package_list_remove(target, j);
 	}
 	/* update packages if found, and add if not */
 	for (i = added->tqh_first; i != NULL; i = i->e.tqe_next) {
-		pkg = NULL;
 		/* find package from <added> in <target> */
-		for (j = target->tqh_first; j != NULL; j = j->e.tqe_next) {
-			if (cmp_pkg(i->p, j->p) == 0) {
-				pkg = j->p;
-				break;
-			}
-		}
+		j = package_list_find(target, i->p);
+		pkg = j ? j->p : NULL;
 		if (pkg == NULL) {
 			/* not found - add new */
 			if ((rc = package_list_add(target, i->p)))
@@ -773,31 +864,18 @@ int merge_pkg_lists( \
 			/* cmp_pkg compare name & arch too, if arch defined
 		  	   therefore redefine arch if it is defined on target only */
 			if (i->p->arch) {
-				if (pkg->arch)
-					free((void *)pkg->arch);
-				if ((pkg->arch = strdup(i->p->arch)) == NULL) {
-					vztt_logger(0, errno, "Can't alloc memory");
-					return VZT_CANT_ALLOC_MEM;
-				}
+				if ((rc = merge_pkg_field(target, &pkg->arch,
+						i->p->arch)))
+					return rc;
 			}
 			if (i->p->evr) {
-				if (pkg->evr)
-					free((void *)pkg->evr);
-				if ((pkg->evr = strdup(i->p->evr)) == NULL) {
-					vztt_logger(0, errno, "Can't alloc memory");
-					return VZT_CANT_ALLOC_MEM;
-				}
-			}
-			if (pkg->descr)
-				free((void *)pkg->descr);
-			if (i->p->descr) {
-				if ((pkg->descr = strdup(i->p->descr)) == NULL) {
-					vztt_logger(0, errno, "Can't alloc memory");
-					return VZT_CANT_ALLOC_MEM;
-				}
+				if ((rc = merge_pkg_field(target, &pkg->evr,
+						i->p->evr)))
+					return rc;
 			}
-			else
-				pkg->descr = NULL;
+			if ((rc = merge_pkg_field(target, &pkg->descr,
+					i->p->descr)))
+				return rc;
 		}
 	}
 	return 0;
@@ -1136,99 +1214,567 @@ ereturn:
 	return 0;
 }
 
-/* remove directory with content */
-int remove_directory(const char *dirname)
+/* workers for parallel directory removing */
+#define REMOVE_THREADS		8
+/* subdirectories up to this depth are removed by separate jobs */
+#define REMOVE_JOB_DEPTH	2
+
+/* remove content of directory fd and close it */
+static int remove_dir_fd(int fd, const char *dirname)
 {
-	char path[PATH_MAX+1];
-	DIR * dir;
-	char dirent_buf[sizeof(struct dirent) + PATH_MAX + 1];
-	struct dirent *de = (struct dirent *) dirent_buf;
-	struct dirent *result;
-	int retval;
+	DIR *dir;
+	struct dirent *de;
 	struct stat st;
-	int rc = 0;
+	int is_dir, sub, rc = 0;
 
-	if ((dir = opendir(dirname)) == NULL) {
+	if ((dir = fdopendir(fd)) == NULL) {
 		vztt_logger(0, errno, "opendir(%s) error", dirname);
+		close(fd);
 		return VZT_CANT_OPEN;
 	}
-
 	while (1) {
-		if ((retval = readdir_r(dir, de, &result)) != 0)
-		{
-			vztt_logger(0, retval, "readdir_r(\"%s\") error",
-					dirname);
-			rc = VZT_CANT_READ;
+		errno = 0;
+		if ((de = readdir(dir)) == NULL) {
+			if (errno) {
+				vztt_logger(0, errno, "readdir(\"%s\") error",
+						dirname);
+				rc = VZT_CANT_READ;
+			}
 			break;
 		}
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
 
-		if (result == NULL)
-			break;
+		/* d_type saves stat() call on most filesystems */
+		if (de->d_type == DT_UNKNOWN) {
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+				vztt_logger(0, errno, "stat(%s/%s) error",
+						dirname, de->d_name);
+				rc = VZT_CANT_LSTAT;
+				break;
+			}
+			is_dir = S_ISDIR(st.st_mode);
+		} else {
+			is_dir = (de->d_type == DT_DIR);
+		}
 
-		if(!strcmp(de->d_name,"."))
+		if (is_dir) {
+			if ((sub = openat(fd, de->d_name,
+				O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+				vztt_logger(0, errno, "open(%s/%s) error",
+						dirname, de->d_name);
+				rc = VZT_CANT_OPEN;
+				break;
+			}
+			if ((rc = remove_dir_fd(sub, de->d_name)))
+				break;
+			if (unlinkat(fd, de->d_name, AT_REMOVEDIR)) {
+				vztt_logger(0, errno, "rmdir(%s/%s) error",
+						dirname, de->d_name);
+				rc = VZT_CANT_REMOVE;
+				break;
+			}
 			continue;
+		}
+		/* remove regfile, symlink, fifo, socket or device */
+		if (unlinkat(fd, de->d_name, 0)) {
+			vztt_logger(0, errno, "unlink(%s/%s) error",
+					dirname, de->d_name);
+			rc = VZT_CANT_REMOVE;
+			break;
+		}
+	}
+	closedir(dir);
 
-		if(!strcmp(de->d_name,".."))
-			continue;
+	return rc;
+}
+
+/* directories kept open to remove their subdirectories by jobs */
+#define REMOVE_MAX_DIRS		256
+
+/*
+subdirectory <name> of directory <parent>: directories are removed relative
+to descriptors of their parents, so tree is never left by symlink which
+replaced a directory. <path> is used for messages only.
+*/
+struct remove_entry {
+	int parent;
+	char *name;
+	char *path;
+	/* shallow directory, open while its subdirectories are removed */
+	DIR *dir;
+};
+
+struct remove_list {
+	struct remove_entry *v;
+	size_t n;
+	size_t size;
+};
+
+static int remove_list_add(
+		struct remove_list *ls,
+		int parent,
+		const char *name,
+		const char *dirname)
+{
+	struct remove_entry *e;
+	size_t size;
+
+	if (ls->n == ls->size) {
+		size = ls->size ? 2 * ls->size : 64;
+		if ((e = realloc(ls->v, size * sizeof(*e))) == NULL)
+			return vztt_error(VZT_CANT_ALLOC_MEM, errno,
+				"realloc()");
+		ls->v = e;
+		ls->size = size;
+	}
+	e = &ls->v[ls->n];
+	memset(e, 0, sizeof(*e));
+	e->parent = parent;
+	if ((e->name = strdup(name)) == NULL ||
+			asprintf(&e->path, "%s/%s", dirname, name) == -1) {
+		free(e->name);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "strdup()");
+	}
+	ls->n++;
+	return 0;
+}
+
+static void remove_list_clean(struct remove_list *ls)
+{
+	size_t i;
+
+	for (i = 0; i < ls->n; i++) {
+		if (ls->v[i].dir)
+			closedir(ls->v[i].dir);
+		free(ls->v[i].name);
+		free(ls->v[i].path);
+	}
+	free(ls->v);
+	memset(ls, 0, sizeof(*ls));
+}
+
+/* workqueue job: remove directory tree, argument is owned by caller */
+static int remove_dir_job(void *arg)
+{
+	struct remove_entry *e = (struct remove_entry *)arg;
+	int fd, rc;
+
+	if ((fd = openat(e->parent, e->name,
+			O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+		vztt_logger(0, errno, "opendir(%s) error", e->path);
+		return VZT_CANT_OPEN;
+	}
+	if ((rc = remove_dir_fd(fd, e->path)))
+		return rc;
+	if (unlinkat(e->parent, e->name, AT_REMOVEDIR)) {
+		vztt_logger(0, errno, "rmdir(%s) error", e->path);
+		return VZT_CANT_REMOVE;
+	}
+	return 0;
+}
 
-		snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+/*
+remove files of shallow directory 'dir' and collect subdirectories to
+remove by separate jobs into 'jobs'. Shallow subdirectories are added to
+'dirs' with open descriptors, parents before children, to remove them
+after all jobs.
+*/
+static int remove_dir_spread(
+		DIR *dir,
+		const char *dirname,
+		int depth,
+		struct remove_list *dirs,
+		struct remove_list *jobs)
+{
+	struct dirent *de;
+	struct stat st;
+	DIR *subdir;
+	int fd = dirfd(dir);
+	int is_dir, sub, rc = 0;
 
-		if (lstat(path, &st)) {
-			vztt_logger(0, errno, "stat(%s) error", path);
-			rc = VZT_CANT_LSTAT;
+	while (1) {
+		errno = 0;
+		if ((de = readdir(dir)) == NULL) {
+			if (errno) {
+				vztt_logger(0, errno, "readdir(\"%s\") error",
+						dirname);
+				rc = VZT_CANT_READ;
+			}
 			break;
 		}
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		if (de->d_type == DT_UNKNOWN) {
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+				vztt_logger(0, errno, "stat(%s/%s) error",
+						dirname, de->d_name);
+				rc = VZT_CANT_LSTAT;
+				break;
+			}
+			is_dir = S_ISDIR(st.st_mode);
+		} else {
+			is_dir = (de->d_type == DT_DIR);
+		}
 
-		if (S_ISDIR(st.st_mode)) {
-			if ((rc = remove_directory(path)))
+		if (!is_dir) {
+			if (unlinkat(fd, de->d_name, 0)) {
+				vztt_logger(0, errno, "unlink(%s/%s) error",
+						dirname, de->d_name);
+				rc = VZT_CANT_REMOVE;
 				break;
+			}
 			continue;
 		}
-		/* remove regfile, symlink, fifo, socket or device */
-		if (unlink(path)) {
-			vztt_logger(0, errno, "unlink(%s) error", path);
-			rc = VZT_CANT_REMOVE;
+		if (depth >= REMOVE_JOB_DEPTH || dirs->n >= REMOVE_MAX_DIRS) {
+			if ((rc = remove_list_add(jobs, fd, de->d_name,
+					dirname)))
+				break;
+			continue;
+		}
+		if ((sub = openat(fd, de->d_name,
+				O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+			vztt_logger(0, errno, "opendir(%s/%s) error",
+					dirname, de->d_name);
+			rc = VZT_CANT_OPEN;
 			break;
 		}
+		if ((subdir = fdopendir(sub)) == NULL) {
+			vztt_logger(0, errno, "opendir(%s/%s) error",
+					dirname, de->d_name);
+			close(sub);
+			rc = VZT_CANT_OPEN;
+			break;
+		}
+		if ((rc = remove_list_add(dirs, fd, de->d_name, dirname))) {
+			closedir(subdir);
+			break;
+		}
+		dirs->v[dirs->n - 1].dir = subdir;
+		if ((rc = remove_dir_spread(subdir, dirs->v[dirs->n - 1].path,
+				depth + 1, dirs, jobs)))
+			break;
 	}
-	closedir(dir);
 
-	/* and remove directory */
-	if (rc)
-		return rc;
+	return rc;
+}
+
+/* remove directory with content */
+int remove_directory(const char *dirname)
+{
+	struct workqueue *wq;
+	struct remove_list dirs;
+	struct remove_list jobs;
+	struct remove_entry *e;
+	DIR *dir;
+	size_t i;
+	int fd, rc, rc2;
+
+	if ((fd = open(dirname,
+			O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+		vztt_logger(0, errno, "opendir(%s) error", dirname);
+		return VZT_CANT_OPEN;
+	}
+	if ((dir = fdopendir(fd)) == NULL) {
+		vztt_logger(0, errno, "opendir(%s) error", dirname);
+		close(fd);
+		return VZT_CANT_OPEN;
+	}
+
+	memset(&dirs, 0, sizeof(dirs));
+	memset(&jobs, 0, sizeof(jobs));
+	if ((rc = remove_dir_spread(dir, dirname, 1, &dirs, &jobs)))
+		goto cleanup;
+
+	/* pool is sized by number of subtrees, small tree is removed inline */
+	if (jobs.n <= 1) {
+		for (i = 0; i < jobs.n; i++)
+			if ((rc = remove_dir_job(&jobs.v[i])))
+				goto cleanup;
+	} else {
+		if ((rc = workqueue_create(&wq, jobs.n < REMOVE_THREADS ?
+				jobs.n : REMOVE_THREADS, 0)))
+			goto cleanup;
+		for (i = 0; i < jobs.n; i++)
+			if ((rc = workqueue_add(wq, remove_dir_job,
+					&jobs.v[i], 0)))
+				break;
+		rc2 = workqueue_destroy(wq);
+		if (rc == 0)
+			rc = rc2;
+		if (rc)
+			goto cleanup;
+	}
+
+	/* shallow directories are empty now, children go after parents */
+	for (i = dirs.n; i-- > 0; ) {
+		e = &dirs.v[i];
+		closedir(e->dir);
+		e->dir = NULL;
+		if (unlinkat(e->parent, e->name, AT_REMOVEDIR)) {
+			vztt_logger(0, errno, "rmdir(%s) error", e->path);
+			rc = VZT_CANT_REMOVE;
+			goto cleanup;
+		}
+	}
 
+	closedir(dir);
+	dir = NULL;
 	if (rmdir(dirname)) {
 		vztt_logger(0, errno, "rmdir(%s) error", dirname);
 		rc = VZT_CANT_REMOVE;
 	}
+cleanup:
+	/* descriptors of shallow directories are parents of jobs */
+	remove_list_clean(&jobs);
+	remove_list_clean(&dirs);
+	if (dir)
+		closedir(dir);
 	return rc;
 }
 
+/*
+rename directory and remove it with content by background rm, which is
+not a child of caller: caller can be multithreaded, so it is not forked,
+and it does not wait for rm or reap it
+*/
+int remove_directory_bg(const char *dirname)
+{
+	char path[PATH_MAX+1];
+	char *argv[] = {"/bin/sh", "-c",
+		"trap '' INT QUIT HUP; rm -rf -- \"$1\" &", "sh", path, NULL};
+	struct runner_fd fds[] = {
+		{RUNNER_DEVNULL, STDIN_FILENO},
+		{RUNNER_DEVNULL, STDOUT_FILENO},
+		{RUNNER_DEVNULL, STDERR_FILENO}};
+	struct runner_opts opts;
+	int status;
+
+	/* directory is replaced by empty one, so the name is unique */
+	if (snprintf(path, sizeof(path), "%s.removing.XXXXXX", dirname) >=
+			(int)sizeof(path) || mkdtemp(path) == NULL)
+		return remove_directory(dirname);
+	if (rename(dirname, path)) {
+		rmdir(path);
+		return remove_directory(dirname);
+	}
+
+	/* shell exits at once, rm is reparented to init */
+	memset(&opts, 0, sizeof(opts));
+	opts.fds = fds;
+	opts.nfds = sizeof(fds) / sizeof(fds[0]);
+	if (runner_run(argv[0], argv, &opts, &status) ||
+			!WIFEXITED(status) || WEXITSTATUS(status)) {
+		vztt_logger(1, 0, "Can not remove %s in background", path);
+		return remove_directory(path);
+	}
+	return 0;
+}
+
+/* buffer size for plain read()/write() copy */
+#define COPY_BUF_SIZE		(1024*1024)
+/* max chunk for copy_file_range() and sendfile() calls */
+#define COPY_CHUNK_SIZE		(64*1024*1024)
+
+#ifndef FICLONE
+#define FICLONE			_IOW(0x94, 9, int)
+#endif
+
+/* copy_file_range() wrapper for old glibc */
+static ssize_t do_copy_file_range(int s, int d, size_t len)
+{
+#ifdef __NR_copy_file_range
+	return syscall(__NR_copy_file_range, s, NULL, d, NULL, len, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* copy methods, from the fastest to the most generic one */
+enum {
+	COPY_RANGE,
+	COPY_SENDFILE,
+	COPY_BUFFER,
+};
+
+/*
+copy len bytes from current position of s to current position of d.
+*method is downgraded if kernel or filesystem does not support it.
+*/
+static int copy_fd_range(int d, int s, off_t len, int *method, char **buf)
+{
+	ssize_t n, w, done;
+	size_t chunk;
+
+	while (len > 0) {
+		chunk = (len > COPY_CHUNK_SIZE) ? COPY_CHUNK_SIZE : len;
+		if (*method == COPY_RANGE) {
+			n = do_copy_file_range(s, d, chunk);
+			if (n == -1 && (errno == ENOSYS || errno == EXDEV ||
+				errno == EINVAL || errno == EOPNOTSUPP ||
+				errno == EBADF)) {
+				*method = COPY_SENDFILE;
+				continue;
+			}
+		} else if (*method == COPY_SENDFILE) {
+			n = sendfile(d, s, NULL, chunk);
+			if (n == -1 && (errno == ENOSYS || errno == EINVAL)) {
+				*method = COPY_BUFFER;
+				continue;
+			}
+		} else {
+			if (*buf == NULL &&
+				posix_memalign((void **)buf, 4096, COPY_BUF_SIZE)) {
+				*buf = NULL;
+				errno = ENOMEM;
+				return -1;
+			}
+			if (chunk > COPY_BUF_SIZE)
+				chunk = COPY_BUF_SIZE;
+			if ((n = read(s, *buf, chunk)) > 0) {
+				for (done = 0; done < n; done += w) {
+					w = write(d, *buf + done, n - done);
+					if (w == -1 && errno == EINTR)
+						w = 0;
+					else if (w == -1)
+						return -1;
+				}
+			}
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -1;
+		/* source file was truncated */
+		if (n == 0)
+			break;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+copy from descriptor s to current position of descriptor d:
+reflink if possible, otherwise copy data segments only for regular files
+(to keep holes) by copy_file_range(), sendfile() or read()/write().
+Destination which is not a regular file or is opened with O_APPEND
+(stdout, log) is written sequentially only.
+*/
+static int copy_fd(int d, int s, const char *dst, const char *src)
+{
+	struct stat sst, dst_st;
+	off_t start, data, hole = 0;
+	int method = COPY_RANGE;
+	int sparse, flags;
+	char *buf = NULL;
+	int rc = 0;
+
+	if (fstat(s, &sst) || fstat(d, &dst_st)) {
+		vztt_logger(0, errno, "fstat() error");
+		return VZT_CANT_LSTAT;
+	}
+	if ((flags = fcntl(d, F_GETFL)) == -1) {
+		vztt_logger(0, errno, "fcntl(%s) error", dst);
+		return VZT_CANT_WRITE;
+	}
+	if (flags & O_APPEND)
+		method = COPY_BUFFER;
+	else if (!S_ISREG(dst_st.st_mode))
+		method = COPY_SENDFILE;
+	start = lseek(d, 0, SEEK_CUR);
+	sparse = S_ISREG(sst.st_mode) && S_ISREG(dst_st.st_mode) &&
+		!(flags & O_APPEND) && start != -1;
+
+	/* reflink whole file to empty destination */
+	if (sparse && start == 0 && dst_st.st_size == 0 &&
+		ioctl(d, FICLONE, s) == 0)
+		return 0;
+
+	if (!sparse) {
+		/* pipe or device: copy up to EOF */
+		if (copy_fd_range(d, s, (off_t)LLONG_MAX, &method, &buf))
+			rc = -1;
+		goto cleanup;
+	}
+
+	while (hole < sst.st_size) {
+		if ((data = lseek(s, hole, SEEK_DATA)) == -1) {
+			/* tail of file is a hole */
+			if (errno == ENXIO)
+				break;
+			/* SEEK_DATA is not supported: whole file is data */
+			data = hole;
+			hole = sst.st_size;
+		} else if ((hole = lseek(s, data, SEEK_HOLE)) == -1) {
+			hole = sst.st_size;
+		}
+		if (lseek(s, data, SEEK_SET) == -1 ||
+			lseek(d, start + data, SEEK_SET) == -1 ||
+			copy_fd_range(d, s, hole - data, &method, &buf)) {
+			rc = -1;
+			goto cleanup;
+		}
+	}
+	/* restore trailing hole */
+	if (ftruncate(d, start + sst.st_size) ||
+		lseek(d, start + sst.st_size, SEEK_SET) == -1)
+		rc = -1;
+
+cleanup:
+	VZTT_FREE_STR(buf);
+	if (rc) {
+		vztt_logger(0, errno, "Can not copy %s to %s", src, dst);
+		return VZT_CANT_WRITE;
+	}
+	return 0;
+}
+
+/* copy extended attributes of file src to dst, errors are not fatal */
+static void copy_file_xattrs(const char *dst, const char *src)
+{
+	char *list = NULL, *name, *value = NULL;
+	ssize_t size, vsize;
+
+	if ((size = llistxattr(src, NULL, 0)) <= 0)
+		return;
+	if ((list = malloc(size)) == NULL)
+		return;
+	if ((size = llistxattr(src, list, size)) <= 0)
+		goto cleanup;
+
+	for (name = list; name < list + size; name += strlen(name) + 1) {
+		if ((vsize = lgetxattr(src, name, NULL, 0)) < 0)
+			continue;
+		VZTT_FREE_STR(value);
+		if ((value = malloc(vsize + 1)) == NULL)
+			break;
+		if ((vsize = lgetxattr(src, name, value, vsize)) < 0)
+			continue;
+		if (lsetxattr(dst, name, value, vsize, 0))
+			vztt_logger(2, errno, "Can not set %s xattr for %s",
+				name, dst);
+	}
+
+cleanup:
+	VZTT_FREE_STR(value);
+	free(list);
+}
+
 /* copy from file src to descriptor d */
 int copy_file_fd(int d, const char *dst, const char *src)
 {
-	int s;
-	char buf[STRSIZ];
-	size_t rs = 0, ws = 0;
+	int s, rc;
 
 	if ((s = open(src, O_RDONLY)) == -1) {
 		vztt_logger(0, errno, "open(%s) error", src);
 		return VZT_CANT_OPEN;
 	}
-	while ((rs = read(s, (void *)buf, sizeof(buf))) > 0) {
-		if ((ws = write(d, (void *)buf, rs)) == -1)
-			break;
-	}
+	rc = copy_fd(d, s, dst, src);
 	close(s);
-	if (ws == -1) {
-		vztt_logger(0, errno, "write() to %s error", dst);
-		return VZT_CANT_WRITE;
-	} else if (rs == -1) {
-		vztt_logger(0, errno, "read() from %s error", src);
-		return VZT_CANT_READ;
-	}
 
-	return 0;
+	return rc;
 }
 
 /* copy from file src to file dst */
@@ -1269,6 +1815,8 @@ int copy_file(const char *dst, const char *src)
 		vztt_logger(0, errno, "Can set owner for %s", dst);
 	if (chmod(dst, st.st_mode & 07777))
 		vztt_logger(0, errno, "Can set mode for %s", dst);
+	/* after chown: it drops security.capability */
+	copy_file_xattrs(dst, src);
 	if (utime(dst, &ut))
 		vztt_logger(0, errno, "Can set utime for %s", dst);
 
@@ -1278,7 +1826,9 @@ int copy_file(const char *dst, const char *src)
 /* move from file src to file dst */
 int move_file(const char *dst, const char *src)
 {
-	int rc;
+	int rc, d;
+	struct stat st;
+	char tmp[PATH_MAX+1];
 
 	if (rename(src, dst) == 0)
 		return 0;
@@ -1288,13 +1838,39 @@ int move_file(const char *dst, const char *src)
 		return VZT_CANT_RENAME;
 	}
 
-	/* src and dst are not on the same filesystem */
-	if (access(dst, F_OK) == 0)
-		unlink(dst);
+	/* src and dst are not on the same filesystem: copy near dst
+	   and replace it atomically, readers never see partial file */
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", dst) >= (int)sizeof(tmp)) {
+		vztt_logger(0, 0, "Too long path %s", dst);
+		return VZT_INTERNAL;
+	}
+	if ((d = mkstemp(tmp)) == -1) {
+		vztt_logger(0, errno, "mkstemp(%s) error", tmp);
+		return VZT_CANT_CREATE;
+	}
+	rc = copy_file_fd(d, tmp, src);
+	/* the same attributes as copy_file() sets */
+	if (rc == 0 && stat(src, &st) == 0) {
+		struct timespec ts[2] = { st.st_atim, st.st_mtim };
 
-	/* try to copy */
-	if ((rc = copy_file(dst, src)))
+		if (fchown(d, st.st_uid, st.st_gid))
+			vztt_logger(0, errno, "Can set owner for %s", tmp);
+		if (fchmod(d, st.st_mode & 07777))
+			vztt_logger(0, errno, "Can set mode for %s", tmp);
+		/* after chown: it drops security.capability */
+		copy_file_xattrs(tmp, src);
+		if (futimens(d, ts))
+			vztt_logger(0, errno, "Can set utime for %s", tmp);
+	}
+	close(d);
+	if (rc == 0 && rename(tmp, dst)) {
+		vztt_logger(0, errno, "rename(%s, %s) error", tmp, dst);
+		rc = VZT_CANT_RENAME;
+	}
+	if (rc) {
+		unlink(tmp);
 		return rc;
+	}
 
 	/* remove source */
 	unlink(src);
@@ -1355,38 +1931,33 @@ int read_string(char *path, char **str)
 	return rc;
 }
 
-/* execute command and check exit code */
+/* execute command by shell and check exit code */
 int exec_cmd(char *cmd, int quiet)
 {
-	int rc, fd0 = -1, fd1 = -1;
+	int rc, status;
+	char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+	/* if quiet - redirect stdout to /dev/null */
+	struct runner_fd fds[] = {{RUNNER_DEVNULL, STDOUT_FILENO}};
+	struct runner_opts opts;
 
+	memset(&opts, 0, sizeof(opts));
+	/* C-c and sigquit are for child, as for system() */
+	opts.ignore_int = 1;
 	if (quiet) {
-		/* if quiet - redirect stdout to /dev/null */
-		fd0 = open("/dev/null", O_WRONLY);
-		fd1 = open("/dev/null", O_WRONLY);
-		/* save stdout */
-		dup2(STDOUT_FILENO, fd1);
-		/* redirect stdout to /dev/null */
-		dup2(fd0, STDOUT_FILENO);
-	}
-	vztt_logger(3, 0, "system(%s)", cmd);
-	rc = system(cmd);
-	if (quiet) {
-		/* restore stdout */
-		dup2(fd1, STDOUT_FILENO);
-		close(fd0);
-		close(fd1);
+		opts.fds = fds;
+		opts.nfds = 1;
 	}
-	if (rc == -1) {
-		vztt_logger(0, errno, "system(%s) error", cmd);
+	vztt_logger(3, 0, "sh -c %s", cmd);
+	if ((rc = runner_run(argv[0], argv, &opts, &status))) {
+		vztt_logger(0, 0, "Can not execute \"%s\"", cmd);
 		return VZT_CANT_EXEC;
 	}
-	if (!WIFEXITED(rc)) {
+	if (!WIFEXITED(status)) {
 		vztt_logger(0, 0, "\"%s\" failed", cmd);
 		return VZT_CMD_FAILED;
 	}
-	if (WEXITSTATUS(rc)) {
-		vztt_logger(0, 0, "\"%s\" return %d", cmd, WEXITSTATUS(rc));
+	if (WEXITSTATUS(status)) {
+		vztt_logger(0, 0, "\"%s\" return %d", cmd, WEXITSTATUS(status));
 		return VZT_CMD_FAILED;
 	}
 	return 0;
@@ -1433,64 +2004,28 @@ int do_vzctl(char *cmd, char *ctid, int mod, int mask)
 /* execute command and check exit code */
 int execv_cmd(char **argv, int quiet, int mod)
 {
-	int rc = 0, fd0 = -1, fd1 = -1, sa_flags;
-	struct sigaction act_chld, act_quit, act_int;
-	pid_t child_pid;
-	int status = 0;
-
-	sigaction(SIGCHLD, NULL, &act_chld);
-	sa_flags = act_chld.sa_flags;
-	act_chld.sa_flags = SA_NOCLDSTOP;
-	sigaction(SIGCHLD, &act_chld, NULL);
-
-	/* ignore sigquit & sigint in parent */
-	sigaction(SIGQUIT, NULL, &act_quit);
-	signal(SIGQUIT, SIG_IGN);
-	sigaction(SIGINT, NULL, &act_int);
-	signal(SIGINT, SIG_IGN);
-
-	child_pid = fork();
-	if (0 == child_pid) {
-		/* allow C-c for child */
-		signal(SIGINT, SIG_DFL);
-		/* allow sigquit for child */
-		signal(SIGQUIT, SIG_DFL);
-		if (quiet) {
-			/* if quiet - redirect stdout to /dev/null */
-			fd0 = open("/dev/null", O_WRONLY);
-			fd1 = open("/dev/null", O_WRONLY);
-			/* save stdout */
-			dup2(STDOUT_FILENO, fd1);
-			/* redirect stdout to /dev/null */
-			dup2(fd0, STDOUT_FILENO);
-		}
-		execv(argv[0], argv);
-		vztt_logger(0, errno, "execv(%s...) failed", argv[0]);
-		_exit(VZT_CANT_EXEC);
-	} else if (child_pid == -1) {
-		vztt_logger(0, errno, "fork() failed");
-		rc = mod * VZT_CANT_EXEC;
-	} else if (child_pid > 0) {
-		vztt_logger(3, 0, "execv(%s...)", argv[0]);
-		if (wait(&status) == -1) {
-			vztt_logger(0, errno, "wait() error");
-			rc = mod * VZT_CMD_FAILED;
-		} else {
-			if (WIFEXITED(status)) {
-				rc = WEXITSTATUS(status);
-			} else if (WIFSIGNALED(status)) {
-				vztt_logger(0, 0,  "Got signal %d", WTERMSIG(status));
-				rc = mod * VZT_CMD_FAILED;
-			}
-		}
-	}
-
-	sigaction(SIGINT, &act_int, NULL);
-	sigaction(SIGQUIT, &act_quit, NULL);
-	act_chld.sa_flags = sa_flags;
-	sigaction(SIGCHLD, &act_chld, NULL);
+	int rc, status;
+	/* if quiet - redirect stdout to /dev/null */
+	struct runner_fd fds[] = {{RUNNER_DEVNULL, STDOUT_FILENO}};
+	struct runner_opts opts;
+	struct runner_child child;
 
-	return rc;
+	memset(&opts, 0, sizeof(opts));
+	/* C-c and sigquit are for child only */
+	opts.ignore_int = 1;
+	if (quiet) {
+		opts.fds = fds;
+		opts.nfds = 1;
+	}
+	vztt_logger(3, 0, "execv(%s...)", argv[0]);
+	if ((rc = runner_spawn(argv[0], argv, &opts, &child)))
+		return (rc == VZT_CANT_EXEC) ? rc : mod * VZT_CANT_EXEC;
+	if (runner_wait(&child, &status))
+		return mod * VZT_CMD_FAILED;
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	vztt_logger(0, 0,  "Got signal %d", WTERMSIG(status));
+	return mod * VZT_CMD_FAILED;
 }
 
 int yum_install_execv_cmd(struct string_list *pkgs, int quiet, int mod)
@@ -1741,6 +2276,12 @@ int tmpl_get_clean_os_name(char *path)
 			return -2;
 		*p = '\0';
 	}
+	else if ((p = strstr(path, TARCHUNKS_SUFFIX)))
+	{
+		if (strlen(p) != TARCHUNKS_SUFFIX_LEN)
+			return -2;
+		*p = '\0';
+	}
 	else if ((p = strstr(path, TARLZRW_SUFFIX)))
 	{
 		if (strlen(p) != TARLZRW_SUFFIX_LEN)
@@ -1803,6 +2344,9 @@ int tmpl_get_cache_tar_name(char *path, int size,
 	case VZT_ARCHIVE_LZRW:
 		archive_suffix = TARLZRW_SUFFIX;
 		break;
+	case VZT_ARCHIVE_CHUNKS:
+		archive_suffix = TARCHUNKS_SUFFIX;
+		break;
 	}
 
 	n = snprintf((path), (size), "%s/cache/%s.%s%s%s",
@@ -1815,7 +2359,7 @@ int tmpl_get_cache_tar_name(char *path, int size,
 int tmpl_get_cache_tar_by_type(char *path, int size, unsigned long cache_type, const char *fstype,
 						const char *tmpldir, const char *osname)
 {
-	const int ARCHIVES[] = {VZT_ARCHIVE_LZ4, VZT_ARCHIVE_LZRW, VZT_ARCHIVE_GZ};
+	const int ARCHIVES[] = {VZT_ARCHIVE_LZ4, VZT_ARCHIVE_CHUNKS, VZT_ARCHIVE_LZRW, VZT_ARCHIVE_GZ};
 	const int ARCHIVES_COUNT = sizeof(ARCHIVES) / sizeof(ARCHIVES[0]);
 	int i;
 	struct stat st;
@@ -1983,17 +2527,28 @@ void tmpl_remove_cache_tar(const char *tmpldir, const char *osname)
 	tmpl_callback_cache_tar(0, tmpldir, osname, remove_tar_file, NULL);
 }
 
-int get_pack_cmd(char *cmd, int size, const char *file, const char *what, const char *opts)
+int get_archive_type(const char *file)
 {
-	unsigned long archive = 0;
 	char *suffix;
 	if ((suffix = strstr(file, TARLZ4_SUFFIX)) && (strlen(suffix) == TARLZ4_SUFFIX_LEN))
-		archive = VZT_ARCHIVE_LZ4;
+		return VZT_ARCHIVE_LZ4;
 	else if ((suffix = strstr(file, TARLZRW_SUFFIX)) && (strlen(suffix) == TARLZRW_SUFFIX_LEN))
-		archive = VZT_ARCHIVE_LZRW;
+		return VZT_ARCHIVE_LZRW;
 	else if ((suffix = strstr(file, TARGZ_SUFFIX)) && (strlen(suffix) == TARGZ_SUFFIX_LEN))
-		archive = VZT_ARCHIVE_GZ;
-	else
+		return VZT_ARCHIVE_GZ;
+	else if ((suffix = strstr(file, TARCHUNKS_SUFFIX)) && (strlen(suffix) == TARCHUNKS_SUFFIX_LEN))
+		return VZT_ARCHIVE_CHUNKS;
+
+	return -1;
+}
+
+int get_pack_cmd(char *cmd, int size, const char *file, const char *what, const char *opts)
+{
+	int archive;
+
+	/* chunk store is handled by built-in archiver only */
+	if ((archive = get_archive_type(file)) == -1 ||
+			archive == VZT_ARCHIVE_CHUNKS)
 		return -1;
 
 	return tar_pack(cmd, size, archive, file, what, opts);
@@ -2001,15 +2556,11 @@ int get_pack_cmd(char *cmd, int size, const char *file, const char *what, const
 
 int get_unpack_cmd(char *cmd, int size, const char *file, const char *where, const char *opts)
 {
-	unsigned long archive = 0;
-	char *suffix;
-	if ((suffix = strstr(file, TARLZ4_SUFFIX)) && (strlen(suffix) == TARLZ4_SUFFIX_LEN))
-		archive = VZT_ARCHIVE_LZ4;
-	else if ((suffix = strstr(file, TARLZRW_SUFFIX)) && (strlen(suffix) == TARLZRW_SUFFIX_LEN))
-		archive = VZT_ARCHIVE_LZRW;
-	else if ((suffix = strstr(file, TARGZ_SUFFIX)) && (strlen(suffix) == TARGZ_SUFFIX_LEN))
-		archive = VZT_ARCHIVE_GZ;
-	else
+	int archive;
+
+	/* chunk store is handled by built-in archiver only */
+	if ((archive = get_archive_type(file)) == -1 ||
+			archive == VZT_ARCHIVE_CHUNKS)
 		return -1;
 
 	return tar_unpack(cmd, size, archive, file, where, opts);
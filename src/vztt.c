@@ -1193,7 +1193,12 @@ static void print_package_list(
 	}
 }
 
+#ifdef VZTTD
+/* command handler of vzttd, run in process forked by daemon */
+int vzpkg_main(int argc, char **argv)
+#else
 int main(int argc, char **argv)
+#endif
 {
 	int rc = 0;
 	vztt_cmd_t command = VZTT_CMD_NONE;
@@ -1212,6 +1217,12 @@ int main(int argc, char **argv)
 	if (argc < 2)
 		usage(argv[0], VZT_BAD_PARAM);
 
+#ifndef VZTTD
+	/* read-only commands are served by vzttd if it is running */
+	if (vztt_daemon_call(VZTTD_SOCKET, argc, argv, &rc) == 0)
+		return rc;
+#endif
+
 	command = VZTT_CMD_NONE;
 	if (argc > 2) {
 		ncmd = 2;
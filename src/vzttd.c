@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ *
+ * vzttd: resident daemon for read-only vzpkg commands
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "vztt_error.h"
+#include "util.h"
+#include "vztt.h"
+
+/* vzpkg command handler, vztt.c built with -DVZTTD */
+int vzpkg_main(int argc, char **argv);
+
+static void usage(const char *progname, int rc)
+{
+	fprintf(stderr, "Usage: %s [-f] [-s socket]\n", progname);
+	fprintf(stderr, "  -f         run in foreground\n");
+	fprintf(stderr, "  -s socket  listen on socket (default %s)\n",
+		VZTTD_SOCKET);
+	exit(rc);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	int foreground = 0;
+	const char *sock = VZTTD_SOCKET;
+
+	umask(022);
+
+	if (getuid()) {
+		vztt_logger(0, 0, "This program should run only from root");
+		return VZT_USER_NOT_ROOT;
+	}
+	while ((c = getopt(argc, argv, "fs:h")) != -1) {
+		switch (c) {
+		case 'f':
+			foreground = 1;
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], VZT_BAD_PARAM);
+		}
+	}
+	if (!foreground && daemon(0, 0)) {
+		vztt_logger(0, errno, "daemon() failed");
+		return VZT_SYSTEM;
+	}
+
+	return vztt_daemon_serve(sock, vzpkg_main);
+}
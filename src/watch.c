@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ *
+ * inotify-based invalidation of in-memory caches
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "vztt_error.h"
+#include "util.h"
+#include "watch.h"
+
+#define WATCH_EVENTS (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO| \
+	IN_CLOSE_WRITE|IN_MODIFY|IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF)
+
+struct watch_dir {
+	char *path;
+	/* -1 if directory watch was removed */
+	int wd;
+	unsigned long gen;
+};
+
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int watch_ifd = -1;
+/* process which reads events */
+static pid_t watch_owner;
+static struct watch_dir *watch_dirs;
+static size_t watch_ndirs;
+static size_t watch_size;
+/* generations are unique over all directories: wd can be reused */
+static unsigned long watch_seq;
+
+int watch_enable(void)
+{
+	pthread_mutex_lock(&watch_mutex);
+	if (watch_ifd == -1) {
+		watch_ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+		if (watch_ifd == -1)
+			vztt_logger(0, errno, "inotify_init1() error");
+		watch_owner = getpid();
+	}
+	pthread_mutex_unlock(&watch_mutex);
+	return watch_ifd;
+}
+
+int watch_enabled(void)
+{
+	return (watch_ifd != -1);
+}
+
+static struct watch_dir *watch_find_wd(int wd)
+{
+	size_t i;
+
+	for (i = 0; i < watch_ndirs; i++)
+		if (watch_dirs[i].wd == wd)
+			return &watch_dirs[i];
+	return NULL;
+}
+
+int watch_get(const char *dir, struct watch_stamp *stamp)
+{
+	int rc = 0;
+	int wd;
+	size_t i;
+	struct watch_dir *d = NULL, *p;
+
+	if (watch_ifd == -1)
+		return VZT_FILE_NFOUND;
+
+	pthread_mutex_lock(&watch_mutex);
+	for (i = 0; i < watch_ndirs; i++) {
+		if (strcmp(watch_dirs[i].path, dir) == 0) {
+			d = &watch_dirs[i];
+			break;
+		}
+	}
+	if (d && d->wd != -1)
+		goto done;
+
+	/* forked child can use snapshot only */
+	if (getpid() != watch_owner) {
+		rc = VZT_FILE_NFOUND;
+		goto cleanup;
+	}
+	if ((wd = inotify_add_watch(watch_ifd, dir, WATCH_EVENTS|IN_ONLYDIR)) == -1) {
+		vztt_logger(2, errno, "inotify_add_watch(%s) error", dir);
+		rc = VZT_FILE_NFOUND;
+		goto cleanup;
+	}
+	/* the same directory via other path */
+	if ((p = watch_find_wd(wd))) {
+		d = p;
+		goto done;
+	}
+	if (d == NULL) {
+		if (watch_ndirs == watch_size) {
+			p = (struct watch_dir *)realloc(watch_dirs,
+				(watch_size + 16) * sizeof(*p));
+			if (p == NULL) {
+				inotify_rm_watch(watch_ifd, wd);
+				rc = vztt_error(VZT_CANT_ALLOC_MEM, errno,
+					"realloc() :");
+				goto cleanup;
+			}
+			watch_dirs = p;
+			watch_size += 16;
+		}
+		d = &watch_dirs[watch_ndirs];
+		if ((d->path = strdup(dir)) == NULL) {
+			inotify_rm_watch(watch_ifd, wd);
+			rc = vztt_error(VZT_CANT_ALLOC_MEM, errno,
+				"strdup() :");
+			goto cleanup;
+		}
+		watch_ndirs++;
+	}
+	d->wd = wd;
+	/* directory could be changed before the watch was added */
+	d->gen = ++watch_seq;
+done:
+	stamp->wd = d->wd;
+	stamp->gen = d->gen;
+cleanup:
+	pthread_mutex_unlock(&watch_mutex);
+	return rc;
+}
+
+int watch_check(const struct watch_stamp *stamp)
+{
+	int valid;
+	struct watch_dir *d;
+
+	if (watch_ifd == -1)
+		return 0;
+	pthread_mutex_lock(&watch_mutex);
+	d = watch_find_wd(stamp->wd);
+	valid = (d && d->gen == stamp->gen);
+	pthread_mutex_unlock(&watch_mutex);
+	return valid;
+}
+
+int watch_sync(void)
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct watch_dir *d;
+	ssize_t len;
+	char *ptr;
+	size_t i;
+	int changed = 0;
+
+	if (watch_ifd == -1 || getpid() != watch_owner)
+		return 0;
+
+	pthread_mutex_lock(&watch_mutex);
+	while ((len = read(watch_ifd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+				ptr += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)ptr;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* events were lost: all is changed */
+				for (i = 0; i < watch_ndirs; i++)
+					watch_dirs[i].gen = ++watch_seq;
+				changed += watch_ndirs;
+				continue;
+			}
+			if ((d = watch_find_wd(ev->wd)) == NULL)
+				continue;
+			d->gen = ++watch_seq;
+			changed++;
+			/* directory was removed, watch it again on next use */
+			if (ev->mask & IN_IGNORED)
+				d->wd = -1;
+			else if (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) {
+				inotify_rm_watch(watch_ifd, d->wd);
+				d->wd = -1;
+			}
+		}
+	}
+	pthread_mutex_unlock(&watch_mutex);
+	return changed;
+}
+
+int vztt_cache_enable(void)
+{
+	if (watch_enable() == -1)
+		return VZT_SYSTEM;
+	return 0;
+}
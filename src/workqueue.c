@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * simple thread pool
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "vztt_error.h"
+#include "util.h"
+#include "workqueue.h"
+
+struct workqueue_job {
+	workqueue_fn fn;
+	void *arg;
+	size_t weight;
+	TAILQ_ENTRY(workqueue_job) e;
+};
+
+TAILQ_HEAD(workqueue_jobs, workqueue_job);
+
+struct workqueue {
+	struct workqueue_jobs jobs;
+	pthread_mutex_t mutex;
+	/* signaled when new job is queued or pool is stopped */
+	pthread_cond_t job_cond;
+	/* signaled when job is completed */
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int nthreads;
+	/* queued and running jobs */
+	size_t pending;
+	size_t weight;
+	size_t max_weight;
+	int stop;
+	int rc;
+};
+
+static void *workqueue_worker(void *arg)
+{
+	struct workqueue *wq = (struct workqueue *)arg;
+	struct workqueue_job *job;
+	int rc;
+
+	pthread_mutex_lock(&wq->mutex);
+	while (1) {
+		if ((job = wq->jobs.tqh_first) == NULL) {
+			if (wq->stop)
+				break;
+			pthread_cond_wait(&wq->job_cond, &wq->mutex);
+			continue;
+		}
+		TAILQ_REMOVE(&wq->jobs, job, e);
+		pthread_mutex_unlock(&wq->mutex);
+
+		rc = job->fn(job->arg);
+
+		pthread_mutex_lock(&wq->mutex);
+		if (rc && wq->rc == 0)
+			wq->rc = rc;
+		wq->weight -= job->weight;
+		wq->pending--;
+		pthread_cond_broadcast(&wq->done_cond);
+		free(job);
+	}
+	pthread_mutex_unlock(&wq->mutex);
+	return NULL;
+}
+
+int workqueue_create(struct workqueue **wq, int nthreads, size_t max_weight)
+{
+	struct workqueue *q;
+	int i = 0;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if ((q = calloc(1, sizeof(*q))) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	if ((q->threads = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+		free(q);
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	}
+	TAILQ_INIT(&q->jobs);
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->job_cond, NULL);
+	pthread_cond_init(&q->done_cond, NULL);
+	q->max_weight = max_weight;
+
+	for (q->nthreads = 0; q->nthreads < nthreads; q->nthreads++)
+		if ((i = pthread_create(&q->threads[q->nthreads], NULL,
+				workqueue_worker, q)))
+			break;
+
+	if (q->nthreads == 0) {
+		workqueue_destroy(q);
+		return vztt_error(VZT_SYSTEM, i, "pthread_create()");
+	}
+
+	*wq = q;
+	return 0;
+}
+
+int workqueue_add(
+		struct workqueue *wq,
+		workqueue_fn fn,
+		void *arg,
+		size_t weight)
+{
+	struct workqueue_job *job;
+	int rc;
+
+	if ((job = malloc(sizeof(*job))) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "malloc()");
+	job->fn = fn;
+	job->arg = arg;
+	job->weight = weight;
+
+	pthread_mutex_lock(&wq->mutex);
+	/* do not block on the single job larger than limit */
+	while (wq->max_weight && wq->pending &&
+			wq->weight + weight > wq->max_weight)
+		pthread_cond_wait(&wq->done_cond, &wq->mutex);
+	TAILQ_INSERT_TAIL(&wq->jobs, job, e);
+	wq->weight += weight;
+	wq->pending++;
+	rc = wq->rc;
+	pthread_cond_signal(&wq->job_cond);
+	pthread_mutex_unlock(&wq->mutex);
+
+	return rc;
+}
+
+int workqueue_wait(struct workqueue *wq)
+{
+	int rc;
+
+	pthread_mutex_lock(&wq->mutex);
+	while (wq->pending)
+		pthread_cond_wait(&wq->done_cond, &wq->mutex);
+	rc = wq->rc;
+	pthread_mutex_unlock(&wq->mutex);
+
+	return rc;
+}
+
+int workqueue_destroy(struct workqueue *wq)
+{
+	int i, rc;
+
+	pthread_mutex_lock(&wq->mutex);
+	wq->stop = 1;
+	pthread_cond_broadcast(&wq->job_cond);
+	pthread_mutex_unlock(&wq->mutex);
+
+	for (i = 0; i < wq->nthreads; i++)
+		pthread_join(wq->threads[i], NULL);
+	rc = wq->rc;
+
+	pthread_mutex_destroy(&wq->mutex);
+	pthread_cond_destroy(&wq->job_cond);
+	pthread_cond_destroy(&wq->done_cond);
+	free(wq->threads);
+	free(wq);
+
+	return rc;
+}
@@ -53,9 +53,12 @@
 #include "util.h"
 #include "vztt.h"
 #include "progress_messages.h"
+#include "mdstore.h"
 
 
 int yum_init(struct Transaction *pm);
+int yum_update_metadata(struct Transaction *pm, const char *name);
+int yum_is_metadata_staged(struct Transaction *pm);
 int yum_clean(struct Transaction *pm);
 int yum_action(
 		struct Transaction *pm,
@@ -100,7 +103,7 @@ int yum_create(struct Transaction **pm)
 	(*pm)->pm_init = yum_init;
 	(*pm)->pm_clean = yum_clean;
 	(*pm)->pm_get_install_pkg = env_compat_get_install_pkg;
-	(*pm)->pm_update_metadata = env_compat_update_metadata;
+	(*pm)->pm_update_metadata = yum_update_metadata;
 	(*pm)->pm_action = yum_action;
 	(*pm)->pm_create_root = env_compat_create_root;
 	(*pm)->pm_find_pkg_area = env_compat_find_pkg_area;
@@ -128,6 +131,7 @@ int yum_create(struct Transaction **pm)
 	(*pm)->pm_package_find_nevra = env_compat_package_find_nevra;
 	(*pm)->pm_clean_metadata_symlinks = yum_clean_metadata_symlinks;
 	(*pm)->pm_clone_metadata = yum_clone_metadata;
+	(*pm)->pm_is_metadata_staged = yum_is_metadata_staged;
 	(*pm)->pm_parse_vzdir_name = env_compat_parse_vzdir_name;
 	(*pm)->pm_get_group_list = yum_get_group_list;
 	(*pm)->pm_get_group_info = yum_get_group_info;
@@ -248,6 +252,10 @@ static int yum_print_repos(struct YumTransaction *yum, FILE *fp)
 	struct _url u;
 	struct string_list urls;
 	struct string_list_el *p;
+	size_t i, n;
+	struct string_list *lists = NULL;
+	char **first = NULL;
+	char (*paths)[PATH_MAX+1] = NULL;
 
 	for (r = yum->repositories.tqh_first; r != NULL; r = r->e.tqe_next) {
 		string_list_init(&urls);
@@ -286,38 +294,63 @@ static int yum_print_repos(struct YumTransaction *yum, FILE *fp)
 	}
 
 	/* process mirrorlists */
-	for (r = yum->mirrorlists.tqh_first; r != NULL; r = r->e.tqe_next) {
-		string_list_init(&urls);
+	n = repo_list_size(&yum->mirrorlists);
+	if (n == 0)
+		return 0;
+	lists = (struct string_list *)calloc(n, sizeof(*lists));
+	first = (char **)calloc(n, sizeof(*first));
+	paths = (char (*)[PATH_MAX+1])calloc(n, sizeof(*paths));
+	if (lists == NULL || first == NULL || paths == NULL) {
+		rc = vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+		goto cleanup;
+	}
+	for (i = 0; i < n; i++)
+		string_list_init(&lists[i]);
+	for (i = 0, r = yum->mirrorlists.tqh_first; r != NULL;
+			i++, r = r->e.tqe_next) {
 		if ((rc = env_compat_parse_repo_rec(r->url, yum->url_map,
-				&urls, yum->force)))
-			return rc;
+				&lists[i], yum->force)))
+			goto cleanup;
+		if (string_list_empty(&lists[i]))
+			continue;
+		if ((yum->vzttproxy == NULL) && \
+				((string_list_size(&lists[i]) == 1) || \
+				(yum->data_source == OPT_DATASOURCE_LOCAL)))
+			continue;
+		first[i] = lists[i].tqh_first->s;
+	}
+	/* first locations of all mirrorlists are loaded at once */
+	if ((rc = fetch_mirrorlists((struct Transaction *)yum, first, paths, n)))
+		goto cleanup;
 
-		if (string_list_empty(&urls))
+	for (i = 0, r = yum->mirrorlists.tqh_first; r != NULL;
+			i++, r = r->e.tqe_next) {
+		if (string_list_empty(&lists[i]))
 			continue;
 
-		if ((yum->vzttproxy == NULL) && \
-				((string_list_size(&urls) == 1) || \
-				(yum->data_source == OPT_DATASOURCE_LOCAL))) {
+		if (first[i] == NULL) {
 			/* do not fetch mirrorlist for local mode : 
 			   write first mirrorlist at config and exit */
 			fprintf(fp, "[%s%d]\nmirrorlist=%s\nenabled=1\n", \
-					r->id, r->num, urls.tqh_first->s);
-			string_list_clean(&urls);
+					r->id, r->num, lists[i].tqh_first->s);
 			continue;
 		}
 		lfound = 0;
-		for (p = urls.tqh_first; p != NULL; p = p->e.tqe_next) {
-			/* try to download mirrorlist */
+		if (paths[i][0]) {
+			strncpy(path, paths[i], sizeof(path));
+			lfound = 1;
+		}
+		for (p = lists[i].tqh_first->e.tqe_next; p != NULL && !lfound;
+				p = p->e.tqe_next) {
+			/* try to download alternative mirrorlist */
 			if (fetch_mirrorlist((struct Transaction *)yum, p->s, path, \
-					sizeof(path)) == 0) {
+					sizeof(path)) == 0)
 				lfound = 1;
-				break;
-			}
 		}
-		string_list_clean(&urls);
 		if (!lfound) {
 			vztt_logger(0, 0, "Can not load mirrorlists: %s", r->url);
-			return VZT_CANT_FETCH;
+			rc = VZT_CANT_FETCH;
+			goto cleanup;
 		}
 
 		/* rewrote fetched mirrorlist file: 
@@ -329,7 +362,15 @@ static int yum_print_repos(struct YumTransaction *yum, FILE *fp)
 		if (yum->vzttproxy)
 			fprintf(fp, "failovermethod=priority\n");
 	}
-	return 0;
+
+cleanup:
+	if (lists)
+		for (i = 0; i < n; i++)
+			string_list_clean(&lists[i]);
+	free(lists);
+	free(first);
+	free(paths);
+	return rc;
 }
 
 /* create temporary yum config */
@@ -362,8 +403,11 @@ static int yum_create_config(struct YumTransaction *yum)
 	}
 
 	fprintf(fd, "[main]\n");
-	fprintf(fd, "cachedir=%s/%s/%s\n", \
-		yum->tmpldir, yum->basesubdir, yum->datadir);
+	if (yum->cachedir)
+		fprintf(fd, "cachedir=%s\n", yum->cachedir);
+	else
+		fprintf(fd, "cachedir=%s/%s/%s\n", \
+			yum->tmpldir, yum->basesubdir, yum->datadir);
 	/* tolerant ? */
 	/* set verbosity
 	quiet == 1
@@ -393,6 +437,8 @@ static int yum_create_config(struct YumTransaction *yum)
 	fprintf(fd, "reposdir=/etc/vzyum.repos.d\n");
 	fprintf(fd, "logfile=%s\n", yum->logfile);
 	fprintf(fd, "plugins=1\n");
+	/* transaction uses packages loaded by download run */
+	fprintf(fd, "keepcache=1\n");
 	fprintf(fd, "timeout=180\n");
 	fprintf(fd, "exactarch=1\n");
 	fprintf(fd, "metadata_expire=%d\n", METADATA_EXPIRE_MAX);
@@ -445,11 +491,41 @@ static int yum_remove_config(struct YumTransaction *yum)
 	return 0;
 }
 
-/* Run yum from chroot */
-static int yum_run(
+/* how yum run with <action> loads packages into shared directories of
+   repositories, see mdstore_download_lock() */
+enum {
+	YUM_DOWNLOAD_NONE,
+	/* packages are downloaded by separate run with --download-only */
+	YUM_DOWNLOAD_PHASE,
+	/* whole run loads or removes packages */
+	YUM_DOWNLOAD_RUN,
+};
+
+static int yum_downloads(pm_action_t action)
+{
+	switch(action) {
+		case VZPKG_UPGRADE:
+		case VZPKG_UPDATE:
+		case VZPKG_INSTALL:
+		case VZPKG_GROUPINSTALL:
+		case VZPKG_GROUPUPDATE:
+			return YUM_DOWNLOAD_PHASE;
+		case VZPKG_FETCH:
+		case VZPKG_GET:
+		case VZPKG_CLEAN:
+			return YUM_DOWNLOAD_RUN;
+		default:
+			return YUM_DOWNLOAD_NONE;
+	}
+}
+
+/* run yum command for <action> with created config, <download_only> -
+   only load packages, which are needed for it */
+static int yum_exec(
 		struct YumTransaction *yum,
 		pm_action_t action,
-		struct string_list *packages)
+		struct string_list *packages,
+		int download_only)
 {
 	int rc;
 	char *cmd = VZYUM_BIN;
@@ -459,25 +535,20 @@ static int yum_run(
 	char buf[PATH_MAX];
 	char progress_stage[PATH_MAX];
 
-	/* Empty packages list, special case of app template: #PSBM-26883
-	   Not packages-related commands should be executed with packages NULL
-	 */
-	if (packages && string_list_empty(packages))
-		return 0;
-
-	if (yum->pythonpath == NULL) {
-		vztt_logger(0, 0, "PYTHONPATH variable not defined");
-		return VZT_INTERNAL;
-	}
 	string_list_init(&args);
 	string_list_init(&envs);
 
-	if ((rc = yum_create_config(yum)))
-		return rc;
-
 	/* yum parameters */
 	yum_set_default_arguments(yum, &args);
-	if (yum->outfile) {
+	if (action == VZPKG_CLEAN_METADATA && yum->clean_repos) {
+		string_list_add(&args, "--disablerepo=*");
+		string_list_for_each(yum->clean_repos, o) {
+			snprintf(buf, sizeof(buf), "--enablerepo=%s", o->s);
+			string_list_add(&args, buf);
+		}
+	}
+	/* results are written by the transaction itself */
+	if (yum->outfile && !download_only) {
 		string_list_add(&args, "--outfile");
 		string_list_add(&args, yum->outfile);
 	}
@@ -492,6 +563,8 @@ static int yum_run(
 	} else if (action == VZPKG_FETCH) {
 		string_list_add(&args, "--ign-conflicts");
 		string_list_add(&args, "--download-only");
+	} else if (download_only) {
+		string_list_add(&args, "--download-only");
 	}
 	if (yum->vzfs_technologies && !yum->force_openat) {
 		string_list_add(&args, "--vzfs3_technologies");
@@ -674,15 +747,19 @@ static int yum_run(
 	if ((rc = add_tmpl_envs(yum->tdata, &envs)))
 		return rc;
 
+	if (download_only)
+		snprintf(progress_stage, sizeof(progress_stage), "%s%s",
+			PROGRESS_PKGMAN_PACKAGE_MANAGER,
+			PROGRESS_PKGMAN_FETCH);
+
 	progress(progress_stage, 0, yum->progress_fd);
 
 	/* run cmd from chroot environment */
-	if ((rc = run_from_chroot(cmd, yum->envdir, yum->debug,
-			yum->ign_pm_err, &args, &envs, yum->osrelease)))
+	rc = run_from_chroot(cmd, yum->envdir, yum->debug,
+			yum->ign_pm_err, &args, &envs, yum->osrelease);
+	if (rc)
 		return rc;
 
-	yum_remove_config(yum);
-
 	/* free mem */
 	string_list_clean(&args);
 	string_list_clean(&envs);
@@ -692,6 +769,79 @@ static int yum_run(
 	return 0;
 }
 
+/* Run yum from chroot */
+static int yum_run(
+		struct YumTransaction *yum,
+		pm_action_t action,
+		struct string_list *packages)
+{
+	int rc;
+	char buf[PATH_MAX];
+	int *mdlocks;
+	void **dllocks;
+
+	/* Empty packages list, special case of app template: #PSBM-26883
+	   Not packages-related commands should be executed with packages NULL
+	 */
+	if (packages && string_list_empty(packages))
+		return 0;
+
+	if (yum->pythonpath == NULL) {
+		vztt_logger(0, 0, "PYTHONPATH variable not defined");
+		return VZT_INTERNAL;
+	}
+	/* metadata of other repositories are shared and up2date */
+	if (action == VZPKG_CLEAN_METADATA && yum->clean_repos &&
+			string_list_empty(yum->clean_repos))
+		return 0;
+
+	if ((rc = yum_create_config(yum)))
+		return rc;
+
+	/* shared metadata generations used by this run are not removed
+	   by concurrent updates */
+	if (yum->cachedir)
+		snprintf(buf, sizeof(buf), "%s", yum->cachedir);
+	else
+		snprintf(buf, sizeof(buf), "%s/%s/%s",
+			yum->tmpldir, yum->basesubdir, yum->datadir);
+	if ((rc = mdstore_read_lock(buf, &mdlocks)))
+		return rc;
+
+	/* packages are downloaded into the same shared directories by
+	   concurrent runs for other templates and containers, so downloads
+	   are serialized, but transactions are not: they take packages
+	   loaded by the download run from cache */
+	switch (yum_downloads(action)) {
+		case YUM_DOWNLOAD_PHASE:
+			if ((rc = mdstore_download_lock(buf, yum->progress_fd,
+					&dllocks)))
+				break;
+			rc = yum_exec(yum, action, packages, 1);
+			mdstore_download_unlock(dllocks);
+			if (rc == 0)
+				rc = yum_exec(yum, action, packages, 0);
+			break;
+		case YUM_DOWNLOAD_RUN:
+			if ((rc = mdstore_download_lock(buf, yum->progress_fd,
+					&dllocks)))
+				break;
+			rc = yum_exec(yum, action, packages, 0);
+			mdstore_download_unlock(dllocks);
+			break;
+		default:
+			rc = yum_exec(yum, action, packages, 0);
+			break;
+	}
+	mdstore_read_unlock(mdlocks);
+	if (rc)
+		return rc;
+
+	yum_remove_config(yum);
+
+	return 0;
+}
+
 /* run yum transaction */
 int yum_action(
 		struct Transaction *pm,
@@ -954,6 +1104,7 @@ int yum_get_info(
 int yum_remove_local_caches(struct Transaction *pm, char *reponame)
 {
 	char path[PATH_MAX+1];
+	struct stat st;
 	int i;
 
 	if (reponame == NULL)
@@ -962,13 +1113,338 @@ int yum_remove_local_caches(struct Transaction *pm, char *reponame)
 	for (i = 0; i < 1000; i++) {
 		snprintf(path, sizeof(path), "%s/%s/%s%d", \
 			pm->basedir, pm->datadir, reponame, i);
-		if (access(path, F_OK))
+		if (lstat(path, &st))
+			break;
+		/* do not remove shared metadata of other templates */
+		if (S_ISLNK(st.st_mode))
+			unlink(path);
+		else
+			remove_directory(path);
+	}
+	/* and remove ones which are not shared anymore */
+	mdstore_gc(pm->tmpldir);
+	return 0;
+}
+
+/* repository cache directory attached to the metadata store */
+struct yum_mdrepo {
+	char id[NAME_MAX+1];
+	char fp[MDSTORE_FP_LEN+1];
+	/* repomd.xml url for revalidation, empty if unknown */
+	char url[2*PATH_MAX];
+	int fd;
+	int expired;
+	int validated;
+	time_t changed;
+	/* cache directory is symlink to store entry */
+	int shared;
+	/* new generation of expired entry, see mdstore_begin() */
+	char gen[PATH_MAX+1];
+};
+
+static int cmp_mdrepo(const void *a, const void *b)
+{
+	return strcmp(((const struct yum_mdrepo *)a)->fp,
+		((const struct yum_mdrepo *)b)->fp);
+}
+
+/* proxy for downloads by vzpkg itself, see fetch_mirrorlist() */
+static struct _url *yum_get_proxy(struct Transaction *pm)
+{
+	if (pm->http_proxy.server)
+		return &pm->http_proxy;
+	if (pm->ftp_proxy.server)
+		return &pm->ftp_proxy;
+	if (pm->https_proxy.server)
+		return &pm->https_proxy;
+	return NULL;
+}
+
+/* calculate fingerprint of repository record <r> */
+static int yum_repo_fingerprint(
+		struct YumTransaction *yum,
+		struct repo_rec *r,
+		const char *kind,
+		struct yum_mdrepo *m)
+{
+	int rc;
+	size_t n;
+	char releasever[PATH_MAX];
+	char buf[PATH_MAX];
+	struct string_list urls;
+	struct string_list_el *p;
+	struct mdstore_var vars[] = {
+		{ "$releasever", releasever },
+		{ "$basearch", yum->pkgarch },
+		{ "$arch", yum->tdata->base->osarch },
+		{ NULL, NULL },
+	};
+
+	/* yum gets releasever from OS template environment:
+	   share such repositories between the same OS versions only */
+	if (yum->release_version)
+		snprintf(releasever, sizeof(releasever), "%s",
+			yum->release_version);
+	else
+		snprintf(releasever, sizeof(releasever), "%s-%s",
+			yum->tdata->base->osname, yum->tdata->base->osver);
+
+	string_list_init(&urls);
+	if ((rc = env_compat_parse_repo_rec(r->url, yum->url_map,
+			&urls, yum->force)))
+		goto cleanup;
+
+	/* $YUMn are template environments */
+	string_list_for_each(&urls, p) {
+		if (strstr(p->s, "$YUM")) {
+			snprintf(buf, sizeof(buf), "%s:%s",
+				kind, yum->tdata->base->name);
+			kind = buf;
 			break;
-		remove_directory(path);
+		}
+	}
+	snprintf(m->id, sizeof(m->id), "%s%d", r->id, r->num);
+	if ((rc = mdstore_fingerprint(kind, &urls, vars, m->fp, sizeof(m->fp))))
+		goto cleanup;
+
+	/* repository index for revalidation: real releasever is known
+	   only if it was set by option */
+	if (strcmp(kind, "baseurl"))
+		goto cleanup;
+	if (yum->release_version == NULL)
+		vars[0].value = "$releasever";
+	string_list_for_each(&urls, p) {
+		mdstore_expand_url(p->s, vars, m->url, sizeof(m->url));
+		if (strchr(m->url, '$')) {
+			m->url[0] = '\0';
+			continue;
+		}
+		n = strlen(m->url);
+		while (n > 0 && m->url[n - 1] == '/')
+			m->url[--n] = '\0';
+		snprintf(m->url + n, sizeof(m->url) - n, "/repodata/repomd.xml");
+		break;
+	}
+
+cleanup:
+	string_list_clean(&urls);
+	return rc;
+}
+
+/* create cache directory for metadata update: new generations of
+   expired store entries and current ones of other repositories,
+   readers keep using template cache directory meanwhile */
+static int yum_stage_cachedir(
+		struct YumTransaction *yum,
+		struct yum_mdrepo *repos,
+		size_t n,
+		char *stage,
+		size_t size)
+{
+	size_t i;
+	char path[PATH_MAX+1];
+	char target[PATH_MAX+1];
+
+	snprintf(stage, size, "%s/%s/.mdupdate.XXXXXX",
+		yum->tmpldir, yum->basesubdir);
+	if (mkdtemp(stage) == NULL)
+		return vztt_error(VZT_CANT_CREATE, errno, "mkdtemp(%s)", stage);
+
+	for (i = 0; i < n; i++) {
+		if (repos[i].gen[0])
+			snprintf(target, sizeof(target), "%s", repos[i].gen);
+		else
+			snprintf(target, sizeof(target), "%s/%s/%s%s",
+				yum->tmpldir, yum->basesubdir, yum->datadir,
+				repos[i].id);
+		snprintf(path, sizeof(path), "%s/%s", stage, repos[i].id);
+		if (symlink(target, path) && errno != EEXIST)
+			return vztt_error(VZT_SYSTEM, errno,
+				"symlink(%s, %s)", target, path);
 	}
 	return 0;
 }
 
+/* repositories are loaded into metadata store generations, see
+   yum_update_metadata(), other metadata are updated in place */
+int yum_is_metadata_staged(struct Transaction *pm)
+{
+	return repo_list_size(&pm->repositories) +
+		repo_list_size(&pm->mirrorlists) > 0;
+}
+
+/*
+  Update metadata with shared metadata store: replace cache directory of
+  every repository by symlink to store entry with the same repository
+  fingerprint and clean/load metadata of expired entries only.
+  Expired entry is revalidated by conditional request of repomd.xml first,
+  and list of template is not created again if no one repository was
+  changed after it.
+  Entries are locked in fingerprint order to avoid deadlocks.
+*/
+int yum_update_metadata(struct Transaction *pm, const char *name)
+{
+	int rc = 0;
+	size_t i, j, n = 0, size;
+	char path[PATH_MAX+1];
+	char stage[PATH_MAX+1] = "";
+	struct stat st;
+	time_t now;
+	struct repo_rec *r;
+	struct yum_mdrepo *repos;
+	struct string_list expired;
+	struct YumTransaction *yum = (struct YumTransaction *)pm;
+
+	size = repo_list_size(&pm->repositories) +
+		repo_list_size(&pm->mirrorlists);
+	if (size == 0)
+		return env_compat_update_metadata(pm, name);
+	if ((repos = (struct yum_mdrepo *)calloc(size, sizeof(*repos))) == NULL)
+		return vztt_error(VZT_CANT_ALLOC_MEM, errno, "calloc()");
+	string_list_init(&expired);
+
+	repo_list_for_each(&pm->repositories, r) {
+		repos[n].fd = -1;
+		if ((rc = yum_repo_fingerprint(yum, r, "baseurl", &repos[n++])))
+			goto cleanup;
+	}
+	repo_list_for_each(&pm->mirrorlists, r) {
+		repos[n].fd = -1;
+		if ((rc = yum_repo_fingerprint(yum, r, "mirrorlist", &repos[n++])))
+			goto cleanup;
+	}
+	qsort(repos, n, sizeof(*repos), cmp_mdrepo);
+
+	snprintf(path, sizeof(path), "%s/%s/%s", pm->tmpldir,
+		pm->basesubdir, pm->datadir);
+	if ((rc = create_dir(path))) {
+		rc = vztt_error(VZT_CANT_CREATE, rc, "can't create %s", path);
+		goto cleanup;
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%s/%s%s", pm->tmpldir,
+			pm->basesubdir, pm->datadir, repos[i].id);
+		if (i > 0 && strcmp(repos[i].fp, repos[i-1].fp) == 0) {
+			/* the same repository in several records */
+			repos[i].expired = repos[i-1].expired;
+			repos[i].changed = repos[i-1].changed;
+			if ((rc = mdstore_link(pm->tmpldir, repos[i].fp, path)))
+				goto cleanup;
+		} else {
+			/* store GC does not remove locked entry */
+			if ((rc = mdstore_lock(pm->tmpldir, repos[i].fp,
+					&repos[i].fd)))
+				goto cleanup;
+			if ((rc = mdstore_link(pm->tmpldir, repos[i].fp, path)))
+				goto cleanup;
+			repos[i].expired =
+				pm->data_source == OPT_DATASOURCE_REMOTE ||
+				!mdstore_is_fresh(repos[i].fd,
+					pm->metadata_expire);
+			/* ask upstream before loading of all metadata */
+			if (repos[i].expired && repos[i].url[0] &&
+					pm->data_source != OPT_DATASOURCE_REMOTE) {
+				repos[i].validated = 1;
+				if (mdstore_revalidate(pm->tmpldir, repos[i].fp,
+						repos[i].fd, repos[i].url,
+						yum_get_proxy(pm), pm->debug) == 0) {
+					vztt_logger(2, 0, "metadata of %s are "
+						"not changed", repos[i].id);
+					mdstore_touch(repos[i].fd);
+					repos[i].expired = 0;
+				}
+			}
+			repos[i].changed = mdstore_changed(repos[i].fd);
+			/* up2date entry is read by this update: it is not
+			   replaced until the end */
+			if (!repos[i].expired) {
+				vztt_logger(2, 0, "metadata of %s are up2date",
+					repos[i].id);
+				if ((rc = mdstore_share(repos[i].fd)))
+					goto cleanup;
+			}
+		}
+		repos[i].shared = lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+		if (repos[i].expired &&
+				(rc = string_list_add(&expired, repos[i].id)))
+			goto cleanup;
+	}
+
+	/* nothing changed since last list creation */
+	if (string_list_empty(&expired) && pm->data_source != OPT_DATASOURCE_REMOTE) {
+		snprintf(path, sizeof(path), "%s/%s/%s/" PM_LIST_SUBDIR "%s",
+			pm->tmpldir, pm->basesubdir, pm->datadir, name);
+		for (i = 0; i < n; i++)
+			if (repos[i].changed == 0)
+				break;
+		if (i == n && lstat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+			for (i = 0; i < n; i++)
+				if (repos[i].changed > st.st_mtime)
+					break;
+			if (i == n) {
+				vztt_logger(2, 0, "metadata of %s are not changed",
+					name);
+				rc = pm_touch_metadata(pm, name);
+				goto cleanup;
+			}
+		}
+	}
+
+	/* expired shared entries are loaded into new generations */
+	for (i = 0; i < n; i++) {
+		if (!repos[i].expired || !repos[i].shared)
+			continue;
+		if (i > 0 && strcmp(repos[i].fp, repos[i-1].fp) == 0) {
+			strcpy(repos[i].gen, repos[i-1].gen);
+			continue;
+		}
+		if ((rc = mdstore_begin(pm->tmpldir, repos[i].fp,
+				repos[i].gen, sizeof(repos[i].gen))))
+			goto cleanup;
+	}
+	if ((rc = yum_stage_cachedir(yum, repos, n, stage, sizeof(stage))))
+		goto cleanup;
+
+	/* list will be newer than update of entries */
+	now = time(NULL);
+	yum->clean_repos = &expired;
+	yum->cachedir = stage;
+	rc = env_compat_update_metadata(pm, name);
+	yum->cachedir = NULL;
+	yum->clean_repos = NULL;
+	if (rc)
+		goto cleanup;
+
+	for (i = 0; i < n; i++) {
+		if (repos[i].fd == -1 || !repos[i].expired)
+			continue;
+		if (repos[i].gen[0]) {
+			if ((rc = mdstore_commit(pm->tmpldir, repos[i].fp,
+					repos[i].gen)))
+				goto cleanup;
+			for (j = i; j < n && strcmp(repos[j].fp,
+					repos[i].fp) == 0; j++)
+				repos[j].gen[0] = '\0';
+		}
+		mdstore_updated(pm->tmpldir, repos[i].fp, repos[i].fd,
+			repos[i].validated, now);
+	}
+
+cleanup:
+	for (i = 0; i < n; i++) {
+		/* the same generation in several records */
+		if (repos[i].gen[0] && (i == 0 ||
+				strcmp(repos[i].gen, repos[i-1].gen)))
+			mdstore_abort(repos[i].gen);
+		mdstore_unlock(repos[i].fd);
+	}
+	if (stage[0])
+		remove_directory(stage);
+	free(repos);
+	string_list_clean(&expired);
+	return rc;
+}
+
 /* 
    yum metadata directory: <basedir>/pm/<name><urlno>
    plesk* app template have the same repository set for all template.
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+CC=${CC:-gcc}
+BIN=./archive_test
+TMP=$(mktemp -d)
+
+function cleanup()
+{
+	rm -rf $TMP $BIN
+}
+
+echo -e "\n\nCheck built-in tar/lz4 archiver against GNU tar"
+$CC -Wall -I../include -o $BIN archive_test.c ../src/libvztt.a \
+	-ldl -lvzctl2 -lploop -llz4 -lxxhash -lcurl -lpthread || exit 1
+
+# fixture tree: regular, empty, multi-block and hardlinked files,
+# long names and symlink targets (GNU LongLink), fifo, empty directory
+mkdir -p $TMP/fx/root/dir/sub $TMP/fx/root/empty $TMP/fx/other
+cd $TMP/fx/root
+: > empty_file
+printf x > dir/one
+head -c 512 /dev/zero > dir/block
+head -c 100000 /dev/urandom > dir/big
+head -c 9000000 /dev/urandom > dir/huge
+ln dir/big dir/big.hard
+ln -s dir/big link
+printf long > dir/sub/$(printf 'n%.0s' $(seq 150))
+ln -s $(printf 't%.0s' $(seq 120)) longlink
+mkfifo fifo
+echo other > ../other/file
+cd - > /dev/null
+
+$BIN $TMP/a.tar.lz4 $TMP/fx root other || { cleanup; exit 1; }
+lz4 -dc $TMP/a.tar.lz4 > $TMP/a.tar || { cleanup; exit 1; }
+tar -C $TMP/fx --format=gnu --numeric-owner -cf $TMP/b.tar root other || \
+	{ cleanup; exit 1; }
+cmp $TMP/a.tar $TMP/b.tar
+rc=$?
+cleanup
+[ $rc -eq 0 ] || exit 1
+
+echo -e "\nSuccess.\n"
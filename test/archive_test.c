@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * pack entries of directory by built-in tar/lz4 archiver
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "vztt_options.h"
+#include "archive.h"
+
+int main(int argc, char *argv[])
+{
+	struct options_vztt opts;
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s file.tar.lz4 dir entry...\n", argv[0]);
+		return 2;
+	}
+	memset(&opts, 0, sizeof(opts));
+	return archive_pack(argv[1], argv[2],
+		(const char *const *)argv + 3, &opts) ? 1 : 0;
+}
@@ -0,0 +1,13 @@
+#!/bin/bash
+
+CC=${CC:-gcc}
+BIN=./evrcmp_test
+
+echo -e "\n\nCheck rpm/dpkg version comparison"
+$CC -Wall -I../include -o $BIN evrcmp_test.c ../src/evrcmp.c || exit 1
+$BIN evrcmp.corpus
+rc=$?
+rm -f $BIN
+[ $rc -eq 0 ] || exit 1
+
+echo -e "\nSuccess.\n"
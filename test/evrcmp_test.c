@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ *
+ * check rpm/dpkg version comparison against corpus file
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "evrcmp.h"
+
+int main(int argc, char *argv[])
+{
+	char buf[BUFSIZ];
+	char type[16], a[256], b[256];
+	int expected, rc, line = 0, failed = 0;
+	FILE *fp;
+
+	if (argc != 2 || (fp = fopen(argv[1], "r")) == NULL) {
+		fprintf(stderr, "Usage: %s corpus\n", argv[0]);
+		return 2;
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		line++;
+		if (buf[0] == '#' || buf[0] == '\n')
+			continue;
+		if (sscanf(buf, "%15s %255s %255s %d", type, a, b, &expected) != 4) {
+			fprintf(stderr, "%s:%d: bad line\n", argv[1], line);
+			failed++;
+			continue;
+		}
+		if (strcmp(type, "rpm") == 0)
+			rc = rpm_evrcmp(a, b);
+		else
+			rc = deb_evrcmp(a, b);
+		if (rc != expected) {
+			printf("%s:%d: %s %s %s: %d, expected %d\n",
+				argv[1], line, type, a, b, rc, expected);
+			failed++;
+		}
+	}
+	fclose(fp);
+	return failed ? 1 : 0;
+}